@@ -40,7 +40,12 @@ LOCAL_SRC_FILES := \
     advanced_functions.c \
     digest/md5.c \
     recovery_settings.c \
+    boot_trace.c \
     nandroid.c \
+    raw_image.c \
+    block_store.c \
+    fingerprint.c \
+    split_archive.c \
     ../../system/core/toolbox/dynarray.c \
     ../../system/core/toolbox/newfs_msdos.c \
     edifyscripting.c \
@@ -172,6 +177,9 @@ LOCAL_STATIC_LIBRARIES += libmake_ext4fs libext4_utils_static libz libsparse_sta
 
 ifeq ($(BOARD_RECOVERY_USE_LIBTAR),true)
 LOCAL_STATIC_LIBRARIES += libtar_recovery
+LOCAL_C_INCLUDES += $(LOCAL_PATH)/libtar/lib $(LOCAL_PATH)/libtar/listhash
+# same TAR layout as libtar_recovery
+LOCAL_CFLAGS += -DHAVE_SELINUX
 endif
 
 ifneq ($(BOARD_USE_NTFS_3G),false)
@@ -250,7 +258,6 @@ LOCAL_ADDITIONAL_DEPENDENCIES += updater
 
 LOCAL_ADDITIONAL_DEPENDENCIES += \
     zip \
-    raw-backup.sh \
     bootscripts_mnt.sh \
     stitch.png
 
@@ -293,14 +300,6 @@ LOCAL_SRC_FILES := killrecovery.sh
 include $(BUILD_PREBUILT)
 
 #philz external scripts
-include $(CLEAR_VARS)
-LOCAL_MODULE := raw-backup.sh
-LOCAL_MODULE_TAGS := optional
-LOCAL_MODULE_CLASS := RECOVERY_EXECUTABLES
-LOCAL_MODULE_PATH := $(TARGET_RECOVERY_ROOT_OUT)/sbin
-LOCAL_SRC_FILES := raw-backup.sh
-include $(BUILD_PREBUILT)
-
 include $(CLEAR_VARS)
 LOCAL_MODULE := bootscripts_mnt.sh
 LOCAL_MODULE_TAGS := optional
@@ -3,6 +3,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <fcntl.h>
 
 #include <sys/limits.h>
 #include <dirent.h>
@@ -288,6 +289,7 @@ int strcmpi(const char *str1, const char *str2) {
 void delete_a_file(const char* filename) {
     ensure_path_mounted(filename);
     remove(filename);
+    forget_config_file(filename);
 }
 
 // search for 'file' in 'dir': only last occurrence is returned if many!
@@ -402,6 +404,10 @@ int copy_a_file(const char* file_in, const char* file_out) {
         return 0;
     }
 
+    // settings files: copy what the user set, not what was last flushed, and re-read the overwritten one
+    flush_config_file(file_in);
+    forget_config_file(file_out);
+
     if (!is_path_ramdisk(file_in) && ensure_path_mounted(file_in) != 0) {
         LOGE("copy: cannot mount volume %s\n", file_in);
         return -1;
@@ -788,28 +794,84 @@ void free_string_array(char** array) {
     free(array);
 }
 
-// to gather directories you need to pass NULL for fileExtensionOrDirectory
-// else, only files are gathered. Pass "" to gather all files
-// NO  MORE NEEDED: if it is not called by choose_file_menu(), passed directory MUST end with a trailing /
+// case insensitive natural compare: "backup9" < "backup10"
+static int strnatcmpi(const char* a, const char* b) {
+    const char* sa = a;
+    const char* sb = b;
+    while (*a && *b) {
+        if (isdigit((unsigned char)*a) && isdigit((unsigned char)*b)) {
+            while (*a == '0')
+                a++;
+            while (*b == '0')
+                b++;
+            const char* da = a;
+            const char* db = b;
+            while (isdigit((unsigned char)*a))
+                a++;
+            while (isdigit((unsigned char)*b))
+                b++;
+            // longer number (without leading zeros) is the bigger one
+            if (a - da != b - db)
+                return (a - da) - (b - db);
+            int ret = strncmp(da, db, a - da);
+            if (ret != 0)
+                return ret;
+            continue;
+        }
+
+        int ca = tolower((unsigned char)*a);
+        int cb = tolower((unsigned char)*b);
+        if (ca != cb)
+            return ca - cb;
+        a++;
+        b++;
+    }
+    if (*a || *b)
+        return (unsigned char)*a - (unsigned char)*b;
+    // equal but for case or leading zeros: keep a stable order
+    return strcmp(sa, sb);
+}
+
+typedef struct {
+    const char* name;
+    size_t len;
+    int is_dir;
+} GatherEntry;
+
+static int gather_entry_cmp(const void* pa, const void* pb) {
+    const GatherEntry* a = (const GatherEntry*)pa;
+    const GatherEntry* b = (const GatherEntry*)pb;
+    // directories first
+    if (a->is_dir != b->is_dir)
+        return b->is_dir - a->is_dir;
+    return strnatcmpi(a->name, b->name);
+}
+
 static int gather_hidden_files = 0;
 void set_gather_hidden_files(int enable) {
     gather_hidden_files = enable;
 }
 
-char** gather_files(const char* basedir, const char* fileExtensionOrDirectory, int* numFiles) {
+/*
+ Scan basedir once and return the sorted full paths of its directories (with a trailing /) if want_dirs is set,
+ followed by its files matching fileExtension ("" or NULL for all files) if want_files is set
+ - d_type tells the entry type, fstatat() is only needed for DT_UNKNOWN. Links are not followed, like lstat()
+ - the result is a single allocation: a NULL terminated table of pointers followed by the strings,
+   release it with free(), not free_string_array()
+*/
+static char** gather_entries(const char* basedir, const char* fileExtension, int want_dirs, int want_files,
+                             int* numDirs, int* numFiles) {
     DIR *dir;
     struct dirent *de;
-    int total = 0;
-    int i;
-    char** files = NULL;
-    int pass;
-    *numFiles = 0;
-    int dirLen = strlen(basedir);
     char directory[PATH_MAX];
+    size_t dirLen = strlen(basedir);
+
+    *numDirs = 0;
+    *numFiles = 0;
 
     // Append a trailing slash if necessary
     strcpy(directory, basedir);
-    if (directory[dirLen - 1] != '/') {
+    if (dirLen == 0 || directory[dirLen - 1] != '/') {
         strcat(directory, "/");
         ++dirLen;
     }
@@ -820,99 +882,124 @@ char** gather_files(const char* basedir, const char* fileExtensionOrDirectory, i
         return NULL;
     }
 
-    unsigned int extension_length = 0;
-    if (fileExtensionOrDirectory != NULL)
-        extension_length = strlen(fileExtensionOrDirectory);
+    size_t extension_length = 0;
+    if (fileExtension != NULL)
+        extension_length = strlen(fileExtension);
 
-    i = 0;
-    // first pass (pass==0) only returns "total" valid file names to initialize files[total] size
-    // second pass (pass == 1), rewinddir and initializes files[i] with directory contents
-    for (pass = 0; pass < 2; pass++) {
-        while ((de = readdir(dir)) != NULL) {
-            // skip hidden files
-            if (!gather_hidden_files && de->d_name[0] == '.')
-                continue;
+    // names are packed in a growable buffer, entries hold their offset until the scan is done
+    char* names = NULL;
+    size_t names_size = 0;
+    size_t names_alloc = 0;
+    GatherEntry* entries = NULL;
+    int count = 0;
+    int alloc = 0;
 
-            // NULL means that we are gathering directories, so skip this
-            if (fileExtensionOrDirectory != NULL) {
-                if (strcmp("", fileExtensionOrDirectory) == 0) {
-                    // we exclude directories since they are gathered on second call to gather_files() by choose_file_menu()
-                    // and we keep stock behavior: folders are gathered only by passing NULL
-                    // else, we break things at strcat(files[i], "/") in end of while loop
-                    struct stat info;
-                    char fullFileName[PATH_MAX];
-                    strcpy(fullFileName, directory);
-                    strcat(fullFileName, de->d_name);
-                    lstat(fullFileName, &info);
-                    // make sure it is not a directory
-                    if (S_ISDIR(info.st_mode))
-                        continue;
-                } else {
-                    // make sure that we can have the desired extension (prevent seg fault)
-                    if (strlen(de->d_name) < extension_length)
-                        continue;
-                    // compare the extension
-                    if (strcmp(de->d_name + strlen(de->d_name) - extension_length, fileExtensionOrDirectory) != 0)
-                        continue;
-                }
-            } else {
-                struct stat info;
-                char fullFileName[PATH_MAX];
-                strcpy(fullFileName, directory);
-                strcat(fullFileName, de->d_name);
-                lstat(fullFileName, &info);
-                // make sure it is a directory
-                if (!(S_ISDIR(info.st_mode)))
-                    continue;
-            }
+    while ((de = readdir(dir)) != NULL) {
+        // skip hidden files
+        if (!gather_hidden_files && de->d_name[0] == '.')
+            continue;
+        if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0)
+            continue;
+
+        int is_dir;
+        if (de->d_type != DT_UNKNOWN) {
+            is_dir = (de->d_type == DT_DIR);
+        } else {
+            struct stat info;
+            is_dir = (fstatat(dirfd(dir), de->d_name, &info, AT_SYMLINK_NOFOLLOW) == 0 && S_ISDIR(info.st_mode));
+        }
 
-            if (pass == 0) {
-                total++;
+        size_t len = strlen(de->d_name);
+        if (is_dir) {
+            if (!want_dirs)
                 continue;
-            }
+        } else {
+            if (!want_files)
+                continue;
+            // compare the extension
+            if (len < extension_length || strcmp(de->d_name + len - extension_length, fileExtension) != 0)
+                continue;
+        }
 
-            // only second pass (pass==1) reaches here: initializes files[i] with directory contents
-            files[i] = (char*)malloc(dirLen + strlen(de->d_name) + 2);
-            strcpy(files[i], directory);
-            strcat(files[i], de->d_name);
-            if (fileExtensionOrDirectory == NULL)
-                strcat(files[i], "/");
-            i++;
+        if (count == alloc) {
+            alloc = alloc ? alloc * 2 : 64;
+            entries = (GatherEntry*)realloc(entries, alloc * sizeof(GatherEntry));
+        }
+        if (names_size + len + 1 > names_alloc) {
+            names_alloc = names_alloc ? names_alloc * 2 : 4096;
+            while (names_size + len + 1 > names_alloc)
+                names_alloc *= 2;
+            names = (char*)realloc(names, names_alloc);
         }
-        if (pass == 1)
-            break;
-        if (total == 0)
-            break;
-        // only first pass (pass == 0) reaches here. We rewinddir for second pass
-        // initialize "total" with number of valid files to show and initialize files[total]
-        rewinddir(dir);
-        *numFiles = total;
-        files = (char**)malloc((total + 1) * sizeof(char*));
-        files[total] = NULL;
+        memcpy(names + names_size, de->d_name, len + 1);
+        entries[count].name = (const char*)names_size;
+        entries[count].len = len;
+        entries[count].is_dir = is_dir;
+        names_size += len + 1;
+        count++;
+        if (is_dir)
+            (*numDirs)++;
+        else
+            (*numFiles)++;
     }
 
     if (closedir(dir) < 0) {
         LOGE("Failed to close directory.\n");
     }
 
-    if (total == 0) {
+    if (count == 0) {
+        free(names);
+        free(entries);
         return NULL;
     }
 
-    // sort the result
-    if (files != NULL) {
-        for (i = 0; i < total; i++) {
-            int curMax = -1;
-            int j;
-            for (j = 0; j < total - i; j++) {
-                if (curMax == -1 || strcmpi(files[curMax], files[j]) < 0)
-                    curMax = j;
-            }
-            char* temp = files[curMax];
-            files[curMax] = files[total - i - 1];
-            files[total - i - 1] = temp;
-        }
-    }
+    int i;
+    for (i = 0; i < count; i++) {
+        entries[i].name = names + (size_t)entries[i].name;
+    }
+    qsort(entries, count, sizeof(GatherEntry), gather_entry_cmp);
+
+    // pointer table and "directory/name[/]" strings in one block
+    size_t strings_size = 0;
+    for (i = 0; i < count; i++) {
+        strings_size += dirLen + entries[i].len + 2;
+    }
+    char** files = (char**)malloc((count + 1) * sizeof(char*) + strings_size);
+    char* cursor = (char*)(files + count + 1);
+    for (i = 0; i < count; i++) {
+        files[i] = cursor;
+        memcpy(cursor, directory, dirLen);
+        cursor += dirLen;
+        memcpy(cursor, entries[i].name, entries[i].len);
+        cursor += entries[i].len;
+        if (entries[i].is_dir)
+            *cursor++ = '/';
+        *cursor++ = '\0';
+    }
+    files[count] = NULL;
+
+    free(names);
+    free(entries);
+    return files;
+}
 
+// to gather directories you need to pass NULL for fileExtensionOrDirectory
+// else, only files are gathered. Pass "" to gather all files
+// returned array is a single allocation: release it with free()
+char** gather_files(const char* basedir, const char* fileExtensionOrDirectory, int* numFiles) {
+    int numDirs = 0;
+    int numOthers = 0;
+    char** files;
+    if (fileExtensionOrDirectory == NULL) {
+        files = gather_entries(basedir, NULL, 1, 0, numFiles, &numOthers);
+    } else {
+        files = gather_entries(basedir, fileExtensionOrDirectory, 0, 1, &numDirs, numFiles);
+    }
     return files;
 }
+
+// directories (with trailing /) then files matching fileExtension, in one scan
+// returned array is a single allocation: release it with free()
+char** gather_files_and_dirs(const char* basedir, const char* fileExtension, int* numDirs, int* numFiles) {
+    return gather_entries(basedir, fileExtension, 1, 1, numDirs, numFiles);
+}
@@ -36,7 +36,9 @@ int Get_Size_Via_statfs(const char* Path);
 
 void set_gather_hidden_files(int enable);
 
+// both return a single allocation: release it with free()
 char** gather_files(const char* basedir, const char* fileExtensionOrDirectory, int* numFiles);
+char** gather_files_and_dirs(const char* basedir, const char* fileExtension, int* numDirs, int* numFiles);
 
 int write_string_to_file(const char* filename, const char* string);
 
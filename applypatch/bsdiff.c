@@ -50,6 +50,7 @@
 #include <bzlib.h>
 #include <err.h>
 #include <fcntl.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -57,103 +58,143 @@
 
 #define MIN(x,y) (((x)<(y)) ? (x) : (y))
 
-static void split(off_t *I,off_t *V,off_t start,off_t len,off_t h)
+/*
+ * Suffix sorting by induced sorting (SA-IS, Nong, Zhang and Chan 2009),
+ * linear time with 32-bit indices.  The empty suffix is a virtual
+ * sentinel smaller than any character, so the input needs no terminator.
+ * 'cs' is the size of a character: bytes for the input, int32_t for the
+ * reduced strings of the recursion.
+ */
+
+#define chr(i) (cs==sizeof(int32_t)?((const int32_t *)T)[i]:((const u_char *)T)[i])
+#define tget(i) ((t[(i)>>3]>>((i)&7))&1)
+#define tset(i,b) (t[(i)>>3]=(b)?(t[(i)>>3]|(1<<((i)&7))):(t[(i)>>3]&~(1<<((i)&7))))
+#define isLMS(i) ((i)>0&&tget(i)&&!tget((i)-1))
+
+static void getbuckets(const void *T,int32_t *B,int32_t n,int32_t k,int cs,int end)
 {
-	off_t i,j,k,x,tmp,jj,kk;
-
-	if(len<16) {
-		for(k=start;k<start+len;k+=j) {
-			j=1;x=V[I[k]+h];
-			for(i=1;k+i<start+len;i++) {
-				if(V[I[k+i]+h]<x) {
-					x=V[I[k+i]+h];
-					j=0;
-				};
-				if(V[I[k+i]+h]==x) {
-					tmp=I[k+j];I[k+j]=I[k+i];I[k+i]=tmp;
-					j++;
-				};
-			};
-			for(i=0;i<j;i++) V[I[k+i]]=k+j-1;
-			if(j==1) I[k]=-1;
-		};
-		return;
-	};
+	int32_t i,sum;
 
-	x=V[I[start+len/2]+h];
-	jj=0;kk=0;
-	for(i=start;i<start+len;i++) {
-		if(V[I[i]+h]<x) jj++;
-		if(V[I[i]+h]==x) kk++;
-	};
-	jj+=start;kk+=jj;
-
-	i=start;j=0;k=0;
-	while(i<jj) {
-		if(V[I[i]+h]<x) {
-			i++;
-		} else if(V[I[i]+h]==x) {
-			tmp=I[i];I[i]=I[jj+j];I[jj+j]=tmp;
-			j++;
-		} else {
-			tmp=I[i];I[i]=I[kk+k];I[kk+k]=tmp;
-			k++;
-		};
+	for(i=0;i<k;i++) B[i]=0;
+	for(i=0;i<n;i++) B[chr(i)]++;
+	for(i=0,sum=0;i<k;i++) {
+		sum+=B[i];
+		B[i]=end?sum:sum-B[i];
 	};
+}
 
-	while(jj+j<kk) {
-		if(V[I[jj+j]+h]==x) {
-			j++;
-		} else {
-			tmp=I[jj+j];I[jj+j]=I[kk+k];I[kk+k]=tmp;
-			k++;
-		};
+static void induce(const void *T,int32_t *SA,const u_char *t,int32_t *B,
+		int32_t n,int32_t k,int cs)
+{
+	int32_t i,j;
+
+	/* L-type suffixes from the left, the sentinel first */
+	getbuckets(T,B,n,k,cs,0);
+	SA[B[chr(n-1)]++]=n-1;
+	for(i=0;i<n;i++) {
+		j=SA[i]-1;
+		if(j>=0&&!tget(j)) SA[B[chr(j)]++]=j;
 	};
 
-	if(jj>start) split(I,V,start,jj-start,h);
-
-	for(i=0;i<kk-jj;i++) V[I[jj+i]]=kk-1;
-	if(jj==kk-1) I[jj]=-1;
-
-	if(start+len>kk) split(I,V,kk,start+len-kk,h);
+	/* S-type suffixes from the right */
+	getbuckets(T,B,n,k,cs,1);
+	for(i=n-1;i>=0;i--) {
+		j=SA[i]-1;
+		if(j>=0&&tget(j)) SA[--B[chr(j)]]=j;
+	};
 }
 
-static void qsufsort(off_t *I,off_t *V,u_char *old,off_t oldsize)
+static int sais(const void *T,int32_t *SA,int32_t n,int32_t k,int cs)
 {
-	off_t buckets[256];
-	off_t i,h,len;
+	u_char *t;
+	int32_t *B;
+	int32_t i,j,d,m,name,pos,prev;
+	int32_t *s1,*SA1;
+
+	if(n==1) {
+		SA[0]=0;
+		return 0;
+	};
 
-	for(i=0;i<256;i++) buckets[i]=0;
-	for(i=0;i<oldsize;i++) buckets[old[i]]++;
-	for(i=1;i<256;i++) buckets[i]+=buckets[i-1];
-	for(i=255;i>0;i--) buckets[i]=buckets[i-1];
-	buckets[0]=0;
+	if(((t=calloc(n/8+1,1))==NULL)||((B=malloc(k*sizeof(int32_t)))==NULL)) {
+		free(t);
+		return -1;
+	};
 
-	for(i=0;i<oldsize;i++) I[++buckets[old[i]]]=i;
-	I[0]=oldsize;
-	for(i=0;i<oldsize;i++) V[i]=buckets[old[i]];
-	V[oldsize]=0;
-	for(i=1;i<256;i++) if(buckets[i]==buckets[i-1]+1) I[buckets[i]]=-1;
-	I[0]=-1;
-
-	for(h=1;I[0]!=-(oldsize+1);h+=h) {
-		len=0;
-		for(i=0;i<oldsize+1;) {
-			if(I[i]<0) {
-				len-=I[i];
-				i-=I[i];
-			} else {
-				if(len) I[i-len]=-len;
-				len=V[I[i]]+1-i;
-				split(I,V,i,len,h);
-				i+=len;
-				len=0;
+	/* S-type is 1; the last suffix is L-type, before the sentinel */
+	tset(n-1,0);
+	for(i=n-2;i>=0;i--)
+		tset(i,chr(i)<chr(i+1)||(chr(i)==chr(i+1)&&tget(i+1)));
+
+	/* sort the LMS substrings */
+	getbuckets(T,B,n,k,cs,1);
+	for(i=0;i<n;i++) SA[i]=-1;
+	for(i=1;i<n;i++) if(isLMS(i)) SA[--B[chr(i)]]=i;
+	induce(T,SA,t,B,n,k,cs);
+
+	/* name them, in text order at the end of SA */
+	for(i=0,m=0;i<n;i++) if(isLMS(SA[i])) SA[m++]=SA[i];
+	for(i=m;i<n;i++) SA[i]=-1;
+	for(i=0,name=0,prev=-1;i<m;i++) {
+		pos=SA[i];
+		for(d=0;prev>=0;d++) {
+			/* the substring that reaches the sentinel is unique */
+			if(pos+d==n||prev+d==n||chr(pos+d)!=chr(prev+d)||
+				tget(pos+d)!=tget(prev+d)) break;
+			if(d>0&&(isLMS(pos+d)||isLMS(prev+d))) {
+				d=-1;
+				break;
 			};
 		};
-		if(len) I[i-len]=-len;
+		if(d>=0) {
+			name++;
+			prev=pos;
+		};
+		SA[m+(pos>>1)]=name-1;
+	};
+	for(i=n-1,j=n-1;i>=m;i--) if(SA[i]>=0) SA[j--]=SA[i];
+
+	/* sort the LMS suffixes, recursing when the names are not unique */
+	s1=SA+n-m;
+	SA1=SA;
+	if(name<m) {
+		if(sais(s1,SA1,m,name,sizeof(int32_t))) {
+			free(t);
+			free(B);
+			return -1;
+		};
+	} else {
+		for(i=0;i<m;i++) SA1[s1[i]]=i;
 	};
 
-	for(i=0;i<oldsize+1;i++) I[V[i]]=i;
+	/* induce the whole suffix array from them */
+	for(i=1,j=0;i<n;i++) if(isLMS(i)) s1[j++]=i;
+	for(i=0;i<m;i++) SA1[i]=s1[SA1[i]];
+	for(i=m;i<n;i++) SA[i]=-1;
+	getbuckets(T,B,n,k,cs,1);
+	for(i=m-1;i>=0;i--) {
+		j=SA[i];
+		SA[i]=-1;
+		SA[--B[chr(j)]]=j;
+	};
+	induce(T,SA,t,B,n,k,cs);
+
+	free(t);
+	free(B);
+	return 0;
+}
+
+#undef chr
+#undef tget
+#undef tset
+#undef isLMS
+
+/* I[0] is the empty suffix, as qsufsort() used to leave it */
+static int suffixsort(int32_t *I,u_char *old,off_t oldsize)
+{
+	I[0]=oldsize;
+	if(oldsize==0) return 0;
+	return sais(old,I+1,oldsize,256,sizeof(u_char));
 }
 
 static off_t matchlen(u_char *old,off_t oldsize,u_char *new,off_t newsize)
@@ -166,7 +207,7 @@ static off_t matchlen(u_char *old,off_t oldsize,u_char *new,off_t newsize)
 	return i;
 }
 
-static off_t search(off_t *I,u_char *old,off_t oldsize,
+static off_t search(int32_t *I,u_char *old,off_t oldsize,
 		u_char *new,off_t newsize,off_t st,off_t en,off_t *pos)
 {
 	off_t x,y;
@@ -210,6 +251,22 @@ static void offtout(off_t x,u_char *buf)
 	if(x<0) buf[7]|=0x80;
 }
 
+// Builds the suffix array of 'old' into *IP if it is still NULL.  It
+// can be called ahead of bsdiff() so that several diffs against the
+// same 'old' data may run concurrently.
+void bsdiff_sort(u_char* old, off_t oldsize, int32_t** IP)
+{
+        if (*IP == NULL) {
+            int32_t* I;
+            if (oldsize >= INT32_MAX)
+                errx(1, "source too large for bsdiff (%lld bytes)", (long long)oldsize);
+            if ((I = malloc((oldsize+1) * sizeof(int32_t))) == NULL ||
+                suffixsort(I, old, oldsize) != 0)
+                err(1, NULL);
+            *IP = I;
+        }
+}
+
 // This is main() from bsdiff.c, with the following changes:
 //
 //    - old, oldsize, new, newsize are arguments; we don't load this
@@ -219,13 +276,17 @@ static void offtout(off_t x,u_char *buf)
 //    - the "I" block of memory is owned by the caller, who passes a
 //      pointer to *I, which can be NULL.  This way if we call
 //      bsdiff() multiple times with the same 'old' data, we only do
-//      the qsufsort() step the first time.
+//      the suffix sorting step the first time.
+//
+//    - the suffix array is built by SA-IS with 32-bit entries instead
+//      of qsufsort() with two off_t per byte; 'old' must be smaller
+//      than 2GB.
 //
-int bsdiff(u_char* old, off_t oldsize, off_t** IP, u_char* new, off_t newsize,
+int bsdiff(u_char* old, off_t oldsize, int32_t** IP, u_char* new, off_t newsize,
            const char* patch_filename)
 {
 	int fd;
-	off_t *I;
+	int32_t *I;
 	off_t scan,pos,len;
 	off_t lastscan,lastpos,lastoffset;
 	off_t oldscore,scsc;
@@ -240,13 +301,7 @@ int bsdiff(u_char* old, off_t oldsize, off_t** IP, u_char* new, off_t newsize,
 	BZFILE * pfbz2;
 	int bz2err;
 
-        if (*IP == NULL) {
-            off_t* V;
-            *IP = malloc((oldsize+1) * sizeof(off_t));
-            V = malloc((oldsize+1) * sizeof(off_t));
-            qsufsort(*IP, V, old, oldsize);
-            free(V);
-        }
+        bsdiff_sort(old, oldsize, IP);
         I = *IP;
 
 	if(((db=malloc(newsize+1))==NULL) ||
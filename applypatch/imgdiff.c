@@ -122,6 +122,8 @@
  */
 
 #include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -143,7 +145,7 @@ typedef struct {
   size_t source_start;
   size_t source_len;
 
-  off_t* I;             // used by bsdiff
+  int32_t* I;           // used by bsdiff
 
   // --- for CHUNK_DEFLATE chunks only: ---
 
@@ -179,8 +181,51 @@ static int fileentry_compare(const void* a, const void* b) {
 }
 
 // from bsdiff.c
-int bsdiff(u_char* old, off_t oldsize, off_t** IP, u_char* new, off_t newsize,
+int bsdiff(u_char* old, off_t oldsize, int32_t** IP, u_char* new, off_t newsize,
            const char* patch_filename);
+void bsdiff_sort(u_char* old, off_t oldsize, int32_t** IP);
+
+/*
+ * Run fn(i, arg) for every i in [0, count) on a pool of threads, one
+ * per online cpu.  Each worker takes the next pending index, so the
+ * big items don't hold up the small ones.
+ */
+typedef struct {
+  int count;
+  int next;
+  void (*fn)(int, void*);
+  void* arg;
+} WorkQueue;
+
+static void* WorkQueueThread(void* cookie) {
+  WorkQueue* q = (WorkQueue*)cookie;
+  int i;
+  while ((i = __sync_fetch_and_add(&q->next, 1)) < q->count) {
+    q->fn(i, q->arg);
+  }
+  return NULL;
+}
+
+void RunParallel(int count, void (*fn)(int, void*), void* arg) {
+  WorkQueue q = { count, 0, fn, arg };
+  long nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+  if (nthreads > count) nthreads = count;
+  if (nthreads < 1) nthreads = 1;
+
+  pthread_t* threads = malloc(nthreads * sizeof(pthread_t));
+  int started = 0;
+  // the calling thread is one of the workers
+  while (started < nthreads - 1 &&
+         pthread_create(threads+started, NULL, WorkQueueThread, &q) == 0) {
+    ++started;
+  }
+  WorkQueueThread(&q);
+  int i;
+  for (i = 0; i < started; ++i) {
+    pthread_join(threads[i], NULL);
+  }
+  free(threads);
+}
 
 unsigned char* ReadZip(const char* filename,
                        int* num_chunks, ImageChunk** chunks,
@@ -566,36 +611,46 @@ int TryReconstruction(ImageChunk* chunk, unsigned char* out) {
 }
 
 /*
- * Verify that we can reproduce exactly the same compressed data that
- * we started with.  Sets the level, method, windowBits, memLevel, and
- * strategy fields in the chunk to the encoding parameters needed to
- * produce the right output.  Returns 0 on success.
+ * Encoder parameters tried to reproduce a deflate chunk, in order of
+ * preference.  We only check two combinations:  level 6 (the default)
+ * and level 9 (the maximum).
  */
-int ReconstructDeflateChunk(ImageChunk* chunk) {
-  if (chunk->type != CHUNK_DEFLATE) {
-    printf("attempt to reconstruct non-deflate chunk\n");
-    return -1;
-  }
+#define NUM_DEFLATE_PROBES 2
+static const int kProbeLevels[NUM_DEFLATE_PROBES] = { 6, 9 };
 
-  size_t p = 0;
-  unsigned char* out = malloc(BUFFER_SIZE);
-
-  // We only check two combinations of encoder parameters:  level 6
-  // (the default) and level 9 (the maximum).
-  for (chunk->level = 6; chunk->level <= 9; chunk->level += 3) {
-    chunk->windowBits = -15;  // 32kb window; negative to indicate a raw stream.
-    chunk->memLevel = 8;      // the default value.
-    chunk->method = Z_DEFLATED;
-    chunk->strategy = Z_DEFAULT_STRATEGY;
-
-    if (TryReconstruction(chunk, out) == 0) {
-      free(out);
-      return 0;
-    }
-  }
+/*
+ * Sets the level, method, windowBits, memLevel, and strategy fields in
+ * the chunk to the encoding parameters of the given probe.
+ */
+static void SetDeflateProbe(ImageChunk* chunk, int probe) {
+  chunk->level = kProbeLevels[probe];
+  chunk->windowBits = -15;  // 32kb window; negative to indicate a raw stream.
+  chunk->memLevel = 8;      // the default value.
+  chunk->method = Z_DEFLATED;
+  chunk->strategy = Z_DEFAULT_STRATEGY;
+}
 
+/*
+ * Verify that we can reproduce exactly the same compressed data that
+ * we started with, using the parameters of one probe.  The chunk is
+ * not modified, so the probes of one chunk can run at once.  Returns 0
+ * on success.
+ */
+int TryDeflateProbe(const ImageChunk* chunk, int probe) {
+  ImageChunk params = *chunk;
+  unsigned char* out = malloc(BUFFER_SIZE);
+  SetDeflateProbe(&params, probe);
+  int r = TryReconstruction(&params, out);
   free(out);
-  return -1;
+  return r;
+}
+
+/*
+ * Returns true if MakePatch() needs a bsdiff for the target chunk;
+ * small normal chunks are always stored raw.
+ */
+int NeedsPatch(ImageChunk* tgt) {
+  return tgt->type != CHUNK_NORMAL || tgt->len > 160;
 }
 
 /*
@@ -603,10 +658,13 @@ int ReconstructDeflateChunk(ImageChunk* chunk) {
  * by running bsdiff in a subprocess.  Return the patch data, placing
  * its length in *size.  Return NULL on failure.  We expect the bsdiff
  * program to be in the path.
+ *
+ * Several chunks can be patched against the same source at once, as
+ * long as its suffix array was built first (see SortSource).
  */
 unsigned char* MakePatch(ImageChunk* src, ImageChunk* tgt, size_t* size) {
   if (tgt->type == CHUNK_NORMAL) {
-    if (tgt->len <= 160) {
+    if (!NeedsPatch(tgt)) {
       tgt->type = CHUNK_RAW;
       *size = tgt->len;
       return tgt->data;
@@ -668,6 +726,14 @@ unsigned char* MakePatch(ImageChunk* src, ImageChunk* tgt, size_t* size) {
   return data;
 }
 
+/*
+ * Build the bsdiff suffix array of a source chunk ahead of time, so
+ * that the patches using it can be computed concurrently.
+ */
+void SortSource(ImageChunk* src) {
+  bsdiff_sort(src->data, src->len, &(src->I));
+}
+
 /*
  * Cause a gzip chunk to be treated as a normal chunk (ie, as a blob
  * of uninterpreted data).  The resulting patch will likely be about
@@ -779,6 +845,52 @@ void DumpChunks(ImageChunk* chunks, int num_chunks) {
     }
 }
 
+typedef struct {
+  ImageChunk* tgt_chunks;
+  int* reconstructed;           // first matching deflate probe per target, or NUM_DEFLATE_PROBES
+  ImageChunk** src;             // source of each target's patch
+  ImageChunk** sources;         // distinct sources to sort
+  unsigned char** patch_data;
+  size_t* patch_size;
+} PatchJobs;
+
+/*
+ * One job per (target, probe): the probes of a big chunk run on
+ * separate workers instead of one after the other.  A probe is skipped
+ * once an earlier one matched, and the earliest match wins, so the
+ * parameters are the same as trying the probes in order.
+ */
+static void ProbeWorker(int i, void* arg) {
+  PatchJobs* jobs = (PatchJobs*)arg;
+  int t = i / NUM_DEFLATE_PROBES;
+  int probe = i % NUM_DEFLATE_PROBES;
+  if (jobs->tgt_chunks[t].type != CHUNK_DEFLATE ||
+      jobs->reconstructed[t] < probe ||
+      TryDeflateProbe(jobs->tgt_chunks+t, probe) != 0) {
+    return;
+  }
+  int cur;
+  while ((cur = jobs->reconstructed[t]) > probe &&
+         !__sync_bool_compare_and_swap(jobs->reconstructed+t, cur, probe)) {
+  }
+}
+
+static void SortWorker(int i, void* arg) {
+  PatchJobs* jobs = (PatchJobs*)arg;
+  SortSource(jobs->sources[i]);
+}
+
+static void PatchWorker(int i, void* arg) {
+  PatchJobs* jobs = (PatchJobs*)arg;
+  jobs->patch_data[i] = MakePatch(jobs->src[i], jobs->tgt_chunks+i, jobs->patch_size+i);
+}
+
+static int pointer_compare(const void* a, const void* b) {
+  const void* pa = *(const void**)a;
+  const void* pb = *(const void**)b;
+  return pa < pb ? -1 : (pa > pb ? 1 : 0);
+}
+
 int main(int argc, char** argv) {
   int zip_mode = 0;
 
@@ -876,13 +988,25 @@ int main(int argc, char** argv) {
     }
   }
 
+  // Confirm that given the uncompressed chunk data in the target, we
+  // can recompress it and get exactly the same bits as are in the
+  // input target image.  The chunks and their encoder parameters are
+  // independent, so they are all checked at once.
+  PatchJobs jobs;
+  jobs.tgt_chunks = tgt_chunks;
+  jobs.reconstructed = malloc(num_tgt_chunks * sizeof(int));
+  for (i = 0; i < num_tgt_chunks; ++i) {
+    jobs.reconstructed[i] = NUM_DEFLATE_PROBES;
+  }
+  RunParallel(num_tgt_chunks * NUM_DEFLATE_PROBES, ProbeWorker, &jobs);
+
   for (i = 0; i < num_tgt_chunks; ++i) {
     if (tgt_chunks[i].type == CHUNK_DEFLATE) {
-      // Confirm that given the uncompressed chunk data in the target, we
-      // can recompress it and get exactly the same bits as are in the
-      // input target image.  If this fails, treat the chunk as a normal
+      // If the chunk can't be reconstructed, treat it as a normal
       // non-deflated chunk.
-      if (ReconstructDeflateChunk(tgt_chunks+i) < 0) {
+      if (jobs.reconstructed[i] < NUM_DEFLATE_PROBES) {
+        SetDeflateProbe(tgt_chunks+i, jobs.reconstructed[i]);
+      } else {
         printf("failed to reconstruct target deflate chunk %d [%s]; "
                "treating as normal\n", i, tgt_chunks[i].filename);
         ChangeDeflateChunkToNormal(tgt_chunks+i);
@@ -946,15 +1070,18 @@ int main(int argc, char** argv) {
   printf("Construct patches for %d chunks...\n", num_tgt_chunks);
   unsigned char** patch_data = malloc(num_tgt_chunks * sizeof(unsigned char*));
   size_t* patch_size = malloc(num_tgt_chunks * sizeof(size_t));
+  ImageChunk** patch_src = malloc(num_tgt_chunks * sizeof(ImageChunk*));
+  ImageChunk** sources = malloc(num_tgt_chunks * sizeof(ImageChunk*));
+  int num_sources = 0;
   for (i = 0; i < num_tgt_chunks; ++i) {
     if (zip_mode) {
       ImageChunk* src;
       if (tgt_chunks[i].type == CHUNK_DEFLATE &&
           (src = FindChunkByName(tgt_chunks[i].filename, src_chunks,
                                  num_src_chunks))) {
-        patch_data[i] = MakePatch(src, tgt_chunks+i, patch_size+i);
+        patch_src[i] = src;
       } else {
-        patch_data[i] = MakePatch(src_chunks, tgt_chunks+i, patch_size+i);
+        patch_src[i] = src_chunks;
       }
     } else {
       if (i == 1 && bonus_data) {
@@ -964,7 +1091,32 @@ int main(int argc, char** argv) {
         src_chunks[i].len += bonus_size;
      }
 
-      patch_data[i] = MakePatch(src_chunks+i, tgt_chunks+i, patch_size+i);
+      patch_src[i] = src_chunks+i;
+    }
+    if (NeedsPatch(tgt_chunks+i)) {
+      sources[num_sources++] = patch_src[i];
+    }
+  }
+
+  // Sort each source once, then diff all the chunks concurrently.
+  qsort(sources, num_sources, sizeof(ImageChunk*), pointer_compare);
+  int num_unique = 0;
+  for (i = 0; i < num_sources; ++i) {
+    if (num_unique == 0 || sources[num_unique-1] != sources[i]) {
+      sources[num_unique++] = sources[i];
+    }
+  }
+  jobs.src = patch_src;
+  jobs.sources = sources;
+  jobs.patch_data = patch_data;
+  jobs.patch_size = patch_size;
+  RunParallel(num_unique, SortWorker, &jobs);
+  RunParallel(num_tgt_chunks, PatchWorker, &jobs);
+
+  for (i = 0; i < num_tgt_chunks; ++i) {
+    if (patch_data[i] == NULL) {
+      printf("failed to construct patch %d\n", i);
+      return 1;
     }
     printf("patch %3d is %d bytes (of %d)\n",
            i, patch_size[i], tgt_chunks[i].source_len);
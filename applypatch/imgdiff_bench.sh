@@ -0,0 +1,78 @@
+#!/bin/bash
+#
+# Host benchmark of imgdiff: builds the current imgdiff and the one before
+# SA-IS suffix sorting and parallel chunk diffing with the host gcc, times
+# both on the given image pair and checks that they write the same patch.
+#
+#   imgdiff_bench.sh [-z] <src-img> <tgt-img>
+#
+# OLD_REV selects the revision to compare against (default: the last one
+# whose bsdiff.c used qsufsort).
+
+RUNS=3
+
+# ------------------------
+
+ZIP_MODE=
+if [ "$1" == "-z" ]; then
+  ZIP_MODE=-z
+  shift
+fi
+if [ $# -ne 2 ]; then
+  echo "usage: $0 [-z] <src-img> <tgt-img>"
+  exit 2
+fi
+SRC_IMG=$(readlink -f $1)
+TGT_IMG=$(readlink -f $2)
+
+cd $(dirname $0)
+tmpdir=$(mktemp -d)
+
+cleanup() {
+  rm -rf $tmpdir
+}
+trap cleanup EXIT
+
+fail() {
+  echo
+  echo FAIL: $@
+  echo
+  exit 1
+}
+
+if [ -z "$OLD_REV" ]; then
+  OLD_REV=$(git log -1 --format=%H -S qsufsort -- bsdiff.c)^
+fi
+
+mkdir -p $tmpdir/old/applypatch
+for f in imgdiff.c imgdiff.h utils.c utils.h bsdiff.c; do
+  git show $OLD_REV:applypatch/$f > $tmpdir/old/applypatch/$f || fail "git show $OLD_REV:$f"
+done
+
+build() {
+  gcc -O2 -Wall -Wno-unused -Wno-format -I.. -I$1/.. -o $2 \
+    $1/imgdiff.c $1/utils.c $1/bsdiff.c -lz -lbz2 -lpthread || fail "build $2"
+}
+build $tmpdir/old/applypatch $tmpdir/imgdiff.old
+build . $tmpdir/imgdiff.new
+
+# best of RUNS, in ms: the host is not idle
+run_imgdiff() {
+  best=
+  for i in $(seq $RUNS); do
+    start=$(date +%s%N)
+    $tmpdir/imgdiff.$1 $ZIP_MODE $SRC_IMG $TGT_IMG $tmpdir/$1.patch > $tmpdir/$1.log \
+      || { cat $tmpdir/$1.log; fail "imgdiff.$1"; }
+    ms=$(( ($(date +%s%N) - start) / 1000000 ))
+    if [ -z "$best" ] || [ $ms -lt $best ]; then
+      best=$ms
+    fi
+  done
+  echo "imgdiff.$1: $best ms, patch $(stat -c %s $tmpdir/$1.patch) bytes"
+}
+
+run_imgdiff old
+run_imgdiff new
+cmp $tmpdir/old.patch $tmpdir/new.patch || fail "patches differ"
+
+echo PASSED
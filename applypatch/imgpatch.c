@@ -17,7 +17,9 @@
 // See imgdiff.c in this directory for a description of the patch file
 // format.
 
+#include <pthread.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <sys/stat.h>
 #include <errno.h>
 #include <unistd.h>
@@ -29,204 +31,420 @@
 #include "imgdiff.h"
 #include "utils.h"
 
+// Chunks are decoded by up to IMGPATCH_WORKERS threads, and at most
+// IMGPATCH_WINDOW of them are held in memory before they reach the sink.
+#define IMGPATCH_WORKERS 4
+#define IMGPATCH_WINDOW  (IMGPATCH_WORKERS * 2)
+
+typedef struct {
+    int type;
+    size_t src_start;
+    size_t src_len;
+    size_t patch_offset;
+
+    // CHUNK_DEFLATE only
+    size_t expanded_len;
+    size_t target_len;
+    int level, method, windowBits, memLevel, strategy;
+    size_t bonus_size;
+
+    // the patched output: owned unless the chunk is CHUNK_RAW
+    unsigned char* data;
+    ssize_t size;
+    int status;         // 0 while pending, 1 when done, -1 on failure
+} PatchChunk;
+
+typedef struct {
+    const unsigned char* old_data;
+    const Value* patch;
+    const Value* bonus_data;
+    PatchChunk* chunks;
+    int num_chunks;
+
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int next_chunk;     // next chunk to decode
+    int next_output;    // next chunk to send to the sink
+    int abort;
+} PatchState;
+
 /*
- * Apply the patch given in 'patch_filename' to the source data given
- * by (old_data, old_size).  Write the patched output to the 'output'
- * file, and update the SHA context with the output data as well.
- * Return 0 on success.
+ * The source range of a chunk must lie inside the source data, and
+ * its bsdiff header inside the patch.  Chunks are checked before any
+ * of them is decoded, as workers run ahead of a failing chunk.
  */
-int ApplyImagePatch(const unsigned char* old_data, ssize_t old_size,
-                    const Value* patch,
-                    SinkFn sink, void* token, SHA_CTX* ctx,
-                    const Value* bonus_data) {
-    ssize_t pos = 12;
-    char* header = patch->data;
-    if (patch->size < 12) {
-        printf("patch too short to contain header\n");
+static int CheckChunkBounds(const PatchChunk* c, ssize_t old_size,
+                            const Value* patch, int i) {
+    if (c->src_start > (size_t)old_size ||
+        c->src_len > (size_t)old_size - c->src_start) {
+        printf("chunk %d source range is outside the source data\n", i);
         return -1;
     }
-
-    // IMGDIFF2 uses CHUNK_NORMAL, CHUNK_DEFLATE, and CHUNK_RAW.
-    // (IMGDIFF1, which is no longer supported, used CHUNK_NORMAL and
-    // CHUNK_GZIP.)
-    if (memcmp(header, "IMGDIFF2", 8) != 0) {
-        printf("corrupt patch file header (magic number)\n");
+    if (patch->size < 32 || c->patch_offset > (size_t)patch->size - 32) {
+        printf("chunk %d patch offset is outside the patch\n", i);
         return -1;
     }
+    return 0;
+}
 
-    int num_chunks = Read4(header+8);
+/*
+ * Read the chunk records of the patch header.  Returns the number of
+ * chunks, or -1 if the header is corrupt.
+ */
+static int ReadChunkHeaders(const Value* patch, const Value* bonus_data,
+                            ssize_t old_size, PatchChunk** chunks_out) {
+    ssize_t pos = 12;
+    int num_chunks = Read4(patch->data+8);
+    if (num_chunks < 0) {
+        printf("invalid chunk count %d\n", num_chunks);
+        return -1;
+    }
+    PatchChunk* chunks = calloc(num_chunks > 0 ? num_chunks : 1, sizeof(PatchChunk));
+    if (chunks == NULL) {
+        printf("failed to allocate %d chunk records\n", num_chunks);
+        return -1;
+    }
 
     int i;
     for (i = 0; i < num_chunks; ++i) {
+        PatchChunk* c = chunks + i;
         // each chunk's header record starts with 4 bytes.
         if (pos + 4 > patch->size) {
             printf("failed to read chunk %d record\n", i);
-            return -1;
+            goto fail;
         }
-        int type = Read4(patch->data + pos);
+        c->type = Read4(patch->data + pos);
         pos += 4;
 
-        if (type == CHUNK_NORMAL) {
+        if (c->type == CHUNK_NORMAL) {
             char* normal_header = patch->data + pos;
             pos += 24;
             if (pos > patch->size) {
                 printf("failed to read chunk %d normal header data\n", i);
-                return -1;
+                goto fail;
             }
 
-            size_t src_start = Read8(normal_header);
-            size_t src_len = Read8(normal_header+8);
-            size_t patch_offset = Read8(normal_header+16);
-
-            ApplyBSDiffPatch(old_data + src_start, src_len,
-                             patch, patch_offset, sink, token, ctx);
-        } else if (type == CHUNK_RAW) {
+            c->src_start = Read8(normal_header);
+            c->src_len = Read8(normal_header+8);
+            c->patch_offset = Read8(normal_header+16);
+            if (CheckChunkBounds(c, old_size, patch, i) != 0) {
+                goto fail;
+            }
+        } else if (c->type == CHUNK_RAW) {
             char* raw_header = patch->data + pos;
             pos += 4;
             if (pos > patch->size) {
                 printf("failed to read chunk %d raw header data\n", i);
-                return -1;
+                goto fail;
             }
 
             ssize_t data_len = Read4(raw_header);
 
-            if (pos + data_len > patch->size) {
+            if (data_len < 0 || pos + data_len > patch->size) {
                 printf("failed to read chunk %d raw data\n", i);
-                return -1;
-            }
-            SHA_update(ctx, patch->data + pos, data_len);
-            if (sink((unsigned char*)patch->data + pos,
-                     data_len, token) != data_len) {
-                printf("failed to write chunk %d raw data\n", i);
-                return -1;
+                goto fail;
             }
+            c->data = (unsigned char*)patch->data + pos;
+            c->size = data_len;
             pos += data_len;
-        } else if (type == CHUNK_DEFLATE) {
+        } else if (c->type == CHUNK_DEFLATE) {
             // deflate chunks have an additional 60 bytes in their chunk header.
             char* deflate_header = patch->data + pos;
             pos += 60;
             if (pos > patch->size) {
                 printf("failed to read chunk %d deflate header data\n", i);
-                return -1;
+                goto fail;
             }
 
-            size_t src_start = Read8(deflate_header);
-            size_t src_len = Read8(deflate_header+8);
-            size_t patch_offset = Read8(deflate_header+16);
-            size_t expanded_len = Read8(deflate_header+24);
-            size_t target_len = Read8(deflate_header+32);
-            int level = Read4(deflate_header+40);
-            int method = Read4(deflate_header+44);
-            int windowBits = Read4(deflate_header+48);
-            int memLevel = Read4(deflate_header+52);
-            int strategy = Read4(deflate_header+56);
-
-            // Decompress the source data; the chunk header tells us exactly
-            // how big we expect it to be when decompressed.
+            c->src_start = Read8(deflate_header);
+            c->src_len = Read8(deflate_header+8);
+            c->patch_offset = Read8(deflate_header+16);
+            c->expanded_len = Read8(deflate_header+24);
+            c->target_len = Read8(deflate_header+32);
+            c->level = Read4(deflate_header+40);
+            c->method = Read4(deflate_header+44);
+            c->windowBits = Read4(deflate_header+48);
+            c->memLevel = Read4(deflate_header+52);
+            c->strategy = Read4(deflate_header+56);
+            if (CheckChunkBounds(c, old_size, patch, i) != 0) {
+                goto fail;
+            }
 
             // Note: expanded_len will include the bonus data size if
             // the patch was constructed with bonus data.  The
             // deflation will come up 'bonus_size' bytes short; these
             // must be appended from the bonus_data value.
-            size_t bonus_size = (i == 1 && bonus_data != NULL) ? bonus_data->size : 0;
-
-            unsigned char* expanded_source = malloc(expanded_len);
-            if (expanded_source == NULL) {
-                printf("failed to allocate %zu bytes for expanded_source\n",
-                       expanded_len);
-                return -1;
+            c->bonus_size = (i == 1 && bonus_data != NULL) ? bonus_data->size : 0;
+            if (c->bonus_size > c->expanded_len) {
+                printf("bonus data larger than chunk %d\n", i);
+                goto fail;
             }
+        } else {
+            printf("patch chunk %d is unknown type %d\n", i, c->type);
+            goto fail;
+        }
+    }
 
-            z_stream strm;
-            strm.zalloc = Z_NULL;
-            strm.zfree = Z_NULL;
-            strm.opaque = Z_NULL;
-            strm.avail_in = src_len;
-            strm.next_in = (unsigned char*)(old_data + src_start);
-            strm.avail_out = expanded_len;
-            strm.next_out = expanded_source;
-
-            int ret;
-            ret = inflateInit2(&strm, -15);
-            if (ret != Z_OK) {
-                printf("failed to init source inflation: %d\n", ret);
-                return -1;
-            }
+    *chunks_out = chunks;
+    return num_chunks;
 
-            // Because we've provided enough room to accommodate the output
-            // data, we expect one call to inflate() to suffice.
-            ret = inflate(&strm, Z_SYNC_FLUSH);
-            if (ret != Z_STREAM_END) {
-                printf("source inflation returned %d\n", ret);
-                return -1;
-            }
-            // We should have filled the output buffer exactly, except
-            // for the bonus_size.
-            if (strm.avail_out != bonus_size) {
-                printf("source inflation short by %zu bytes\n", strm.avail_out-bonus_size);
-                return -1;
-            }
-            inflateEnd(&strm);
+fail:
+    free(chunks);
+    return -1;
+}
 
-            if (bonus_size) {
-                memcpy(expanded_source + (expanded_len - bonus_size),
-                       bonus_data->data, bonus_size);
-            }
+/*
+ * Inflate the source of a deflate chunk, apply its bsdiff patch and
+ * compress the result again with the encoder parameters of the
+ * target.  The compressed target is left in c->data.
+ */
+static int ApplyDeflateChunk(const unsigned char* old_data, const Value* patch,
+                             const Value* bonus_data, PatchChunk* c) {
+    // Decompress the source data; the chunk header tells us exactly
+    // how big we expect it to be when decompressed.
+    unsigned char* expanded_source = malloc(c->expanded_len);
+    if (expanded_source == NULL) {
+        printf("failed to allocate %zu bytes for expanded_source\n",
+               c->expanded_len);
+        return -1;
+    }
 
-            // Next, apply the bsdiff patch (in memory) to the uncompressed
-            // data.
-            unsigned char* uncompressed_target_data;
-            ssize_t uncompressed_target_size;
-            if (ApplyBSDiffPatchMem(expanded_source, expanded_len,
-                                    patch, patch_offset,
-                                    &uncompressed_target_data,
-                                    &uncompressed_target_size) != 0) {
-                return -1;
-            }
+    z_stream strm;
+    strm.zalloc = Z_NULL;
+    strm.zfree = Z_NULL;
+    strm.opaque = Z_NULL;
+    strm.avail_in = c->src_len;
+    strm.next_in = (unsigned char*)(old_data + c->src_start);
+    strm.avail_out = c->expanded_len;
+    strm.next_out = expanded_source;
 
-            // Now compress the target data and append it to the output.
-
-            // we're done with the expanded_source data buffer, so we'll
-            // reuse that memory to receive the output of deflate.
-            unsigned char* temp_data = expanded_source;
-            ssize_t temp_size = expanded_len;
-            if (temp_size < 32768) {
-                // ... unless the buffer is too small, in which case we'll
-                // allocate a fresh one.
-                free(temp_data);
-                temp_data = malloc(32768);
-                temp_size = 32768;
-            }
+    int ret;
+    ret = inflateInit2(&strm, -15);
+    if (ret != Z_OK) {
+        printf("failed to init source inflation: %d\n", ret);
+        free(expanded_source);
+        return -1;
+    }
+
+    // Because we've provided enough room to accommodate the output
+    // data, we expect one call to inflate() to suffice.
+    ret = inflate(&strm, Z_SYNC_FLUSH);
+    inflateEnd(&strm);
+    if (ret != Z_STREAM_END) {
+        printf("source inflation returned %d\n", ret);
+        free(expanded_source);
+        return -1;
+    }
+    // We should have filled the output buffer exactly, except
+    // for the bonus_size.
+    if (strm.avail_out != c->bonus_size) {
+        printf("source inflation short by %zu bytes\n", strm.avail_out-c->bonus_size);
+        free(expanded_source);
+        return -1;
+    }
 
-            // now the deflate stream
-            strm.zalloc = Z_NULL;
-            strm.zfree = Z_NULL;
-            strm.opaque = Z_NULL;
-            strm.avail_in = uncompressed_target_size;
-            strm.next_in = uncompressed_target_data;
-            ret = deflateInit2(&strm, level, method, windowBits, memLevel, strategy);
-            do {
-                strm.avail_out = temp_size;
-                strm.next_out = temp_data;
-                ret = deflate(&strm, Z_FINISH);
-                ssize_t have = temp_size - strm.avail_out;
-
-                if (sink(temp_data, have, token) != have) {
-                    printf("failed to write %ld compressed bytes to output\n",
-                           (long)have);
-                    return -1;
-                }
-                SHA_update(ctx, temp_data, have);
-            } while (ret != Z_STREAM_END);
-            deflateEnd(&strm);
-
-            free(temp_data);
-            free(uncompressed_target_data);
+    if (c->bonus_size) {
+        memcpy(expanded_source + (c->expanded_len - c->bonus_size),
+               bonus_data->data, c->bonus_size);
+    }
+
+    // Next, apply the bsdiff patch (in memory) to the uncompressed
+    // data.
+    unsigned char* uncompressed_target_data;
+    ssize_t uncompressed_target_size;
+    ret = ApplyBSDiffPatchMem(expanded_source, c->expanded_len,
+                              patch, c->patch_offset,
+                              &uncompressed_target_data,
+                              &uncompressed_target_size);
+    free(expanded_source);
+    if (ret != 0) {
+        return -1;
+    }
+
+    // Now compress the target data.  deflateBound() leaves room for
+    // the whole stream, so a single deflate() call finishes it.
+    strm.zalloc = Z_NULL;
+    strm.zfree = Z_NULL;
+    strm.opaque = Z_NULL;
+    strm.avail_in = uncompressed_target_size;
+    strm.next_in = uncompressed_target_data;
+    ret = deflateInit2(&strm, c->level, c->method, c->windowBits, c->memLevel, c->strategy);
+    if (ret != Z_OK) {
+        printf("failed to init target deflation: %d\n", ret);
+        free(uncompressed_target_data);
+        return -1;
+    }
+    size_t bound = deflateBound(&strm, uncompressed_target_size);
+    c->data = malloc(bound);
+    if (c->data == NULL) {
+        printf("failed to allocate %zu bytes for deflate output\n", bound);
+        deflateEnd(&strm);
+        free(uncompressed_target_data);
+        return -1;
+    }
+    strm.avail_out = bound;
+    strm.next_out = c->data;
+    ret = deflate(&strm, Z_FINISH);
+    c->size = bound - strm.avail_out;
+    deflateEnd(&strm);
+    free(uncompressed_target_data);
+    if (ret != Z_STREAM_END) {
+        printf("target deflation returned %d\n", ret);
+        free(c->data);
+        c->data = NULL;
+        return -1;
+    }
+    return 0;
+}
+
+static int ApplyChunk(PatchState* state, PatchChunk* c) {
+    switch (c->type) {
+        case CHUNK_NORMAL:
+            return ApplyBSDiffPatchMem(state->old_data + c->src_start, c->src_len,
+                                       state->patch, c->patch_offset,
+                                       &c->data, &c->size);
+        case CHUNK_DEFLATE:
+            return ApplyDeflateChunk(state->old_data, state->patch,
+                                     state->bonus_data, c);
+        default:
+            // CHUNK_RAW: the data is in the patch itself
+            return 0;
+    }
+}
+
+static void* ChunkWorker(void* cookie) {
+    PatchState* state = (PatchState*)cookie;
+
+    pthread_mutex_lock(&state->lock);
+    for (;;) {
+        // don't run further ahead of the sink than the window
+        while (!state->abort && state->next_chunk < state->num_chunks &&
+               state->next_chunk >= state->next_output + IMGPATCH_WINDOW) {
+            pthread_cond_wait(&state->cond, &state->lock);
+        }
+        if (state->abort || state->next_chunk >= state->num_chunks)
+            break;
+        PatchChunk* c = state->chunks + state->next_chunk++;
+        pthread_mutex_unlock(&state->lock);
+
+        int status = ApplyChunk(state, c) == 0 ? 1 : -1;
+
+        pthread_mutex_lock(&state->lock);
+        c->status = status;
+        // the output stops at the first failing chunk: don't decode past it
+        if (status < 0) {
+            state->abort = 1;
+        }
+        pthread_cond_broadcast(&state->cond);
+    }
+    pthread_mutex_unlock(&state->lock);
+    return NULL;
+}
+
+/*
+ * Apply the patch given in 'patch_filename' to the source data given
+ * by (old_data, old_size).  Write the patched output to the 'output'
+ * file, and update the SHA context with the output data as well.
+ * Return 0 on success.
+ *
+ * The chunks are patched concurrently, but always written to the
+ * sink and the SHA context in order.
+ */
+int ApplyImagePatch(const unsigned char* old_data, ssize_t old_size,
+                    const Value* patch,
+                    SinkFn sink, void* token, SHA_CTX* ctx,
+                    const Value* bonus_data) {
+    char* header = patch->data;
+    if (patch->size < 12) {
+        printf("patch too short to contain header\n");
+        return -1;
+    }
+
+    // IMGDIFF2 uses CHUNK_NORMAL, CHUNK_DEFLATE, and CHUNK_RAW.
+    // (IMGDIFF1, which is no longer supported, used CHUNK_NORMAL and
+    // CHUNK_GZIP.)
+    if (memcmp(header, "IMGDIFF2", 8) != 0) {
+        printf("corrupt patch file header (magic number)\n");
+        return -1;
+    }
+
+    PatchState state;
+    state.num_chunks = ReadChunkHeaders(patch, bonus_data, old_size, &state.chunks);
+    if (state.num_chunks < 0) {
+        return -1;
+    }
+    state.old_data = old_data;
+    state.patch = patch;
+    state.bonus_data = bonus_data;
+    state.next_chunk = 0;
+    state.next_output = 0;
+    state.abort = 0;
+    pthread_mutex_init(&state.lock, NULL);
+    pthread_cond_init(&state.cond, NULL);
+
+    pthread_t workers[IMGPATCH_WORKERS];
+    int num_workers = 0;
+    long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+    while (num_workers < IMGPATCH_WORKERS && num_workers < ncpus &&
+           num_workers < state.num_chunks &&
+           pthread_create(workers+num_workers, NULL, ChunkWorker, &state) == 0) {
+        ++num_workers;
+    }
+
+    int result = 0;
+    int i;
+    for (i = 0; i < state.num_chunks; ++i) {
+        PatchChunk* c = state.chunks + i;
+        if (num_workers == 0) {
+            // no thread could be started: decode the chunks in turn
+            c->status = ApplyChunk(&state, c) == 0 ? 1 : -1;
         } else {
-            printf("patch chunk %d is unknown type %d\n", i, type);
-            return -1;
+            pthread_mutex_lock(&state.lock);
+            while (c->status == 0) {
+                pthread_cond_wait(&state.cond, &state.lock);
+            }
+            pthread_mutex_unlock(&state.lock);
+        }
+
+        if (c->status < 0) {
+            printf("failed to patch chunk %d\n", i);
+            result = -1;
+            break;
+        }
+        if (sink(c->data, c->size, token) != c->size) {
+            printf("failed to write %ld bytes of chunk %d to output\n",
+                   (long)c->size, i);
+            result = -1;
+            break;
         }
+        SHA_update(ctx, c->data, c->size);
+        if (c->type != CHUNK_RAW) {
+            free(c->data);
+            c->data = NULL;
+        }
+
+        pthread_mutex_lock(&state.lock);
+        state.next_output = i + 1;
+        pthread_cond_broadcast(&state.cond);
+        pthread_mutex_unlock(&state.lock);
     }
 
-    return 0;
+    pthread_mutex_lock(&state.lock);
+    state.abort = 1;
+    pthread_cond_broadcast(&state.cond);
+    pthread_mutex_unlock(&state.lock);
+    for (i = 0; i < num_workers; ++i) {
+        pthread_join(workers[i], NULL);
+    }
+
+    // release whatever was decoded past a failure
+    for (i = 0; i < state.num_chunks; ++i) {
+        if (state.chunks[i].type != CHUNK_RAW) {
+            free(state.chunks[i].data);
+        }
+    }
+    free(state.chunks);
+    pthread_cond_destroy(&state.cond);
+    pthread_mutex_destroy(&state.lock);
+    return result;
 }
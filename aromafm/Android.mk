@@ -120,6 +120,7 @@ LOCAL_SRC_FILES += \
     src/libs/aroma_array.c \
     src/libs/aroma_freetype.c \
     src/libs/aroma_graph.c \
+    src/libs/aroma_graph_simd.c \
     src/libs/aroma_input.c \
     src/libs/aroma_languages.c \
     src/libs/aroma_libs.c \
@@ -180,15 +180,50 @@ typedef struct {
   byte * data;    // Data
 } AZMEM;
 
+//
+// AROMA FREETYPE RENDERED GLYPH (in the family atlas)
+//
+typedef struct {
+  short     left;   // bitmap left
+  short     top;    // bitmap top
+  word      w;      // width in pixels
+  word      h;      // rows
+  word      pitch;  // bytes per row (w * 3 for lcd)
+  byte   *  data;   // coverage
+} AFTBITMAP, * AFTBITMAPP;
+
 //
 // AROMA FREETYPE GLYPH CACHE
 //
 typedef struct {
   FT_Glyph  g;
   byte      w;    // width
-  byte      init; // cached
+  volatile byte init; // cached
+  AFTBITMAPP volatile bmp[8]; // rendered, per style: bold | italic << 1 | lcd << 2
 } AFTGLYPH, * AFTGLYPHP;
 
+//
+// AROMA FREETYPE CHARACTER MAP ENTRY
+//
+typedef struct {
+  void   *  f;    // AFTFACEP
+  long      id;   // glyph index
+  volatile byte ready;
+} AFTCHAR, * AFTCHARP;
+
+//
+// AROMA FREETYPE KERNING CACHE ENTRY
+//
+typedef struct {
+  volatile dword seq; // odd while written
+  volatile dword key; // previous << 16 | current, 0 = empty
+  volatile int   val;
+} AFTKERN, * AFTKERNP;
+
+#define AFT_MAP_PAGES   256   // 256 pages of 256 characters: the BMP
+#define AFT_KERN_CACHE  1024
+#define AFT_ASCII_N     95    // ' ' to '~'
+
 //
 // AROMA FREETYPE FONT FACE
 //
@@ -214,6 +249,17 @@ typedef struct {
   byte      h;
   byte      y;
   byte      init;
+  
+  //-- Lookup Tables, read without lock
+  AFTCHARP volatile map[AFT_MAP_PAGES];
+  AFTKERN   kcache[AFT_KERN_CACHE];
+  byte      aw[AFT_ASCII_N];                // ascii advances
+  signed char ak[AFT_ASCII_N][AFT_ASCII_N]; // ascii kerning [previous][current]
+  byte      ascii;                          // aw & ak are filled
+  
+  //-- Glyph Atlas Pages
+  byte   *  atlas;      // current page, first bytes link the previous one
+  int       atlas_pos;
 } AFTFAMILY, * AFTFAMILYP;
 
 //
@@ -553,6 +599,9 @@ byte    aft_fontheight(byte isbig);
 byte    aft_load(const char * source_name, int size, byte isbig, char * relativeto);
 byte aft_drawfont(CANVAS * _b, byte isbig, int fpos, int xpos, int ypos, color cl, byte underline, byte bold, byte italic, byte lcd);
 byte aft_isrtl(int c, byte checkleft);
+byte    aft_runget(const char * s, int maxw, byte isbig, int * val, dword * gen);
+void    aft_runput(const char * s, int maxw, byte isbig, int val, dword gen);
+void    aft_runclear();
 
 
 //
@@ -633,6 +682,21 @@ dword     ag_calcpushlight(color c1, color c2);
 color     ag_calpushad(color c_g);
 color     ag_calculatecontrast(color c, float intensity);
 
+//
+// AROMA Row Compositing Kernels (NEON/AVX2/SSE2, picked at runtime)
+//
+#define AG_SIMD_C     0
+#define AG_SIMD_SSE2  1
+#define AG_SIMD_AVX2  2
+#define AG_SIMD_NEON  3
+void      ag_simd_init();                                              // Pick the fastest kernels for this cpu
+byte      ag_simd_set(byte level);                                     // Force kernels, 0 if not supported
+const char * ag_simd_name();                                           // Name of the selected kernels
+void      ag_blend_row(color * dst, const color * src, int n, byte l); // dst = ag_calculatealpha(dst, src, l)
+void      ag_opa_row(color * dst, const color * src, int n, byte l);   // dst = aAlphaB(src, l)
+void      ag_rgb32_row(dword * dst, const dword * src, int n,          // Convert 0xRRGGBB to framebuffer
+                       int rp, int gp, int bp);                                  // channel positions
+
 //
 // AROMA PNG Font Functions
 //
@@ -888,6 +952,7 @@ ACONTROLP acime2(
   byte inputMsg
 );
 
+typedef byte(*AFBOX_ONFETCH)(ACONTROLP ctl, int index, char * title, byte d_type);
 ACONTROLP afbox(
   AWINDOWP win,
   int x,
@@ -912,6 +977,8 @@ dword   afbox_ddata(ACONTROLP ctl);
 byte afbox_add(ACONTROLP ctl, char * title, char * desc, byte checked, PNGCANVAS * img,
                byte d_type,  char * d_perm, dword d_data, byte selDef);
 void afbox_scrolltoitem(ACONTROLP ctl);
+void afbox_setonfetch(ACONTROLP ctl, AFBOX_ONFETCH onfetch);
+byte afbox_setdesc(ACONTROLP ctl, int index, char * desc, char * d_perm);
 
 byte afbox_addgroup(ACONTROLP ctl, char * title, char * desc);
 int afbox_itemcount(ACONTROLP ctl);
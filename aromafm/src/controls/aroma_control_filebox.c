@@ -51,6 +51,9 @@ typedef struct {
   char d_perm[10];
   dword d_data;
   
+  /* Lazy Desc: 0=Filled, 1=Waiting, 2=Requested */
+  byte pending;
+  
 } AFBOXI, * AFBOXIP;
 typedef struct {
   byte      acheck_signature;
@@ -88,6 +91,9 @@ typedef struct {
   byte      boxtype;
   long      lasttouch;
   int       selectedId;
+  
+  /* Lazy Desc Provider */
+  AFBOX_ONFETCH onfetch;
 } AFBOXD, * AFBOXDP;
 void afbox_ondestroy(void * x) {
   ACONTROLP ctl = (ACONTROLP) x;
@@ -476,9 +482,10 @@ byte afbox_add(ACONTROLP ctl, char * title, char * desc, byte checked, PNGCANVAS
   AFBOXIP newip = (AFBOXIP) malloc(sizeof(AFBOXI));
   newip->d_type   = d_type;
   newip->d_data   = d_data;
-  snprintf(newip->d_perm, 10, "%s", d_perm);
+  newip->pending  = (desc == NULL) ? 1 : 0;
+  snprintf(newip->d_perm, 10, "%s", (d_perm == NULL) ? "" : d_perm);
   snprintf(newip->title, 256, "%s", title);
-  snprintf(newip->desc, 256, "%s", desc);
+  snprintf(newip->desc, 256, "%s", (desc == NULL) ? "" : desc);
   newip->img      = img;
   int imgS        = agdp() * 24;
   newip->drawed   = 0;
@@ -529,6 +536,35 @@ byte afbox_add(ACONTROLP ctl, char * title, char * desc, byte checked, PNGCANVAS
   d->itemn++;
   return 1;
 }
+//-- Set Lazy Desc Provider
+void afbox_setonfetch(ACONTROLP ctl, AFBOX_ONFETCH onfetch) {
+  AFBOXDP d = (AFBOXDP) ctl->d;
+  
+  if (d->acheck_signature != 177) {
+    return;  //-- Not Valid Signature
+  }
+  
+  d->onfetch = onfetch;
+}
+//-- Fill Item Desc & Permission, Redrawed On Next Draw
+byte afbox_setdesc(ACONTROLP ctl, int index, char * desc, char * d_perm) {
+  AFBOXDP d = (AFBOXDP) ctl->d;
+  
+  if (d->acheck_signature != 177) {
+    return 0;  //-- Not Valid Signature
+  }
+  
+  if ((index >= d->itemn) || (index < 0)) {
+    return 0;  //-- Not Valid Index
+  }
+  
+  AFBOXIP p = d->items[index];
+  snprintf(p->desc, 256, "%s", desc);
+  snprintf(p->d_perm, 10, "%s", d_perm);
+  p->pending = 0;
+  p->drawed  = 0;
+  return 1;
+}
 //-- Add Item Into Control
 byte afbox_addgroup(ACONTROLP ctl, char * title, char * desc) {
   AFBOXDP d = (AFBOXDP) ctl->d;
@@ -667,7 +703,15 @@ void afbox_ondraw(void * x) {
     else if (p->y > dr_bottom) {
       break;
     }
-    else if (!p->drawed) {
+    
+    //-- Ask Desc Only For Visible Items
+    if ((p->pending == 1) && (d->onfetch != NULL)) {
+      if (d->onfetch(ctl, i, p->title, p->d_type)) {
+        p->pending = 2;
+      }
+    }
+    
+    if (!p->drawed) {
       afbox_redrawitem_ex(ctl, i);
       p->drawed = 1;
     }
@@ -1210,6 +1254,7 @@ ACONTROLP afbox(
   d->draweditemn = 0;
   d->groupCounts = 0;
   d->groupCurrId = -1;
+  d->onfetch     = NULL;
   ACONTROLP ctl = malloc(sizeof(ACONTROL));
   ctl->ondestroy = &afbox_ondestroy;
   ctl->oninput  = &afbox_oninput;
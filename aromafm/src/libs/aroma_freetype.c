@@ -35,6 +35,26 @@ static AFTFAMILY              aft_big;            // Big Font Family
 static AFTFAMILY              aft_small;          // Small Font Family
 static AFTFAMILY              aft_fix;            // Fixed Font
 
+#define AFT_ATLAS_PAGE  65536   // Glyph atlas page size
+#define AFT_ATLAS_HDR   8       // Page header: link to the previous page
+#define AFT_RUN_CACHE   256     // Measured text runs
+#define AFT_RUN_MAXLEN  128     // Longer strings are not cached
+
+//-- Measured text run, guarded by a sequence number (odd while written)
+//-- and stamped with the font generation it was measured with
+typedef struct {
+  volatile dword seq;
+  dword gen;
+  dword hash;
+  int   maxw;
+  int   val;
+  byte  isbig;
+  char  s[AFT_RUN_MAXLEN];
+} AFTRUN, * AFTRUNP;
+static AFTRUN                 aft_runs[AFT_RUN_CACHE];
+static pthread_mutex_t        aft_run_mutex = PTHREAD_MUTEX_INITIALIZER;
+static volatile dword         aft_run_gen = 0;    // Bumped on font change
+
 /******************************[ LOCK FUNCTIONS ]******************************/
 static pthread_mutex_t  _afont_mutex = PTHREAD_MUTEX_INITIALIZER;
 void aft_waitlock() {
@@ -43,6 +63,7 @@ void aft_waitlock() {
 void aft_unlock() {
   pthread_mutex_unlock(&_afont_mutex);
 }
+
 AFTFAMILYP aftfnt(byte isbig) {
   if (isbig == 2) {
     return &aft_fix;
@@ -54,6 +75,34 @@ AFTFAMILYP aftfnt(byte isbig) {
   
   return &aft_small;
 }
+
+/*****************************[ READER COUNT ]*****************************/
+//-- Lookup tables, glyphs & atlas are read without lock: a family is
+//-- unpublished (init = 0), then freed once no reader can still use it
+static volatile int     aft_readers = 0;
+
+static AFTFAMILYP aft_readbegin(byte isbig) {
+  __sync_fetch_and_add(&aft_readers, 1);
+  AFTFAMILYP m = aftfnt(isbig);
+  
+  if (!m->init) {
+    __sync_fetch_and_sub(&aft_readers, 1);
+    return NULL;
+  }
+  
+  return m;
+}
+static void aft_readend() {
+  __sync_fetch_and_sub(&aft_readers, 1);
+}
+static void aft_waitreaders() {
+  __sync_synchronize();
+  
+  while (aft_readers > 0) {
+    usleep(1000);
+  }
+}
+
 /*******************************[ RTL FUNCTION ]*******************************/
 //*
 //* RTL CHECKER
@@ -202,13 +251,16 @@ byte aft_cacheglyph(AFTFACEP f, long id) {
     return 0;
   }
   
-  if (f->cache_n < id) {
+  if (f->cache_n <= id) {
     return 0;
   }
   
   if (!f->cache[id].init) {
     FT_Get_Glyph(f->face->glyph, &f->cache[id].g);
     f->cache[id].w    = f->face->glyph->advance.x >> 6;
+    
+    //-- Published: readers check init without lock
+    __sync_synchronize();
     f->cache[id].init = 1;
   }
   
@@ -216,6 +268,75 @@ byte aft_cacheglyph(AFTFACEP f, long id) {
 }
 
 /**************************[ FONT FAMILY MANAGEMENT ]***************************/
+//*
+//* Find face & glyph index for given character, lock must be held
+//*
+static long aft_findid(AFTFAMILYP m, AFTFACEP * f, int c) {
+  int i = 0;
+  
+  for (i = 0; i < m->facen; i++) {
+    long id = FT_Get_Char_Index(m->faces[i].face, c);
+    
+    if (id != 0) {
+      *f = &(m->faces[i]);
+      return id;
+    }
+  }
+  
+  *f = &(m->faces[0]);
+  return 0;
+}
+
+//*
+//* Character map lookup, filled on first use then read without lock
+//*
+static long aft_mapid(AFTFAMILYP m, AFTFACEP * f, int c, byte locked) {
+  byte inmap = ((c >= 0) && (c < AFT_MAP_PAGES * 256));
+  
+  if (inmap) {
+    AFTCHARP pg = m->map[c >> 8];
+    
+    if ((pg != NULL) && (pg[c & 0xff].ready)) {
+      __sync_synchronize();
+      *f = (AFTFACEP) pg[c & 0xff].f;
+      return pg[c & 0xff].id;
+    }
+  }
+  
+  if (!locked) {
+    aft_waitlock();
+  }
+  
+  long id = aft_findid(m, f, c);
+  
+  if (inmap) {
+    AFTCHARP pg = m->map[c >> 8];
+    
+    if (pg == NULL) {
+      pg = (AFTCHARP) malloc(sizeof(AFTCHAR) * 256);
+      
+      if (pg != NULL) {
+        memset(pg, 0, sizeof(AFTCHAR) * 256);
+        __sync_synchronize();
+        m->map[c >> 8] = pg;
+      }
+    }
+    
+    if (pg != NULL) {
+      pg[c & 0xff].f  = (void *) *f;
+      pg[c & 0xff].id = id;
+      __sync_synchronize();
+      pg[c & 0xff].ready = 1;
+    }
+  }
+  
+  if (!locked) {
+    aft_unlock();
+  }
+  
+  return id;
+}
+
 //*
 //* Get glyph index & face for given character
 //*
@@ -228,33 +349,121 @@ long aft_id(AFTFACEP * f, int c, byte isbig) {
     return 0;
   }
   
-  AFTFAMILYP m = aftfnt(isbig);
+  AFTFAMILYP m = aft_readbegin(isbig);
   
-  if (!m->init) {
+  if (m == NULL) {
     return 0;
   }
   
+  long id = 0;
+  
   if (m->facen > 0) {
+    id = aft_mapid(m, f, c, 0);
+  }
+  
+  aft_readend();
+  return id;
+}
+
+//*
+//* Get cached glyph for given character, loaded on first use
+//*
+static AFTGLYPHP aft_glyph(AFTFAMILYP m, int c, byte locked) {
+  if ((c == 0xfeff) || (m->facen < 1)) {
+    return NULL;
+  }
+  
+  AFTFACEP f = NULL;
+  long uc    = aft_mapid(m, &f, c, locked);
+  
+  if ((f == NULL) || (f->cache == NULL) || (uc >= f->cache_n)) {
+    return NULL;
+  }
+  
+  AFTGLYPHP g = &f->cache[uc];
+  
+  if (g->init) {
+    __sync_synchronize();
+    return g;
+  }
+  
+  if (!locked) {
     aft_waitlock();
-    long id = 0;
-    int  i  = 0;
+  }
+  
+  if (!g->init) {
+    if (FT_Load_Glyph(f->face, uc, FT_LOAD_DEFAULT) == 0) {
+      aft_cacheglyph(f, uc);
+    }
+  }
+  
+  if (!locked) {
+    aft_unlock();
+  }
+  
+  return g->init ? g : NULL;
+}
+
+//*
+//* Kerning of a pair, from the ascii table, the cache or freetype
+//*
+static int aft_kernpair(AFTFAMILYP m, int c, int p) {
+  //-- Precomputed ascii pairs
+  if (m->ascii && (c >= ' ') && (c <= '~') && (p >= ' ') && (p <= '~')) {
+    return m->ak[p - ' '][c - ' '];
+  }
+  
+  if (m->facen < 1) {
+    return 0;
+  }
+  
+  AFTFACEP cf = NULL;
+  AFTFACEP pf = NULL;
+  long  up = aft_mapid(m, &pf, p, 0);
+  long  uc = aft_mapid(m, &cf, c, 0);
+  
+  if (!up || !uc || !cf || !pf || (cf != pf) || (cf->kern != 1)) {
+    return 0;
+  }
+  
+  //-- Cached pairs: valid if the sequence is even and unchanged after the read
+  AFTKERNP k  = NULL;
+  dword   key = 0;
+  
+  if ((p > 0) && (p < 0x10000) && (c > 0) && (c < 0x10000)) {
+    key = (((dword) p) << 16) | ((dword) c);
+    k   = &m->kcache[(key ^ (key >> 13)) % AFT_KERN_CACHE];
+    dword seq = k->seq;
     
-    for (i = 0; i < m->facen; i++) {
-      id = FT_Get_Char_Index(m->faces[i].face, c);
+    if (!(seq & 1)) {
+      __sync_synchronize();
+      dword kk = k->key;
+      int v    = k->val;
+      __sync_synchronize();
       
-      if (id != 0) {
-        *f = &(m->faces[i]);
-        aft_unlock();
-        return id;
+      if ((k->seq == seq) && (kk == key)) {
+        return v;
       }
     }
-    
-    *f = &(m->faces[0]);
-    aft_unlock();
-    return 0;
   }
   
-  return 0;
+  aft_waitlock();
+  FT_Vector delta;
+  delta.x = 0;
+  FT_Get_Kerning(cf->face, up, uc, FT_KERNING_DEFAULT, &delta );
+  int v = delta.x >> 6;
+  
+  if (k != NULL) {
+    k->seq++;
+    __sync_synchronize();
+    k->key = key;
+    k->val = v;
+    __sync_synchronize();
+    k->seq++;
+  }
+  
+  aft_unlock();
+  return v;
 }
 
 //*
@@ -269,34 +478,111 @@ int aft_kern(int c, int p, byte isbig) {
     return 0;
   }
   
-  AFTFAMILYP m = aftfnt(isbig);
+  AFTFAMILYP m = aft_readbegin(isbig);
   
-  if (!m->init) {
+  if (m == NULL) {
     return 0;
   }
   
-  AFTFACEP cf = NULL;
-  AFTFACEP pf = NULL;
-  long  up = aft_id(&pf, p, isbig);
-  long  uc = aft_id(&cf, c, isbig);
+  int v = aft_kernpair(m, c, p);
+  aft_readend();
+  return v;
+}
+
+//*
+//* Precompute ascii advance & kerning tables, lock must be held
+//*
+static void aft_asciitables(AFTFAMILYP m) {
+  long     id[AFT_ASCII_N];
+  AFTFACEP fc[AFT_ASCII_N];
+  int      i, j;
+  
+  for (i = 0; i < AFT_ASCII_N; i++) {
+    AFTGLYPHP g = aft_glyph(m, i + ' ', 1);
+    m->aw[i] = (g != NULL) ? g->w : 0;
+    fc[i]    = NULL;
+    id[i]    = aft_mapid(m, &fc[i], i + ' ', 1);
+  }
   
-  if (up && uc && cf && pf) {
-    if (cf == pf) {
-      if (cf->kern == 1) {
-        aft_waitlock();
+  memset(m->ak, 0, sizeof(m->ak));
+  
+  for (i = 0; i < AFT_ASCII_N; i++) {
+    for (j = 0; j < AFT_ASCII_N; j++) {
+      if (id[i] && id[j] && (fc[i] == fc[j]) && (fc[i]->kern == 1)) {
         FT_Vector delta;
-        FT_Get_Kerning(cf->face, up, uc, FT_KERNING_DEFAULT, &delta );
-        aft_unlock();
-        return (delta.x >> 6);
+        delta.x = 0;
+        FT_Get_Kerning(fc[i]->face, id[i], id[j], FT_KERNING_DEFAULT, &delta);
+        m->ak[i][j] = delta.x >> 6;
       }
     }
   }
   
-  return 0;
+  __sync_synchronize();
+  m->ascii = 1;
+}
+
+//*
+//* Allocate from the family glyph atlas, lock must be held
+//*
+static byte * aft_atlasalloc(AFTFAMILYP m, int sz) {
+  sz = (sz + 7) & ~7;
+  
+  //-- Bigger than a page: own page, linked behind the current one
+  if (sz > AFT_ATLAS_PAGE - AFT_ATLAS_HDR) {
+    byte * pg = (byte *) malloc(AFT_ATLAS_HDR + sz);
+    
+    if (pg == NULL) {
+      return NULL;
+    }
+    
+    if (m->atlas != NULL) {
+      *((byte **) pg)       = *((byte **) m->atlas);
+      *((byte **) m->atlas) = pg;
+    }
+    else {
+      *((byte **) pg) = NULL;
+      m->atlas        = pg;
+      m->atlas_pos    = AFT_ATLAS_PAGE;
+    }
+    
+    return pg + AFT_ATLAS_HDR;
+  }
+  
+  if ((m->atlas == NULL) || (m->atlas_pos + sz > AFT_ATLAS_PAGE)) {
+    byte * pg = (byte *) malloc(AFT_ATLAS_PAGE);
+    
+    if (pg == NULL) {
+      return NULL;
+    }
+    
+    *((byte **) pg) = m->atlas;
+    m->atlas        = pg;
+    m->atlas_pos    = AFT_ATLAS_HDR;
+  }
+  
+  byte * p = m->atlas + m->atlas_pos;
+  m->atlas_pos += sz;
+  return p;
+}
+
+//*
+//* Release the family glyph atlas, lock must be held
+//*
+static void aft_atlasfree(AFTFAMILYP m) {
+  byte * pg = m->atlas;
+  
+  while (pg != NULL) {
+    byte * prev = *((byte **) pg);
+    free(pg);
+    pg = prev;
+  }
+  
+  m->atlas     = NULL;
+  m->atlas_pos = 0;
 }
 
 //*
-//* Free Font Family
+//* Free Font Family, the lock must not be held
 //*
 byte aft_free(AFTFAMILYP m) {
   if (!aft_initialized) {
@@ -311,13 +597,28 @@ byte aft_free(AFTFAMILYP m) {
     return 0;
   }
   
+  //-- Unpublish, then wait for the readers which may still use it
+  m->init = 0;
+  aft_waitreaders();
+  aft_waitlock();
   int fn = m->facen;
   m->facen = 0;
-  m->init = 0;
+  m->ascii = 0;
+  
+  //-- Lookup tables & rendered glyphs
+  int i;
+  
+  for (i = 0; i < AFT_MAP_PAGES; i++) {
+    if (m->map[i] != NULL) {
+      free(m->map[i]);
+      m->map[i] = NULL;
+    }
+  }
+  
+  memset(m->kcache, 0, sizeof(m->kcache));
+  aft_atlasfree(m);
   
   if (fn > 0) {
-    int i;
-    
     for (i = 0; i < fn; i++) {
       aft_closeglyph(&(m->faces[i]));
       FT_Done_Face(m->faces[i].face);
@@ -327,6 +628,7 @@ byte aft_free(AFTFAMILYP m) {
     free(m->faces);
   }
   
+  aft_unlock();
   return 1;
 }
 
@@ -407,10 +709,10 @@ byte aft_load(const char * source_name, int size, byte isbig, char * relativeto)
   }
   
   if (c > 0) {
-    aft_waitlock();
     AFTFAMILYP m = aftfnt(isbig);
-    //-- Cleanup Font
+    //-- Cleanup Font, without the lock: readers may need it to finish
     aft_free(m);
+    aft_waitlock();
     m->s = m_s;
     m->p = m_p;
     m->h = m_h;
@@ -426,6 +728,7 @@ byte aft_load(const char * source_name, int size, byte isbig, char * relativeto)
     }
     
     m->facen = c;
+    aft_asciitables(m);
     m->init  = 1;
     LOGS("(%i) Freetype fonts loaded as Font Family\n", c);
     aft_unlock();
@@ -496,73 +799,30 @@ byte aft_close() {
 }
 
 //*
-//* Font Width - No Auto Unlock
+//* Font Width
 //*
-int aft_fontwidth_lock(int c, byte isbig, AFTGLYPHP * ch, byte * onlock) {
+int aft_fontwidth(int c, byte isbig) {
   if (!aft_initialized) {
     return 0;
   }
   
-  if (c == 0xfeff) {
-    return 0;
-  }
-  
-  AFTFACEP   f = NULL;
-  long uc      = aft_id(&f, c, isbig);
-  
-  if (f == NULL) {
-    return 0;
-  }
+  AFTFAMILYP m = aft_readbegin(isbig);
   
-  if (f->cache == NULL) {
-    return 0;
-  }
-  
-  if (uc > f->cache_n) {
+  if (m == NULL) {
     return 0;
   }
   
-  aft_waitlock();
-  *onlock = 1;
-  
-  if (f->cache[uc].init) {
-    if (ch != NULL) {
-      *ch = &f->cache[uc];
-    }
-    
-    return f->cache[uc].w;
-  }
-  
-  if (FT_Load_Glyph(f->face, uc, FT_LOAD_DEFAULT) == 0) {
-    if (aft_cacheglyph(f, uc)) {
-      if (ch != NULL) {
-        *ch = &f->cache[uc];
-      }
-      
-      return f->cache[uc].w;
-    }
-    
-    return 0;
-  }
+  int w = 0;
   
-  return 0;
-}
-
-//*
-//* Font Width - Auto Unlock
-//*
-int aft_fontwidth(int c, byte isbig) {
-  if (!aft_initialized) {
-    return 0;
+  if (m->ascii && (c >= ' ') && (c <= '~')) {
+    w = m->aw[c - ' '];
   }
-  
-  byte onlock = 0;
-  int w = aft_fontwidth_lock(c, isbig, NULL, &onlock);
-  
-  if (onlock) {
-    aft_unlock();
+  else {
+    AFTGLYPHP g = aft_glyph(m, c, 0);
+    w = (g != NULL) ? g->w : 0;
   }
   
+  aft_readend();
   return w;
 }
 
@@ -614,50 +874,33 @@ color aAlphaMulti(color dcl, color scl, byte lr, byte lg, byte lb) {
   return ag_rgb(r, g, b);
 }
 //*
-//* Draw Font
+//* Render glyph into the family atlas, once per style
 //*
-byte aft_drawfont(CANVAS * _b, byte isbig, int fpos, int xpos, int ypos, color cl, byte underline, byte bold, byte italic, byte lcd) {
-  if (!aft_initialized) {
-    return 0;
-  }
+static AFTBITMAPP aft_render(AFTFAMILYP m, AFTGLYPHP ch, byte bold, byte italic, byte lcd) {
+  byte style    = (bold ? 1 : 0) | (italic ? 2 : 0) | (lcd ? 4 : 0);
+  AFTBITMAPP bm = ch->bmp[style];
   
-  //-- Is Default Canvas?
-  if (_b == NULL) {
-    _b = agc();
+  if (bm != NULL) {
+    __sync_synchronize();
+    return bm;
   }
   
-  //-- Get Font Glyph
-  AFTFAMILYP m      = aftfnt(isbig);
+  aft_waitlock();
+  bm = ch->bmp[style];
   
-  if (!m->init) {
-    return 0;
+  if (bm != NULL) {
+    aft_unlock();
+    return bm;
   }
   
-  AFTGLYPHP ch      = NULL;
-  byte      onlock  = 0;
-  int       fw      = aft_fontwidth_lock(fpos, isbig, &ch, &onlock);
-  int       fh      = aft_fontheight(isbig);
-  
-  //-- Check Validity
-  if ((fw == 0) || (ch == NULL)) {
-    if (onlock) {
-      aft_unlock();
-    }
-    
-    return 0;
-  }
+  //-- Copy & Render
+  FT_Glyph glyph;
   
-  if (!ch->init) {
-    if (onlock) {
-      aft_unlock();
-    }
-    
-    return 0;
+  if (FT_Glyph_Copy(ch->g, &glyph) != 0) {
+    aft_unlock();
+    return NULL;
   }
   
-  //-- Copy & Render
-  FT_Glyph glyph;
-  FT_Glyph_Copy(ch->g, &glyph);
   /* Outline Embolden - BOLD */
   byte embolded = 0;
   
@@ -679,65 +922,127 @@ byte aft_drawfont(CANVAS * _b, byte isbig, int fpos, int xpos, int ypos, color c
     FT_Glyph_Transform(glyph, &matrix, NULL);
   }
   
-  if (lcd) {
-    FT_Glyph_To_Bitmap(&glyph, FT_RENDER_MODE_LCD, 0, 1);
-  }
-  else {
-    FT_Glyph_To_Bitmap(&glyph, FT_RENDER_MODE_NORMAL, 0, 1);
-  }
-  
-  //-- Prepare Raster Glyph
-  FT_BitmapGlyph  bit = (FT_BitmapGlyph) glyph;
-  
-  /* Bitmap Embolden  - BOLD */
-  if ((bold) && (!embolded)) {
-    FT_Bitmap_Embolden(bit->root.library, &bit->bitmap, 80, 80);
+  if (FT_Glyph_To_Bitmap(&glyph, lcd ? FT_RENDER_MODE_LCD : FT_RENDER_MODE_NORMAL, 0, 1) == 0) {
+    FT_BitmapGlyph  bit = (FT_BitmapGlyph) glyph;
+    
+    /* Bitmap Embolden  - BOLD */
+    if ((bold) && (!embolded)) {
+      FT_Bitmap_Embolden(bit->root.library, &bit->bitmap, 80, 80);
+    }
+    
+    int w     = lcd ? (bit->bitmap.width / 3) : bit->bitmap.width;
+    int pitch = lcd ? (w * 3) : w;
+    int rows  = bit->bitmap.rows;
+    byte * p  = aft_atlasalloc(m, sizeof(AFTBITMAP) + (pitch * rows));
+    
+    if (p != NULL) {
+      AFTBITMAPP nb = (AFTBITMAPP) p;
+      nb->left  = bit->left;
+      nb->top   = bit->top;
+      nb->w     = w;
+      nb->h     = rows;
+      nb->pitch = pitch;
+      nb->data  = p + sizeof(AFTBITMAP);
+      int yy;
+      
+      for (yy = 0; yy < rows; yy++) {
+        memcpy(nb->data + (yy * pitch), bit->bitmap.buffer + (yy * bit->bitmap.pitch), pitch);
+      }
+      
+      __sync_synchronize();
+      ch->bmp[style] = nb;
+      bm = nb;
+    }
   }
   
-  //-- Draw
-  if (lcd) {
-    int xx, yy;
-    int fhalf = ceil(((float) fh) / 2);
-    int bmp_w = bit->bitmap.width / 3;
+  FT_Done_Glyph(glyph);
+  aft_unlock();
+  return bm;
+}
+
+//*
+//* Blit rendered glyph, clipped once, span by span
+//*
+static void aft_blit(CANVAS * _b, AFTBITMAPP bm, int x, int y, color cl, byte lcd) {
+  int x0 = (x < 0) ? -x : 0;
+  int y0 = (y < 0) ? -y : 0;
+  int x1 = min(bm->w, _b->w - x);
+  int y1 = min(bm->h, _b->h - y);
+  int yy;
+  
+  for (yy = y0; yy < y1; yy++) {
+    const byte * src = bm->data + (yy * bm->pitch);
+    color * dst      = _b->data + ((y + yy) * _b->w) + x;
+    int xx           = x0;
     
-    for (yy = 0; yy < bit->bitmap.rows; yy++) {
-      for (xx = 0; xx < bmp_w; xx++) {
-        byte ar = bit->bitmap.buffer[ (yy * bit->bitmap.pitch) + xx * 3];
-        byte ag = bit->bitmap.buffer[ (yy * bit->bitmap.pitch) + xx * 3 + 1];
-        byte ab = bit->bitmap.buffer[ (yy * bit->bitmap.pitch) + xx * 3 + 2];
+    if (lcd) {
+      for (; xx < x1; xx++) {
+        const byte * a = src + (xx * 3);
         
-        if (ar + ag + ab > 0) {
-          int bx = xpos + bit->left + xx;
-          int by = (ypos + yy + fh - m->y) - bit->top;
-          color * dst = agxy(_b, bx, by);
-          
-          if (dst) {
-            *dst = aAlphaMulti(*dst, cl, ar, ag, ab);
-          }
+        if (a[0] + a[1] + a[2] > 0) {
+          dst[xx] = aAlphaMulti(dst[xx], cl, a[0], a[1], a[2]);
         }
       }
+      
+      continue;
     }
-  }
-  else {
-    int xx, yy;
-    int fhalf = ceil(((float) fh) / 2);
-    int bmp_w = bit->bitmap.width;
     
-    for (yy = 0; yy < bit->bitmap.rows; yy++) {
-      for (xx = 0; xx < bmp_w; xx++) {
-        byte a = bit->bitmap.buffer[ (yy * bit->bitmap.pitch) + xx];
-        
-        if (a > 0) {
-          int bx = xpos + bit->left + xx;
-          int by = (ypos + yy + fh - m->y) - bit->top;
-          ag_subpixel(_b, bx, by, cl, a);
-        }
+    while (xx < x1) {
+      //-- Transparent span
+      while ((xx < x1) && (src[xx] == 0)) {
+        xx++;
+      }
+      
+      //-- Solid span
+      while ((xx < x1) && (src[xx] == 255)) {
+        dst[xx++] = cl;
+      }
+      
+      //-- Antialiased span
+      while ((xx < x1) && (src[xx] != 0) && (src[xx] != 255)) {
+        dst[xx] = ag_calculatealpha(dst[xx], cl, src[xx]);
+        xx++;
       }
     }
   }
+}
+
+//*
+//* Draw Font
+//*
+byte aft_drawfont(CANVAS * _b, byte isbig, int fpos, int xpos, int ypos, color cl, byte underline, byte bold, byte italic, byte lcd) {
+  if (!aft_initialized) {
+    return 0;
+  }
   
-  //-- Release Glyph
-  FT_Done_Glyph(glyph);
+  //-- Is Default Canvas?
+  if (_b == NULL) {
+    _b = agc();
+  }
+  
+  //-- Get Font Glyph
+  AFTFAMILYP m      = aft_readbegin(isbig);
+  
+  if (m == NULL) {
+    return 0;
+  }
+  
+  AFTGLYPHP ch      = aft_glyph(m, fpos, 0);
+  
+  //-- Check Validity
+  if ((ch == NULL) || (ch->w == 0)) {
+    aft_readend();
+    return 0;
+  }
+  
+  int fw            = ch->w;
+  int fh            = m->h;
+  AFTBITMAPP bm     = aft_render(m, ch, bold, italic, lcd);
+  
+  //-- Draw
+  if (bm != NULL) {
+    aft_blit(_b, bm, xpos + bm->left, (ypos + fh - m->y) - bm->top, cl, lcd);
+  }
   
   //-- Draw Underline
   if (underline) {
@@ -751,10 +1056,117 @@ byte aft_drawfont(CANVAS * _b, byte isbig, int fpos, int xpos, int ypos, color c
     }
   }
   
-  //-- Unlock
-  if (onlock) {
-    aft_unlock();
+  aft_readend();
+  return 1;
+}
+
+/*****************************[ TEXT RUN CACHE ]*****************************/
+//*
+//* Hash for run cache, 0 when the string can not be cached
+//*
+static dword aft_runhash(const char * s, int maxw, byte isbig, int * len) {
+  dword h = 2166136261u;
+  int   i = 0;
+  
+  for (i = 0; s[i]; i++) {
+    //-- Language & variable tags may change value
+    if ((s[i] == '<') && ((s[i + 1] == '~') || (s[i + 1] == '$'))) {
+      return 0;
+    }
+    
+    if (i >= AFT_RUN_MAXLEN - 1) {
+      return 0;
+    }
+    
+    h = (h ^ (byte) s[i]) * 16777619u;
+  }
+  
+  if (i == 0) {
+    return 0;
+  }
+  
+  h = (h ^ (dword) maxw) * 16777619u;
+  h = (h ^ isbig) * 16777619u;
+  *len = i;
+  return h ? h : 1;
+}
+
+//*
+//* Get measured run (width or wrapped height), without lock
+//* On a miss, gen is to be passed to aft_runput with the measured value
+//*
+byte aft_runget(const char * s, int maxw, byte isbig, int * val, dword * gen) {
+  int   len = 0;
+  dword g   = aft_run_gen;
+  dword h;
+  
+  *gen = g;
+  __sync_synchronize();
+  h = aft_runhash(s, maxw, isbig, &len);
+  
+  if (!h) {
+    return 0;
   }
   
+  AFTRUNP r = &aft_runs[h % AFT_RUN_CACHE];
+  dword seq = r->seq;
+  
+  if ((seq == 0) || (seq & 1)) {
+    return 0;
+  }
+  
+  __sync_synchronize();
+  byte hit = (r->gen == g) && (r->hash == h) && (r->maxw == maxw) &&
+             (r->isbig == isbig) && (memcmp(r->s, s, len + 1) == 0);
+  int  v   = r->val;
+  __sync_synchronize();
+  
+  if (!hit || (r->seq != seq)) {
+    return 0;
+  }
+  
+  *val = v;
   return 1;
 }
+
+//*
+//* Store measured run, unless the fonts changed since aft_runget gave gen:
+//* the value may have been measured with the previous font
+//*
+void aft_runput(const char * s, int maxw, byte isbig, int val, dword gen) {
+  int   len = 0;
+  dword h   = aft_runhash(s, maxw, isbig, &len);
+  
+  if (!h) {
+    return;
+  }
+  
+  AFTRUNP r = &aft_runs[h % AFT_RUN_CACHE];
+  pthread_mutex_lock(&aft_run_mutex);
+  
+  if (gen != aft_run_gen) {
+    pthread_mutex_unlock(&aft_run_mutex);
+    return;
+  }
+  
+  r->seq++;
+  __sync_synchronize();
+  r->gen   = gen;
+  r->hash  = h;
+  r->maxw  = maxw;
+  r->isbig = isbig;
+  r->val   = val;
+  memcpy(r->s, s, len + 1);
+  __sync_synchronize();
+  r->seq++;
+  pthread_mutex_unlock(&aft_run_mutex);
+}
+
+//*
+//* Forget all runs, on font change: entries of older generations miss
+//*
+void aft_runclear() {
+  pthread_mutex_lock(&aft_run_mutex);
+  aft_run_gen++;
+  pthread_mutex_unlock(&aft_run_mutex);
+}
@@ -0,0 +1,339 @@
+/*
+ * Freetype renderer test, built for the host by aroma_freetype_test.sh
+ *
+ * - Glyphs drawn from the atlas must match, pixel by pixel, the glyphs
+ *   rendered the previous way (outline copied and rasterized on every
+ *   call, blended pixel by pixel) for every style, clipped or not.
+ * - Fonts are reloaded while other threads draw and measure text: run
+ *   with AddressSanitizer, it catches lookup tables or atlas pages freed
+ *   under a reader.
+ * - A text run measured before a font change must not be cached after it.
+ *
+ *   aroma_freetype_test <font directory>
+ */
+
+#include "aroma_freetype.c"
+
+/*****************************[ CANVAS STUBS ]*****************************/
+#undef malloc
+#undef free
+
+void * aroma_malloc(size_t size) {
+  return malloc(size ? size : 1);
+}
+void aroma_free(void ** x) {
+  free(*x);
+  *x = NULL;
+}
+
+static CANVAS test_canvas;
+
+CANVAS * agc() {
+  return &test_canvas;
+}
+int agdp() {
+  return 2;
+}
+int min(int a, int b) {
+  return (a < b) ? a : b;
+}
+color * agxy(CANVAS * _b, int x, int y) {
+  if ((x < 0) || (y < 0) || (x >= _b->w) || (y >= _b->h)) {
+    return NULL;
+  }
+
+  return _b->data + (y * _b->w) + x;
+}
+byte ag_setpixel(CANVAS * _b, int x, int y, color cl) {
+  color * c = agxy(_b, x, y);
+
+  if (c == NULL) {
+    return 0;
+  }
+
+  c[0] = cl;
+  return 1;
+}
+color ag_calculatealpha(color dcl, color scl, byte l) {
+  if (scl == dcl) {
+    return scl;
+  }
+  else if (l == 0) {
+    return dcl;
+  }
+  else if (l == 255) {
+    return scl;
+  }
+
+  byte  ralpha = 255 - l;
+  byte r = (byte) (((((int) ag_r(dcl)) * ralpha) + (((int) ag_r(scl)) * l)) >> 8);
+  byte g = (byte) (((((int) ag_g(dcl)) * ralpha) + (((int) ag_g(scl)) * l)) >> 8);
+  byte b = (byte) (((((int) ag_b(dcl)) * ralpha) + (((int) ag_b(scl)) * l)) >> 8);
+  return ag_rgb(r, g, b);
+}
+byte ag_subpixel(CANVAS * _b, int x, int y, color cl, byte l) {
+  if (l >= 255) {
+    return ag_setpixel(_b, x, y, cl);
+  }
+
+  if (l <= 0) {
+    return 1;
+  }
+
+  color * c = agxy(_b, x, y);
+
+  if (c == NULL) {
+    return 0;
+  }
+
+  c[0] = ag_calculatealpha(c[0], cl, l);
+  return 1;
+}
+byte az_readmem(AZMEM * out, const char * zpath, byte bytesafe) {
+  FILE * f = fopen(zpath, "rb");
+
+  if (f == NULL) {
+    return 0;
+  }
+
+  fseek(f, 0, SEEK_END);
+  out->sz   = ftell(f);
+  out->data = malloc(out->sz + (bytesafe ? 1 : 0));
+  fseek(f, 0, SEEK_SET);
+
+  if (fread(out->data, 1, out->sz, f) != out->sz) {
+    free(out->data);
+    fclose(f);
+    return 0;
+  }
+
+  if (bytesafe) {
+    out->data[out->sz] = 0;
+  }
+
+  fclose(f);
+  return 1;
+}
+
+/**************************[ REFERENCE RENDERER ]**************************/
+//-- aft_drawfont before the glyph atlas, without underline
+static byte ref_drawfont(CANVAS * _b, byte isbig, int fpos, int xpos, int ypos, color cl, byte bold, byte italic, byte lcd) {
+  AFTFAMILYP m = aftfnt(isbig);
+  AFTGLYPHP ch = aft_glyph(m, fpos, 0);
+
+  if ((ch == NULL) || (ch->w == 0)) {
+    return 0;
+  }
+
+  int fh = m->h;
+  FT_Glyph glyph;
+  FT_Glyph_Copy(ch->g, &glyph);
+  byte embolded = 0;
+
+  if (bold) {
+    if (glyph->format == FT_GLYPH_FORMAT_OUTLINE) {
+      FT_OutlineGlyph foglyph = (FT_OutlineGlyph) glyph;
+      FT_Outline_Embolden(&foglyph->outline, 80);
+      embolded = 1;
+    }
+  }
+
+  if (italic) {
+    FT_Matrix matrix;
+    matrix.xx = 0x10000L;
+    matrix.xy = 0x5000L;
+    matrix.yx = 0;
+    matrix.yy = 0x10000L;
+    FT_Glyph_Transform(glyph, &matrix, NULL);
+  }
+
+  FT_Glyph_To_Bitmap(&glyph, lcd ? FT_RENDER_MODE_LCD : FT_RENDER_MODE_NORMAL, 0, 1);
+  FT_BitmapGlyph  bit = (FT_BitmapGlyph) glyph;
+
+  if ((bold) && (!embolded)) {
+    FT_Bitmap_Embolden(bit->root.library, &bit->bitmap, 80, 80);
+  }
+
+  int xx, yy;
+
+  if (lcd) {
+    int bmp_w = bit->bitmap.width / 3;
+
+    for (yy = 0; yy < (int) bit->bitmap.rows; yy++) {
+      for (xx = 0; xx < bmp_w; xx++) {
+        byte ar = bit->bitmap.buffer[ (yy * bit->bitmap.pitch) + xx * 3];
+        byte ag = bit->bitmap.buffer[ (yy * bit->bitmap.pitch) + xx * 3 + 1];
+        byte ab = bit->bitmap.buffer[ (yy * bit->bitmap.pitch) + xx * 3 + 2];
+
+        if (ar + ag + ab > 0) {
+          color * dst = agxy(_b, xpos + bit->left + xx, (ypos + yy + fh - m->y) - bit->top);
+
+          if (dst) {
+            *dst = aAlphaMulti(*dst, cl, ar, ag, ab);
+          }
+        }
+      }
+    }
+  }
+  else {
+    for (yy = 0; yy < (int) bit->bitmap.rows; yy++) {
+      for (xx = 0; xx < (int) bit->bitmap.width; xx++) {
+        byte a = bit->bitmap.buffer[ (yy * bit->bitmap.pitch) + xx];
+
+        if (a > 0) {
+          ag_subpixel(_b, xpos + bit->left + xx, (ypos + yy + fh - m->y) - bit->top, cl, a);
+        }
+      }
+    }
+  }
+
+  FT_Done_Glyph(glyph);
+  return 1;
+}
+
+/*********************************[ TESTS ]*********************************/
+#define TEST_W  48
+#define TEST_H  48
+
+static void test_background(CANVAS * c) {
+  int i;
+
+  for (i = 0; i < c->w * c->h; i++) {
+    c->data[i] = (color) (i * 2654435761u >> 7);
+  }
+}
+
+static int test_pixels(byte isbig) {
+  static const int chars[] = { 0xe9, 0xdf, 0x416, 0x3a9, 0x20ac, 0xfffd };
+  static const int pos[][2] = { { 8, 4 }, { -5, 2 }, { 4, -9 }, { TEST_W - 6, 6 }, { 10, TEST_H - 8 }, { -7, -7 } };
+  color bufa[TEST_W * TEST_H];
+  color bufb[TEST_W * TEST_H];
+  CANVAS a = { TEST_W, TEST_H, sizeof(bufa), bufa };
+  CANVAS b = { TEST_W, TEST_H, sizeof(bufb), bufb };
+  int failed = 0;
+  int n = 0;
+  int style, c, p;
+
+  for (style = 0; style < 8; style++) {
+    for (c = ' '; c <= '~' + (int) (sizeof(chars) / sizeof(int)); c++) {
+      int ch = (c <= '~') ? c : chars[c - '~' - 1];
+
+      for (p = 0; p < (int) (sizeof(pos) / sizeof(pos[0])); p++) {
+        test_background(&a);
+        test_background(&b);
+        aft_drawfont(&a, isbig, ch, pos[p][0], pos[p][1], 0xf81f, 0, style & 1, style & 2, style & 4);
+        ref_drawfont(&b, isbig, ch, pos[p][0], pos[p][1], 0xf81f, style & 1, style & 2, style & 4);
+        n++;
+
+        if (memcmp(bufa, bufb, sizeof(bufa)) != 0) {
+          if (failed++ < 10) {
+            printf("pixels: U+%04x style %d at %d,%d differs\n", ch, style, pos[p][0], pos[p][1]);
+          }
+        }
+      }
+    }
+  }
+
+  printf("pixels: %d glyphs compared, %d different\n", n, failed);
+  return failed;
+}
+
+static char         test_fonts[1024];
+static volatile int test_stop = 0;
+
+static void * test_reader(void * cookie) {
+  color buf[TEST_W * TEST_H];
+  CANVAS cv = { TEST_W, TEST_H, sizeof(buf), buf };
+  int i = 0;
+
+  while (!test_stop) {
+    int c = ' ' + (i % 300);
+    aft_drawfont(&cv, 0, c, 4, 4, 0xffff, 0, i & 1, i & 2, i & 4);
+    aft_fontwidth(c, 0);
+    aft_kern(c, c + 1, 0);
+    i++;
+  }
+
+  return NULL;
+}
+
+static int test_reload() {
+  pthread_t th[2];
+  int i;
+
+  for (i = 0; i < 2; i++) {
+    pthread_create(&th[i], NULL, test_reader, NULL);
+  }
+
+  for (i = 0; i < 50; i++) {
+    aft_load(test_fonts, 10 + (i % 4), 0, "");
+  }
+
+  test_stop = 1;
+
+  for (i = 0; i < 2; i++) {
+    pthread_join(th[i], NULL);
+  }
+
+  printf("reload: 50 reloads while drawing\n");
+  return 0;
+}
+
+static int test_runs() {
+  int   v = 0;
+  dword gen, stale;
+  int   failed = 0;
+
+  //-- measured, stored, found
+  if (aft_runget("run cache", -1, 0, &v, &gen)) {
+    failed++;
+  }
+  aft_runput("run cache", -1, 0, 42, gen);
+  if (!aft_runget("run cache", -1, 0, &v, &gen) || (v != 42)) {
+    failed++;
+  }
+
+  //-- font change: stored runs are gone
+  aft_runclear();
+  if (aft_runget("run cache", -1, 0, &v, &gen)) {
+    failed++;
+  }
+
+  //-- measured across a font change: dropped
+  aft_runget("run cache 2", -1, 0, &v, &stale);
+  aft_runclear();
+  aft_runput("run cache 2", -1, 0, 7, stale);
+  if (aft_runget("run cache 2", -1, 0, &v, &gen)) {
+    failed++;
+  }
+  aft_runput("run cache 2", -1, 0, 8, gen);
+  if (!aft_runget("run cache 2", -1, 0, &v, &gen) || (v != 8)) {
+    failed++;
+  }
+
+  printf("runs: %d checks failed\n", failed);
+  return failed;
+}
+
+int main(int argc, char ** argv) {
+  if (argc != 2) {
+    fprintf(stderr, "usage: %s <font directory>\n", argv[0]);
+    return 2;
+  }
+
+  snprintf(test_fonts, sizeof(test_fonts), "%s/Roboto-Regular.ttf;%s/DroidSans.ttf", argv[1], argv[1]);
+
+  if (!aft_open() || !aft_load(test_fonts, 12, 0, "") || !aft_load(test_fonts, 18, 1, "")) {
+    fprintf(stderr, "can't load %s\n", test_fonts);
+    return 1;
+  }
+
+  int failed = 0;
+  failed += test_pixels(0);
+  failed += test_pixels(1);
+  failed += test_reload();
+  failed += test_runs();
+  aft_close();
+  printf("%s\n", failed ? "FAILED" : "PASSED");
+  return failed ? 1 : 0;
+}
@@ -0,0 +1,35 @@
+#!/bin/bash
+#
+# Host test of the freetype renderer: builds the bundled freetype and
+# aroma_freetype_test with the host gcc and AddressSanitizer, then compares
+# the glyph atlas output with the previous renderer and reloads fonts under
+# concurrent readers (see aroma_freetype_test.c).
+
+# ------------------------
+
+cd $(dirname $0)
+aromafm=$(cd ../.. && pwd)
+tmpdir=$(mktemp -d)
+
+cleanup() {
+  rm -rf $tmpdir
+}
+trap cleanup EXIT
+
+fail() {
+  echo
+  echo FAIL: $@
+  echo
+  exit 1
+}
+
+FT_SRC=$(grep -o 'libs/freetype/[^ ]*\.c' $aromafm/Android.mk | sed "s|^|$aromafm/|")
+
+gcc -O1 -g -w -fsanitize=address -DFT2_BUILD_LIBRARY=1 -D_AROMA_NODEBUG -I$aromafm/include \
+  -o $tmpdir/aroma_freetype_test aroma_freetype_test.c $FT_SRC -lm -lpthread || fail "build"
+
+fonts=$tmpdir/fonts
+mkdir -p $fonts
+cp "$aromafm/assets/assets/fonts/Roboto/Roboto-Regular.ttf" "$aromafm/assets/assets/fonts/Droid Sans/DroidSans.ttf" $fonts || fail "fonts"
+
+$tmpdir/aroma_freetype_test $fonts || fail "aroma_freetype_test"
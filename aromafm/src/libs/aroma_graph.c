@@ -301,6 +301,9 @@ byte ag_init() {
     return 0;
   }
   
+  //-- Row kernels for this cpu
+  ag_simd_init();
+  
   //-- Open Framebuffer
   ag_fb = open(AROMA_FRAMEBUFFER, O_RDWR, 0);
   
@@ -480,7 +483,7 @@ byte ag_draw_strecth(CANVAS * d,
   }
   
   if (sy + sh > s->h) {
-    sw = s->h - sy;
+    sh = s->h - sy;
   }
   
   int x_ratio = (int)((sw << 16) / dw) + 1;
@@ -538,7 +541,7 @@ byte ag_draw_strecth_ex(
   }
   
   if (sy + sh > s->h) {
-    sw = s->h - sy;
+    sh = s->h - sy;
   }
   
   int x_ratio = (int)((sw << 16) / dw) + 1;
@@ -546,29 +549,42 @@ byte ag_draw_strecth_ex(
   int x2, y2;
   int i, j;
   
+  //-- Source columns are the same for every row
+  int  * xs  = (int *) malloc(sizeof(int) * dw);
+  word * row = (word *) malloc(sizeof(word) * dw);
+  
+  if ((xs == NULL) || (row == NULL)) {
+    free(xs);
+    free(row);
+    return 0;
+  }
+  
+  int rat = 0;
+  
+  for (j = 0; j < dw; j++) {
+    xs[j] = (rat >> 16);
+    rat += x_ratio;
+  }
+  
   for (i = 0; i < dh; i++) {
     word * t = d->data + (i + dy) * d->w + dx;
     y2       = ((i * y_ratio) >> 16);
     word * p = s->data + (y2 + sy) * s->w + sx;
-    int rat = 0;
+    
+    for (j = 0; j < dw; j++) {
+      row[j] = p[xs[j]];
+    }
     
     if (withdest) {
-      for (j = 0; j < dw; j++) {
-        x2   = (rat >> 16);
-        *t = ag_calculatealpha(*t, p[x2], alpha);
-        *t++;
-        rat += x_ratio;
-      }
+      ag_blend_row(t, row, dw, alpha);
     }
     else {
-      for (j = 0; j < dw; j++) {
-        x2   = (rat >> 16);
-        *t++ = aAlphaB(p[x2], alpha);
-        rat += x_ratio;
-      }
+      ag_opa_row(t, row, dw, alpha);
     }
   }
   
+  free(xs);
+  free(row);
   return 1;
 }
 
@@ -600,22 +616,17 @@ byte ag_draw_opa(
   sh = (sh > s->h) ? s->h : sh;
   sw = (dx + sw > d->w) ? d->w - dx : sw;
   sh = (dy + sh > d->h) ? d->h - dy : sh;
-  int x, y;
+  int y;
   
   for (y = 0; y < sh; y++) {
     word * t = d->data + (y + sy) * d->w + sx;
     word * p = s->data + (y + dy) * s->w + dx;
     
     if (withdest) {
-      for (x = 0; x < sw; x++) {
-        *t = ag_calculatealpha(*t, *p++, alpha);
-        *t++;
-      }
+      ag_blend_row(t, p, sw, alpha);
     }
     else {
-      for (x = 0; x < sw; x++) {
-        *t++ = aAlphaB(*p++, alpha);
-      }
+      ag_opa_row(t, p, sw, alpha);
     }
   }
   
@@ -910,7 +921,17 @@ void ag32fbufcopy(dword * bfbz) {
   for (y = 0; y < ag_fbv.yres; y++) {
     int yp = y * ag_fbv.xres;
     int yd = (ag_fbf.line_length * y);
-  
+    
+    if (agclp == 4) {
+      ag_rgb32_row(
+        (dword *) (ag_fbuf32 + yd),
+        bfbz + yp, ag_fbv.xres,
+        colorspace_positions[0],
+        colorspace_positions[1],
+        colorspace_positions[2]);
+      continue;
+    }
+    
     for (x = 0; x < ag_fbv.xres; x++) {
       int xy = yp + x;
       *((dword *) (ag_fbuf32 + yd + (x * agclp))) =
@@ -923,18 +944,13 @@ void ag32fbufcopy(dword * bfbz) {
 #endif
 }
 void ag16fbufcopy(word * bfbz) {
-  int x, y;
+  int y;
   
+  //-- Pixels are already in framebuffer format, only rows are padded
   for (y = 0; y < ag_fbv.yres; y++) {
     int yp    = y * ag_fbv.xres;
     int ypos  = y * ag_fbf.line_length;
-    
-    for (x = 0; x < ag_fbv.xres; x++) {
-      int xy = yp + x;
-      int xp = ypos + (x * agclp);
-      // word * fbf = (word *) (((byte *) ag_fbuf) +xp);
-      ag_fbuf[xp / 2] = bfbz[xy];
-    }
+    memcpy(((byte *) ag_fbuf) + ypos, bfbz + yp, ag_fbv.xres * sizeof(word));
   }
 }
 void ag_drawcaret() {
@@ -1193,6 +1209,20 @@ void ag_sync_fade(int frame) {
   */
   ag_sync();
 }
+//-- Dither one blurred pixel, carrying the quantization error to next pixel
+static inline color ag_blur_dither(dword r, dword g, dword b, int radd,
+                                   float * er, float * eg, float * eb) {
+  float vr = min((r / radd) + *er, 255);
+  float vg = min((g / radd) + *eg, 255);
+  float vb = min((b / radd) + *eb, 255);
+  byte  nr = ag_close_r(round(vr));
+  byte  ng = ag_close_g(round(vg));
+  byte  nb = ag_close_b(round(vb));
+  *er = vr - nr;
+  *eg = vg - ng;
+  *eb = vb - nb;
+  return ag_rgb(nr, ng, nb);
+}
 byte ag_blur_h(CANVAS * d, CANVAS * s, int radius) {
   if (radius < 1) {
     return 0;
@@ -1209,62 +1239,44 @@ byte ag_blur_h(CANVAS * d, CANVAS * s, int radius) {
   int x, y, k;
   int rad = radius * 2;
   int radd = rad + 1;
+  int dw = min(s->w, d->w);
+  int dh = min(s->h, d->h);
   
-  for (y = 0; y < s->h; y++) {
+  //-- Sliding window: one pixel enters and one leaves the sums per step
+  for (y = 0; y < dh; y++) {
+    color * src = s->data + y * s->w;
+    color * dst = d->data + y * d->w;
     dword r = 0;
     dword g = 0;
     dword b = 0;
+    float er = 0;
+    float eg = 0;
+    float eb = 0;
     
     for (k = 0; (k <= radius) && (k < s->w); k++) {
-      color * cl = agxy(s, k, y);
-      
-      if (cl != NULL) {
-        r += ag_r(cl[0]);
-        g += ag_g(cl[0]);
-        b += ag_b(cl[0]);
-      }
+      r += ag_r(src[k]);
+      g += ag_g(src[k]);
+      b += ag_b(src[k]);
     }
     
-    //-- Dither Engine
-    float vr = r / radd;
-    float vg = g / radd;
-    float vb = b / radd;
-    byte  nr = ag_close_r(round(vr));
-    byte  ng = ag_close_g(round(vg));
-    byte  nb = ag_close_b(round(vb));
-    float er = vr - nr;
-    float eg = vg - ng;
-    float eb = vb - nb;
-    //-- Save
-    ag_setpixel(d, 0, y, ag_rgb(nr, ng, nb));
-    
-    for (x = 1; x < s->w; x++) {
+    dst[0] = ag_blur_dither(r, g, b, radd, &er, &eg, &eb);
+    
+    for (x = 1; x < dw; x++) {
       if (x > radius) {
-        color * cl = agxy(s, x - radius - 1, y);
-        r -= ag_r(cl[0]);
-        g -= ag_g(cl[0]);
-        b -= ag_b(cl[0]);
+        color cl = src[x - radius - 1];
+        r -= ag_r(cl);
+        g -= ag_g(cl);
+        b -= ag_b(cl);
       }
       
       if (x < s->w - (radius + 1)) {
-        color * cl = agxy(s, x + radius, y);
-        r += ag_r(cl[0]);
-        g += ag_g(cl[0]);
-        b += ag_b(cl[0]);
+        color cl = src[x + radius];
+        r += ag_r(cl);
+        g += ag_g(cl);
+        b += ag_b(cl);
       }
       
-      //-- Dither Engine
-      vr = min((r / radd) + er, 255);
-      vg = min((g / radd) + eg, 255);
-      vb = min((b / radd) + eb, 255);
-      nr = ag_close_r(round(vr));
-      ng = ag_close_g(round(vg));
-      nb = ag_close_b(round(vb));
-      er = vr - nr;
-      eg = vg - ng;
-      eb = vb - nb;
-      //-- Save
-      ag_setpixel(d, x, y, ag_rgb(nr, ng, nb));
+      dst[x] = ag_blur_dither(r, g, b, radd, &er, &eg, &eb);
     }
   }
   
@@ -1286,65 +1298,66 @@ byte ag_blur_v(CANVAS * d, CANVAS * s, int radius) {
   int x, y, k;
   int rad = radius * 2;
   int radd = rad + 1;
+  int dw = min(s->w, d->w);
+  int dh = min(s->h, d->h);
   
-  for (x = 0; x < s->w; x++) {
-    dword r = 0;
-    dword g = 0;
-    dword b = 0;
+  if ((dw < 1) || (dh < 1)) {
+    return 1;
+  }
+  
+  //-- Walk rows instead of columns: keep the sliding sums and dither
+  //-- errors of every column, so memory is read sequentially
+  dword * sums = (dword *) calloc(dw * 3, sizeof(dword));
+  float * errs = (float *) calloc(dw * 3, sizeof(float));
+  
+  if ((sums == NULL) || (errs == NULL)) {
+    free(sums);
+    free(errs);
+    return 0;
+  }
+  
+  for (k = 0; (k <= radius) && (k < s->h); k++) {
+    color * src = s->data + k * s->w;
     
-    for (k = 0; (k <= radius) && (k < s->h); k++) {
-      color * cl = agxy(s, x, k);
+    for (x = 0; x < dw; x++) {
+      sums[x * 3]     += ag_r(src[x]);
+      sums[x * 3 + 1] += ag_g(src[x]);
+      sums[x * 3 + 2] += ag_b(src[x]);
+    }
+  }
+  
+  for (y = 0; y < dh; y++) {
+    color * dst = d->data + y * d->w;
+    
+    if (y > radius) {
+      color * src = s->data + (y - radius - 1) * s->w;
       
-      if (cl != NULL) {
-        r += ag_r(cl[0]);
-        g += ag_g(cl[0]);
-        b += ag_b(cl[0]);
+      for (x = 0; x < dw; x++) {
+        sums[x * 3]     -= ag_r(src[x]);
+        sums[x * 3 + 1] -= ag_g(src[x]);
+        sums[x * 3 + 2] -= ag_b(src[x]);
       }
     }
     
-    //-- Dither Engine
-    float vr = r / radd;
-    float vg = g / radd;
-    float vb = b / radd;
-    byte  nr = ag_close_r(round(vr));
-    byte  ng = ag_close_g(round(vg));
-    byte  nb = ag_close_b(round(vb));
-    float er = vr - nr;
-    float eg = vg - ng;
-    float eb = vb - nb;
-    //-- Save
-    ag_setpixel(d, x, 0, ag_rgb(nr, ng, nb));
-    
-    for (y = 1; y < s->h; y++) {
-      if (y > radius) {
-        color * cl = agxy(s, x, y - radius - 1);
-        r -= ag_r(cl[0]);
-        g -= ag_g(cl[0]);
-        b -= ag_b(cl[0]);
-      }
+    if ((y > 0) && (y < s->h - (radius + 1))) {
+      color * src = s->data + (y + radius) * s->w;
       
-      if (y < s->h - (radius + 1)) {
-        color * cl = agxy(s, x, y + radius);
-        r += ag_r(cl[0]);
-        g += ag_g(cl[0]);
-        b += ag_b(cl[0]);
+      for (x = 0; x < dw; x++) {
+        sums[x * 3]     += ag_r(src[x]);
+        sums[x * 3 + 1] += ag_g(src[x]);
+        sums[x * 3 + 2] += ag_b(src[x]);
       }
-      
-      //-- Dither Engine
-      vr = min((r / radd) + er, 255);
-      vg = min((g / radd) + eg, 255);
-      vb = min((b / radd) + eb, 255);
-      nr = ag_close_r(round(vr));
-      ng = ag_close_g(round(vg));
-      nb = ag_close_b(round(vb));
-      er = vr - nr;
-      eg = vg - ng;
-      eb = vb - nb;
-      //--Save
-      ag_setpixel(d, x, y, ag_rgb(nr, ng, nb));
+    }
+    
+    for (x = 0; x < dw; x++) {
+      dst[x] = ag_blur_dither(
+                 sums[x * 3], sums[x * 3 + 1], sums[x * 3 + 2], radd,
+                 &errs[x * 3], &errs[x * 3 + 1], &errs[x * 3 + 2]);
     }
   }
   
+  free(sums);
+  free(errs);
   return 1;
 }
 byte ag_blur(CANVAS * d, CANVAS * s, int radius) {
@@ -2045,6 +2058,7 @@ byte ag_loadsmallfont(char * fontname, byte is_freetype, char * relativeto) {
     }
   }
   
+  aft_runclear();
   ag_font_onload = 0;
   return r;
 }
@@ -2074,6 +2088,7 @@ byte ag_loadbigfont(char * fontname, byte is_freetype, char * relativeto) {
     }
   }
   
+  aft_runclear();
   ag_font_onload = 0;
   return r;
 }
@@ -2090,6 +2105,7 @@ byte ag_loadfixedfont(char * fontname, byte is_freetype, char * relativeto) {
     r = aft_load(fontname, is_freetype + 1, 2, relativeto);
   }
   
+  aft_runclear();
   ag_font_onload = 0;
   return r;
 }
@@ -2460,6 +2476,12 @@ int ag_txtwidth(const char * ss, byte isbig) {
   int move = 0;
   int p = 0;
   byte isfreetype = isbig ? AG_BIG_FONT_FT : AG_SMALL_FONT_FT;
+  dword gen;
+  
+  if (aft_runget(ss, -1, isbig, &w, &gen)) {
+    return w;
+  }
+  
   char * sams   = alang_ams(ss);
   const char * s = sams;
   
@@ -2483,6 +2505,7 @@ int ag_txtwidth(const char * ss, byte isbig) {
   }
   
   free(sams);
+  aft_runput(ss, -1, isbig, w, gen);
   return w;
 }
 int ag_fontheight(byte isbig) {
@@ -2731,6 +2754,13 @@ int ag_txtheight(int maxwidth, const char * ss, byte isbig) {
     maxwidth = fheight * 2;
   }
   
+  int cached = 0;
+  dword gen;
+  
+  if (aft_runget(ss, maxwidth, isbig, &cached, &gen)) {
+    return cached;
+  }
+  
   char * sams   = alang_ams(ss);
   const char * s = sams;
   int indent = 0;
@@ -2755,6 +2785,7 @@ int ag_txtheight(int maxwidth, const char * ss, byte isbig) {
   }
   
   free(sams);
+  aft_runput(ss, maxwidth, isbig, lines * fheight, gen);
   return (lines * fheight);
 }
 void ag_txtxy(int * x, int * y, int maxwidth, const char * ss, byte isbig, int haltat) {
@@ -0,0 +1,405 @@
+/*
+ * Graphics kernels benchmark, built for the host by aroma_graph_bench.sh
+ *
+ * Each kernel runs on a 1080x1920 canvas with every set of row kernels
+ * this cpu supports (c, sse2, avx2 or neon). Its output must match, pixel
+ * by pixel, the per pixel functions it replaced, which are timed too:
+ * - ag_blend_row()/ag_opa_row() against ag_calculatealpha()/aAlphaB()
+ * - ag_rgb32_row() through ag32fbufcopy(), and ag16fbufcopy(), against
+ *   the per pixel framebuffer copies
+ * - ag_blur_h()/ag_blur_v() against the agxy()/ag_setpixel() blurs
+ *
+ *   aroma_graph_bench
+ */
+
+#include <sys/time.h>
+
+#include "aroma_graph.c"
+
+/********************************[ STUBS ]*********************************/
+#undef malloc
+#undef free
+
+void * aroma_malloc(size_t size) {
+  return malloc(size ? size : 1);
+}
+void aroma_free(void ** x) {
+  free(*x);
+  *x = NULL;
+}
+int min(int a, int b) {
+  return (a < b) ? a : b;
+}
+
+/**************************[ REFERENCE KERNELS ]***************************/
+//-- ag_draw_opa() rows before the row kernels
+static void ref_blend_row(color * t, const color * p, int n, byte alpha) {
+  int x;
+
+  for (x = 0; x < n; x++) {
+    *t = ag_calculatealpha(*t, *p++, alpha);
+    t++;
+  }
+}
+static void ref_opa_row(color * t, const color * p, int n, byte alpha) {
+  int x;
+
+  for (x = 0; x < n; x++) {
+    *t++ = aAlphaB(*p++, alpha);
+  }
+}
+
+//-- ag32fbufcopy() and ag16fbufcopy() before the row kernels
+static void ref_32fbufcopy(dword * bfbz) {
+  int x, y;
+
+  for (y = 0; y < ag_fbv.yres; y++) {
+    int yp = y * ag_fbv.xres;
+    int yd = (ag_fbf.line_length * y);
+
+    for (x = 0; x < ag_fbv.xres; x++) {
+      int xy = yp + x;
+      *((dword *) (ag_fbuf32 + yd + (x * agclp))) =
+        (ag_r32(bfbz[xy]) << colorspace_positions[0]) |
+        (ag_g32(bfbz[xy]) << colorspace_positions[1]) |
+        (ag_b32(bfbz[xy]) << colorspace_positions[2]);
+    }
+  }
+}
+static void ref_16fbufcopy(word * bfbz) {
+  int x, y;
+
+  for (y = 0; y < ag_fbv.yres; y++) {
+    int yp    = y * ag_fbv.xres;
+    int ypos  = y * ag_fbf.line_length;
+
+    for (x = 0; x < ag_fbv.xres; x++) {
+      int xy = yp + x;
+      int xp = ypos + (x * agclp);
+      ag_fbuf[xp / 2] = bfbz[xy];
+    }
+  }
+}
+
+//-- ag_blur_h() and ag_blur_v() before the sliding rows
+static void ref_blur_h(CANVAS * d, CANVAS * s, int radius) {
+  int x, y, k;
+  int rad = radius * 2;
+  int radd = rad + 1;
+
+  for (y = 0; y < s->h; y++) {
+    dword r = 0;
+    dword g = 0;
+    dword b = 0;
+
+    for (k = 0; (k <= radius) && (k < s->w); k++) {
+      color * cl = agxy(s, k, y);
+
+      if (cl != NULL) {
+        r += ag_r(cl[0]);
+        g += ag_g(cl[0]);
+        b += ag_b(cl[0]);
+      }
+    }
+
+    float vr = r / radd;
+    float vg = g / radd;
+    float vb = b / radd;
+    byte  nr = ag_close_r(round(vr));
+    byte  ng = ag_close_g(round(vg));
+    byte  nb = ag_close_b(round(vb));
+    float er = vr - nr;
+    float eg = vg - ng;
+    float eb = vb - nb;
+    ag_setpixel(d, 0, y, ag_rgb(nr, ng, nb));
+
+    for (x = 1; x < s->w; x++) {
+      if (x > radius) {
+        color * cl = agxy(s, x - radius - 1, y);
+        r -= ag_r(cl[0]);
+        g -= ag_g(cl[0]);
+        b -= ag_b(cl[0]);
+      }
+
+      if (x < s->w - (radius + 1)) {
+        color * cl = agxy(s, x + radius, y);
+        r += ag_r(cl[0]);
+        g += ag_g(cl[0]);
+        b += ag_b(cl[0]);
+      }
+
+      vr = min((r / radd) + er, 255);
+      vg = min((g / radd) + eg, 255);
+      vb = min((b / radd) + eb, 255);
+      nr = ag_close_r(round(vr));
+      ng = ag_close_g(round(vg));
+      nb = ag_close_b(round(vb));
+      er = vr - nr;
+      eg = vg - ng;
+      eb = vb - nb;
+      ag_setpixel(d, x, y, ag_rgb(nr, ng, nb));
+    }
+  }
+}
+static void ref_blur_v(CANVAS * d, CANVAS * s, int radius) {
+  int x, y, k;
+  int rad = radius * 2;
+  int radd = rad + 1;
+
+  for (x = 0; x < s->w; x++) {
+    dword r = 0;
+    dword g = 0;
+    dword b = 0;
+
+    for (k = 0; (k <= radius) && (k < s->h); k++) {
+      color * cl = agxy(s, x, k);
+
+      if (cl != NULL) {
+        r += ag_r(cl[0]);
+        g += ag_g(cl[0]);
+        b += ag_b(cl[0]);
+      }
+    }
+
+    float vr = r / radd;
+    float vg = g / radd;
+    float vb = b / radd;
+    byte  nr = ag_close_r(round(vr));
+    byte  ng = ag_close_g(round(vg));
+    byte  nb = ag_close_b(round(vb));
+    float er = vr - nr;
+    float eg = vg - ng;
+    float eb = vb - nb;
+    ag_setpixel(d, x, 0, ag_rgb(nr, ng, nb));
+
+    for (y = 1; y < s->h; y++) {
+      if (y > radius) {
+        color * cl = agxy(s, x, y - radius - 1);
+        r -= ag_r(cl[0]);
+        g -= ag_g(cl[0]);
+        b -= ag_b(cl[0]);
+      }
+
+      if (y < s->h - (radius + 1)) {
+        color * cl = agxy(s, x, y + radius);
+        r += ag_r(cl[0]);
+        g += ag_g(cl[0]);
+        b += ag_b(cl[0]);
+      }
+
+      vr = min((r / radd) + er, 255);
+      vg = min((g / radd) + eg, 255);
+      vb = min((b / radd) + eb, 255);
+      nr = ag_close_r(round(vr));
+      ng = ag_close_g(round(vg));
+      nb = ag_close_b(round(vb));
+      er = vr - nr;
+      eg = vg - ng;
+      eb = vb - nb;
+      ag_setpixel(d, x, y, ag_rgb(nr, ng, nb));
+    }
+  }
+}
+
+/*******************************[ BENCHES ]********************************/
+#define BENCH_W     1080
+#define BENCH_H     1920
+#define BENCH_PAD   32      //-- framebuffer row padding, in pixels
+#define BENCH_RUNS  20      //-- timed runs, the best one is kept
+#define BENCH_BLUR  8       //-- blur radius
+
+static const char * bench_levels[] = { "c", "sse2", "avx2", "neon" };
+static int bench_failed = 0;
+
+static long long now_usec() {
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return (long long) tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+static void bench_fill(color * c, int n, dword seed) {
+  int i;
+
+  for (i = 0; i < n; i++) {
+    seed = seed * 1103515245 + 12345;
+    c[i] = (color) (seed >> 16);
+  }
+}
+
+static void bench_report(const char * kernel, const char * level, long long us, long long ref_us, byte same) {
+  printf("%-10s %-5s %7lld us, previous %7lld us%s\n", kernel, level, us, ref_us,
+         same ? "" : "  DIFFERENT");
+
+  if (!same) {
+    bench_failed++;
+  }
+}
+
+//-- ag_blend_row and ag_opa_row, all alpha values over the frame
+typedef void (*row_fn)(color * dst, const color * src, int n, byte l);
+
+static long long bench_rows(row_fn fn, color * dst, const color * dst0, const color * src) {
+  long long best = -1;
+  int run;
+
+  for (run = 0; run < BENCH_RUNS; run++) {
+    int y;
+    memcpy(dst, dst0, BENCH_W * BENCH_H * sizeof(color));
+    long long start = now_usec();
+
+    for (y = 0; y < BENCH_H; y++) {
+      fn(dst + y * BENCH_W, src + y * BENCH_W, BENCH_W, (byte) y);
+    }
+
+    long long us = now_usec() - start;
+
+    if ((best < 0) || (us < best)) {
+      best = us;
+    }
+  }
+
+  return best;
+}
+
+static void bench_alpha(const char * level) {
+  int sz = BENCH_W * BENCH_H;
+  color * src  = malloc(sz * sizeof(color));
+  color * dst0 = malloc(sz * sizeof(color));
+  color * dst  = malloc(sz * sizeof(color));
+  color * ref  = malloc(sz * sizeof(color));
+  bench_fill(src, sz, 1);
+  bench_fill(dst0, sz, 2);
+  long long ref_us = bench_rows(ref_blend_row, ref, dst0, src);
+  long long us     = bench_rows(ag_blend_row, dst, dst0, src);
+  bench_report("blend_row", level, us, ref_us, memcmp(dst, ref, sz * sizeof(color)) == 0);
+  ref_us = bench_rows(ref_opa_row, ref, dst0, src);
+  us     = bench_rows(ag_opa_row, dst, dst0, src);
+  bench_report("opa_row", level, us, ref_us, memcmp(dst, ref, sz * sizeof(color)) == 0);
+  free(src);
+  free(dst0);
+  free(dst);
+  free(ref);
+}
+
+//-- Framebuffer copies, through the ag_fbv/ag_fbf state of aroma_graph.c
+static long long bench_fbuf(void (*fn)(void *), void * src) {
+  long long best = -1;
+  int run;
+
+  for (run = 0; run < BENCH_RUNS; run++) {
+    long long start = now_usec();
+    fn(src);
+    long long us = now_usec() - start;
+
+    if ((best < 0) || (us < best)) {
+      best = us;
+    }
+  }
+
+  return best;
+}
+
+static void bench_fbufcopy(const char * level) {
+  int sz = BENCH_W * BENCH_H;
+  ag_fbv.xres = BENCH_W;
+  ag_fbv.yres = BENCH_H;
+  //-- 32 bits, rgba framebuffer
+  agclp = 4;
+  ag_fbf.line_length = (BENCH_W + BENCH_PAD) * 4;
+  colorspace_positions[0] = 0;
+  colorspace_positions[1] = 8;
+  colorspace_positions[2] = 16;
+  dword * src32 = malloc(sz * sizeof(dword));
+  byte * fb_ref = calloc(ag_fbf.line_length, BENCH_H);
+  byte * fb     = calloc(ag_fbf.line_length, BENCH_H);
+  bench_fill((color *) src32, sz * 2, 3);
+  ag_fbuf32 = fb_ref;
+  long long ref_us = bench_fbuf((void (*)(void *)) ref_32fbufcopy, src32);
+  ag_fbuf32 = fb;
+  long long us = bench_fbuf((void (*)(void *)) ag32fbufcopy, src32);
+  bench_report("fbuf32", level, us, ref_us, memcmp(fb, fb_ref, ag_fbf.line_length * BENCH_H) == 0);
+  free(src32);
+  free(fb_ref);
+  free(fb);
+  //-- 16 bits
+  agclp = 2;
+  ag_fbf.line_length = (BENCH_W + BENCH_PAD) * 2;
+  color * src16 = malloc(sz * sizeof(color));
+  fb_ref = calloc(ag_fbf.line_length, BENCH_H);
+  fb     = calloc(ag_fbf.line_length, BENCH_H);
+  bench_fill(src16, sz, 4);
+  ag_fbuf = (word *) fb_ref;
+  ref_us = bench_fbuf((void (*)(void *)) ref_16fbufcopy, src16);
+  ag_fbuf = (word *) fb;
+  us = bench_fbuf((void (*)(void *)) ag16fbufcopy, src16);
+  bench_report("fbuf16", level, us, ref_us, memcmp(fb, fb_ref, ag_fbf.line_length * BENCH_H) == 0);
+  free(src16);
+  free(fb_ref);
+  free(fb);
+  ag_fbuf = NULL;
+  ag_fbuf32 = NULL;
+}
+
+//-- Blur passes: plain C, they don't depend on the row kernels
+typedef void (*blur_fn)(CANVAS * d, CANVAS * s, int radius);
+
+static long long bench_blur_pass(blur_fn fn, CANVAS * d, CANVAS * s) {
+  long long best = -1;
+  int run;
+
+  for (run = 0; run < BENCH_RUNS / 4; run++) {
+    long long start = now_usec();
+    fn(d, s, BENCH_BLUR);
+    long long us = now_usec() - start;
+
+    if ((best < 0) || (us < best)) {
+      best = us;
+    }
+  }
+
+  return best;
+}
+
+static void blur_h(CANVAS * d, CANVAS * s, int radius) {
+  ag_blur_h(d, s, radius);
+}
+static void blur_v(CANVAS * d, CANVAS * s, int radius) {
+  ag_blur_v(d, s, radius);
+}
+
+static void bench_blur() {
+  CANVAS s, d, r;
+  ag_canvas(&s, BENCH_W, BENCH_H);
+  ag_canvas(&d, BENCH_W, BENCH_H);
+  ag_canvas(&r, BENCH_W, BENCH_H);
+  bench_fill(s.data, BENCH_W * BENCH_H, 5);
+  long long ref_us = bench_blur_pass(ref_blur_h, &r, &s);
+  long long us = bench_blur_pass(blur_h, &d, &s);
+  bench_report("blur_h", "c", us, ref_us, memcmp(d.data, r.data, s.sz) == 0);
+  ref_us = bench_blur_pass(ref_blur_v, &r, &s);
+  us = bench_blur_pass(blur_v, &d, &s);
+  bench_report("blur_v", "c", us, ref_us, memcmp(d.data, r.data, s.sz) == 0);
+  ag_ccanvas(&s);
+  ag_ccanvas(&d);
+  ag_ccanvas(&r);
+}
+
+int main(int argc, char ** argv) {
+  byte level;
+
+  for (level = AG_SIMD_C; level <= AG_SIMD_NEON; level++) {
+    if (!ag_simd_set(level)) {
+      printf("%-10s %-5s not supported\n", "kernels", bench_levels[level]);
+      continue;
+    }
+
+    bench_alpha(bench_levels[level]);
+    bench_fbufcopy(bench_levels[level]);
+  }
+
+  bench_blur();
+  ag_simd_init();
+  printf("runtime kernels: %s\n", ag_simd_name());
+  printf("%s\n", bench_failed ? "FAILED" : "PASSED");
+  return bench_failed ? 1 : 0;
+}
@@ -0,0 +1,30 @@
+#!/bin/bash
+#
+# Host benchmark of the graphics kernels: builds aroma_graph_bench with the
+# host gcc and runs every set of row kernels the cpu supports against the
+# per pixel functions they replaced (see aroma_graph_bench.c).
+
+# ------------------------
+
+cd $(dirname $0)
+aromafm=$(cd ../.. && pwd)
+tmpdir=$(mktemp -d)
+
+cleanup() {
+  rm -rf $tmpdir
+}
+trap cleanup EXIT
+
+fail() {
+  echo
+  echo FAIL: $@
+  echo
+  exit 1
+}
+
+# unused parts of aroma_graph.c (fonts, config) are dropped by the linker
+gcc -O2 -Wall -Wno-unused -D_AROMA_NODEBUG -I$aromafm/include \
+  -ffunction-sections -fdata-sections -Wl,--gc-sections \
+  -o $tmpdir/aroma_graph_bench aroma_graph_bench.c aroma_graph_simd.c -lm -lpthread || fail "build"
+
+$tmpdir/aroma_graph_bench || fail "aroma_graph_bench"
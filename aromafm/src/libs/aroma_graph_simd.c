@@ -0,0 +1,429 @@
+/*
+ * Copyright (C) 2011 Ahmad Amarullah ( http://amarullz.com/ )
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Descriptions:
+ * -------------
+ * Row Compositing Kernels - NEON, AVX2, SSE2 and plain C versions
+ *
+ * Every kernel must give exactly the same pixels than the per pixel
+ * functions in aroma_graph.c (ag_calculatealpha, aAlphaB, ag32fbufcopy).
+ * For 565 colors, channel * 256 never exceeds 16 bits, so each blend is
+ * computed in 16 bits lanes: 8 pixels per 128 bits vector.
+ *
+ * The kernels are picked at runtime by ag_simd_init(), from the cpu
+ * features: x86 kernels are built with target attributes, so they don't
+ * depend on the compiler flags. NEON kernels are only built in NEON
+ * builds (AROMA_ARM_NEON), and used if the cpu reports NEON.
+ *
+ */
+
+#include "../aroma.h"
+
+#if defined(__i386__) || defined(__x86_64__)
+#define AG_SIMD_X86 1
+#include <immintrin.h>
+#elif defined(__ARM_NEON__) || defined(__aarch64__)
+#define AG_SIMD_ARM 1
+#include <arm_neon.h>
+#endif
+
+//-- Plain C pixel, same as ag_calculatealpha without the shortcuts
+static inline color ag_blend_px(color d, color s, word na, word fa) {
+  return
+    (color) (
+      ((((d & 0xF800) >> 8) * fa + ((s & 0xF800) >> 8) * na) & 0xF800) |
+      (((((d & 0x07E0) >> 3) * fa + ((s & 0x07E0) >> 3) * na) >> 10) << 5) |
+      ((((d & 0x001F) << 3) * fa + ((s & 0x001F) << 3) * na) >> 11)
+    );
+}
+
+/******************************[ C KERNELS ]*******************************/
+static void ag_blend_c(color * dst, const color * src, int n, word na, word fa) {
+  int i;
+
+  for (i = 0; i < n; i++) {
+    dst[i] = ag_blend_px(dst[i], src[i], na, fa);
+  }
+}
+static void ag_opa_c(color * dst, const color * src, int n, word na) {
+  int i;
+
+  for (i = 0; i < n; i++) {
+    dst[i] = ag_blend_px(0, src[i], na, 0);
+  }
+}
+static void ag_rgb32_c(dword * dst, const dword * src, int n, int rp, int gp, int bp) {
+  int i;
+
+  for (i = 0; i < n; i++) {
+    dword s = src[i];
+    dst[i] = (((s >> 16) & 0xff) << rp) |
+             (((s >> 8) & 0xff) << gp) |
+             ((s & 0xff) << bp);
+  }
+}
+
+#ifdef AG_SIMD_X86
+/*****************************[ SSE2 KERNELS ]*****************************/
+__attribute__((target("sse2")))
+static void ag_blend_sse2(color * dst, const color * src, int n, word na, word fa) {
+  __m128i m_r = _mm_set1_epi16((short) 0xF800);
+  __m128i m_g = _mm_set1_epi16(0x07E0);
+  __m128i m_b = _mm_set1_epi16(0x001F);
+  __m128i v_na = _mm_set1_epi16(na);
+  __m128i v_fa = _mm_set1_epi16(fa);
+  int i = 0;
+
+  for (; i + 8 <= n; i += 8) {
+    __m128i d = _mm_loadu_si128((const __m128i *) (dst + i));
+    __m128i s = _mm_loadu_si128((const __m128i *) (src + i));
+    __m128i r = _mm_add_epi16(
+                  _mm_mullo_epi16(_mm_srli_epi16(_mm_and_si128(d, m_r), 8), v_fa),
+                  _mm_mullo_epi16(_mm_srli_epi16(_mm_and_si128(s, m_r), 8), v_na));
+    __m128i g = _mm_add_epi16(
+                  _mm_mullo_epi16(_mm_srli_epi16(_mm_and_si128(d, m_g), 3), v_fa),
+                  _mm_mullo_epi16(_mm_srli_epi16(_mm_and_si128(s, m_g), 3), v_na));
+    __m128i b = _mm_add_epi16(
+                  _mm_mullo_epi16(_mm_slli_epi16(_mm_and_si128(d, m_b), 3), v_fa),
+                  _mm_mullo_epi16(_mm_slli_epi16(_mm_and_si128(s, m_b), 3), v_na));
+    r = _mm_and_si128(r, m_r);
+    g = _mm_slli_epi16(_mm_srli_epi16(g, 10), 5);
+    b = _mm_srli_epi16(b, 11);
+    _mm_storeu_si128((__m128i *) (dst + i), _mm_or_si128(r, _mm_or_si128(g, b)));
+  }
+
+  ag_blend_c(dst + i, src + i, n - i, na, fa);
+}
+__attribute__((target("sse2")))
+static void ag_opa_sse2(color * dst, const color * src, int n, word na) {
+  __m128i m_r = _mm_set1_epi16((short) 0xF800);
+  __m128i m_g = _mm_set1_epi16(0x07E0);
+  __m128i m_b = _mm_set1_epi16(0x001F);
+  __m128i v_na = _mm_set1_epi16(na);
+  int i = 0;
+
+  for (; i + 8 <= n; i += 8) {
+    __m128i s = _mm_loadu_si128((const __m128i *) (src + i));
+    __m128i r = _mm_mullo_epi16(_mm_srli_epi16(_mm_and_si128(s, m_r), 8), v_na);
+    __m128i g = _mm_mullo_epi16(_mm_srli_epi16(_mm_and_si128(s, m_g), 3), v_na);
+    __m128i b = _mm_mullo_epi16(_mm_slli_epi16(_mm_and_si128(s, m_b), 3), v_na);
+    r = _mm_and_si128(r, m_r);
+    g = _mm_slli_epi16(_mm_srli_epi16(g, 10), 5);
+    b = _mm_srli_epi16(b, 11);
+    _mm_storeu_si128((__m128i *) (dst + i), _mm_or_si128(r, _mm_or_si128(g, b)));
+  }
+
+  ag_opa_c(dst + i, src + i, n - i, na);
+}
+__attribute__((target("sse2")))
+static void ag_rgb32_sse2(dword * dst, const dword * src, int n, int rp, int gp, int bp) {
+  __m128i m   = _mm_set1_epi32(0xff);
+  __m128i s_r = _mm_cvtsi32_si128(rp);
+  __m128i s_g = _mm_cvtsi32_si128(gp);
+  __m128i s_b = _mm_cvtsi32_si128(bp);
+  int i = 0;
+
+  for (; i + 4 <= n; i += 4) {
+    __m128i s = _mm_loadu_si128((const __m128i *) (src + i));
+    __m128i r = _mm_sll_epi32(_mm_and_si128(_mm_srli_epi32(s, 16), m), s_r);
+    __m128i g = _mm_sll_epi32(_mm_and_si128(_mm_srli_epi32(s, 8), m), s_g);
+    __m128i b = _mm_sll_epi32(_mm_and_si128(s, m), s_b);
+    _mm_storeu_si128((__m128i *) (dst + i), _mm_or_si128(r, _mm_or_si128(g, b)));
+  }
+
+  ag_rgb32_c(dst + i, src + i, n - i, rp, gp, bp);
+}
+
+/*****************************[ AVX2 KERNELS ]*****************************/
+//-- Same as SSE2 on 256 bits: 16 pixels, 8 for 32 bits
+__attribute__((target("avx2")))
+static void ag_blend_avx2(color * dst, const color * src, int n, word na, word fa) {
+  __m256i m_r = _mm256_set1_epi16((short) 0xF800);
+  __m256i m_g = _mm256_set1_epi16(0x07E0);
+  __m256i m_b = _mm256_set1_epi16(0x001F);
+  __m256i v_na = _mm256_set1_epi16(na);
+  __m256i v_fa = _mm256_set1_epi16(fa);
+  int i = 0;
+
+  for (; i + 16 <= n; i += 16) {
+    __m256i d = _mm256_loadu_si256((const __m256i *) (dst + i));
+    __m256i s = _mm256_loadu_si256((const __m256i *) (src + i));
+    __m256i r = _mm256_add_epi16(
+                  _mm256_mullo_epi16(_mm256_srli_epi16(_mm256_and_si256(d, m_r), 8), v_fa),
+                  _mm256_mullo_epi16(_mm256_srli_epi16(_mm256_and_si256(s, m_r), 8), v_na));
+    __m256i g = _mm256_add_epi16(
+                  _mm256_mullo_epi16(_mm256_srli_epi16(_mm256_and_si256(d, m_g), 3), v_fa),
+                  _mm256_mullo_epi16(_mm256_srli_epi16(_mm256_and_si256(s, m_g), 3), v_na));
+    __m256i b = _mm256_add_epi16(
+                  _mm256_mullo_epi16(_mm256_slli_epi16(_mm256_and_si256(d, m_b), 3), v_fa),
+                  _mm256_mullo_epi16(_mm256_slli_epi16(_mm256_and_si256(s, m_b), 3), v_na));
+    r = _mm256_and_si256(r, m_r);
+    g = _mm256_slli_epi16(_mm256_srli_epi16(g, 10), 5);
+    b = _mm256_srli_epi16(b, 11);
+    _mm256_storeu_si256((__m256i *) (dst + i), _mm256_or_si256(r, _mm256_or_si256(g, b)));
+  }
+
+  ag_blend_c(dst + i, src + i, n - i, na, fa);
+}
+__attribute__((target("avx2")))
+static void ag_opa_avx2(color * dst, const color * src, int n, word na) {
+  __m256i m_r = _mm256_set1_epi16((short) 0xF800);
+  __m256i m_g = _mm256_set1_epi16(0x07E0);
+  __m256i m_b = _mm256_set1_epi16(0x001F);
+  __m256i v_na = _mm256_set1_epi16(na);
+  int i = 0;
+
+  for (; i + 16 <= n; i += 16) {
+    __m256i s = _mm256_loadu_si256((const __m256i *) (src + i));
+    __m256i r = _mm256_mullo_epi16(_mm256_srli_epi16(_mm256_and_si256(s, m_r), 8), v_na);
+    __m256i g = _mm256_mullo_epi16(_mm256_srli_epi16(_mm256_and_si256(s, m_g), 3), v_na);
+    __m256i b = _mm256_mullo_epi16(_mm256_slli_epi16(_mm256_and_si256(s, m_b), 3), v_na);
+    r = _mm256_and_si256(r, m_r);
+    g = _mm256_slli_epi16(_mm256_srli_epi16(g, 10), 5);
+    b = _mm256_srli_epi16(b, 11);
+    _mm256_storeu_si256((__m256i *) (dst + i), _mm256_or_si256(r, _mm256_or_si256(g, b)));
+  }
+
+  ag_opa_c(dst + i, src + i, n - i, na);
+}
+__attribute__((target("avx2")))
+static void ag_rgb32_avx2(dword * dst, const dword * src, int n, int rp, int gp, int bp) {
+  __m256i m   = _mm256_set1_epi32(0xff);
+  __m128i s_r = _mm_cvtsi32_si128(rp);
+  __m128i s_g = _mm_cvtsi32_si128(gp);
+  __m128i s_b = _mm_cvtsi32_si128(bp);
+  int i = 0;
+
+  for (; i + 8 <= n; i += 8) {
+    __m256i s = _mm256_loadu_si256((const __m256i *) (src + i));
+    __m256i r = _mm256_sll_epi32(_mm256_and_si256(_mm256_srli_epi32(s, 16), m), s_r);
+    __m256i g = _mm256_sll_epi32(_mm256_and_si256(_mm256_srli_epi32(s, 8), m), s_g);
+    __m256i b = _mm256_sll_epi32(_mm256_and_si256(s, m), s_b);
+    _mm256_storeu_si256((__m256i *) (dst + i), _mm256_or_si256(r, _mm256_or_si256(g, b)));
+  }
+
+  ag_rgb32_c(dst + i, src + i, n - i, rp, gp, bp);
+}
+#endif
+
+#ifdef AG_SIMD_ARM
+/*****************************[ NEON KERNELS ]*****************************/
+static void ag_blend_neon(color * dst, const color * src, int n, word na, word fa) {
+  uint16x8_t m_r = vdupq_n_u16(0xF800);
+  uint16x8_t m_g = vdupq_n_u16(0x07E0);
+  uint16x8_t m_b = vdupq_n_u16(0x001F);
+  int i = 0;
+
+  for (; i + 8 <= n; i += 8) {
+    uint16x8_t d = vld1q_u16(dst + i);
+    uint16x8_t s = vld1q_u16(src + i);
+    uint16x8_t r = vmlaq_n_u16(vmulq_n_u16(vshrq_n_u16(vandq_u16(d, m_r), 8), fa),
+                               vshrq_n_u16(vandq_u16(s, m_r), 8), na);
+    uint16x8_t g = vmlaq_n_u16(vmulq_n_u16(vshrq_n_u16(vandq_u16(d, m_g), 3), fa),
+                               vshrq_n_u16(vandq_u16(s, m_g), 3), na);
+    uint16x8_t b = vmlaq_n_u16(vmulq_n_u16(vshlq_n_u16(vandq_u16(d, m_b), 3), fa),
+                               vshlq_n_u16(vandq_u16(s, m_b), 3), na);
+    r = vandq_u16(r, m_r);
+    g = vshlq_n_u16(vshrq_n_u16(g, 10), 5);
+    b = vshrq_n_u16(b, 11);
+    vst1q_u16(dst + i, vorrq_u16(r, vorrq_u16(g, b)));
+  }
+
+  ag_blend_c(dst + i, src + i, n - i, na, fa);
+}
+static void ag_opa_neon(color * dst, const color * src, int n, word na) {
+  uint16x8_t m_r = vdupq_n_u16(0xF800);
+  uint16x8_t m_g = vdupq_n_u16(0x07E0);
+  uint16x8_t m_b = vdupq_n_u16(0x001F);
+  int i = 0;
+
+  for (; i + 8 <= n; i += 8) {
+    uint16x8_t s = vld1q_u16(src + i);
+    uint16x8_t r = vmulq_n_u16(vshrq_n_u16(vandq_u16(s, m_r), 8), na);
+    uint16x8_t g = vmulq_n_u16(vshrq_n_u16(vandq_u16(s, m_g), 3), na);
+    uint16x8_t b = vmulq_n_u16(vshlq_n_u16(vandq_u16(s, m_b), 3), na);
+    r = vandq_u16(r, m_r);
+    g = vshlq_n_u16(vshrq_n_u16(g, 10), 5);
+    b = vshrq_n_u16(b, 11);
+    vst1q_u16(dst + i, vorrq_u16(r, vorrq_u16(g, b)));
+  }
+
+  ag_opa_c(dst + i, src + i, n - i, na);
+}
+static void ag_rgb32_neon(dword * dst, const dword * src, int n, int rp, int gp, int bp) {
+  uint32x4_t m   = vdupq_n_u32(0xff);
+  int32x4_t  s_r = vdupq_n_s32(rp - 16);
+  int32x4_t  s_g = vdupq_n_s32(gp - 8);
+  int32x4_t  s_b = vdupq_n_s32(bp);
+  int i = 0;
+
+  for (; i + 4 <= n; i += 4) {
+    uint32x4_t s = vld1q_u32(src + i);
+    uint32x4_t r = vshlq_u32(vandq_u32(s, vdupq_n_u32(0xff0000)), s_r);
+    uint32x4_t g = vshlq_u32(vandq_u32(s, vdupq_n_u32(0xff00)), s_g);
+    uint32x4_t b = vshlq_u32(vandq_u32(s, m), s_b);
+    vst1q_u32(dst + i, vorrq_u32(r, vorrq_u32(g, b)));
+  }
+
+  ag_rgb32_c(dst + i, src + i, n - i, rp, gp, bp);
+}
+
+//-- aarch64 always has it, armv7 lists it in /proc/cpuinfo features
+static byte ag_cpu_neon() {
+#ifdef __aarch64__
+  return 1;
+#else
+  char line[1024];
+  byte neon = 0;
+  FILE * fp = fopen("/proc/cpuinfo", "r");
+
+  if (fp == NULL) {
+    return 0;
+  }
+
+  while (!neon && (fgets(line, sizeof(line), fp) != NULL)) {
+    if ((strncmp(line, "Features", 8) == 0) && (strstr(line, " neon") != NULL)) {
+      neon = 1;
+    }
+  }
+
+  fclose(fp);
+  return neon;
+#endif
+}
+#endif
+
+/*******************************[ DISPATCH ]*******************************/
+static struct {
+  byte level;
+  void (*blend)(color * dst, const color * src, int n, word na, word fa);
+  void (*opa)(color * dst, const color * src, int n, word na);
+  void (*rgb32)(dword * dst, const dword * src, int n, int rp, int gp, int bp);
+} ag_simd = { AG_SIMD_C, ag_blend_c, ag_opa_c, ag_rgb32_c };
+
+//-- Select kernels, 0 if this cpu or build can't run them
+byte ag_simd_set(byte level) {
+  switch (level) {
+    case AG_SIMD_C:
+      ag_simd.blend = ag_blend_c;
+      ag_simd.opa   = ag_opa_c;
+      ag_simd.rgb32 = ag_rgb32_c;
+      break;
+#ifdef AG_SIMD_X86
+
+    case AG_SIMD_SSE2:
+      __builtin_cpu_init();
+
+      if (!__builtin_cpu_supports("sse2")) {
+        return 0;
+      }
+
+      ag_simd.blend = ag_blend_sse2;
+      ag_simd.opa   = ag_opa_sse2;
+      ag_simd.rgb32 = ag_rgb32_sse2;
+      break;
+
+    case AG_SIMD_AVX2:
+      __builtin_cpu_init();
+
+      if (!__builtin_cpu_supports("avx2")) {
+        return 0;
+      }
+
+      ag_simd.blend = ag_blend_avx2;
+      ag_simd.opa   = ag_opa_avx2;
+      ag_simd.rgb32 = ag_rgb32_avx2;
+      break;
+#endif
+#ifdef AG_SIMD_ARM
+
+    case AG_SIMD_NEON:
+      if (!ag_cpu_neon()) {
+        return 0;
+      }
+
+      ag_simd.blend = ag_blend_neon;
+      ag_simd.opa   = ag_opa_neon;
+      ag_simd.rgb32 = ag_rgb32_neon;
+      break;
+#endif
+
+    default:
+      return 0;
+  }
+
+  ag_simd.level = level;
+  return 1;
+}
+
+//-- Pick the fastest kernels: called once by ag_init()
+void ag_simd_init() {
+  if (!ag_simd_set(AG_SIMD_NEON) && !ag_simd_set(AG_SIMD_AVX2) && !ag_simd_set(AG_SIMD_SSE2)) {
+    ag_simd_set(AG_SIMD_C);
+  }
+}
+
+//-- Name of the selected kernels
+const char * ag_simd_name() {
+  switch (ag_simd.level) {
+    case AG_SIMD_SSE2:
+      return "sse2";
+
+    case AG_SIMD_AVX2:
+      return "avx2";
+
+    case AG_SIMD_NEON:
+      return "neon";
+  }
+
+  return "c";
+}
+
+/*****************************[ ROW FUNCTIONS ]*****************************/
+//-- dst[i] = ag_calculatealpha(dst[i], src[i], l)
+void ag_blend_row(color * dst, const color * src, int n, byte l) {
+  word na = l + (l >> 7);
+
+  if (l == 0) {
+    return;
+  }
+  else if (l == 255) {
+    memcpy(dst, src, n * sizeof(color));
+    return;
+  }
+
+  ag_simd.blend(dst, src, n, na, 256 - na);
+}
+
+//-- dst[i] = aAlphaB(src[i], l)
+void ag_opa_row(color * dst, const color * src, int n, byte l) {
+  if (l == 0) {
+    memset(dst, 0, n * sizeof(color));
+    return;
+  }
+  else if (l == 255) {
+    memcpy(dst, src, n * sizeof(color));
+    return;
+  }
+
+  ag_simd.opa(dst, src, n, l + (l >> 7));
+}
+
+//-- Move the r, g, b bytes of 0x00RRGGBB pixels to framebuffer positions
+void ag_rgb32_row(dword * dst, const dword * src, int n, int rp, int gp, int bp) {
+  ag_simd.rgb32(dst, src, n, rp, gp, bp);
+}
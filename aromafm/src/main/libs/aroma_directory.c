@@ -120,30 +120,49 @@ void aui_filesize(char * buf, char * path) {
   }
 }
 
+void aui_permstr(char * buf, mode_t mode) {
+  buf[8] = (mode & S_IXOTH) ? 'x' : '-';
+  buf[7] = (mode & S_IWOTH) ? 'w' : '-';
+  buf[6] = (mode & S_IROTH) ? 'r' : '-';
+  buf[5] = (mode & S_IXGRP) ? 'x' : '-';
+  buf[4] = (mode & S_IWGRP) ? 'w' : '-';
+  buf[3] = (mode & S_IRGRP) ? 'r' : '-';
+  buf[2] = (mode & S_IXUSR) ? 'x' : '-';
+  buf[1] = (mode & S_IWUSR) ? 'w' : '-';
+  buf[0] = (mode & S_IRUSR) ? 'r' : '-';
+  //-- SUID, GUID, STICKY
+  buf[2] = (mode & S_ISUID) ? ((buf[2] == 'x') ? 's' : 'S') : buf[2];
+  buf[5] = (mode & S_ISGID) ? ((buf[2] == 'x') ? 's' : 'S') : buf[5];
+  buf[8] = (mode & S_ISVTX) ? ((buf[2] == 'x') ? 't' : 'T') : buf[8];
+  buf[9] = 0;
+}
+
 void aui_fileperm(char * buf, char * path) {
   struct stat fst;
   
   if (!stat(path, &fst)) {
-    buf[8] = (fst.st_mode & S_IXOTH) ? 'x' : '-';
-    buf[7] = (fst.st_mode & S_IWOTH) ? 'w' : '-';
-    buf[6] = (fst.st_mode & S_IROTH) ? 'r' : '-';
-    buf[5] = (fst.st_mode & S_IXGRP) ? 'x' : '-';
-    buf[4] = (fst.st_mode & S_IWGRP) ? 'w' : '-';
-    buf[3] = (fst.st_mode & S_IRGRP) ? 'r' : '-';
-    buf[2] = (fst.st_mode & S_IXUSR) ? 'x' : '-';
-    buf[1] = (fst.st_mode & S_IWUSR) ? 'w' : '-';
-    buf[0] = (fst.st_mode & S_IRUSR) ? 'r' : '-';
-    //-- SUID, GUID, STICKY
-    buf[2] = (fst.st_mode & S_ISUID) ? ((buf[2] == 'x') ? 's' : 'S') : buf[2];
-    buf[5] = (fst.st_mode & S_ISGID) ? ((buf[2] == 'x') ? 's' : 'S') : buf[5];
-    buf[8] = (fst.st_mode & S_ISVTX) ? ((buf[2] == 'x') ? 't' : 'T') : buf[8];
-    buf[9] = 0;
+    aui_permstr(buf, fst.st_mode);
   }
   else {
     snprintf(buf, 10, "---------");
   }
 }
 
+void aui_dirdesc(char * desc, int cnt) {
+  char formats[256];
+  char formats2[256];
+  snprintf(formats, 256,
+           "<#selectbg_g>%i</#>", cnt);
+  snprintf(formats2, 256,
+           alang_get((cnt >
+                      1) ?
+                     "dir.filecounts" :
+                     "dir.filecount"),
+           formats);
+  snprintf(desc, 256, "<@right>%s</@>",
+           formats2);
+}
+
 byte aui_ishidden_file(const char * fn) {
   if (strcmp(fn, "/dev") == 0) {
     return 1;
@@ -170,9 +189,261 @@ byte aui_ishidden_file(const char * fn) {
   return 0;
 }
 
+//*
+//* Lazy Row Metadata
+//*
+//* Rows are added with the name only. Size, permission and child count
+//* are computed by one worker thread, for the rows afbox_ondraw reach.
+//*
+#define AUI_META_QMAX   64
+#define AUI_META_DIRN   8
+
+typedef struct {
+  int  index;
+  byte d_type;
+  char name[256];
+} AUI_METAREQ;
+
+typedef struct {
+  char    path[PATH_MAX];
+  time_t  mtime;
+  long    used;
+  AARRAYP items;    //-- name => "mtime:count" of subdirectories
+} AUI_METADIR;
+
+static pthread_mutex_t aui_meta_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  aui_meta_cond  = PTHREAD_COND_INITIALIZER;
+static ACONTROLP   aui_meta_ctl       = NULL;
+static byte        aui_meta_running   = 0;
+static byte        aui_meta_joinable  = 0;
+static pthread_t   aui_meta_th;
+static char        aui_meta_path[PATH_MAX];
+static AUI_METAREQ aui_meta_q[AUI_META_QMAX];
+static int         aui_meta_qn        = 0;
+static AUI_METADIR aui_meta_dirs[AUI_META_DIRN];
+static long        aui_meta_usedn     = 0;
+
+//-- Cache of current directory, dropped when directory mtime changed
+static AUI_METADIR * aui_meta_dir(char * path) {
+  struct stat st;
+  
+  if (stat(path, &st)) {
+    return NULL;
+  }
+  
+  int i;
+  AUI_METADIR * slot = &aui_meta_dirs[0];
+  
+  for (i = 0; i < AUI_META_DIRN; i++) {
+    AUI_METADIR * c = &aui_meta_dirs[i];
+    
+    if ((c->items != NULL) && (!strcmp(c->path, path))) {
+      slot = c;
+      break;
+    }
+    
+    if ((slot->items != NULL) &&
+        ((c->items == NULL) || (c->used < slot->used))) {
+      slot = c;
+    }
+  }
+  
+  if ((slot->items != NULL) &&
+      ((strcmp(slot->path, path)) || (slot->mtime != st.st_mtime))) {
+    aarray_free(slot->items);
+    slot->items = NULL;
+  }
+  
+  if (slot->items == NULL) {
+    snprintf(slot->path, PATH_MAX, "%s", path);
+    slot->mtime = st.st_mtime;
+    slot->items = aarray_create();
+  }
+  
+  slot->used = ++aui_meta_usedn;
+  return slot;
+}
+
+static void aui_meta_fill(ACONTROLP ctl, char * path, AUI_METAREQ * r) {
+  char * full_path = NULL;
+  char desc[256];
+  char perm[10];
+  struct stat st;
+  aui_setpath(&full_path, path, r->name, 0);
+  
+  if (full_path == NULL) {
+    return;
+  }
+  
+  if (stat(full_path, &st)) {
+    snprintf(perm, 10, "---------");
+    
+    if (r->d_type == 4) {
+      aui_dirdesc(desc, 0);
+    }
+    else {
+      snprintf(desc, 256, "<@right><#selectbg_g>0</#> Bytes</@>");
+    }
+  }
+  else {
+    aui_permstr(perm, st.st_mode);
+    
+    if (r->d_type == 4) {
+      AUI_METADIR * dc = aui_meta_dir(path);
+      char * cached = (dc != NULL) ? aarray_get(dc->items, r->name) : NULL;
+      long cmtime = 0;
+      int cnt = -1;
+      
+      if (cached != NULL) {
+        sscanf(cached, "%ld:%i", &cmtime, &cnt);
+      }
+      
+      if ((cnt < 0) || (cmtime != (long) st.st_mtime)) {
+        char val[64];
+        cnt = aui_getdircount(full_path);
+        snprintf(val, 64, "%ld:%i", (long) st.st_mtime, cnt);
+        
+        if (dc != NULL) {
+          aarray_set(dc->items, r->name, val);
+        }
+      }
+      
+      aui_dirdesc(desc, cnt);
+    }
+    else {
+      char dsz[256];
+      aui_bytesize(dsz, st.st_size);
+      snprintf(desc, 256, "<@right>%s</@>", dsz);
+    }
+  }
+  
+  free(full_path);
+  afbox_setdesc(ctl, r->index, desc, perm);
+}
+
+static void * aui_meta_thread(void * cookie) {
+  ACONTROLP ctl = (ACONTROLP) cookie;
+  AWINDOWP  win = ctl->win;
+  byte dirty = 0;
+  char path[PATH_MAX];
+  pthread_mutex_lock(&aui_meta_mutex);
+  
+  while ((win->isActived) && (aui_meta_ctl == ctl)) {
+    if (aui_meta_qn == 0) {
+      if (dirty) {
+        //-- Batch done, show it
+        dirty = 0;
+        pthread_mutex_unlock(&aui_meta_mutex);
+        ctl->ondraw(ctl);
+        aw_draw(win);
+        pthread_mutex_lock(&aui_meta_mutex);
+        continue;
+      }
+      
+      struct timespec ts;
+      clock_gettime(CLOCK_REALTIME, &ts);
+      ts.tv_nsec += 50000000;
+      
+      if (ts.tv_nsec >= 1000000000) {
+        ts.tv_sec++;
+        ts.tv_nsec -= 1000000000;
+      }
+      
+      pthread_cond_timedwait(&aui_meta_cond, &aui_meta_mutex, &ts);
+      continue;
+    }
+    
+    AUI_METAREQ r = aui_meta_q[0];
+    aui_meta_qn--;
+    memmove(aui_meta_q, aui_meta_q + 1, sizeof(AUI_METAREQ) * aui_meta_qn);
+    //-- Queued requests belong to the bound path, aui_meta_bind may change it
+    snprintf(path, PATH_MAX, "%s", aui_meta_path);
+    pthread_mutex_unlock(&aui_meta_mutex);
+    aui_meta_fill(ctl, path, &r);
+    dirty = 1;
+    pthread_mutex_lock(&aui_meta_mutex);
+  }
+  
+  aui_meta_running = 0;
+  win->threadnum--;
+  pthread_mutex_unlock(&aui_meta_mutex);
+  return NULL;
+}
+
+//-- afbox onfetch callback, called from afbox_ondraw
+byte aui_meta_request(ACONTROLP ctl, int index, char * title, byte d_type) {
+  byte ret = 0;
+  pthread_mutex_lock(&aui_meta_mutex);
+  
+  if ((ctl == aui_meta_ctl) && (aui_meta_qn < AUI_META_QMAX) &&
+      (ctl->win->isActived)) {
+    AUI_METAREQ * r = &aui_meta_q[aui_meta_qn++];
+    r->index  = index;
+    r->d_type = d_type;
+    snprintf(r->name, 256, "%s", title);
+    
+    if (!aui_meta_running) {
+      //-- Previous thread is finished, release it
+      if (aui_meta_joinable) {
+        pthread_join(aui_meta_th, NULL);
+        aui_meta_joinable = 0;
+      }
+      
+      //-- Count the thread before aw_destroy can wait for it
+      aui_meta_running = 1;
+      ctl->win->threadnum++;
+      
+      if (pthread_create(&aui_meta_th, NULL, aui_meta_thread, (void *) ctl) == 0) {
+        aui_meta_joinable = 1;
+      }
+      else {
+        aui_meta_running = 0;
+        ctl->win->threadnum--;
+      }
+    }
+    
+    pthread_cond_signal(&aui_meta_cond);
+    ret = 1;
+  }
+  
+  pthread_mutex_unlock(&aui_meta_mutex);
+  return ret;
+}
+
+//-- Stop the worker before the filebox is destroyed, it draws the control
+void aui_meta_unbind() {
+  pthread_mutex_lock(&aui_meta_mutex);
+  aui_meta_ctl = NULL;
+  aui_meta_qn  = 0;
+  pthread_cond_broadcast(&aui_meta_cond);
+  byte joinable = aui_meta_joinable;
+  aui_meta_joinable = 0;
+  pthread_mutex_unlock(&aui_meta_mutex);
+  
+  if (joinable) {
+    pthread_join(aui_meta_th, NULL);
+  }
+}
+
+//-- Bind filebox with directory, waiting requests are dropped
+void aui_meta_bind(char * path, ACONTROLP FB) {
+  //-- The worker serves one filebox, end it before switching
+  if (FB != aui_meta_ctl) {
+    aui_meta_unbind();
+  }
+  
+  pthread_mutex_lock(&aui_meta_mutex);
+  aui_meta_ctl = FB;
+  aui_meta_qn  = 0;
+  snprintf(aui_meta_path, PATH_MAX, "%s", path);
+  pthread_mutex_unlock(&aui_meta_mutex);
+  afbox_setonfetch(FB, aui_meta_request);
+}
+
 int aui_fetch(char * path, ACONTROLP FB, char * selfile) {
   struct dirent ** files;
   aui_dir_active_path = path;
+  aui_meta_bind(path, FB);
   int n = scandir(path, &files, 0, *aui_fsort);
   
   if (n > 0) {
@@ -206,39 +477,11 @@ int aui_fetch(char * path, ACONTROLP FB, char * selfile) {
         byte selectedDefault =
           strcmp(selfile, dname) ? 0 : 1;
           
-        //-- DIR
-        if (dtype == 4) {
-          int cnt = aui_getdircount(full_path);
-          char desc[256];
-          char perm[10];
-          aui_fileperm(perm, full_path);
-          char formats[256];
-          char formats2[256];
-          snprintf(formats, 256,
-                   "<#selectbg_g>%i</#>", cnt);
-          snprintf(formats2, 256,
-                   alang_get((cnt >
-                              1) ?
-                             "dir.filecounts" :
-                             "dir.filecount"),
-                   formats);
-          snprintf(desc, 256, "<@right>%s</@>",
-                   formats2);
-          afbox_add(FB, dname, desc, 0,
-                    &UI_ICONS[22], dtype, perm, 0,
-                    selectedDefault);
-        }
-        //-- FILE
-        else if (dtype == 8) {
-          char desc[256];
-          char dsz[256];
-          char perm[10];
-          aui_fileperm(perm, full_path);
-          aui_filesize(dsz, full_path);
-          snprintf(desc, 256, "<@right>%s</@>",
-                   dsz);
-          afbox_add(FB, dname, desc, 0,
-                    &UI_ICONS[21], dtype, perm, 0,
+        //-- DIR & FILE, desc filled by aui_meta_thread
+        if ((dtype == 4) || (dtype == 8)) {
+          afbox_add(FB, dname, NULL, 0,
+                    &UI_ICONS[(dtype == 4) ? 22 : 21],
+                    dtype, NULL, 0,
                     selectedDefault);
         }
         //-- LINK FILE / DIR
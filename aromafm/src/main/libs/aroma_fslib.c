@@ -21,8 +21,13 @@
  *
  */
 #include <pthread.h>
+#include <sys/syscall.h>
 
 #define AFS_KILOBYTE 1024
+#define AFS_COPY_CHUNK   (AFS_KILOBYTE * 1024)   //-- Bytes per kernel copy call / read buffer
+#define AFS_COPY_WORKERS 3                       //-- File copy threads
+#define AFS_COPY_QUEUE   32                      //-- Files queued by the tree walker
+
 typedef struct {
   byte status;		//-- Operation Status
   
@@ -32,11 +37,13 @@ typedef struct {
   
   char curr[256];		//-- Current Proccessed File
   
-  int k;			//-- Size in KB
-  int b;			//-- Size in Bytes
-  int n;			//-- Number of Files
-  int cs;			//-- Current Size
-  int cr;			//-- Current Readed
+  //-- Progress, updated with atomics by the workers and polled by the UI
+  volatile int k;		//-- Size in KB
+  volatile int b;		//-- Size in Bytes
+  volatile int n;		//-- Number of Files
+  volatile int cs;	//-- Current Size
+  volatile int cr;	//-- Current Readed
+  void * volatile cf;	//-- Current File owner (job), only it updates cr
   
   dword msgFinish;	//-- Finish Message
   dword msgTick;		//-- Tick Message
@@ -51,6 +58,37 @@ typedef struct {
   pthread_cond_t ovrCond;
 } AFSDT, *AFSDTP;
 
+//-- One regular file to copy: dest is stored after path in the same allocation
+typedef struct {
+  char * path;
+  char * dest;
+  struct stat st;
+} AFSJOB, *AFSJOBP;
+
+//-- Directory to fix up once all its files are copied
+typedef struct _AFSDIR {
+  char * path;
+  char * dest;
+  struct stat st;
+  struct _AFSDIR * next;
+} AFSDIR, *AFSDIRP;
+
+//-- Copy engine: the tree walker queues files, the workers copy them
+typedef struct {
+  AFSDTP dt;
+  AFSJOBP jobs[AFS_COPY_QUEUE];
+  int head;
+  int count;
+  byte done;
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+  pthread_mutex_t askMutex;	//-- One dialog at a time
+  byte no_rename;			//-- rename() failed with EXDEV once: always copy
+  int workers;			//-- Running workers, 0 = the walker copies itself
+  char * rbuf;			//-- Walker read buffer when there is no worker
+  AFSDIRP dirs;			//-- Children before their parent
+} AFSENGINE, *AFSENGINEP;
+
 void
 afs_setoftitle(char * buf, char * format, int v1, int v2, char * sv1, char * sv2) {
   char st1[64];
@@ -80,8 +118,11 @@ byte afs_tick(AFSDTP dt) {
   
   long ctick = alib_tick();
   
-  if (dt->lstTick < (ctick - dt->intTick)) {
-    dt->lstTick = ctick;
+  long ltick = dt->lstTick;
+  
+  //-- Several copy workers tick: only one of them sends the message
+  if ((ltick < (ctick - dt->intTick)) &&
+      __sync_bool_compare_and_swap(&dt->lstTick, ltick, ctick)) {
     return atouch_send_message(dt->msgTick);
   }
   
@@ -164,425 +205,628 @@ void afs_showDiskfull(AWINDOWP hWin, AFSDTP dt) {
   pthread_mutex_unlock(&dt->ovrMutex);
 }
 
-void afs_filesize_do(AFSDTP dt, const char * path, byte ischild) {
-  //-- Define
-  struct stat fstat;
-  struct stat lfstat;
-  byte islnk = 0;
-  int sz = 0;
-  
-  //-- Get Stat
-  if (stat(path, &fstat)) {
+//-- Add bytes to the progress counters: lock free, workers run in parallel
+void afs_addsize(AFSDTP dt, long long sz) {
+  int k = sz / AFS_KILOBYTE;
+  int b = __sync_add_and_fetch(&dt->b, (int) (sz % AFS_KILOBYTE));
+  
+  //-- Carry whole kilobytes out of the bytes counter
+  while (b >= AFS_KILOBYTE) {
+    if (__sync_bool_compare_and_swap(&dt->b, b, b - AFS_KILOBYTE)) {
+      k++;
+    }
+    
+    b = __sync_fetch_and_add(&dt->b, 0);
+  }
+  
+  if (k) {
+    __sync_fetch_and_add(&dt->k, k);
+  }
+}
+
+//-- Set current file name, from a full path
+void afs_setcurr(AFSDTP dt, const char * path) {
+  const char * bsn = strrchr(path, '/');
+  snprintf(dt->curr, 255, "%s", (bsn != NULL) ? bsn + 1 : path);
+}
+
+//-- Type of a directory entry: d_type, fstatat() only when the filesystem does not tell
+byte afs_isdir(int dfd, struct dirent * p) {
+  if (p->d_type != DT_UNKNOWN) {
+    return (p->d_type == DT_DIR);
+  }
+  
+  struct stat st;
+  return ((fstatat(dfd, p->d_name, &st, AT_SYMLINK_NOFOLLOW) == 0) && S_ISDIR(st.st_mode));
+}
+
+//-- Append name to the path buffer, returns the new length or -1 if too long
+int afs_pathcat(char * buf, int len, const char * name) {
+  int nlen = strlen(name);
+  
+  if (len + nlen + 2 > PATH_MAX) {
+    return -1;
+  }
+  
+  buf[len] = '/';
+  memcpy(buf + len + 1, name, nlen + 1);
+  return len + nlen + 1;
+}
+
+byte afs_isdot(const char * name) {
+  return ((name[0] == '.') && ((name[1] == 0) || ((name[1] == '.') && (name[2] == 0))));
+}
+
+//-- Size a tree: path is a PATH_MAX buffer, extended in place while walking
+void afs_filesize_walk(AFSDTP dt, char * path, int len, byte ischild) {
+  struct stat st;
+  
+  if (lstat(path, &st)) {
     return;
   }
   
-  //-- Set Current Info
   if (ischild) {
-    //-- Get Link Stat
-    if ((lstat(path, &lfstat) == 0) && S_ISLNK(lfstat.st_mode)) {
-      sz = lfstat.st_size;
-      islnk = 1;
-    }
-    else {
-      sz = fstat.st_size;
+    afs_setcurr(dt, path);
+    __sync_fetch_and_add(&dt->n, 1);
+    dt->cr = 0;
+    dt->cs = st.st_size;
+    afs_addsize(dt, st.st_size);
+    afs_tick(dt);
+  }
+  
+  if (!S_ISDIR(st.st_mode)) {
+    return;
+  }
+  
+  DIR * d = opendir(path);
+  
+  if (d == NULL) {
+    return;
+  }
+  
+  struct dirent * p;
+  
+  while ((dt->status == 1) && (p = readdir(d))) {
+    if (afs_isdot(p->d_name)) {
+      continue;
     }
     
-    //-- Set Current Filename
-    char * bsn = basename(path);
+    int nlen = afs_pathcat(path, len, p->d_name);
     
-    if (bsn != NULL) {
-      snprintf(dt->curr, 255, "%s", bsn);
-      free(bsn);
+    if (nlen < 0) {
+      continue;
     }
     
-    //-- Set Current Status
-    dt->n += 1;
-    dt->cr = 0;
-    dt->cs = sz;
-    //-- Set Total Size
-    int kbsz = sz / AFS_KILOBYTE;
-    dt->b += sz % AFS_KILOBYTE;
-    
-    if (dt->b >= AFS_KILOBYTE) {
-      dt->b -= AFS_KILOBYTE;
-      dt->k += 1;
+    if (afs_isdir(dirfd(d), p)) {
+      afs_filesize_walk(dt, path, nlen, 1);
     }
-    
-    dt->k += kbsz;
-    //-- Tick
-    afs_tick(dt);
-  }
-  
-  if (!islnk && S_ISDIR(fstat.st_mode)) {
-    DIR * d = opendir(path);
-    size_t path_len = strlen(path);
-    
-    if (d) {
-      struct dirent * p;
+    else {
+      struct stat fst;
       
-      while ((dt->status == 1) && (p = readdir(d))) {
-        //-- No "." & ".."
-        if ((p->d_name[0] == '.')
-            && ((p->d_name[1] == 0)
-                || ((p->d_name[1] == '.')
-                    && (p->d_name[2] == 0)))) {
-          continue;
-        }
-        
-        //-- Filename Buffer
-        size_t len = path_len + strlen(p->d_name) + 2;
-        char * buf = malloc(len);
-        
-        if (buf) {
-          snprintf(buf, len, "%s/%s", path,
-                   p->d_name);
-          afs_filesize_do(dt, buf, 1);
-          free(buf);
-        }
+      if (fstatat(dirfd(d), p->d_name, &fst, AT_SYMLINK_NOFOLLOW) == 0) {
+        snprintf(dt->curr, 255, "%s", p->d_name);
+        __sync_fetch_and_add(&dt->n, 1);
+        dt->cr = 0;
+        dt->cs = fst.st_size;
+        afs_addsize(dt, fst.st_size);
+        afs_tick(dt);
       }
     }
     
-    closedir(d);
+    path[len] = 0;
   }
+  
+  closedir(d);
 }
 
-void afs_filedelete_do(AFSDTP dt, const char * path, byte ischild) {
-  //-- Define
-  struct stat fstat;
-  struct stat lfstat;
-  byte islnk = 0;
-  int sz = 0;
+void afs_filesize_do(AFSDTP dt, const char * path, byte ischild) {
+  char buf[PATH_MAX];
+  snprintf(buf, PATH_MAX, "%s", path);
+  afs_filesize_walk(dt, buf, strlen(buf), ischild);
+}
+
+//-- Delete a tree: same walker than the copy engine, no allocation per entry
+void afs_filedelete_walk(AFSDTP dt, char * path, int len, byte ischild) {
+  struct stat st;
   
   //-- Forbidden File
   if (isnodelete(path)) {
     return;
   }
   
-  //-- Get Stat
-  if (stat(path, &fstat)) {
+  if (lstat(path, &st)) {
     return;
   }
   
-  //-- Set Current Info
   if (ischild) {
-    //-- Get Link Stat
-    if ((lstat(path, &lfstat) == 0) && S_ISLNK(lfstat.st_mode)) {
-      sz = lfstat.st_size;
-      islnk = 1;
+    afs_setcurr(dt, path);
+    __sync_fetch_and_add(&dt->n, 1);
+    dt->cr = 0;
+    dt->cs = st.st_size;
+    afs_addsize(dt, st.st_size);
+    afs_tick(dt);
+  }
+  
+  if (!S_ISDIR(st.st_mode)) {
+    unlink(path);
+    return;
+  }
+  
+  DIR * d = opendir(path);
+  
+  if (d != NULL) {
+    struct dirent * p;
+    
+    while ((dt->status == 1) && (p = readdir(d))) {
+      if (afs_isdot(p->d_name)) {
+        continue;
+      }
+      
+      int nlen = afs_pathcat(path, len, p->d_name);
+      
+      if (nlen >= 0) {
+        afs_filedelete_walk(dt, path, nlen, 1);
+        path[len] = 0;
+      }
+    }
+    
+    closedir(d);
+  }
+  
+  rmdir(path);
+}
+
+void afs_filedelete_do(AFSDTP dt, const char * path, byte ischild) {
+  char buf[PATH_MAX];
+  snprintf(buf, PATH_MAX, "%s", path);
+  afs_filedelete_walk(dt, buf, strlen(buf), ischild);
+}
+
+//-- Copy file contents: copy_file_range, else sendfile, else a large buffer
+//-- Returns 0 on success, -1 with errno set on error or when cancelled
+int afs_copy_data(AFSDTP dt, AFSJOBP j, int sfd, int dfd, char ** rbuf) {
+  long long done = 0;
+  byte method = 0;
+  
+  while (dt->status == 1) {
+    ssize_t n = -1;
+    
+    if (method == 0) {
+#ifdef __NR_copy_file_range
+      n = syscall(__NR_copy_file_range, sfd, NULL, dfd, NULL, AFS_COPY_CHUNK, 0);
+      
+      if ((n < 0) && (done == 0) && ((errno == ENOSYS) || (errno == EXDEV) ||
+                                     (errno == EINVAL) || (errno == EOPNOTSUPP))) {
+        method = 1;
+        continue;
+      }
+      
+#else
+      method = 1;
+      continue;
+#endif
+    }
+    else if (method == 1) {
+      n = sendfile(dfd, sfd, NULL, AFS_COPY_CHUNK);
+      
+      if ((n < 0) && (done == 0) && ((errno == EINVAL) || (errno == ENOSYS))) {
+        method = 2;
+        continue;
+      }
     }
     else {
-      sz = fstat.st_size;
+      if (*rbuf == NULL) {
+        *rbuf = malloc(AFS_COPY_CHUNK);
+        
+        if (*rbuf == NULL) {
+          return -1;
+        }
+      }
+      
+      n = read(sfd, *rbuf, AFS_COPY_CHUNK);
+      
+      if (n > 0) {
+        ssize_t w = 0;
+        
+        while (w < n) {
+          ssize_t r = write(dfd, *rbuf + w, n - w);
+          
+          if (r <= 0) {
+            if ((r < 0) && (errno == EINTR)) {
+              continue;
+            }
+            
+            if (r == 0) {
+              errno = ENOSPC;
+            }
+            
+            return -1;
+          }
+          
+          w += r;
+        }
+      }
     }
     
-    //-- Set Current Filename
-    char * bsn = basename(path);
+    if (n == 0) {
+      return 0;
+    }
     
-    if (bsn != NULL) {
-      snprintf(dt->curr, 255, "%s", bsn);
-      free(bsn);
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      
+      return -1;
     }
     
-    //-- Set Current Status
-    dt->n += 1;
-    dt->cr = 0;
-    dt->cs = sz;
-    //-- Set Total Size
-    int kbsz = sz / AFS_KILOBYTE;
-    dt->b += sz % AFS_KILOBYTE;
-    
-    if (dt->b >= AFS_KILOBYTE) {
-      dt->b -= AFS_KILOBYTE;
-      dt->k += 1;
+    done += n;
+    afs_addsize(dt, n);
+    
+    if (dt->cf == j) {
+      dt->cr = done;
     }
     
-    dt->k += kbsz;
-    //-- Tick
     afs_tick(dt);
   }
   
-  if (!islnk && S_ISDIR(fstat.st_mode)) {
-    DIR * d = opendir(path);
-    size_t path_len = strlen(path);
+  errno = ECANCELED;
+  return -1;
+}
+
+//-- Worker: copy one regular file, keep mode and owner
+void afs_copy_file(AFSENGINEP e, AFSJOBP j, char ** rbuf) {
+  AFSDTP dt = e->dt;
+  long long copied = 0;
+  byte success = 0;
+  int sfd = -1;
+  int dfd = -1;
+  
+  afs_setcurr(dt, j->path);
+  dt->cf = j;
+  dt->cs = j->st.st_size;
+  dt->cr = 0;
+  
+  if ((sfd = open(j->path, O_RDONLY)) == -1) {
+    goto done;
+  }
+  
+  if ((dfd = open(j->dest, O_CREAT | O_WRONLY | O_TRUNC, j->st.st_mode & 0777)) == -1) {
+    goto done;
+  }
+  
+  off_t before = lseek(dfd, 0, SEEK_CUR);
+  
+  if (afs_copy_data(dt, j, sfd, dfd, rbuf) == 0) {
+    success = 1;
+  }
+  else if (errno == ENOSPC) {
+    pthread_mutex_lock(&e->askMutex);
     
-    if (d) {
-      struct dirent * p;
-      
-      while ((dt->status == 1) && (p = readdir(d))) {
-        //-- No "." & ".."
-        if ((p->d_name[0] == '.')
-            && ((p->d_name[1] == 0)
-                || ((p->d_name[1] == '.')
-                    && (p->d_name[2] == 0)))) {
-          continue;
-        }
-        
-        //-- Filename Buffer
-        size_t len = path_len + strlen(p->d_name) + 2;
-        char * buf = malloc(len);
-        
-        if (buf) {
-          snprintf(buf, len, "%s/%s", path,
-                   p->d_name);
-          afs_filedelete_do(dt, buf, 1);
-          free(buf);
-        }
-      }
+    if (dt->status == 1) {
+      afs_setcurr(dt, j->path);
+      afs_askdiskfull(dt);
     }
     
-    closedir(d);
-    rmdir(path);
+    pthread_mutex_unlock(&e->askMutex);
   }
-  else {
-    unlink(path);
+  
+  copied = lseek(dfd, 0, SEEK_CUR) - before;
+  
+  if (success) {
+    fchown(dfd, j->st.st_uid, j->st.st_gid);
+    fchmod(dfd, j->st.st_mode & 07777);
   }
-}
+  
+done:
 
-void afs_copy_do(AFSDTP dt, const char * path, const char * dest) {
-  //-- Define
-  struct stat fstat;
-  struct stat lfstat;
-  byte islnk = 0;
-  int sz = 0;
-  
-  //-- Get Stat
-  if (stat(path, &fstat)) {
-    return;
+  if (sfd != -1) {
+    close(sfd);
   }
   
-  //-- Get Link Stat
-  if ((lstat(path, &lfstat) == 0) && S_ISLNK(lfstat.st_mode)) {
-    sz = lfstat.st_size;
-    islnk = 1;
+  if (dfd != -1) {
+    close(dfd);
+  }
+  
+  if (success) {
+    if (dt->flag == 1) {
+      unlink(j->path);
+    }
   }
   else {
-    sz = fstat.st_size;
+    unlink(j->dest);
+  }
+  
+  //-- The file counts for its whole size, even when not copied
+  if (copied < j->st.st_size) {
+    afs_addsize(dt, j->st.st_size - copied);
   }
   
-  //-- Set Current Info
-  if (1) {
-    char * bsn = basename(path);
+  if (dt->cf == j) {
+    dt->cr = dt->cs;
+  }
+  
+  afs_tick(dt);
+}
+
+static void * afs_copy_worker(void * cookie) {
+  AFSENGINEP e = (AFSENGINEP) cookie;
+  char * rbuf = NULL;
+  
+  for (;;) {
+    pthread_mutex_lock(&e->mutex);
     
-    if (bsn != NULL) {
-      snprintf(dt->curr, 255, "%s", bsn);
-      free(bsn);
+    while ((e->count == 0) && !e->done) {
+      pthread_cond_wait(&e->cond, &e->mutex);
     }
     
-    dt->n += 1;
-    dt->cr = 0;
-    dt->cs = sz;
+    if (e->count == 0) {
+      pthread_mutex_unlock(&e->mutex);
+      break;
+    }
+    
+    AFSJOBP j = e->jobs[e->head];
+    e->head = (e->head + 1) % AFS_COPY_QUEUE;
+    e->count--;
+    pthread_cond_broadcast(&e->cond);
+    pthread_mutex_unlock(&e->mutex);
+    
+    //-- When cancelled, queued files are only dropped
+    if (e->dt->status == 1) {
+      afs_copy_file(e, j, &rbuf);
+    }
+    
+    free(j);
   }
   
+  if (rbuf != NULL) {
+    free(rbuf);
+  }
+  
+  return NULL;
+}
+
+void afs_copy_queue(AFSENGINEP e, const char * path, const char * dest, struct stat * st) {
+  size_t plen = strlen(path) + 1;
+  size_t dlen = strlen(dest) + 1;
+  AFSJOBP j = (AFSJOBP) malloc(sizeof(AFSJOB) + plen + dlen);
+  
+  if (j == NULL) {
+    return;
+  }
+  
+  j->path = (char *) (j + 1);
+  j->dest = j->path + plen;
+  memcpy(j->path, path, plen);
+  memcpy(j->dest, dest, dlen);
+  memcpy(&j->st, st, sizeof(struct stat));
+  
+  if (e->workers == 0) {
+    afs_copy_file(e, j, &e->rbuf);
+    free(j);
+    return;
+  }
+  
+  pthread_mutex_lock(&e->mutex);
+  
+  while (e->count == AFS_COPY_QUEUE) {
+    pthread_cond_wait(&e->cond, &e->mutex);
+  }
+  
+  e->jobs[(e->head + e->count) % AFS_COPY_QUEUE] = j;
+  e->count++;
+  pthread_cond_broadcast(&e->cond);
+  pthread_mutex_unlock(&e->mutex);
+}
+
+byte afs_copy_ask(AFSENGINEP e, const char * path) {
+  pthread_mutex_lock(&e->askMutex);
+  afs_setcurr(e->dt, path);
+  byte ret = afs_askoverwrite(e->dt);
+  pthread_mutex_unlock(&e->askMutex);
+  return ret;
+}
+
+//-- Tree walker: directories and links are done here, files go to the workers.
+//-- path and dest are PATH_MAX buffers, extended in place while walking.
+void afs_copy_walk(AFSENGINEP e, char * path, int plen, char * dest, int dlen) {
+  AFSDTP dt = e->dt;
+  struct stat st;
+  struct stat dst;
+  
+  if (lstat(path, &st)) {
+    return;
+  }
+  
+  afs_setcurr(dt, path);
+  __sync_fetch_and_add(&dt->n, 1);
+  byte exists = (lstat(dest, &dst) == 0);
   byte copyit = 1;
   
-  if (file_exists(dest)) {
-    copyit = afs_askoverwrite(dt);
+  if (exists) {
+    copyit = afs_copy_ask(e, path);
   }
   
-  if (copyit) {
-    //-- Process Directory
-    if (!islnk && S_ISDIR(fstat.st_mode)) {
-      //-- Make destination directory
-      mkdir(dest, fstat.st_mode);
-      
-      //-- Check exist
-      if (file_exists(dest)) {
-        //-- Open dir to read
-        DIR * d = opendir(path);
-        size_t path_len = strlen(path);
-        size_t dest_len = strlen(dest);
-        
-        if (d) {
-          struct dirent * p;
-          
-          while ((dt->status == 1)
-                 && (p = readdir(d))) {
-            //-- No "." & ".."
-            if ((p->d_name[0] == '.')
-                && ((p->d_name[1] == 0)
-                    ||
-                    ((p->d_name[1] == '.')
-                     && (p->d_name[2] ==
-                         0)))) {
-              continue;
-            }
-            
-            //-- Filename Buffer
-            size_t len =
-              path_len +
-              strlen(p->d_name) + 2;
-            size_t led =
-              dest_len +
-              strlen(p->d_name) + 2;
-            char * buf = malloc(len);
-            char * bud = malloc(led);
-            
-            //-- Fetch
-            if (buf) {
-              if (bud) {
-                snprintf(buf,
-                         len,
-                         "%s/%s",
-                         path,
-                         p->
-                         d_name);
-                snprintf(bud,
-                         led,
-                         "%s/%s",
-                         dest,
-                         p->
-                         d_name);
-                afs_copy_do(dt,
-                            buf,
-                            bud);
-                free(bud);
-              }
-              
-              free(buf);
-            }
-          }
+  if (!copyit) {
+    //-- Skipped directory still counts in the progress
+    if (S_ISDIR(st.st_mode)) {
+      AFSDT dtsz;
+      memset(&dtsz, 0, sizeof(AFSDT));
+      dtsz.status = 1;
+      afs_filesize_do(&dtsz, path, 0);
+      afs_addsize(dt, ((long long) dtsz.k) * AFS_KILOBYTE + dtsz.b);
+      __sync_fetch_and_add(&dt->n, dtsz.n);
+    }
+    
+    afs_addsize(dt, st.st_size);
+    return;
+  }
+  
+  //-- Cut: rename first, copy only across filesystems
+  if ((dt->flag == 1) && !e->no_rename) {
+    if (exists && !S_ISDIR(st.st_mode)) {
+      unlink(dest);
+      exists = 0;
+    }
+    
+    if (!exists) {
+      if (rename(path, dest) == 0) {
+        if (S_ISDIR(st.st_mode)) {
+          AFSDT dtsz;
+          memset(&dtsz, 0, sizeof(AFSDT));
+          dtsz.status = 1;
+          afs_filesize_do(&dtsz, dest, 0);
+          afs_addsize(dt, ((long long) dtsz.k) * AFS_KILOBYTE + dtsz.b);
+          __sync_fetch_and_add(&dt->n, dtsz.n);
         }
         
-        //-- Clean up
-        closedir(d);
-        
-        if (dt->flag == 1) {
-          rmdir(path);
-        }
+        afs_addsize(dt, st.st_size);
+        afs_tick(dt);
+        return;
+      }
+      
+      if (errno == EXDEV) {
+        e->no_rename = 1;
       }
     }
-    else if (islnk) {
-      //-- Create symlink
-      char buf[4096];
-      int len = readlink(path, buf, sizeof(buf));
+  }
+  
+  if (S_ISDIR(st.st_mode)) {
+    //-- Writable until its files are copied, mode and owner are set at the end
+    mkdir(dest, (st.st_mode & 0777) | S_IRWXU);
+    afs_addsize(dt, st.st_size);
+    
+    //-- Listed before its children: the list head is always the deepest
+    AFSDIRP dr = (AFSDIRP) malloc(sizeof(AFSDIR) + plen + dlen + 2);
+    
+    if (dr != NULL) {
+      dr->path = (char *) (dr + 1);
+      dr->dest = dr->path + plen + 1;
+      memcpy(dr->path, path, plen + 1);
+      memcpy(dr->dest, dest, dlen + 1);
+      memcpy(&dr->st, &st, sizeof(struct stat));
+      dr->next = e->dirs;
+      e->dirs = dr;
+    }
+    DIR * d = opendir(path);
+    
+    if (d == NULL) {
+      return;
+    }
+    
+    struct dirent * p;
+    
+    while ((dt->status == 1) && (p = readdir(d))) {
+      if (afs_isdot(p->d_name)) {
+        continue;
+      }
       
-      if (len >= 0) {
-        buf[len] = 0;
-        unlink(dest);
-        symlink(buf, dest);
+      int np = afs_pathcat(path, plen, p->d_name);
+      int nd = afs_pathcat(dest, dlen, p->d_name);
+      
+      if ((np >= 0) && (nd >= 0)) {
+        afs_copy_walk(e, path, np, dest, nd);
+      }
+      
+      path[plen] = 0;
+      dest[dlen] = 0;
+    }
+    
+    closedir(d);
+  }
+  else if (S_ISLNK(st.st_mode)) {
+    char buf[4096];
+    int len = readlink(path, buf, sizeof(buf) - 1);
+    
+    if (len >= 0) {
+      buf[len] = 0;
+      unlink(dest);
+      
+      if (symlink(buf, dest) == 0) {
+        lchown(dest, st.st_uid, st.st_gid);
         
         if (dt->flag == 1) {
           unlink(path);
         }
       }
     }
-    else {
-      byte do_full_copy = 1;
+    
+    afs_addsize(dt, st.st_size);
+  }
+  else if (S_ISREG(st.st_mode)) {
+    afs_copy_queue(e, path, dest, &st);
+  }
+  else {
+    //-- Device nodes, fifos and sockets are recreated, not read
+    unlink(dest);
+    
+    if (mknod(dest, st.st_mode, st.st_rdev) == 0) {
+      chown(dest, st.st_uid, st.st_gid);
       
       if (dt->flag == 1) {
-        if (file_exists(dest)) {
-          unlink(dest);
-        }
-        
-        if (rename(path, dest) != -1) {
-          do_full_copy = 0;
-        }
-      }
-      
-      if (do_full_copy) {
-        //-- Preparing File Copy
-        int sfd = -1, dfd = -1, readsz = AFS_KILOBYTE * 32;	// * ((dt->intTick >> 3) << 6);
-        byte success = 0;
-        ssize_t readed;
-        off_t offset = 0;
-        
-        //-- Open Source & Destination
-        if ((sfd = open(path, O_RDONLY)) == -1) {
-          goto done;
-        }
-        
-        if ((dfd =
-               open(dest, O_CREAT | O_WRONLY | O_TRUNC,
-                    fstat.st_mode)) == -1) {
-          goto done;
-        }
-        
-        //-- Copy Contents
-        while ((readed =
-                  sendfile(dfd, sfd, &offset,
-                           readsz)) > 0) {
-          dt->cr += readed;
-          int kbsz = readed / AFS_KILOBYTE;
-          dt->b += readed % AFS_KILOBYTE;
-          
-          if (dt->b >= AFS_KILOBYTE) {
-            dt->b -= AFS_KILOBYTE;
-            dt->k += 1;
-          }
-          
-          dt->k += kbsz;
-          
-          if (dt->status != 1) {
-            readed = -1;
-            break;
-          }
-          
-          afs_tick(dt);
-        }
-        
-        if (readed == -1) {
-          if (errno == 28) {
-            afs_askdiskfull(dt);
-          }
-          
-          goto done;
-        }
-        
-        success = 1;
-        
-        if (dt->cr <= sz) {
-          sz -= dt->cr;
-        }
-        else {
-          sz = 0;
-        }
-        
-        //-- Cleanup
-      done:
-      
-        if (sfd != -1) {
-          close(sfd);
-        }
-        
-        if (dfd != -1) {
-          close(dfd);
-        }
-        
-        if (success) {
-          if (dt->flag == 1) {
-            unlink(path);
-          }
-        }
-        else {
-          unlink(dest);
-        }
+        unlink(path);
       }
     }
+    
+    afs_addsize(dt, st.st_size);
   }
-  else if (!islnk && S_ISDIR(fstat.st_mode)) {
-    AFSDT dtsz;
-    memset(&dtsz, 0, sizeof(AFSDT));
-    dtsz.status = 1;
-    dtsz.flag = 0;
-    dtsz.path = path;
-    dtsz.intTick = 100;
-    afs_filesize_do(&dtsz, path, 0);
-    sz += dtsz.b;
-    dt->k += dtsz.k;
-    dt->n += dtsz.n;
+  
+  afs_tick(dt);
+}
+
+void afs_copy_do(AFSDTP dt, const char * path, const char * dest) {
+  AFSENGINE e;
+  pthread_t workers[AFS_COPY_WORKERS];
+  int i;
+  char pbuf[PATH_MAX];
+  char dbuf[PATH_MAX];
+  memset(&e, 0, sizeof(AFSENGINE));
+  e.dt = dt;
+  pthread_mutex_init(&e.mutex, NULL);
+  pthread_cond_init(&e.cond, NULL);
+  pthread_mutex_init(&e.askMutex, NULL);
+  
+  for (i = 0; i < AFS_COPY_WORKERS; i++) {
+    if (pthread_create(&workers[e.workers], NULL, afs_copy_worker, (void *) &e) == 0) {
+      e.workers++;
+    }
   }
   
-  //-- Save Information
-  dt->cr = dt->cs;
-  int kbsz = sz / AFS_KILOBYTE;
-  dt->b += sz % AFS_KILOBYTE;
+  snprintf(pbuf, PATH_MAX, "%s", path);
+  snprintf(dbuf, PATH_MAX, "%s", dest);
+  afs_copy_walk(&e, pbuf, strlen(pbuf), dbuf, strlen(dbuf));
+  
+  //-- Let the workers empty the queue
+  pthread_mutex_lock(&e.mutex);
+  e.done = 1;
+  pthread_cond_broadcast(&e.cond);
+  pthread_mutex_unlock(&e.mutex);
   
-  if (dt->b >= AFS_KILOBYTE) {
-    dt->b -= AFS_KILOBYTE;
-    dt->k += 1;
+  for (i = 0; i < e.workers; i++) {
+    pthread_join(workers[i], NULL);
   }
   
-  dt->k += kbsz;
-  afs_tick(dt);
+  if (e.rbuf != NULL) {
+    free(e.rbuf);
+  }
+  
+  //-- Directories: deepest first
+  while (e.dirs != NULL) {
+    AFSDIRP dr = e.dirs;
+    e.dirs = dr->next;
+    chown(dr->dest, dr->st.st_uid, dr->st.st_gid);
+    chmod(dr->dest, dr->st.st_mode & 07777);
+    
+    if (dt->flag == 1) {
+      rmdir(dr->path);
+    }
+    
+    free(dr);
+  }
+  
+  pthread_mutex_destroy(&e.askMutex);
+  pthread_cond_destroy(&e.cond);
+  pthread_mutex_destroy(&e.mutex);
 }
 
 static void * afs_filesize_th(void * cookie) {
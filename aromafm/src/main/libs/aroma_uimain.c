@@ -268,6 +268,7 @@ byte aui_show(char ** path, byte * state, char * selfile, byte back_ani) {
   while (aui_dispatch(&v));
   
   //-- Window
+  aui_meta_unbind();
   aw_destroy(v.hWin);
   //-- Set New Path
   printf("RESHOW PATH [%s]\n", v.path);
@@ -0,0 +1,892 @@
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <linux/fs.h>
+
+#include "zlib.h"
+#include "mincrypt/sha256.h"
+
+#include "common.h"
+#include "block_store.h"
+
+#define BLOCK_STORE_MAGIC           0x6b6c6221  // "!blk"
+#define BLOCK_STORE_VERSION         1
+#define BLOCK_STORE_FS_EXT4         1
+#define BLOCK_STORE_FS_F2FS         2
+
+// one extent is 1MB of a 4KB blocks filesystem
+#define BLOCK_STORE_EXTENT_BLOCKS   256
+#define BLOCK_STORE_MAX_BLOCK_SIZE  4096
+
+// manifest: the header, then one record per extent holding used blocks
+typedef struct {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t fs_type;
+    uint32_t blk_sz;
+    uint32_t extent_blks;
+    uint64_t total_blks;
+    uint64_t used_blks;
+    uint32_t extent_count;
+    uint32_t crc;           // crc32 of the records
+} block_store_header_t;
+
+typedef struct {
+    uint32_t index;
+    uint8_t map[BLOCK_STORE_EXTENT_BLOCKS / 8];     // used blocks, lsb first
+    uint8_t digest[SHA256_DIGEST_SIZE];             // of the used blocks only
+} block_store_extent_t;
+
+// one bit per block of the filesystem, lsb first like the ext4 bitmaps
+typedef struct {
+    int fs_type;
+    uint32_t blk_sz;
+    uint64_t total_blks;
+    uint8_t* bits;
+} UsedMap;
+
+static uint16_t get_le16(const uint8_t* p) {
+    return p[0] | (p[1] << 8);
+}
+
+static uint32_t get_le32(const uint8_t* p) {
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static uint64_t get_le64(const uint8_t* p) {
+    return get_le32(p) | ((uint64_t)get_le32(p + 4) << 32);
+}
+
+static void map_set_range(UsedMap* map, uint64_t start, uint64_t count) {
+    uint64_t b;
+    if (start >= map->total_blks)
+        return;
+    if (count > map->total_blks - start)
+        count = map->total_blks - start;
+    for (b = start; b < start + count; b++)
+        map->bits[b >> 3] |= 1 << (b & 7);
+}
+
+static int pread_full(int fd, void* buf, size_t len, off64_t offset) {
+    size_t done = 0;
+    while (done < len) {
+        ssize_t r = pread64(fd, (char*)buf + done, len - done, offset + done);
+        if (r < 0 && errno == EINTR)
+            continue;
+        if (r <= 0)
+            return -1;
+        done += r;
+    }
+    return 0;
+}
+
+static int pwrite_full(int fd, const void* buf, size_t len, off64_t offset) {
+    size_t done = 0;
+    while (done < len) {
+        ssize_t w = pwrite64(fd, (const char*)buf + done, len - done, offset + done);
+        if (w < 0 && errno == EINTR)
+            continue;
+        if (w <= 0)
+            return -1;
+        done += w;
+    }
+    return 0;
+}
+
+static uint64_t popcount_map(const uint8_t* map, size_t len) {
+    uint64_t count = 0;
+    size_t i;
+    for (i = 0; i < len; i++)
+        count += __builtin_popcount(map[i]);
+    return count;
+}
+
+/*
+ * ext4: each block group has a block bitmap. Groups flagged BLOCK_UNINIT
+ * have no bitmap on disk, only the group metadata is used in them, so the
+ * superblock backups, group descriptors and the bitmaps / inode tables
+ * listed in the descriptors are always marked.
+ */
+#define EXT4_SUPER_MAGIC                        0xEF53
+#define EXT4_FEATURE_COMPAT_SPARSE_SUPER2       0x0200
+#define EXT4_FEATURE_INCOMPAT_RECOVER           0x0004
+#define EXT4_FEATURE_INCOMPAT_META_BG           0x0010
+#define EXT4_FEATURE_INCOMPAT_64BIT             0x0080
+#define EXT4_FEATURE_RO_COMPAT_SPARSE_SUPER     0x0001
+#define EXT4_FEATURE_RO_COMPAT_GDT_CSUM         0x0010
+#define EXT4_FEATURE_RO_COMPAT_BIGALLOC         0x0200
+#define EXT4_FEATURE_RO_COMPAT_METADATA_CSUM    0x0400
+#define EXT4_BG_BLOCK_UNINIT                    0x0002
+
+static int is_power_of(uint32_t n, uint32_t base) {
+    while (n > 1 && n % base == 0)
+        n /= base;
+    return n == 1;
+}
+
+static int ext4_group_has_super(const uint8_t* sb, uint32_t group) {
+    if (group == 0)
+        return 1;
+    if (get_le32(sb + 0x5C) & EXT4_FEATURE_COMPAT_SPARSE_SUPER2)
+        return group == get_le32(sb + 0x24C) || group == get_le32(sb + 0x250);
+    if (group == 1 || !(get_le32(sb + 0x64) & EXT4_FEATURE_RO_COMPAT_SPARSE_SUPER))
+        return 1;
+    return is_power_of(group, 3) || is_power_of(group, 5) || is_power_of(group, 7);
+}
+
+// returns 1 when all the blocks must be copied
+static int ext4_used_map(int fd, const uint8_t* sb, UsedMap* map) {
+    uint32_t incompat = get_le32(sb + 0x60);
+    uint32_t ro_compat = get_le32(sb + 0x64);
+    uint64_t first = get_le32(sb + 0x14);
+    uint32_t bpg = get_le32(sb + 0x20);
+    uint32_t ipg = get_le32(sb + 0x28);
+    uint32_t inode_size = get_le32(sb + 0x4C) == 0 ? 128 : get_le16(sb + 0x58);
+    uint32_t desc_size = (incompat & EXT4_FEATURE_INCOMPAT_64BIT) ? get_le16(sb + 0xFE) : 32;
+    uint32_t reserved_gdt = get_le16(sb + 0xCE);
+    int uninit = (ro_compat & (EXT4_FEATURE_RO_COMPAT_GDT_CSUM | EXT4_FEATURE_RO_COMPAT_METADATA_CSUM)) != 0;
+    uint8_t* gdt = NULL;
+    uint8_t* bitmap = NULL;
+    int ret = -1;
+
+    if (bpg == 0 || bpg > map->blk_sz * 8 || first >= map->total_blks || desc_size < 32) {
+        LOGE("block store: invalid ext4 superblock\n");
+        return -1;
+    }
+    if (incompat & EXT4_FEATURE_INCOMPAT_RECOVER) {
+        LOGW("block store: ext4 journal needs recovery, copying all blocks\n");
+        return 1;
+    }
+    if ((incompat & EXT4_FEATURE_INCOMPAT_META_BG) || (ro_compat & EXT4_FEATURE_RO_COMPAT_BIGALLOC)) {
+        LOGW("block store: unsupported ext4 layout, copying all blocks\n");
+        return 1;
+    }
+
+    uint32_t groups = (map->total_blks - first + bpg - 1) / bpg;
+    uint32_t gdt_blocks = ((uint64_t)groups * desc_size + map->blk_sz - 1) / map->blk_sz;
+    uint32_t itable_blocks = ((uint64_t)ipg * inode_size + map->blk_sz - 1) / map->blk_sz;
+    gdt = malloc((size_t)gdt_blocks * map->blk_sz);
+    bitmap = malloc(map->blk_sz);
+    if (gdt == NULL || bitmap == NULL) {
+        LOGE("block store: out of memory\n");
+        goto out;
+    }
+    if (pread_full(fd, gdt, (size_t)gdt_blocks * map->blk_sz, (first + 1) * map->blk_sz) != 0) {
+        LOGE("block store: can't read ext4 group descriptors (%s)\n", strerror(errno));
+        goto out;
+    }
+
+    // boot sector of the 1KB blocks filesystems
+    map_set_range(map, 0, 1);
+    uint32_t g;
+    for (g = 0; g < groups; g++) {
+        const uint8_t* desc = gdt + (size_t)g * desc_size;
+        uint64_t start = first + (uint64_t)g * bpg;
+        uint64_t count = map->total_blks - start < bpg ? map->total_blks - start : bpg;
+        uint64_t block_bitmap = get_le32(desc);
+        uint64_t inode_bitmap = get_le32(desc + 0x4);
+        uint64_t inode_table = get_le32(desc + 0x8);
+        if (desc_size >= 64) {
+            block_bitmap |= (uint64_t)get_le32(desc + 0x20) << 32;
+            inode_bitmap |= (uint64_t)get_le32(desc + 0x24) << 32;
+            inode_table |= (uint64_t)get_le32(desc + 0x28) << 32;
+        }
+
+        if (ext4_group_has_super(sb, g))
+            map_set_range(map, start, 1 + gdt_blocks + reserved_gdt);
+        map_set_range(map, block_bitmap, 1);
+        map_set_range(map, inode_bitmap, 1);
+        map_set_range(map, inode_table, itable_blocks);
+        if (uninit && (get_le16(desc + 0x12) & EXT4_BG_BLOCK_UNINIT))
+            continue;
+
+        if (block_bitmap >= map->total_blks ||
+                pread_full(fd, bitmap, map->blk_sz, block_bitmap * map->blk_sz) != 0) {
+            LOGE("block store: can't read ext4 bitmap of group %u\n", g);
+            goto out;
+        }
+        uint64_t i;
+        for (i = 0; i < count; i++) {
+            if ((i & 7) == 0 && bitmap[i >> 3] == 0) {
+                i += 7;
+                continue;
+            }
+            if (bitmap[i >> 3] & (1 << (i & 7)))
+                map_set_range(map, start + i, 1);
+        }
+    }
+    ret = 0;
+
+out:
+    free(bitmap);
+    free(gdt);
+    return ret;
+}
+
+/*
+ * f2fs: all the areas before the main area (checkpoint, SIT, NAT, SSA)
+ * are copied. In the main area, a block is in use when its bit is set
+ * in the SIT entry of its segment. The valid SIT copy depends on a bitmap
+ * of the checkpoint, and recent entries live in the SIT journal of the
+ * checkpoint summaries: marking the blocks of both copies and of the
+ * journal can only copy more blocks than needed.
+ */
+#define F2FS_SUPER_MAGIC            0xF2F52010
+#define F2FS_BLKSIZE                4096
+#define F2FS_BLOCKS_PER_SEG         512
+#define CP_UMOUNT_FLAG              0x00000001
+#define CP_COMPACT_SUM_FLAG         0x00000004
+#define NR_CURSEG_TYPE              6
+#define CURSEG_COLD_DATA            2
+#define SIT_ENTRY_SIZE              74
+#define SIT_ENTRY_PER_BLOCK         (F2FS_BLKSIZE / SIT_ENTRY_SIZE)
+#define SUM_ENTRIES_SIZE            (7 * F2FS_BLOCKS_PER_SEG)
+#define SUM_JOURNAL_SIZE            (F2FS_BLKSIZE - 5 - SUM_ENTRIES_SIZE)
+#define SIT_JOURNAL_ENTRY_SIZE      (4 + SIT_ENTRY_SIZE)
+#define SIT_JOURNAL_ENTRIES         ((SUM_JOURNAL_SIZE - 2) / SIT_JOURNAL_ENTRY_SIZE)
+
+// f2fs checksums are a crc32 seeded with the magic, without the final inversion
+static uint32_t f2fs_crc32(const uint8_t* buf, size_t len) {
+    return ~(uint32_t)crc32(~(uint32_t)F2FS_SUPER_MAGIC, buf, len);
+}
+
+static int f2fs_valid_cp_block(const uint8_t* cp) {
+    uint32_t offset = get_le32(cp + 164);
+    if (offset < 168 || offset > F2FS_BLKSIZE - 4 || (offset & 3) != 0)
+        return 0;
+    return get_le32(cp + offset) == f2fs_crc32(cp, offset);
+}
+
+// a checkpoint pack is valid when its first and last blocks match
+static int f2fs_read_cp(int fd, uint64_t addr, uint8_t* cp, uint64_t* version) {
+    uint8_t end[F2FS_BLKSIZE];
+    if (pread_full(fd, cp, F2FS_BLKSIZE, addr * F2FS_BLKSIZE) != 0 || !f2fs_valid_cp_block(cp))
+        return -1;
+    uint32_t pack_blocks = get_le32(cp + 136);
+    if (pack_blocks < 2 || pack_blocks > F2FS_BLOCKS_PER_SEG ||
+            pread_full(fd, end, F2FS_BLKSIZE, (addr + pack_blocks - 1) * F2FS_BLKSIZE) != 0 ||
+            !f2fs_valid_cp_block(end) || get_le64(end) != get_le64(cp))
+        return -1;
+    *version = get_le64(cp);
+    return 0;
+}
+
+static void f2fs_mark_segment(UsedMap* map, uint64_t main_blkaddr, uint32_t segno, const uint8_t* valid_map) {
+    uint64_t start = main_blkaddr + (uint64_t)segno * F2FS_BLOCKS_PER_SEG;
+    int i;
+    for (i = 0; i < F2FS_BLOCKS_PER_SEG; i++) {
+        if ((i & 7) == 0 && valid_map[i >> 3] == 0) {
+            i += 7;
+            continue;
+        }
+        if (valid_map[i >> 3] & (0x80 >> (i & 7)))
+            map_set_range(map, start + i, 1);
+    }
+}
+
+static int f2fs_used_map(int fd, const uint8_t* sb, UsedMap* map) {
+    uint8_t cp[F2FS_BLKSIZE], cp2[F2FS_BLKSIZE];
+    uint8_t blk[F2FS_BLKSIZE];
+    uint64_t version, version2;
+    uint32_t log_blocks_per_seg = get_le32(sb + 20);
+    uint32_t segment_count_sit = get_le32(sb + 56);
+    uint32_t segment_count_main = get_le32(sb + 68);
+    uint64_t cp_blkaddr = get_le32(sb + 76);
+    uint64_t sit_blkaddr = get_le32(sb + 80);
+    uint64_t main_blkaddr = get_le32(sb + 92);
+
+    if (get_le32(sb + 16) != 12 || (1U << log_blocks_per_seg) != F2FS_BLOCKS_PER_SEG ||
+            main_blkaddr + (uint64_t)segment_count_main * F2FS_BLOCKS_PER_SEG > map->total_blks) {
+        LOGE("block store: unsupported f2fs superblock\n");
+        return -1;
+    }
+
+    uint64_t cp_addr = cp_blkaddr;
+    int valid = f2fs_read_cp(fd, cp_blkaddr, cp, &version) == 0;
+    if (f2fs_read_cp(fd, cp_blkaddr + F2FS_BLOCKS_PER_SEG, cp2, &version2) == 0 &&
+            (!valid || version2 > version)) {
+        memcpy(cp, cp2, sizeof(cp));
+        cp_addr = cp_blkaddr + F2FS_BLOCKS_PER_SEG;
+        valid = 1;
+    }
+    if (!valid) {
+        LOGE("block store: no valid f2fs checkpoint\n");
+        return -1;
+    }
+    uint32_t flags = get_le32(cp + 132);
+    if (!(flags & CP_UMOUNT_FLAG)) {
+        LOGW("block store: f2fs was not cleanly unmounted, copying all blocks\n");
+        return 1;
+    }
+
+    map_set_range(map, 0, main_blkaddr);
+
+    uint32_t sit_blocks = (segment_count_main + SIT_ENTRY_PER_BLOCK - 1) / SIT_ENTRY_PER_BLOCK;
+    uint64_t copy_blocks = (uint64_t)(segment_count_sit / 2) * F2FS_BLOCKS_PER_SEG;
+    int copy;
+    uint32_t b, e;
+    for (copy = 0; copy < 2; copy++) {
+        for (b = 0; b < sit_blocks; b++) {
+            if (pread_full(fd, blk, F2FS_BLKSIZE, (sit_blkaddr + copy * copy_blocks + b) * F2FS_BLKSIZE) != 0) {
+                LOGE("block store: can't read f2fs SIT (%s)\n", strerror(errno));
+                return -1;
+            }
+            for (e = 0; e < SIT_ENTRY_PER_BLOCK && b * SIT_ENTRY_PER_BLOCK + e < segment_count_main; e++)
+                f2fs_mark_segment(map, main_blkaddr, b * SIT_ENTRY_PER_BLOCK + e, blk + e * SIT_ENTRY_SIZE + 2);
+        }
+    }
+
+    // the SIT journal is kept with the cold data summary
+    const uint8_t* journal;
+    uint64_t sum_addr;
+    if (flags & CP_COMPACT_SUM_FLAG) {
+        sum_addr = cp_addr + get_le32(cp + 140);
+        journal = blk + SUM_JOURNAL_SIZE;
+    } else {
+        sum_addr = cp_addr + get_le32(cp + 136) - (NR_CURSEG_TYPE + 1) + CURSEG_COLD_DATA;
+        journal = blk + SUM_ENTRIES_SIZE;
+    }
+    if (pread_full(fd, blk, F2FS_BLKSIZE, sum_addr * F2FS_BLKSIZE) != 0) {
+        LOGE("block store: can't read f2fs summary (%s)\n", strerror(errno));
+        return -1;
+    }
+    uint16_t n_sits = get_le16(journal);
+    if (n_sits > SIT_JOURNAL_ENTRIES) {
+        LOGE("block store: invalid f2fs SIT journal\n");
+        return -1;
+    }
+    for (e = 0; e < n_sits; e++) {
+        const uint8_t* entry = journal + 2 + e * SIT_JOURNAL_ENTRY_SIZE;
+        if (get_le32(entry) < segment_count_main)
+            f2fs_mark_segment(map, main_blkaddr, get_le32(entry), entry + 4 + 2);
+    }
+    return 0;
+}
+
+static int build_used_map(int fd, UsedMap* map) {
+    uint8_t sb[1024];
+    if (pread_full(fd, sb, sizeof(sb), 1024) != 0) {
+        LOGE("block store: can't read superblock (%s)\n", strerror(errno));
+        return -1;
+    }
+
+    if (get_le16(sb + 0x38) == EXT4_SUPER_MAGIC) {
+        map->fs_type = BLOCK_STORE_FS_EXT4;
+        map->blk_sz = 1024 << get_le32(sb + 0x18);
+        map->total_blks = get_le32(sb + 0x4);
+        if (get_le32(sb + 0x60) & EXT4_FEATURE_INCOMPAT_64BIT)
+            map->total_blks |= (uint64_t)get_le32(sb + 0x150) << 32;
+    } else if (get_le32(sb) == F2FS_SUPER_MAGIC) {
+        map->fs_type = BLOCK_STORE_FS_F2FS;
+        map->blk_sz = 1 << get_le32(sb + 16);
+        map->total_blks = get_le64(sb + 36);
+    } else {
+        LOGE("block store: no ext4 or f2fs filesystem found\n");
+        return -1;
+    }
+    if (map->blk_sz > BLOCK_STORE_MAX_BLOCK_SIZE || map->total_blks == 0 ||
+            map->total_blks / BLOCK_STORE_EXTENT_BLOCKS >= UINT32_MAX) {
+        LOGE("block store: unsupported filesystem geometry\n");
+        return -1;
+    }
+
+    // whole extents, the padding bits are never set
+    size_t len = (map->total_blks + BLOCK_STORE_EXTENT_BLOCKS - 1) / BLOCK_STORE_EXTENT_BLOCKS *
+                 (BLOCK_STORE_EXTENT_BLOCKS / 8);
+    map->bits = calloc(1, len);
+    if (map->bits == NULL) {
+        LOGE("block store: out of memory\n");
+        return -1;
+    }
+
+    int ret;
+    if (map->fs_type == BLOCK_STORE_FS_EXT4)
+        ret = ext4_used_map(fd, sb, map);
+    else
+        ret = f2fs_used_map(fd, sb, map);
+    if (ret > 0) {
+        map_set_range(map, 0, map->total_blks);
+        ret = 0;
+    }
+    return ret;
+}
+
+// same layout than the dedupe blobs: abc/def...
+static void extent_path(const char* store_dir, const uint8_t* digest, char* path) {
+    static const char hex[] = "0123456789abcdef";
+    char key[SHA256_DIGEST_SIZE * 2 + 2];
+    int i, j = 0;
+    for (i = 0; i < SHA256_DIGEST_SIZE; i++) {
+        key[j++] = hex[digest[i] >> 4];
+        if (j == 3)
+            key[j++] = '/';
+        key[j++] = hex[digest[i] & 0xf];
+        if (j == 3)
+            key[j++] = '/';
+    }
+    key[j] = '\0';
+    sprintf(path, "%s/%s", store_dir, key);
+}
+
+// returns the number of bytes added to the store, or -1
+static long store_extent(const char* store_dir, const uint8_t* digest, const void* data, size_t len) {
+    char path[PATH_MAX];
+    char tmp[PATH_MAX];
+    struct stat st;
+
+    extent_path(store_dir, digest, path);
+    if (stat(path, &st) == 0 && (size_t)st.st_size == len)
+        return 0;
+
+    strcpy(tmp, path);
+    *strrchr(tmp, '/') = '\0';
+    mkdir(tmp, 0755);
+    sprintf(tmp, "%s.tmp", path);
+    FILE* f = fopen(tmp, "wb");
+    if (f == NULL) {
+        LOGE("block store: can't create %s (%s)\n", tmp, strerror(errno));
+        return -1;
+    }
+    // a partial extent is never left under its final name
+    int ret = fwrite(data, len, 1, f) == 1 ? 0 : -1;
+    if (fclose(f) != 0)
+        ret = -1;
+    if (ret == 0 && rename(tmp, path) != 0)
+        ret = -1;
+    if (ret != 0) {
+        LOGE("block store: write error on %s (%s)\n", path, strerror(errno));
+        unlink(tmp);
+        return -1;
+    }
+    return len;
+}
+
+int block_store_backup(const char* device, const char* manifest_file, const char* store_dir,
+                       block_store_progress progress, BlockStoreStats* stats) {
+    UsedMap map;
+    block_store_header_t header;
+    char* buf = NULL;
+    FILE* out = NULL;
+    int ret = -1;
+
+    memset(&map, 0, sizeof(map));
+    int fd = open(device, O_RDONLY | O_LARGEFILE);
+    if (fd < 0) {
+        LOGE("block store: can't open %s (%s)\n", device, strerror(errno));
+        return -1;
+    }
+    if (build_used_map(fd, &map) != 0)
+        goto out;
+
+    uint32_t extents = (map.total_blks + BLOCK_STORE_EXTENT_BLOCKS - 1) / BLOCK_STORE_EXTENT_BLOCKS;
+    unsigned long long used = (unsigned long long)popcount_map(map.bits, (size_t)extents * (BLOCK_STORE_EXTENT_BLOCKS / 8)) * map.blk_sz;
+    unsigned long long done = 0, written = 0;
+
+    memset(&header, 0, sizeof(header));
+    header.magic = BLOCK_STORE_MAGIC;
+    header.version = BLOCK_STORE_VERSION;
+    header.fs_type = map.fs_type;
+    header.blk_sz = map.blk_sz;
+    header.extent_blks = BLOCK_STORE_EXTENT_BLOCKS;
+    header.total_blks = map.total_blks;
+    header.used_blks = used / map.blk_sz;
+    header.crc = crc32(0L, Z_NULL, 0);
+
+    if (posix_memalign((void**)&buf, 4096, BLOCK_STORE_EXTENT_BLOCKS * map.blk_sz) != 0) {
+        buf = NULL;
+        LOGE("block store: out of memory\n");
+        goto out;
+    }
+    out = fopen(manifest_file, "wb");
+    if (out == NULL) {
+        LOGE("block store: can't create %s (%s)\n", manifest_file, strerror(errno));
+        goto out;
+    }
+    // the header is written again once the extents are known
+    if (fwrite(&header, sizeof(header), 1, out) != 1)
+        goto write_error;
+
+    uint32_t e;
+    for (e = 0; e < extents; e++) {
+        block_store_extent_t record;
+        memset(&record, 0, sizeof(record));
+        record.index = e;
+        memcpy(record.map, map.bits + (size_t)e * sizeof(record.map), sizeof(record.map));
+        if (popcount_map(record.map, sizeof(record.map)) == 0)
+            continue;
+
+        // read each run of used blocks, packed in the buffer
+        uint64_t first = (uint64_t)e * BLOCK_STORE_EXTENT_BLOCKS;
+        size_t len = 0;
+        int i = 0;
+        while (i < BLOCK_STORE_EXTENT_BLOCKS) {
+            if (!(record.map[i >> 3] & (1 << (i & 7)))) {
+                i++;
+                continue;
+            }
+            int run = 1;
+            while (i + run < BLOCK_STORE_EXTENT_BLOCKS && (record.map[(i + run) >> 3] & (1 << ((i + run) & 7))))
+                run++;
+            if (pread_full(fd, buf + len, (size_t)run * map.blk_sz, (first + i) * map.blk_sz) != 0) {
+                LOGE("block store: read error on %s at block %llu (%s)\n", device,
+                     (unsigned long long)(first + i), strerror(errno));
+                goto out;
+            }
+            len += (size_t)run * map.blk_sz;
+            i += run;
+        }
+
+        SHA256_hash(buf, len, record.digest);
+        long added = store_extent(store_dir, record.digest, buf, len);
+        if (added < 0)
+            goto out;
+        written += added;
+        if (fwrite(&record, sizeof(record), 1, out) != 1)
+            goto write_error;
+        header.crc = crc32(header.crc, (const Bytef*)&record, sizeof(record));
+        header.extent_count++;
+
+        done += len;
+        if (progress != NULL)
+            progress(done, used);
+    }
+
+    if (fseeko(out, 0, SEEK_SET) != 0 || fwrite(&header, sizeof(header), 1, out) != 1 ||
+            fflush(out) != 0 || fsync(fileno(out)) != 0)
+        goto write_error;
+
+    if (stats != NULL) {
+        stats->size = map.total_blks * map.blk_sz;
+        stats->used = used;
+        stats->written = written;
+    }
+    ret = 0;
+    goto out;
+
+write_error:
+    LOGE("block store: write error on %s (%s)\n", manifest_file, strerror(errno));
+
+out:
+    if (out != NULL && fclose(out) != 0 && ret == 0) {
+        LOGE("block store: can't close %s (%s)\n", manifest_file, strerror(errno));
+        ret = -1;
+    }
+    if (ret != 0 && out != NULL)
+        unlink(manifest_file);
+    free(buf);
+    free(map.bits);
+    close(fd);
+    return ret;
+}
+
+// returns the records of a valid manifest, NULL otherwise
+static block_store_extent_t* read_manifest(const char* manifest_file, block_store_header_t* header) {
+    block_store_extent_t* records = NULL;
+    FILE* f = fopen(manifest_file, "rb");
+    if (f == NULL) {
+        LOGE("block store: can't open %s (%s)\n", manifest_file, strerror(errno));
+        return NULL;
+    }
+
+    if (fread(header, sizeof(*header), 1, f) != 1 || header->magic != BLOCK_STORE_MAGIC ||
+            header->version != BLOCK_STORE_VERSION || header->extent_blks != BLOCK_STORE_EXTENT_BLOCKS ||
+            header->blk_sz == 0 || header->blk_sz > BLOCK_STORE_MAX_BLOCK_SIZE ||
+            header->total_blks / BLOCK_STORE_EXTENT_BLOCKS >= UINT32_MAX) {
+        LOGE("block store: %s is not a block image\n", manifest_file);
+        goto out;
+    }
+    uint32_t extents = (header->total_blks + BLOCK_STORE_EXTENT_BLOCKS - 1) / BLOCK_STORE_EXTENT_BLOCKS;
+    if (header->extent_count > extents) {
+        LOGE("block store: invalid manifest %s\n", manifest_file);
+        goto out;
+    }
+    records = malloc((size_t)header->extent_count * sizeof(*records) + 1);
+    if (records == NULL) {
+        LOGE("block store: out of memory\n");
+        goto out;
+    }
+    if (header->extent_count &&
+            fread(records, sizeof(*records), header->extent_count, f) != header->extent_count) {
+        LOGE("block store: truncated manifest %s\n", manifest_file);
+        goto error;
+    }
+    if (crc32(crc32(0L, Z_NULL, 0), (const Bytef*)records, header->extent_count * sizeof(*records)) != header->crc) {
+        LOGE("block store: crc mismatch in %s\n", manifest_file);
+        goto error;
+    }
+
+    // extents are in increasing order, and never go past the filesystem end
+    uint64_t used = 0;
+    uint32_t i;
+    for (i = 0; i < header->extent_count; i++) {
+        const block_store_extent_t* r = &records[i];
+        uint64_t first = (uint64_t)r->index * BLOCK_STORE_EXTENT_BLOCKS;
+        int b;
+        if (r->index >= extents || (i > 0 && r->index <= records[i - 1].index))
+            break;
+        for (b = header->total_blks - first < BLOCK_STORE_EXTENT_BLOCKS ? header->total_blks - first : BLOCK_STORE_EXTENT_BLOCKS;
+                b < BLOCK_STORE_EXTENT_BLOCKS; b++) {
+            if (r->map[b >> 3] & (1 << (b & 7)))
+                break;
+        }
+        if (b < BLOCK_STORE_EXTENT_BLOCKS)
+            break;
+        used += popcount_map(r->map, sizeof(r->map));
+    }
+    if (i < header->extent_count || used != header->used_blks) {
+        LOGE("block store: invalid manifest %s\n", manifest_file);
+        goto error;
+    }
+    goto out;
+
+error:
+    free(records);
+    records = NULL;
+
+out:
+    fclose(f);
+    return records;
+}
+
+int block_store_restore(const char* manifest_file, const char* store_dir, const char* device,
+                        block_store_progress progress, BlockStoreStats* stats) {
+    block_store_header_t header;
+    char path[PATH_MAX];
+    struct stat st;
+    char* buf = NULL;
+    int dev = -1;
+    int ret = -1;
+    uint32_t i;
+
+    block_store_extent_t* records = read_manifest(manifest_file, &header);
+    if (records == NULL)
+        return -1;
+
+    // nothing is written unless every extent is in the store
+    for (i = 0; i < header.extent_count; i++) {
+        extent_path(store_dir, records[i].digest, path);
+        if (stat(path, &st) != 0 ||
+                st.st_size != (off_t)popcount_map(records[i].map, sizeof(records[i].map)) * header.blk_sz) {
+            LOGE("block store: missing extent %s\n", path);
+            goto out;
+        }
+    }
+
+    if (posix_memalign((void**)&buf, 4096, BLOCK_STORE_EXTENT_BLOCKS * header.blk_sz) != 0) {
+        buf = NULL;
+        LOGE("block store: out of memory\n");
+        goto out;
+    }
+    dev = open(device, O_WRONLY | O_LARGEFILE);
+    if (dev < 0) {
+        LOGE("block store: can't open %s (%s)\n", device, strerror(errno));
+        goto out;
+    }
+    unsigned long long size = header.total_blks * header.blk_sz;
+    unsigned long long device_size;
+    if (ioctl(dev, BLKGETSIZE64, &device_size) == 0 && size > device_size) {
+        LOGE("block store: %s (%llu bytes) is larger than %s (%llu bytes)\n",
+             manifest_file, size, device, device_size);
+        goto out;
+    }
+
+    unsigned long long used = header.used_blks * header.blk_sz;
+    unsigned long long done = 0;
+    for (i = 0; i < header.extent_count; i++) {
+        const block_store_extent_t* r = &records[i];
+        size_t len = (size_t)popcount_map(r->map, sizeof(r->map)) * header.blk_sz;
+        uint8_t digest[SHA256_DIGEST_SIZE];
+
+        extent_path(store_dir, r->digest, path);
+        FILE* f = fopen(path, "rb");
+        if (f == NULL || fread(buf, len, 1, f) != 1) {
+            LOGE("block store: can't read %s\n", path);
+            if (f != NULL)
+                fclose(f);
+            goto out;
+        }
+        fclose(f);
+        if (memcmp(SHA256_hash(buf, len, digest), r->digest, SHA256_DIGEST_SIZE) != 0) {
+            LOGE("block store: %s is corrupted\n", path);
+            goto out;
+        }
+
+        uint64_t first = (uint64_t)r->index * BLOCK_STORE_EXTENT_BLOCKS;
+        size_t pos = 0;
+        int b = 0;
+        while (b < BLOCK_STORE_EXTENT_BLOCKS) {
+            if (!(r->map[b >> 3] & (1 << (b & 7)))) {
+                b++;
+                continue;
+            }
+            int run = 1;
+            while (b + run < BLOCK_STORE_EXTENT_BLOCKS && (r->map[(b + run) >> 3] & (1 << ((b + run) & 7))))
+                run++;
+            if (pwrite_full(dev, buf + pos, (size_t)run * header.blk_sz, (first + b) * header.blk_sz) != 0) {
+                LOGE("block store: write error at block %llu (%s)\n",
+                     (unsigned long long)(first + b), strerror(errno));
+                goto out;
+            }
+            pos += (size_t)run * header.blk_sz;
+            b += run;
+        }
+
+        done += len;
+        if (progress != NULL)
+            progress(done, used);
+    }
+
+    if (fsync(dev) != 0) {
+        LOGE("block store: can't sync %s (%s)\n", device, strerror(errno));
+        goto out;
+    }
+    if (stats != NULL) {
+        stats->size = size;
+        stats->used = used;
+        stats->written = used;
+    }
+    ret = 0;
+
+out:
+    if (dev >= 0)
+        close(dev);
+    free(buf);
+    free(records);
+    return ret;
+}
+
+typedef struct {
+    uint8_t (*digests)[SHA256_DIGEST_SIZE];
+    size_t count;
+    size_t cap;
+} DigestSet;
+
+static int compare_digests(const void* a, const void* b) {
+    return memcmp(a, b, SHA256_DIGEST_SIZE);
+}
+
+// add the digests of all the manifests below dir
+static int collect_digests(const char* dir, DigestSet* set) {
+    DIR* d = opendir(dir);
+    if (d == NULL)
+        return 0;
+
+    struct dirent* de;
+    char path[PATH_MAX];
+    int ret = 0;
+    while (ret == 0 && (de = readdir(d)) != NULL) {
+        struct stat st;
+        if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0)
+            continue;
+        snprintf(path, sizeof(path), "%s/%s", dir, de->d_name);
+        if (lstat(path, &st) != 0)
+            continue;
+        if (S_ISDIR(st.st_mode)) {
+            ret = collect_digests(path, set);
+            continue;
+        }
+        size_t len = strlen(de->d_name);
+        if (!S_ISREG(st.st_mode) || len < 4 || strcmp(de->d_name + len - 4, ".blk") != 0)
+            continue;
+
+        // an unreadable manifest could still refer to extents: keep them all
+        block_store_header_t header;
+        block_store_extent_t* records = read_manifest(path, &header);
+        if (records == NULL) {
+            ret = -1;
+            break;
+        }
+        if (set->count + header.extent_count > set->cap) {
+            size_t cap = (set->count + header.extent_count) * 2;
+            void* digests = realloc(set->digests, cap * SHA256_DIGEST_SIZE);
+            if (digests == NULL) {
+                free(records);
+                ret = -1;
+                break;
+            }
+            set->digests = digests;
+            set->cap = cap;
+        }
+        uint32_t i;
+        for (i = 0; i < header.extent_count; i++)
+            memcpy(set->digests[set->count++], records[i].digest, SHA256_DIGEST_SIZE);
+        free(records);
+    }
+    closedir(d);
+    return ret;
+}
+
+static int parse_key(const char* dir_name, const char* name, uint8_t* digest) {
+    char key[SHA256_DIGEST_SIZE * 2 + 1];
+    int i;
+    if (strlen(dir_name) != 3 || strlen(name) != sizeof(key) - 4)
+        return -1;
+    sprintf(key, "%s%s", dir_name, name);
+    for (i = 0; i < SHA256_DIGEST_SIZE * 2; i++) {
+        char c = key[i];
+        int v = c >= '0' && c <= '9' ? c - '0' : c >= 'a' && c <= 'f' ? c - 'a' + 10 : -1;
+        if (v < 0)
+            return -1;
+        if (i & 1)
+            digest[i >> 1] |= v;
+        else
+            digest[i >> 1] = v << 4;
+    }
+    return 0;
+}
+
+long long block_store_gc(const char* store_dir, const char* backup_dir) {
+    DigestSet set;
+    long long freed = 0;
+
+    memset(&set, 0, sizeof(set));
+    if (collect_digests(backup_dir, &set) != 0) {
+        LOGE("block store: can't read all block images, nothing freed\n");
+        free(set.digests);
+        return -1;
+    }
+    qsort(set.digests, set.count, SHA256_DIGEST_SIZE, compare_digests);
+
+    DIR* store = opendir(store_dir);
+    if (store == NULL) {
+        free(set.digests);
+        return 0;
+    }
+    struct dirent* sub;
+    char dir[PATH_MAX];
+    char path[PATH_MAX];
+    while ((sub = readdir(store)) != NULL) {
+        if (sub->d_name[0] == '.')
+            continue;
+        snprintf(dir, sizeof(dir), "%s/%s", store_dir, sub->d_name);
+        DIR* d = opendir(dir);
+        if (d == NULL)
+            continue;
+
+        struct dirent* de;
+        while ((de = readdir(d)) != NULL) {
+            uint8_t digest[SHA256_DIGEST_SIZE];
+            struct stat st;
+            if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0)
+                continue;
+            // left over .tmp files of interrupted backups are not referenced either
+            if (parse_key(sub->d_name, de->d_name, digest) == 0 &&
+                    bsearch(digest, set.digests, set.count, SHA256_DIGEST_SIZE, compare_digests) != NULL)
+                continue;
+            snprintf(path, sizeof(path), "%s/%s", dir, de->d_name);
+            if (lstat(path, &st) == 0 && S_ISREG(st.st_mode) && unlink(path) == 0)
+                freed += st.st_size;
+        }
+        closedir(d);
+        rmdir(dir);
+    }
+    closedir(store);
+    free(set.digests);
+    return freed;
+}
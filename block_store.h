@@ -0,0 +1,35 @@
+/*
+    Block level incremental backups of ext4 and f2fs partitions
+*/
+
+#ifndef _BLOCK_STORE_H
+#define _BLOCK_STORE_H
+
+#include <stdint.h>
+
+// only the blocks the filesystem marks as in use (ext4 block bitmaps,
+// f2fs SIT) are read. They are grouped by 1MB extents of the partition,
+// and each extent is stored once in a store shared by all backups, named
+// after the sha256 of its content: unchanged extents are not copied again
+typedef struct {
+    unsigned long long size;        // bytes of the filesystem
+    unsigned long long used;        // bytes of the in use blocks
+    unsigned long long written;     // bytes added to the store
+} BlockStoreStats;
+
+// called after each extent, done and total are in bytes of in use blocks
+typedef void (*block_store_progress)(unsigned long long done, unsigned long long total);
+
+// the device must not be mounted. Returns 0 on success
+int block_store_backup(const char* device, const char* manifest_file, const char* store_dir,
+                       block_store_progress progress, BlockStoreStats* stats);
+
+// all extents are checked in the store before the device is written
+int block_store_restore(const char* manifest_file, const char* store_dir, const char* device,
+                        block_store_progress progress, BlockStoreStats* stats);
+
+// delete the extents no .blk manifest below backup_dir refers to
+// returns the number of freed bytes, or -1 on error
+long long block_store_gc(const char* store_dir, const char* backup_dir);
+
+#endif // _BLOCK_STORE_H
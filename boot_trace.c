@@ -0,0 +1,89 @@
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "common.h"
+#include "boot_trace.h"
+
+#define BOOT_TRACE_MAX  32
+
+typedef struct {
+    const char* phase;
+    long long start;
+    long long end;
+    int tid;
+} BootTracePhase;
+
+static BootTracePhase phases[BOOT_TRACE_MAX];
+static int phase_count = 0;
+static int dumped = 0;
+static long long t0 = 0;
+static pthread_mutex_t boot_trace_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static long long boot_trace_now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+void boot_trace_init() {
+    t0 = boot_trace_now();
+}
+
+// returns the phase id for boot_trace_end(), -1 if not traced
+int boot_trace_begin(const char* phase) {
+    int id = -1;
+    pthread_mutex_lock(&boot_trace_lock);
+    if (!dumped && phase_count < BOOT_TRACE_MAX) {
+        id = phase_count++;
+        phases[id].phase = phase;
+        phases[id].start = boot_trace_now() - t0;
+        phases[id].end = -1;
+        phases[id].tid = gettid();
+    }
+    pthread_mutex_unlock(&boot_trace_lock);
+    return id;
+}
+
+void boot_trace_end(int id) {
+    if (id < 0)
+        return;
+    pthread_mutex_lock(&boot_trace_lock);
+    phases[id].end = boot_trace_now() - t0;
+    pthread_mutex_unlock(&boot_trace_lock);
+}
+
+void boot_trace_dump(const char* reached) {
+    pthread_mutex_lock(&boot_trace_lock);
+    if (dumped) {
+        pthread_mutex_unlock(&boot_trace_lock);
+        return;
+    }
+    dumped = 1;
+
+    long long now = boot_trace_now();
+    FILE* fp = fopen(BOOT_TRACE_FILE, "w");
+    if (fp != NULL)
+        fprintf(fp, "# phase start_ms end_ms tid (t0 = %lld ms since boot)\n", t0);
+
+    int i;
+    for (i = 0; i < phase_count; ++i) {
+        BootTracePhase* p = &phases[i];
+        if (p->end < 0) {
+            LOGI("boot: %-20s %5lld ms  (still running)\n", p->phase, p->start);
+        } else {
+            LOGI("boot: %-20s %5lld ms  +%lld ms\n", p->phase, p->start, p->end - p->start);
+        }
+        if (fp != NULL)
+            fprintf(fp, "%s %lld %lld %d\n", p->phase, p->start, p->end, p->tid);
+    }
+
+    LOGI("boot: %s after %lld ms\n", reached, now - t0);
+    if (fp != NULL) {
+        fprintf(fp, "%s %lld %lld %d\n", reached, now - t0, now - t0, gettid());
+        fclose(fp);
+    }
+    pthread_mutex_unlock(&boot_trace_lock);
+}
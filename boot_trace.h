@@ -0,0 +1,19 @@
+/*
+    Recovery start up timing
+*/
+
+#ifndef _BOOT_TRACE_H
+#define _BOOT_TRACE_H
+
+// one line per start up phase: "<phase> <start ms> <end ms> <tid>"
+// times are CLOCK_MONOTONIC milliseconds since boot_trace_init()
+#define BOOT_TRACE_FILE     "/tmp/recovery_boot_trace.txt"
+
+void boot_trace_init();
+int boot_trace_begin(const char* phase);
+void boot_trace_end(int id);
+
+// log the phases and write BOOT_TRACE_FILE: only the first call does it
+void boot_trace_dump(const char* reached);
+
+#endif // _BOOT_TRACE_H
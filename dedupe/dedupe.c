@@ -20,15 +20,74 @@
 #include <unistd.h>
 #include <paths.h>
 #include <sys/wait.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <zlib.h>
 
 #include <selinux/selinux.h>
 
-#define DEDUPE_VERSION 2
+#define DEDUPE_VERSION 3
 #define ARRAY_CAPACITY 1000
+#define COPY_BUFFER_SIZE (1024 * 1024)
+#define DEDUPE_WORKERS 4
+
+// blobs are stored raw, or compressed under a name with the codec suffix
+#define BLOB_CODEC_MASK 0x0f
+#define BLOB_CODEC_NONE 0
+#define BLOB_CODEC_ZLIB 1
+#define BLOB_CODEC_COUNT 2
+
+// smaller files would hardly save a filesystem block
+#define COMPRESS_MIN_SIZE 4096
+// the first block of a file decides whether it is worth compressing
+#define COMPRESS_SAMPLE_SIZE (64 * 1024)
+#define COMPRESS_MIN_GAIN 10
+
+#ifndef FICLONE
+#define FICLONE _IOW(0x94, 9, int)
+#endif
+
+// copy from the current offsets until end of file, in the kernel when possible
+static int copy_fd(int srcfd, int dstfd, off_t size) {
+    ssize_t bytes_read, bytes_written;
+#ifdef __NR_copy_file_range
+    ssize_t ret;
+    while ((ret = syscall(__NR_copy_file_range, srcfd, NULL, dstfd, NULL, COPY_BUFFER_SIZE, 0)) > 0)
+        ;
+    if (ret == 0)
+        return 0;
+    if (errno != ENOSYS && errno != EXDEV && errno != EINVAL && errno != EOPNOTSUPP)
+        return 5;
+#endif
+
+    size_t bufsize = size < COPY_BUFFER_SIZE ? (size > 4096 ? size : 4096) : COPY_BUFFER_SIZE;
+    char *buf = malloc(bufsize);
+    if (buf == NULL)
+        return 5;
+    while ((bytes_read = read(srcfd, buf, bufsize)) > 0) {
+        char *p = buf;
+        while (bytes_read > 0) {
+            bytes_written = write(dstfd, p, bytes_read);
+            if (bytes_written <= 0) {
+                free(buf);
+                return 5;
+            }
+            p += bytes_written;
+            bytes_read -= bytes_written;
+        }
+    }
+    free(buf);
+    return bytes_read < 0 ? 5 : 0;
+}
 
-static int copy_file(const char *src, const char *dst) {
-    char buf[4096];
-    int dstfd, srcfd, bytes_read, bytes_written, total_read = 0;
+// reflink is a shared flag: try to clone the blob extents first, and give
+// up cloning for good the first time the filesystem does not support it
+static int copy_file(const char *src, const char *dst, int *reflink) {
+    int dstfd, srcfd, ret;
+    struct stat st;
     if (src == NULL)
         return 1;
     if (dst == NULL)
@@ -38,33 +97,519 @@ static int copy_file(const char *src, const char *dst) {
     if (srcfd < 0)
         return 3;
 
-    dstfd = open(dst, O_RDWR | O_CREAT | O_TRUNC, 0666);
+    dstfd = open(dst, O_WRONLY | O_CREAT | O_TRUNC, 0666);
     if (dstfd < 0) {
         close(srcfd);
         return 4;
     }
 
-    while (bytes_read = read(srcfd, buf, 4096)) {
-        total_read += bytes_read;
-        if (write(dstfd, buf, bytes_read) != bytes_read)
-            return 5;
+    ret = 0;
+    if (reflink != NULL && *reflink && ioctl(dstfd, FICLONE, srcfd) == 0)
+        goto out;
+    if (reflink != NULL && *reflink && errno != EINTR && errno != ENOSPC)
+        *reflink = 0;
+
+    if (fstat(srcfd, &st) != 0)
+        st.st_size = COPY_BUFFER_SIZE;
+    ret = copy_fd(srcfd, dstfd, st.st_size);
+
+out:
+    if (close(dstfd) != 0 && ret == 0)
+        ret = 5;
+    close(srcfd);
+
+    return ret;
+}
+
+static const char *blob_suffix[BLOB_CODEC_COUNT] = { "", ".z" };
+
+// signatures of the formats that are already compressed: archives, apks, media
+static const struct {
+    int offset;
+    int len;
+    const char *magic;
+} compressed_magics[] = {
+    { 0, 4, "PK\x03\x04" },             // zip, apk, jar
+    { 0, 2, "\x1f\x8b" },               // gzip
+    { 0, 3, "BZh" },                    // bzip2
+    { 0, 6, "\xfd" "7zXZ\x00" },        // xz
+    { 0, 6, "7z\xbc\xaf\x27\x1c" },     // 7z
+    { 0, 4, "\x28\xb5\x2f\xfd" },       // zstd
+    { 0, 4, "\x04\x22\x4d\x18" },       // lz4
+    { 0, 3, "\xff\xd8\xff" },           // jpeg
+    { 0, 8, "\x89PNG\r\n\x1a\n" },      // png
+    { 0, 4, "GIF8" },                   // gif
+    { 8, 4, "WEBP" },                   // webp
+    { 4, 4, "ftyp" },                   // mp4, 3gp, m4a
+    { 0, 4, "\x1a\x45\xdf\xa3" },       // mkv, webm
+    { 0, 4, "OggS" },                   // ogg, opus
+    { 0, 3, "ID3" },                    // mp3
+};
+
+static int is_compressible(const unsigned char *sample, size_t len) {
+    size_t i;
+    for (i = 0; i < sizeof(compressed_magics) / sizeof(compressed_magics[0]); i++) {
+        if (len >= (size_t)(compressed_magics[i].offset + compressed_magics[i].len) &&
+                memcmp(sample + compressed_magics[i].offset, compressed_magics[i].magic, compressed_magics[i].len) == 0)
+            return 0;
+    }
+
+    // unknown format: try the fastest level on the sample
+    uLongf out_len = compressBound(len);
+    unsigned char *out = malloc(out_len);
+    if (out == NULL)
+        return 0;
+    int ret = compress2(out, &out_len, sample, len, 1) == Z_OK &&
+              out_len * 100 <= len * (100 - COMPRESS_MIN_GAIN);
+    free(out);
+    return ret;
+}
+
+// returns -1 when the file does not compress, so that it is stored raw
+static int compress_file(const char *src, const char *dst, int level) {
+    unsigned char *in, *out;
+    int dstfd, srcfd, ret = 0, flush;
+    ssize_t len;
+    z_stream z;
+
+    srcfd = open(src, O_RDONLY);
+    if (srcfd < 0)
+        return 3;
+
+    in = malloc(COMPRESS_SAMPLE_SIZE);
+    out = malloc(COMPRESS_SAMPLE_SIZE);
+    if (in == NULL || out == NULL) {
+        free(in);
+        free(out);
+        close(srcfd);
+        return 5;
+    }
+
+    len = read(srcfd, in, COMPRESS_SAMPLE_SIZE);
+    if (len < 0 || !is_compressible(in, len)) {
+        free(in);
+        free(out);
+        close(srcfd);
+        return len < 0 ? 5 : -1;
+    }
+
+    dstfd = open(dst, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (dstfd < 0) {
+        free(in);
+        free(out);
+        close(srcfd);
+        return 4;
     }
 
-    close(dstfd);
+    memset(&z, 0, sizeof(z));
+    if (deflateInit(&z, level) != Z_OK) {
+        ret = 5;
+        goto out;
+    }
+    do {
+        flush = len < COMPRESS_SAMPLE_SIZE ? Z_FINISH : Z_NO_FLUSH;
+        z.next_in = in;
+        z.avail_in = len;
+        do {
+            z.next_out = out;
+            z.avail_out = COMPRESS_SAMPLE_SIZE;
+            deflate(&z, flush);
+            size_t have = COMPRESS_SAMPLE_SIZE - z.avail_out;
+            if (have && write(dstfd, out, have) != (ssize_t)have) {
+                ret = 5;
+                break;
+            }
+        } while (z.avail_out == 0);
+        if (ret || flush == Z_FINISH)
+            break;
+        len = read(srcfd, in, COMPRESS_SAMPLE_SIZE);
+        if (len < 0)
+            ret = 5;
+    } while (!ret);
+    deflateEnd(&z);
+
+out:
+    if (close(dstfd) != 0 && ret == 0)
+        ret = 5;
     close(srcfd);
+    free(in);
+    free(out);
+    return ret;
+}
 
-    return 0;
+static int decompress_file(const char *src, const char *dst) {
+    unsigned char *in, *out;
+    int dstfd, srcfd, ret = 0, zret = Z_OK;
+    ssize_t len;
+    z_stream z;
+
+    srcfd = open(src, O_RDONLY);
+    if (srcfd < 0)
+        return 3;
+
+    dstfd = open(dst, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (dstfd < 0) {
+        close(srcfd);
+        return 4;
+    }
+
+    in = malloc(COMPRESS_SAMPLE_SIZE);
+    out = malloc(COPY_BUFFER_SIZE);
+    memset(&z, 0, sizeof(z));
+    if (in == NULL || out == NULL || inflateInit(&z) != Z_OK) {
+        ret = 5;
+        goto out;
+    }
+    while (zret != Z_STREAM_END && (len = read(srcfd, in, COMPRESS_SAMPLE_SIZE)) > 0) {
+        z.next_in = in;
+        z.avail_in = len;
+        do {
+            z.next_out = out;
+            z.avail_out = COPY_BUFFER_SIZE;
+            zret = inflate(&z, Z_NO_FLUSH);
+            if (zret != Z_OK && zret != Z_STREAM_END) {
+                ret = 5;
+                break;
+            }
+            size_t have = COPY_BUFFER_SIZE - z.avail_out;
+            if (have && write(dstfd, out, have) != (ssize_t)have) {
+                ret = 5;
+                break;
+            }
+        } while (zret != Z_STREAM_END && (z.avail_in != 0 || z.avail_out == 0));
+        if (ret)
+            break;
+    }
+    if (zret != Z_STREAM_END)
+        ret = 5;
+    inflateEnd(&z);
+
+out:
+    if (close(dstfd) != 0 && ret == 0)
+        ret = 5;
+    close(srcfd);
+    free(in);
+    free(out);
+    return ret;
 }
 
+// run the worker function on DEDUPE_WORKERS threads, or on this one if none can be started
+static void run_workers(void* (*worker)(void*), void *arg) {
+    pthread_t workers[DEDUPE_WORKERS];
+    int nworkers = 0;
+    int i;
+
+    while (nworkers < DEDUPE_WORKERS &&
+            pthread_create(&workers[nworkers], NULL, worker, arg) == 0) {
+        nworkers++;
+    }
+    if (nworkers == 0)
+        worker(arg);
+    for (i = 0; i < nworkers; i++) {
+        pthread_join(workers[i], NULL);
+    }
+}
+
+/*
+ * Manifests up to version 2 are tab separated text, one line per entry.
+ * Version 3 manifests are binary, in the native byte order:
+ *
+ *   header | records | digests | strings
+ *
+ * Records have a fixed size and refer to the paths, selabels and link
+ * targets by their offset in a string table where each string is stored
+ * once, and to the blobs by their index in a table of unique raw sha256
+ * digests. A manifest can thus be mapped and iterated without parsing;
+ * gc walks the file records, whose flags hold the codec that names each
+ * blob, without touching the strings. The header starts with the same
+ * "dedupe\t<version>\n" line as the text manifests, so that the previous
+ * versions reject it as a newer manifest. A manifest may be gzipped.
+ */
+#define DEDUPE_MAGIC "dedupe\t3\n"
+#define DIGEST_SIZE SHA256_DIGEST_LENGTH
+
+struct DEDUPE_HEADER {
+    char magic[16];
+    uint32_t version;
+    uint32_t record_size;
+    uint32_t record_count;
+    uint32_t digest_count;
+    uint32_t strings_size;
+    uint32_t reserved;
+    uint64_t records_offset;
+    uint64_t digests_offset;
+    uint64_t strings_offset;
+};
+
+struct DEDUPE_RECORD {
+    uint8_t type;       // 'f', 'd' or 'l'
+    uint8_t flags;
+    uint16_t reserved;
+    uint32_t mode;
+    uint32_t uid;
+    uint32_t gid;
+    uint32_t path;      // offsets in the string table
+    uint32_t selabel;
+    uint32_t target;    // digest index for files, link target offset for links
+    uint32_t reserved2;
+    int64_t atime;
+    int64_t mtime;
+    int64_t ctime;
+    uint64_t size;      // original size, whatever the blob codec in flags
+};
+
+// open addressing hash index of the strings or digests already in a table
+struct DEDUPE_INDEX_SLOT {
+    uint32_t hash;
+    uint32_t value;     // table offset or index + 1, 0 when the slot is free
+};
+
+struct DEDUPE_INDEX {
+    struct DEDUPE_INDEX_SLOT *slots;
+    uint32_t size;
+    uint32_t count;
+};
+
+struct DEDUPE_MANIFEST {
+    int version;
+    struct DEDUPE_RECORD *records;
+    uint32_t record_count;
+    unsigned char *digests;
+    uint32_t digest_count;
+    char *strings;
+    uint32_t strings_size;
+
+    // a loaded v3 manifest: the tables point into the mapped or inflated data
+    void *data;
+    size_t data_size;
+    int mapped;
+
+    // a built manifest: the tables are allocated
+    uint32_t record_cap;
+    uint32_t digest_cap;
+    uint32_t strings_cap;
+    struct DEDUPE_INDEX strings_index;
+    struct DEDUPE_INDEX digests_index;
+};
+
+static uint32_t fnv1a(const void *data, size_t len) {
+    const unsigned char *p = data;
+    uint32_t h = 2166136261U;
+    while (len--) {
+        h ^= *p++;
+        h *= 16777619U;
+    }
+    return h;
+}
+
+// make room for one more entry, keeping the load under one half
+static void index_reserve(struct DEDUPE_INDEX *index) {
+    if ((index->count + 1) * 2 <= index->size)
+        return;
+
+    uint32_t size = index->size ? index->size * 2 : 1024;
+    struct DEDUPE_INDEX_SLOT *slots = calloc(size, sizeof(*slots));
+    assert(slots != NULL);
+    uint32_t i;
+    for (i = 0; i < index->size; i++) {
+        if (index->slots[i].value) {
+            uint32_t j = index->slots[i].hash & (size - 1);
+            while (slots[j].value)
+                j = (j + 1) & (size - 1);
+            slots[j] = index->slots[i];
+        }
+    }
+    free(index->slots);
+    index->slots = slots;
+    index->size = size;
+}
+
+static void* table_reserve(void *table, uint32_t *cap, uint32_t needed, size_t unit) {
+    if (needed <= *cap)
+        return table;
+    while (*cap < needed)
+        *cap = *cap ? *cap * 2 : 1024;
+    table = realloc(table, (size_t)*cap * unit);
+    assert(table != NULL);
+    return table;
+}
+
+static uint32_t manifest_add_string(struct DEDUPE_MANIFEST *m, const char *str) {
+    size_t len = strlen(str) + 1;
+    uint32_t hash = fnv1a(str, len);
+    uint32_t i;
+
+    index_reserve(&m->strings_index);
+    for (i = hash & (m->strings_index.size - 1); m->strings_index.slots[i].value; i = (i + 1) & (m->strings_index.size - 1)) {
+        struct DEDUPE_INDEX_SLOT *slot = &m->strings_index.slots[i];
+        if (slot->hash == hash && strcmp(m->strings + slot->value - 1, str) == 0)
+            return slot->value - 1;
+    }
+
+    uint32_t offset = m->strings_size;
+    m->strings = table_reserve(m->strings, &m->strings_cap, offset + len, 1);
+    memcpy(m->strings + offset, str, len);
+    m->strings_size += len;
+    m->strings_index.slots[i].hash = hash;
+    m->strings_index.slots[i].value = offset + 1;
+    m->strings_index.count++;
+    return offset;
+}
+
+static uint32_t manifest_add_digest(struct DEDUPE_MANIFEST *m, const unsigned char *digest) {
+    uint32_t hash = fnv1a(digest, DIGEST_SIZE);
+    uint32_t i;
+
+    index_reserve(&m->digests_index);
+    for (i = hash & (m->digests_index.size - 1); m->digests_index.slots[i].value; i = (i + 1) & (m->digests_index.size - 1)) {
+        struct DEDUPE_INDEX_SLOT *slot = &m->digests_index.slots[i];
+        if (slot->hash == hash && memcmp(m->digests + (size_t)(slot->value - 1) * DIGEST_SIZE, digest, DIGEST_SIZE) == 0)
+            return slot->value - 1;
+    }
+
+    uint32_t n = m->digest_count;
+    m->digests = table_reserve(m->digests, &m->digest_cap, n + 1, DIGEST_SIZE);
+    memcpy(m->digests + (size_t)n * DIGEST_SIZE, digest, DIGEST_SIZE);
+    m->digest_count++;
+    m->digests_index.slots[i].hash = hash;
+    m->digests_index.slots[i].value = n + 1;
+    m->digests_index.count++;
+    return n;
+}
+
+// the record stays valid until the next one is added
+static struct DEDUPE_RECORD* manifest_add_record(struct DEDUPE_MANIFEST *m, char type, int mode, int uid, int gid,
+                                                 long atime, long mtime, long ctime, const char *path, const char *selabel) {
+    uint32_t path_offset = manifest_add_string(m, path);
+    uint32_t selabel_offset = manifest_add_string(m, selabel);
+    m->records = table_reserve(m->records, &m->record_cap, m->record_count + 1, sizeof(struct DEDUPE_RECORD));
+    struct DEDUPE_RECORD *r = &m->records[m->record_count++];
+    memset(r, 0, sizeof(*r));
+    r->type = type;
+    r->mode = mode;
+    r->uid = uid;
+    r->gid = gid;
+    r->path = path_offset;
+    r->selabel = selabel_offset;
+    r->atime = atime;
+    r->mtime = mtime;
+    r->ctime = ctime;
+    return r;
+}
+
+static void manifest_free(struct DEDUPE_MANIFEST *m) {
+    if (m->data != NULL) {
+        if (m->mapped)
+            munmap(m->data, m->data_size);
+        else
+            free(m->data);
+    }
+    else {
+        free(m->records);
+        free(m->digests);
+        free(m->strings);
+    }
+    free(m->strings_index.slots);
+    free(m->digests_index.slots);
+    memset(m, 0, sizeof(*m));
+}
+
+static int write_all(FILE *f, gzFile gz, const void *buf, size_t len) {
+    if (len == 0)
+        return 0;
+    if (gz != NULL)
+        return gzwrite(gz, buf, len) == (int)len ? 0 : -1;
+    return fwrite(buf, 1, len, f) == len ? 0 : -1;
+}
+
+// the manifest is gzipped when its name ends with .gz, fd is closed
+static int manifest_write(struct DEDUPE_MANIFEST *m, int fd, const char *filename) {
+    struct DEDUPE_HEADER header;
+    size_t records_size = (size_t)m->record_count * sizeof(struct DEDUPE_RECORD);
+    size_t digests_size = (size_t)m->digest_count * DIGEST_SIZE;
+    size_t len = strlen(filename);
+    FILE *f = NULL;
+    gzFile gz = NULL;
+    int ret;
+
+    memset(&header, 0, sizeof(header));
+    strcpy(header.magic, DEDUPE_MAGIC);
+    header.version = DEDUPE_VERSION;
+    header.record_size = sizeof(struct DEDUPE_RECORD);
+    header.record_count = m->record_count;
+    header.digest_count = m->digest_count;
+    header.strings_size = m->strings_size;
+    header.records_offset = sizeof(header);
+    header.digests_offset = header.records_offset + records_size;
+    header.strings_offset = header.digests_offset + digests_size;
+
+    if (len > 3 && strcmp(filename + len - 3, ".gz") == 0)
+        gz = gzdopen(fd, "wb");
+    else
+        f = fdopen(fd, "wb");
+    if (gz == NULL && f == NULL) {
+        fprintf(stderr, "Unable to open output file %s\n", filename);
+        close(fd);
+        return 1;
+    }
+
+    ret = write_all(f, gz, &header, sizeof(header)) ||
+          write_all(f, gz, m->records, records_size) ||
+          write_all(f, gz, m->digests, digests_size) ||
+          write_all(f, gz, m->strings, m->strings_size);
+    if (gz != NULL) {
+        if (gzclose(gz) != Z_OK)
+            ret = 1;
+    }
+    else if (fclose(f) != 0) {
+        ret = 1;
+    }
+    if (ret)
+        fprintf(stderr, "Error writing manifest %s\n", filename);
+    return ret;
+}
+
+// if a hash is abcdefg,
+// the output blob name is abc/defg
+// this is to get around vfat having a 64k directory size limit (usually around 20k files)
+static void blob_key(const unsigned char *digest, char *key) {
+    static const char hex[] = "0123456789abcdef";
+    int i, j = 0;
+    for (i = 0; i < DIGEST_SIZE; i++) {
+        key[j++] = hex[digest[i] >> 4];
+        if (j == 3)
+            key[j++] = '/';
+        key[j++] = hex[digest[i] & 0xf];
+        if (j == 3)
+            key[j++] = '/';
+    }
+    key[j] = '\0';
+}
+
+// files found by the walk, hashed and stored by the workers
+struct DEDUPE_STORE_JOB {
+    uint32_t record;
+    uint32_t codec;
+    off_t size;
+    char *path;
+    unsigned char digest[DIGEST_SIZE];
+};
+
 typedef struct DEDUPE_STORE_CONTEXT {
     char blob_dir[PATH_MAX];
-    FILE *output_manifest;
+    struct DEDUPE_MANIFEST manifest;
     const char** excludes;
     int exclude_count;
+    int compression;
+    struct DEDUPE_STORE_JOB *jobs;
+    uint32_t job_count;
+    uint32_t job_cap;
+    int next_job;
+    int error;
 };
 
 static void usage(char** argv) {
-    fprintf(stderr, "usage: %s c input_directory blob_dir output_manifest [exclude...]\n", argv[0]);
+    fprintf(stderr, "usage: %s c [-z level] input_directory blob_dir output_manifest [exclude...]\n", argv[0]);
     fprintf(stderr, "usage: %s x input_manifest blob_dir output_directory\n", argv[0]);
     fprintf(stderr, "usage: %s gc blob_dir input_manifests...\n", argv[0]);
 }
@@ -98,74 +643,117 @@ static int do_sha256sum_file(const char* filename, unsigned char *rptr) {
 
 static int store_st(struct DEDUPE_STORE_CONTEXT *context, struct stat st, const char* s);
 
-void print_stat(struct DEDUPE_STORE_CONTEXT *context, char type, struct stat st, char *selabel, const char *f) {
-    fprintf(context->output_manifest, "%c\t%o\t%lu\t%lu\t%s\t%lu\t%lu\t%lu\t%s\t", type, st.st_mode & (S_IRWXU | S_IRWXG | S_IRWXO | S_ISUID | S_ISGID), st.st_uid, st.st_gid, selabel, st.st_atime, st.st_mtime, st.st_ctime, f);
+static void add_stat(struct DEDUPE_STORE_CONTEXT *context, char type, struct stat st, char *selabel, const char *f) {
+    manifest_add_record(&context->manifest, type, st.st_mode & (S_IRWXU | S_IRWXG | S_IRWXO | S_ISUID | S_ISGID), st.st_uid, st.st_gid, st.st_atime, st.st_mtime, st.st_ctime, f, selabel);
 }
 
 static int store_file(struct DEDUPE_STORE_CONTEXT *context, struct stat st, const char* f) {
+    context->jobs = table_reserve(context->jobs, &context->job_cap, context->job_count + 1, sizeof(struct DEDUPE_STORE_JOB));
+    struct DEDUPE_STORE_JOB *job = &context->jobs[context->job_count++];
+    job->record = context->manifest.record_count - 1;
+    job->codec = BLOB_CODEC_NONE;
+    job->size = st.st_size;
+    job->path = strdup(f);
+    assert(job->path != NULL);
+    return 0;
+}
+
+static int store_blob(struct DEDUPE_STORE_CONTEXT *context, struct DEDUPE_STORE_JOB *job, int n) {
+    const char *f = job->path;
     printf("%s\n", f);
-    unsigned char sumdata[SHA256_DIGEST_LENGTH];
     int ret;
-    if (ret = do_sha256sum_file(f, sumdata)) {
+    if (ret = do_sha256sum_file(f, job->digest)) {
         fprintf(stderr, "Error calculating sha256sum of %s\n", f);
         return ret;
     }
-    char psum[128];
-    int j;
-    for (j = 0; j < SHA256_DIGEST_LENGTH; j++)
-        sprintf(&psum[(j*2)], "%02x", (int)sumdata[j]);
-    psum[(SHA256_DIGEST_LENGTH * 2)] = '\0';
 
-    // if a hash is abcdefg,
-    // the output blob name is abc/defg
-    // this is to get around vfat having a 64k directory size limit (usually around 20k files)
     char out_blob[PATH_MAX];
+    char out_zblob[PATH_MAX];
     char tmp_out_blob[PATH_MAX];
     char key[SHA256_DIGEST_LENGTH * 2 + 2];
-    // int i = 0;
-    // int keyIndex = 0;
-    // while (psum[i]) {
-    //     key[keyIndex] = psum[i];
-    //     i++;
-    //     keyIndex++;
-    //     if (i % 2 == 0 && psum[i]) {
-    //         key[keyIndex] = '/';
-    //         keyIndex++;
-    //     }
-    // }
-    strcpy(key, psum);
-    key[3] = '/';
-    key[4] = NULL;
-    strcat(key, psum + 3);
+    blob_key(job->digest, key);
     sprintf(out_blob, "%s/%s", context->blob_dir, key);
-    sprintf(tmp_out_blob, "%s.tmp", out_blob);
+    sprintf(out_zblob, "%s%s", out_blob, blob_suffix[BLOB_CODEC_ZLIB]);
+    // several workers may store the same content at once
+    sprintf(tmp_out_blob, "%s.tmp%d", out_blob, n);
     //when BUILD_HOST_EXECUTABLE, dirname(out_blob) will change out_blob
     char out_blob_dir[PATH_MAX];
     strcpy(out_blob_dir, out_blob);
     mkdir(dirname(out_blob_dir), S_IRWXU | S_IRWXG | S_IRWXO);
 
     // don't copy the file if it exists? not quite sure how I feel about this.
-    int size = (int)st.st_size;
     struct stat file_info;
     // verify the file exists and is of the same size
-    int file_ok = stat(out_blob, &file_info) == 0;
-    if (file_ok) {
-        int existing_size = file_info.st_size;
-        if (existing_size != size)
-            file_ok = 0;
-    }
-    if (!file_ok) {
-        // copy to the tmp file
-        if ((ret = copy_file(f, tmp_out_blob)) || (ret = rename(tmp_out_blob, out_blob))) {
-            fprintf(stderr, "Error copying blob %s\n", f);
+    if (stat(out_blob, &file_info) == 0 && file_info.st_size == job->size) {
+        job->codec = BLOB_CODEC_NONE;
+        return 0;
+    }
+    // compressed blobs are renamed in place once complete
+    if (stat(out_zblob, &file_info) == 0) {
+        job->codec = BLOB_CODEC_ZLIB;
+        return 0;
+    }
+
+    if (context->compression && job->size >= COMPRESS_MIN_SIZE) {
+        ret = compress_file(f, tmp_out_blob, context->compression);
+        if (ret == 0 && (ret = rename(tmp_out_blob, out_zblob)) == 0) {
+            job->codec = BLOB_CODEC_ZLIB;
+            return 0;
+        }
+        if (ret > 0) {
+            fprintf(stderr, "Error compressing blob %s\n", f);
             return ret;
         }
     }
 
-    fprintf(context->output_manifest, "%s\t%d\t\n", key, size);
+    // copy to the tmp file
+    if ((ret = copy_file(f, tmp_out_blob, NULL)) || (ret = rename(tmp_out_blob, out_blob))) {
+        fprintf(stderr, "Error copying blob %s\n", f);
+        return ret;
+    }
+    job->codec = BLOB_CODEC_NONE;
     return 0;
 }
 
+static void* store_worker(void *arg) {
+    struct DEDUPE_STORE_CONTEXT *context = arg;
+    int i, ret;
+
+    while (!context->error) {
+        i = __sync_fetch_and_add(&context->next_job, 1);
+        if (i >= (int)context->job_count)
+            break;
+        if ((ret = store_blob(context, &context->jobs[i], i)))
+            __sync_bool_compare_and_swap(&context->error, 0, ret);
+    }
+    return NULL;
+}
+
+// hash and store the files found by the walk, then fill their records
+static int store_blobs(struct DEDUPE_STORE_CONTEXT *context) {
+    struct DEDUPE_MANIFEST *m = &context->manifest;
+    uint32_t i;
+
+    context->next_job = 0;
+    context->error = 0;
+    run_workers(store_worker, context);
+
+    for (i = 0; i < context->job_count; i++) {
+        struct DEDUPE_STORE_JOB *job = &context->jobs[i];
+        if (!context->error) {
+            uint32_t digest = manifest_add_digest(m, job->digest);
+            m->records[job->record].target = digest;
+            m->records[job->record].flags = job->codec;
+            m->records[job->record].size = job->size;
+        }
+        free(job->path);
+    }
+    free(context->jobs);
+    context->jobs = NULL;
+    context->job_count = context->job_cap = 0;
+    return context->error;
+}
+
 static int store_dir(struct DEDUPE_STORE_CONTEXT *context, struct stat st, const char* d) {
     char full_path[PATH_MAX];
     printf("%s\n", d);
@@ -215,7 +803,10 @@ static int store_link(struct DEDUPE_STORE_CONTEXT *context, struct stat st, cons
         return errno;
     }
     link[ret] = '\0';
-    fprintf(context->output_manifest, "%s\t\n", link);
+    struct DEDUPE_MANIFEST *m = &context->manifest;
+    uint32_t target = manifest_add_string(m, link);
+    m->records[m->record_count - 1].target = target;
+    m->records[m->record_count - 1].size = ret;
     return 0;
 }
 
@@ -226,18 +817,17 @@ static int store_st(struct DEDUPE_STORE_CONTEXT *context, struct stat st, const
         selabel = strdup("unlabel");
     }
     if (S_ISREG(st.st_mode)) {
-        print_stat(context, 'f', st, selabel, s);
+        add_stat(context, 'f', st, selabel, s);
         freecon(selabel);
         return store_file(context, st, s);
     }
     else if (S_ISDIR(st.st_mode)) {
-        print_stat(context, 'd', st, selabel, s);
-        fprintf(context->output_manifest, "\n");
+        add_stat(context, 'd', st, selabel, s);
         freecon(selabel);
         return store_dir(context, st, s);
     }
     else if (S_ISLNK(st.st_mode)) {
-        print_stat(context, 'l', st, selabel, s);
+        add_stat(context, 'l', st, selabel, s);
         freecon(selabel);
         return store_link(context, st, s);
     }
@@ -351,6 +941,381 @@ static void recursive_list_dir(char* d, struct array *arr) {
     closedir(dp);
 }
 
+static int hex_value(char c) {
+    if (c >= '0' && c <= '9')
+        return c - '0';
+    if (c >= 'a' && c <= 'f')
+        return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F')
+        return c - 'A' + 10;
+    return -1;
+}
+
+// blob key abc/defg... back to the raw digest
+static int parse_blob_key(const char *key, unsigned char *digest) {
+    int i = 0, hi = -1;
+    for (; *key; key++) {
+        if (*key == '/')
+            continue;
+        int v = hex_value(*key);
+        if (v < 0 || i == DIGEST_SIZE)
+            return -1;
+        if (hi < 0) {
+            hi = v;
+        }
+        else {
+            digest[i++] = (hi << 4) | v;
+            hi = -1;
+        }
+    }
+    return i == DIGEST_SIZE && hi < 0 ? 0 : -1;
+}
+
+// convert a version 1 or 2 text manifest into the version 3 tables
+static int manifest_parse_text(struct DEDUPE_MANIFEST *m, const char *data, size_t size, int version) {
+    const char *end = data + size;
+    char line[PATH_MAX];
+
+    while (data < end) {
+        const char *eol = memchr(data, '\n', end - data);
+        size_t len = (eol != NULL ? eol : end) - data;
+        if (len >= PATH_MAX)
+            len = PATH_MAX - 1;
+        memcpy(line, data, len);
+        line[len] = '\0';
+        data = eol != NULL ? eol + 1 : end;
+        if (len == 0)
+            continue;
+
+        char type[4];
+        char mode[8];
+        char uid[32];
+        char gid[32];
+        char selabel[PATH_MAX];
+        char at[32] = "0";
+        char mt[32] = "0";
+        char ct[32] = "0";
+        char filename[PATH_MAX];
+        char target[PATH_MAX];
+
+        char *token = line;
+        if ((token = tokenize(type, token, '\t')) == NULL ||
+                (token = tokenize(mode, token, '\t')) == NULL ||
+                (token = tokenize(uid, token, '\t')) == NULL ||
+                (token = tokenize(gid, token, '\t')) == NULL ||
+                (token = tokenize(selabel, token, '\t')) == NULL ||
+                (version >= 2 && ((token = tokenize(at, token, '\t')) == NULL ||
+                                  (token = tokenize(mt, token, '\t')) == NULL ||
+                                  (token = tokenize(ct, token, '\t')) == NULL)) ||
+                (token = tokenize(filename, token, '\t')) == NULL) {
+            fprintf(stderr, "Invalid manifest line: %s\n", line);
+            return 1;
+        }
+
+        if (strcmp(type, "f") != 0 && strcmp(type, "l") != 0 && strcmp(type, "d") != 0) {
+            fprintf(stderr, "Unknown type %s\n", type);
+            return 1;
+        }
+
+        manifest_add_record(m, type[0], dec_to_oct(atoi(mode)), atoi(uid), atoi(gid),
+                            atol(at), atol(mt), atol(ct), filename, selabel);
+        uint32_t n = m->record_count - 1;
+        if (type[0] == 'f') {
+            unsigned char digest[DIGEST_SIZE];
+            char sizeStr[32] = "0";
+            if ((token = tokenize(target, token, '\t')) == NULL || parse_blob_key(target, digest)) {
+                fprintf(stderr, "Invalid blob for %s\n", filename);
+                return 1;
+            }
+            tokenize(sizeStr, token, '\t');
+            uint32_t d = manifest_add_digest(m, digest);
+            m->records[n].target = d;
+            m->records[n].size = atoll(sizeStr);
+        }
+        else if (type[0] == 'l') {
+            if (tokenize(target, token, '\t') == NULL) {
+                fprintf(stderr, "Invalid link %s\n", filename);
+                return 1;
+            }
+            uint32_t t = manifest_add_string(m, target);
+            m->records[n].target = t;
+        }
+    }
+    return 0;
+}
+
+// 1 if [offset, offset + size) is within the manifest, whatever the offset
+static int manifest_table_fits(const struct DEDUPE_MANIFEST *m, uint64_t offset, uint64_t size) {
+    return offset <= m->data_size && size <= m->data_size - offset;
+}
+
+// point the tables into a version 3 manifest, after checking all the offsets
+static int manifest_map_tables(struct DEDUPE_MANIFEST *m) {
+    const struct DEDUPE_HEADER *h = m->data;
+    uint32_t i;
+
+    // the counts are 32 bits, so the table sizes can't overflow 64 bits
+    if (h->version != DEDUPE_VERSION || h->record_size != sizeof(struct DEDUPE_RECORD) ||
+            h->records_offset % 8 != 0 ||
+            !manifest_table_fits(m, h->records_offset,
+                                 (uint64_t)h->record_count * sizeof(struct DEDUPE_RECORD)) ||
+            !manifest_table_fits(m, h->digests_offset, (uint64_t)h->digest_count * DIGEST_SIZE) ||
+            !manifest_table_fits(m, h->strings_offset, h->strings_size))
+        return 1;
+
+    m->version = h->version;
+    m->records = (struct DEDUPE_RECORD*)((char*)m->data + h->records_offset);
+    m->record_count = h->record_count;
+    m->digests = (unsigned char*)m->data + h->digests_offset;
+    m->digest_count = h->digest_count;
+    m->strings = (char*)m->data + h->strings_offset;
+    m->strings_size = h->strings_size;
+
+    if (m->record_count == 0)
+        return 0;
+    if (m->strings_size == 0 || m->strings[m->strings_size - 1] != '\0')
+        return 1;
+    for (i = 0; i < m->record_count; i++) {
+        const struct DEDUPE_RECORD *r = &m->records[i];
+        if (r->path >= m->strings_size || r->selabel >= m->strings_size)
+            return 1;
+        if (r->type == 'f' && r->target >= m->digest_count)
+            return 1;
+        if (r->type == 'l' && r->target >= m->strings_size)
+            return 1;
+    }
+    return 0;
+}
+
+static void* gz_read_all(int fd, size_t *size) {
+    gzFile gz = gzdopen(fd, "rb");
+    size_t cap = 1 << 20, len = 0;
+    char *buf = malloc(cap);
+    int n;
+    if (gz == NULL || buf == NULL) {
+        if (gz != NULL)
+            gzclose(gz);
+        else
+            close(fd);
+        free(buf);
+        return NULL;
+    }
+    while ((n = gzread(gz, buf + len, cap - len)) > 0) {
+        len += n;
+        if (len == cap) {
+            char *tmp = realloc(buf, cap * 2);
+            if (tmp == NULL) {
+                n = -1;
+                break;
+            }
+            buf = tmp;
+            cap *= 2;
+        }
+    }
+    gzclose(gz);
+    if (n < 0) {
+        free(buf);
+        return NULL;
+    }
+    *size = len;
+    return buf;
+}
+
+// load a manifest of any version, gzipped or not
+static int manifest_load(struct DEDUPE_MANIFEST *m, const char *filename) {
+    unsigned char magic[2] = { 0, 0 };
+    struct stat st;
+    int fd, ret;
+
+    memset(m, 0, sizeof(*m));
+    fd = open(filename, O_RDONLY);
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        fprintf(stderr, "Unable to open input manifest %s\n", filename);
+        if (fd >= 0)
+            close(fd);
+        return 1;
+    }
+
+    if (pread(fd, magic, 2, 0) == 2 && magic[0] == 0x1f && magic[1] == 0x8b) {
+        // gz_read_all closes fd
+        m->data = gz_read_all(fd, &m->data_size);
+    }
+    else {
+        m->data_size = st.st_size;
+        if (m->data_size > 0) {
+            m->data = mmap(NULL, m->data_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (m->data == MAP_FAILED)
+                m->data = NULL;
+            else
+                m->mapped = 1;
+        }
+        close(fd);
+    }
+    if (m->data == NULL) {
+        fprintf(stderr, "Unable to read input manifest %s\n", filename);
+        m->data_size = 0;
+        return 1;
+    }
+
+    if (m->data_size >= sizeof(struct DEDUPE_HEADER) &&
+            memcmp(m->data, DEDUPE_MAGIC, sizeof(DEDUPE_MAGIC) - 1) == 0) {
+        if (manifest_map_tables(m)) {
+            fprintf(stderr, "Corrupted manifest %s\n", filename);
+            manifest_free(m);
+            return 1;
+        }
+        return 0;
+    }
+
+    // text manifest, the version line is missing in version 1
+    const char *data = m->data;
+    size_t size = m->data_size;
+    int version = 1;
+    if (size > 7 && memcmp(data, "dedupe\t", 7) == 0) {
+        version = atoi(data + 7);
+        const char *eol = memchr(data, '\n', size);
+        size = eol != NULL ? size - (eol + 1 - data) : 0;
+        data = eol != NULL ? eol + 1 : data + m->data_size;
+    }
+    if (version > DEDUPE_VERSION) {
+        fprintf(stderr, "Attempting to use newer dedupe file: %s\n", filename);
+        manifest_free(m);
+        return 1;
+    }
+
+    void *loaded = m->data;
+    size_t loaded_size = m->data_size;
+    int mapped = m->mapped;
+    m->data = NULL;
+    m->version = version;
+    ret = manifest_parse_text(m, data, size, version);
+    if (mapped)
+        munmap(loaded, loaded_size);
+    else
+        free(loaded);
+    if (ret)
+        manifest_free(m);
+    return ret;
+}
+
+struct DEDUPE_RESTORE_CONTEXT {
+    char blob_dir[PATH_MAX];
+    struct DEDUPE_MANIFEST *manifest;
+    struct array files;
+    int next_file;
+    int error;
+    int reflink;
+};
+
+// files are materialized by several workers, each one taking the next pending file
+static void* restore_worker(void *arg) {
+    struct DEDUPE_RESTORE_CONTEXT *context = arg;
+    struct DEDUPE_MANIFEST *m = context->manifest;
+    char blob_file[PATH_MAX];
+    char key[DIGEST_SIZE * 2 + 2];
+    int i, ret;
+
+    while (!context->error) {
+        i = __sync_fetch_and_add(&context->next_file, 1);
+        if (i >= context->files.size)
+            break;
+
+        const struct DEDUPE_RECORD *r = context->files.data[i];
+        const char *filename = m->strings + r->path;
+        int codec = r->flags & BLOB_CODEC_MASK;
+        printf("%s\n", filename);
+        if (codec >= BLOB_CODEC_COUNT) {
+            fprintf(stderr, "Unknown blob codec %d for %s\n", codec, filename);
+            __sync_bool_compare_and_swap(&context->error, 0, 1);
+            break;
+        }
+        blob_key(m->digests + (size_t)r->target * DIGEST_SIZE, key);
+        sprintf(blob_file, "%s/%s%s", context->blob_dir, key, blob_suffix[codec]);
+        if (codec == BLOB_CODEC_ZLIB)
+            ret = decompress_file(blob_file, filename);
+        else
+            ret = copy_file(blob_file, filename, &context->reflink);
+        if (ret) {
+            fprintf(stderr, "Unable to copy file %s\n", filename);
+            __sync_bool_compare_and_swap(&context->error, 0, ret);
+        }
+    }
+    return NULL;
+}
+
+static void restore_metadata(struct DEDUPE_MANIFEST *m, const struct DEDUPE_RECORD *r) {
+    const char *filename = m->strings + r->path;
+    if (r->type == 'l') {
+        // Android has no lchmod, and chmod follows symlinks
+        lchown(filename, r->uid, r->gid);
+    }
+    else {
+        chown(filename, r->uid, r->gid);
+        chmod(filename, r->mode);
+    }
+    if (lsetfilecon(filename, m->strings + r->selabel) < 0) {
+        fprintf(stderr, "Can't setfilecon %s\n", filename);
+    }
+    // utimes follows symlinks
+    if (m->version >= 2 && r->type != 'l') {
+        struct timeval times[2];
+        times[0].tv_sec = r->atime;
+        times[0].tv_usec = 0;
+        times[1].tv_sec = r->mtime;
+        times[1].tv_usec = 0;
+        utimes(filename, times);
+    }
+}
+
+// Restore in passes: the directories and links first, then the file
+// contents by DEDUPE_WORKERS threads, and last the ownership, modes,
+// labels and times, children before parents so that the directory
+// times are not changed by the restore itself.
+static int restore_entries(struct DEDUPE_MANIFEST *m, const char *blob_dir) {
+    struct DEDUPE_RESTORE_CONTEXT context;
+    struct stat blob_st, out_st;
+    int i;
+
+    strcpy(context.blob_dir, blob_dir);
+    context.manifest = m;
+    array_init(&context.files, m->record_count > 0 ? m->record_count : 1);
+    context.next_file = 0;
+    context.error = 0;
+    // cloning is only possible when the blobs are on the same filesystem
+    context.reflink = stat(blob_dir, &blob_st) == 0 && stat(".", &out_st) == 0 &&
+                      blob_st.st_dev == out_st.st_dev;
+
+    for (i = 0; i < (int)m->record_count; i++) {
+        struct DEDUPE_RECORD *r = &m->records[i];
+        if (r->type == 'd') {
+            printf("%s\n", m->strings + r->path);
+            mkdir(m->strings + r->path, S_IRWXU);
+        }
+        else if (r->type == 'l') {
+            printf("%s\n", m->strings + r->path);
+            symlink(m->strings + r->target, m->strings + r->path);
+        }
+        else if (r->type == 'f') {
+            array_add(&context.files, r);
+        }
+        else {
+            fprintf(stderr, "Unknown type %c\n", r->type);
+            array_free(&context.files, 0);
+            return 1;
+        }
+    }
+
+    run_workers(restore_worker, &context);
+    array_free(&context.files, 0);
+    if (context.error)
+        return context.error;
+
+    for (i = (int)m->record_count - 1; i >= 0; i--) {
+        restore_metadata(m, &m->records[i]);
+    }
+    return 0;
+}
+
 static int check_file(const char* f) {
     struct stat cst;
     return lstat(f, &cst);
@@ -363,6 +1328,18 @@ int dedupe_main(int argc, char** argv) {
     }
 
     if (strcmp(argv[1], "c") == 0) {
+        int compression = 0;
+        if (argc >= 4 && strcmp(argv[2], "-z") == 0) {
+            compression = atoi(argv[3]);
+            if (compression < 1 || compression > 9) {
+                fprintf(stderr, "Compression level must be between 1 and 9.\n");
+                return 1;
+            }
+            // drop the option so that the positional arguments stay in place
+            argv[3] = argv[1];
+            argv += 2;
+            argc -= 2;
+        }
         if (argc < 5) {
             usage(argv);
             return 1;
@@ -381,9 +1358,12 @@ int dedupe_main(int argc, char** argv) {
         }
 
         struct DEDUPE_STORE_CONTEXT context;
-        context.output_manifest = fopen(argv[4], "wb");
-        fprintf(context.output_manifest, "dedupe\t%d\n", DEDUPE_VERSION);
-        if (context.output_manifest == NULL) {
+        memset(&context, 0, sizeof(context));
+        context.compression = compression;
+        context.manifest.version = DEDUPE_VERSION;
+        // the manifest is only written once complete
+        int output_manifest = open(argv[4], O_WRONLY | O_CREAT | O_TRUNC, 0666);
+        if (output_manifest < 0) {
             fprintf(stderr, "Unable to open output file %s\n", argv[4]);
             return 1;
         }
@@ -393,7 +1373,15 @@ int dedupe_main(int argc, char** argv) {
         context.excludes = argv + 5;
         context.exclude_count = argc - 5;
 
-        return store_dir(&context, st, ".");
+        ret = store_dir(&context, st, ".");
+        if (ret == 0)
+            ret = store_blobs(&context);
+        if (ret == 0)
+            ret = manifest_write(&context.manifest, output_manifest, argv[4]);
+        else
+            close(output_manifest);
+        manifest_free(&context.manifest);
+        return ret;
     }
     else if (strcmp(argv[1], "x") == 0) {
         if (argc != 5) {
@@ -401,9 +1389,8 @@ int dedupe_main(int argc, char** argv) {
             return 1;
         }
 
-        FILE *input_manifest = fopen(argv[2], "rb");
-        if (input_manifest == NULL) {
-            fprintf(stderr, "Unable to open input manifest %s\n", argv[2]);
+        struct DEDUPE_MANIFEST manifest;
+        if (manifest_load(&manifest, argv[2])) {
             return 1;
         }
 
@@ -415,107 +1402,13 @@ int dedupe_main(int argc, char** argv) {
         mkdir(output_dir, S_IRWXU | S_IRWXG | S_IRWXO);
         if (chdir(output_dir)) {
             fprintf(stderr, "Unable to open output directory %s\n", output_dir);
+            manifest_free(&manifest);
             return 1;
         }
 
-        char line[PATH_MAX];
-        fgets(line, PATH_MAX, input_manifest);
-        int version = 1;
-        if (sscanf(line, "dedupe\t%d", &version) != 1) {
-            fseek(input_manifest, 0, SEEK_SET);
-        }
-        if (version > DEDUPE_VERSION) {
-            fprintf(stderr, "Attempting to restore newer dedupe file: %s\n", argv[2]);
-            return 1;
-        }
-        while (fgets(line, PATH_MAX, input_manifest)) {
-            //printf("%s", line);
-
-            char type[4];
-            char mode[8];
-            char uid[32];
-            char gid[32];
-            char selabel[PATH_MAX];
-            char at[32];
-            char mt[32];
-            char ct[32];
-            char filename[PATH_MAX];
-
-            char *token = line;
-            token = tokenize(type, token, '\t');
-            token = tokenize(mode, token, '\t');
-            token = tokenize(uid, token, '\t');
-            token = tokenize(gid, token, '\t');
-            token = tokenize(selabel, token, '\t');
-            if (version >= 2) {
-                token = tokenize(at, token, '\t');
-                token = tokenize(mt, token, '\t');
-                token = tokenize(ct, token, '\t');
-            }
-            token = tokenize(filename, token, '\t');
-
-            int mode_oct = dec_to_oct(atoi(mode));
-            int uid_int = atoi(uid);
-            int gid_int = atoi(gid);
-            int ret;
-            //printf("%s\t%s\t%s\t%s\t%s\t%s\t", type, mode, uid, gid, selabel, filename);
-            printf("%s\n", filename);
-            if (strcmp(type, "f") == 0) {
-                char sha256[128];
-                token = tokenize(sha256, token, '\t');
-                char sizeStr[32];
-                token = tokenize(sizeStr, token, '\t');
-                int size = atoi(sizeStr);
-                // printf("%s\t%d\n", sha256, size);
-
-                char blob_file[PATH_MAX];
-                sprintf(blob_file, "%s/%s", blob_dir, sha256);
-                if (ret = copy_file(blob_file, filename)) {
-                    fprintf(stderr, "Unable to copy file %s\n", filename);
-                    fclose(input_manifest);
-                    return ret;
-                }
-
-                chown(filename, uid_int, gid_int);
-                chmod(filename, mode_oct);
-            }
-            else if (strcmp(type, "l") == 0) {
-                char link[41];
-                token = tokenize(link, token, '\t');
-                // printf("%s\n", link);
-
-                symlink(link, filename);
-
-                // Android has no lchmod, and chmod follows symlinks
-                //chmod(filename, mode_oct);
-                lchown(filename, uid_int, gid_int);
-            }
-            else if (strcmp(type, "d") == 0) {
-                // printf("\n");
-
-                mkdir(filename, mode_oct);
-
-                chown(filename, uid_int, gid_int);
-                chmod(filename, mode_oct);
-            }
-            else {
-                fprintf(stderr, "Unknown type %s\n", type);
-                fclose(input_manifest);
-                return 1;
-            }
-            if (lsetfilecon(filename, selabel) < 0) {
-                fprintf(stderr, "Can't setfilecon %s\n", filename);
-            }
-            if (version >= 2) {
-                struct timeval times[2];
-                times[0].tv_sec = atol(at);
-                times[1].tv_sec = atol(mt);
-                utimes(filename, times);
-            }
-        }
-
-        fclose(input_manifest);
-        return 0;
+        int ret = restore_entries(&manifest, blob_dir);
+        manifest_free(&manifest);
+        return ret;
     }
     else if (strcmp(argv[1], "gc") == 0) {
         if (argc < 3) {
@@ -539,66 +1432,31 @@ int dedupe_main(int argc, char** argv) {
         int i;
         int failure = 0;
         for (i = 3; i < argc; i++) {
-            FILE *input_manifest = fopen(argv[i], "rb");
-            if (input_manifest == NULL) {
-                fprintf(stderr, "Unable to open input manifest %s\n", argv[i]);
+            struct DEDUPE_MANIFEST manifest;
+            if (manifest_load(&manifest, argv[i])) {
                 failure = 1;
                 goto out;
             }
 
-            char line[PATH_MAX];
-            fgets(line, PATH_MAX, input_manifest);
-            int version = 1;
-            if (sscanf(line, "dedupe\t%d", &version) != 1) {
-                fseek(input_manifest, 0, SEEK_SET);
-            }
-            if (version > DEDUPE_VERSION) {
-                fprintf(stderr, "Attempting to gc newer dedupe file: %s\n", argv[2]);
-                failure = 1;
-                fclose(input_manifest);
-                break;
-            }
-            while (fgets(line, PATH_MAX, input_manifest)) {
-                char type[4];
-                char mode[8];
-                char uid[32];
-                char gid[32];
-                char selabel[PATH_MAX];
-                char at[32];
-                char mt[32];
-                char ct[32];
-                char filename[PATH_MAX];
-
-                char *token = line;
-                token = tokenize(type, token, '\t');
-                token = tokenize(mode, token, '\t');
-                token = tokenize(uid, token, '\t');
-                token = tokenize(gid, token, '\t');
-                token = tokenize(selabel, token, '\t');
-                if (version >= 2) {
-                    token = tokenize(at, token, '\t');
-                    token = tokenize(mt, token, '\t');
-                    token = tokenize(ct, token, '\t');
-                }
-                token = tokenize(filename, token, '\t');
-
-                int mode_oct = dec_to_oct(atoi(mode));
-                int uid_int = atoi(uid);
-                int gid_int = atoi(gid);
-                int ret;
-                // printf("%s\n", filename);
-                if (strcmp(type, "f") == 0) {
-                    char key[128];
-                    token = tokenize(key, token, '\t');
-                    char sizeStr[32];
-                    token = tokenize(sizeStr, token, '\t');
-                    int size = atoi(sizeStr);
-
-                    sprintf(blob, "%s/%s", blob_dir, key);
-                    array_add(&used_files, strdup(blob));
+            // the record flags tell under which name each blob is stored
+            uint32_t r;
+            char key[DIGEST_SIZE * 2 + 2];
+            for (r = 0; r < manifest.record_count; r++) {
+                const struct DEDUPE_RECORD *record = &manifest.records[r];
+                int codec = record->flags & BLOB_CODEC_MASK;
+                if (record->type != 'f')
+                    continue;
+                if (codec >= BLOB_CODEC_COUNT) {
+                    fprintf(stderr, "Unknown blob codec %d in %s\n", codec, argv[i]);
+                    manifest_free(&manifest);
+                    failure = 1;
+                    goto out;
                 }
+                blob_key(manifest.digests + (size_t)record->target * DIGEST_SIZE, key);
+                sprintf(blob, "%s/%s%s", blob_dir, key, blob_suffix[codec]);
+                array_add(&used_files, strdup(blob));
             }
-            fclose(input_manifest);
+            manifest_free(&manifest);
         }
 
         recursive_list_dir(blob_dir, &all_files);
@@ -44,6 +44,7 @@
 #include "voldclient/voldclient.h"
 #include "common.h"
 #include "install.h"
+#include "minzip/DirUtil.h"
 #include "make_ext4fs.h"
 #include "recovery_ui.h"
 #include "roots.h"
@@ -135,10 +136,14 @@ char* choose_file_menu(const char* basedir, const char* fileExtensionOrDirectory
     // fixed_headers[i + 2] = NULL;
     fixed_headers[i + 1] = NULL;
 
-    char** files = gather_files(directory, fileExtensionOrDirectory, &numFiles);
-    char** dirs = NULL;
+    // one directory scan: sorted folders followed by sorted files
+    char** entries;
     if (fileExtensionOrDirectory != NULL)
-        dirs = gather_files(directory, NULL, &numDirs);
+        entries = gather_files_and_dirs(directory, fileExtensionOrDirectory, &numDirs, &numFiles);
+    else
+        entries = gather_files(directory, NULL, &numFiles);
+    char** dirs = entries;
+    char** files = entries == NULL ? NULL : entries + numDirs;
     int total = numDirs + numFiles;
     if (total == 0) {
         // we found no valid file to select
@@ -151,12 +156,9 @@ char* choose_file_menu(const char* basedir, const char* fileExtensionOrDirectory
         list[total] = NULL;
 
 
-        for (i = 0; i < numDirs; i++) {
-            list[i] = strdup(dirs[i] + dir_len);
-        }
-
-        for (i = 0; i < numFiles; i++) {
-            list[numDirs + i] = strdup(files[i] + dir_len);
+        // menu items point into the gathered paths
+        for (i = 0; i < total; i++) {
+            list[i] = entries[i] + dir_len;
         }
 
         for (;;) {
@@ -179,11 +181,10 @@ char* choose_file_menu(const char* basedir, const char* fileExtensionOrDirectory
             return_value = strdup(files[chosen_item - numDirs]);
             break;
         }
-        free_string_array(list);
+        free(list);
     }
 
-    free_string_array(files);
-    free_string_array(dirs);
+    free(entries);
     return return_value;
 }
 
@@ -292,30 +293,43 @@ void handle_failure() {
     if (0 != ensure_path_mounted(get_primary_storage_path()))
         return;
     mkdir("/sdcard/clockworkmod", S_IRWXU | S_IRWXG | S_IRWXO);
-    __system("cp /tmp/recovery.log /sdcard/clockworkmod/philz_recovery.log");
+    copy_a_file("/tmp/recovery.log", "/sdcard/clockworkmod/philz_recovery.log");
     ui_print("/tmp/recovery.log copied to /sdcard/clockworkmod/philz_recovery.log\n");
     ui_print("Send file to Phil3759 @xda\n");
 }
 
 //start print tail from custom log file
 void ui_print_custom_logtail(const char* filename, int nb_lines) {
-    char * backup_log;
-    char tmp[PATH_MAX];
-    FILE * f;
-    int line=0;
-    sprintf(tmp, "tail -n %d %s > /tmp/custom_tail.log", nb_lines, filename);
-    __system(tmp);
-    f = fopen("/tmp/custom_tail.log", "rb");
-    if (f != NULL) {
-        while (line < nb_lines) {
-            backup_log = fgets(tmp, PATH_MAX, f);
-            if (backup_log == NULL) break;
-            ui_print("%s", tmp);
-            line++;
-        }
-        fclose(f);
-    } else
-        LOGE("Cannot open /tmp/custom_tail.log\n");
+    unsigned long len = 0;
+    char* buf = read_file_to_buffer(filename, &len);
+    if (buf == NULL) {
+        LOGE("Cannot open %s\n", filename);
+        return;
+    }
+    buf[len] = '\0';
+
+    // walk back to the start of the last nb_lines lines, like tail -n
+    unsigned long start = len;
+    int line = 0;
+    if (start > 0 && buf[start - 1] == '\n')
+        start--;
+    while (start > 0) {
+        if (buf[start - 1] == '\n' && ++line == nb_lines)
+            break;
+        start--;
+    }
+
+    char* p = buf + start;
+    while (*p != '\0') {
+        char* eol = strchr(p, '\n');
+        if (eol != NULL)
+            *eol = '\0';
+        ui_print("%s\n", p);
+        if (eol == NULL)
+            break;
+        p = eol + 1;
+    }
+    free(buf);
 }
 
 /**********************************/
@@ -740,9 +754,9 @@ void wipe_data_menu() {
                 ensure_path_mounted("/cache");
                 if (confirm_selection("Wipe dalvik cache ?", "Yes - Wipe dalvik cache")) {
                     ui_print("\n-- Wiping dalvik cache...\n");
-                    __system("rm -r /data/dalvik-cache");
-                    __system("rm -r /cache/dalvik-cache");
-                    __system("rm -r /sd-ext/dalvik-cache");
+                    dirUnlinkHierarchy("/data/dalvik-cache");
+                    dirUnlinkHierarchy("/cache/dalvik-cache");
+                    dirUnlinkHierarchy("/sd-ext/dalvik-cache");
                     ui_print("Dalvik Cache wiped.\n");
                 }
                 break;
@@ -916,7 +930,7 @@ void show_multi_flash_menu() {
         }
         free_string_array(list);
     }
-    free_string_array(files);
+    free(files);
     free(zip_folder);
 }
 //-------- End Multi-Flash Zip code
@@ -1167,9 +1181,9 @@ int run_ors_script(const char* ors_script) {
                     }
                     ensure_path_mounted("/sd-ext");
                     ensure_path_mounted("/cache");
-                    __system("rm -r /data/dalvik-cache");
-                    __system("rm -r /cache/dalvik-cache");
-                    __system("rm -r /sd-ext/dalvik-cache");
+                    dirUnlinkHierarchy("/data/dalvik-cache");
+                    dirUnlinkHierarchy("/cache/dalvik-cache");
+                    dirUnlinkHierarchy("/sd-ext/dalvik-cache");
                     ui_print("Dalvik Cache wiped.\n");
                     ensure_path_unmounted("/data");
                     ui_print("-- Dalvik Cache Wipe Complete!\n");
@@ -1604,6 +1618,7 @@ void misc_nandroid_menu() {
     char item_use_nandroid_simple_logging[MENU_MAX_COLS];
     char item_nand_progress[MENU_MAX_COLS];
     char item_prompt_low_space[MENU_MAX_COLS];
+    char item_skip_unchanged[MENU_MAX_COLS];
     char item_ors_path[MENU_MAX_COLS];
     char item_compress[MENU_MAX_COLS];
 
@@ -1615,6 +1630,7 @@ void misc_nandroid_menu() {
         item_use_nandroid_simple_logging,
         item_nand_progress,
         item_prompt_low_space,
+        item_skip_unchanged,
         item_ors_path,
         item_compress,
         "Default Backup Format...",
@@ -1661,21 +1677,22 @@ void misc_nandroid_menu() {
             ui_format_gui_menu(item_prompt_low_space, "Prompt on Low Free Space", "(x)");
         else ui_format_gui_menu(item_prompt_low_space, "Prompt on Low Free Space", "( )");
 
+        if (nand_skip_unchanged.value)
+            ui_format_gui_menu(item_skip_unchanged, "Skip Unchanged Partitions", "(x)");
+        else ui_format_gui_menu(item_skip_unchanged, "Skip Unchanged Partitions", "( )");
+
         char ors_volume[PATH_MAX];
         get_ors_backup_volume(ors_volume);
         ui_format_gui_menu(item_ors_path,  "ORS Backup Target", ors_volume);
 
         fmt = nandroid_get_default_backup_format();
         if (fmt == NANDROID_BACKUP_FORMAT_TGZ) {
-            if (compression_value.value == TAR_GZ_FAST)
-                ui_format_gui_menu(item_compress, "Compression", "fast");
-            else if (compression_value.value == TAR_GZ_LOW)
-                ui_format_gui_menu(item_compress, "Compression", "low");
-            else if (compression_value.value == TAR_GZ_MEDIUM)
-                ui_format_gui_menu(item_compress, "Compression", "medium");
-            else if (compression_value.value == TAR_GZ_HIGH)
-                ui_format_gui_menu(item_compress, "Compression", "high");
-            else ui_format_gui_menu(item_compress, "Compression", TAR_GZ_DEFAULT_STR); // useless but to not make exceptions
+            const char* level = compression_level_name(compression_value.value);
+            // default is useless but to not make exceptions
+            ui_format_gui_menu(item_compress, "Compression", level != NULL ? level : TAR_GZ_DEFAULT_STR);
+        } else if (fmt == NANDROID_BACKUP_FORMAT_DUP) {
+            const char* level = compression_level_name(dedupe_compression.value);
+            ui_format_gui_menu(item_compress, "Compression", level != NULL ? level : "off");
         } else
             ui_format_gui_menu(item_compress, "Compression", "No");
 
@@ -1736,38 +1753,50 @@ void misc_nandroid_menu() {
                 break;
             }
             case 7: {
-                choose_ors_volume();
+                char value[3];
+                nand_skip_unchanged.value ^= 1;
+                sprintf(value, "%d", nand_skip_unchanged.value);
+                write_config_file(PHILZ_SETTINGS_FILE, nand_skip_unchanged.key, value);
                 break;
             }
             case 8: {
-                if (fmt != NANDROID_BACKUP_FORMAT_TGZ) {
-                    ui_print("First set backup format to tar.gz\n");
+                choose_ors_volume();
+                break;
+            }
+            case 9: {
+                if (fmt == NANDROID_BACKUP_FORMAT_DUP) {
+                    // switch dedupe blobs compression: off, then the same levels than pigz
+                    if (dedupe_compression.value == 0)
+                        dedupe_compression.value = TAR_GZ_FAST;
+                    else
+                        dedupe_compression.value += 2;
+                    const char* level = compression_level_name(dedupe_compression.value);
+                    if (level == NULL) {
+                        // loop back the toggle
+                        dedupe_compression.value = 0;
+                        level = "off";
+                    }
+                    write_config_file(PHILZ_SETTINGS_FILE, dedupe_compression.key, level);
+                } else if (fmt != NANDROID_BACKUP_FORMAT_TGZ) {
+                    ui_print("First set backup format to tar.gz or dup\n");
                 } else {
                     // switch pigz -[ fast(1), low(3), medium(5), high(7) ] compression level
-                    char value[8];
                     compression_value.value += 2;
-                    if (compression_value.value == TAR_GZ_FAST)
-                        sprintf(value, "fast");
-                    else if (compression_value.value == TAR_GZ_LOW)
-                        sprintf(value, "low");
-                    else if (compression_value.value == TAR_GZ_MEDIUM)
-                        sprintf(value, "medium");
-                    else if (compression_value.value == TAR_GZ_HIGH)
-                        sprintf(value, "high");
-                    else {
+                    const char* level = compression_level_name(compression_value.value);
+                    if (level == NULL) {
                         // loop back the toggle
                         compression_value.value = TAR_GZ_FAST;
-                        sprintf(value, "fast");
+                        level = compression_level_name(TAR_GZ_FAST);
                     }
-                    write_config_file(PHILZ_SETTINGS_FILE, compression_value.key, value);
+                    write_config_file(PHILZ_SETTINGS_FILE, compression_value.key, level);
                 }
                 break;
             }
-            case 9: {
+            case 10: {
                 choose_default_backup_format();
                 break;
             }
-            case 10: {
+            case 11: {
                 regenerate_md5_sum_menu();
                 break;
             }
@@ -1904,7 +1933,7 @@ void set_custom_zip_path() {
         dir_len = strlen(custom_path);
         numDirs = 0;
         free_string_array(list);
-        free_string_array(dirs);
+        free(dirs);
         dirs = gather_files(custom_path, NULL, &numDirs);
         list = (char**)malloc((numDirs + 3) * sizeof(char*));
         list[0] = strdup("../");
@@ -1915,7 +1944,7 @@ void set_custom_zip_path() {
         }
     }
     free_string_array(list);
-    free_string_array(dirs);
+    free(dirs);
     free(fixed_headers);
 
 out:
@@ -1973,8 +2002,8 @@ int show_custom_zip_menu() {
     int numDirs = 0;
     int numFiles = 0;
     int total;
-    char** dirs = gather_files(custom_path, NULL, &numDirs);
-    char** files = gather_files(custom_path, ".zip", &numFiles);
+    char** dirs = gather_files_and_dirs(custom_path, ".zip", &numDirs, &numFiles);
+    char** files = dirs == NULL ? NULL : dirs + numDirs;
     total = numFiles + numDirs;
     char** list = (char**)malloc((total + 2) * sizeof(char*));
     memset(list, 0, sizeof(list));
@@ -2045,10 +2074,9 @@ int show_custom_zip_menu() {
             numDirs = 0;
             numFiles = 0;
             free_string_array(list);
-            free_string_array(files);
-            free_string_array(dirs);
-            dirs = gather_files(custom_path, NULL, &numDirs);
-            files = gather_files(custom_path, ".zip", &numFiles);
+            free(dirs);
+            dirs = gather_files_and_dirs(custom_path, ".zip", &numDirs, &numFiles);
+            files = dirs == NULL ? NULL : dirs + numDirs;
             total = numFiles + numDirs;
             list = (char**)malloc((total + 2) * sizeof(char*));
             list[0] = strdup("../");
@@ -2095,8 +2123,7 @@ int show_custom_zip_menu() {
         }
     }
     free_string_array(list);
-    free_string_array(files);
-    free_string_array(dirs);
+    free(dirs);
     free(fixed_headers);
     return 0;
 }
@@ -2346,6 +2373,7 @@ static void custom_restore_handler(const char* backup_volume, const char* backup
             LOGE("No /efs partition to flash\n");
             return;
         }
+        // also lists the sparse .simg images made by dd_raw_backup_handler()
         file = choose_file_menu(backup_path, ".img", headers);
         if (file == NULL) {
             // either no valid files found or we selected no files by pressing back menu
@@ -4217,12 +4245,16 @@ static void run_dedupe_gc() {
     sprintf(path, fmt, primary_path);
     ensure_path_mounted(primary_path);
     nandroid_dedupe_gc(path);
+    sprintf(path, "%s/clockworkmod/blocks", primary_path);
+    nandroid_block_store_gc(path);
 
     if (extra_paths != NULL) {
         for (i = 0; i < get_num_extra_volumes(); i++) {
             ensure_path_mounted(extra_paths[i]);
             sprintf(path, fmt, extra_paths[i]);
             nandroid_dedupe_gc(path);
+            sprintf(path, "%s/clockworkmod/blocks", extra_paths[i]);
+            nandroid_block_store_gc(path);
         }
         free_string_array(extra_paths);
     }
@@ -4237,20 +4269,30 @@ void choose_default_backup_format() {
     char* list_tar_default[] = { "tar (default)",
                                  "dup",
                                  "tar + gzip",
+                                 "block image",
                                  NULL };
     char* list_dup_default[] = { "tar",
                                  "dup (default)",
                                  "tar + gzip",
+                                 "block image",
                                  NULL };
     char* list_tgz_default[] = { "tar",
                                  "dup",
                                  "tar + gzip (default)",
+                                 "block image",
+                                 NULL };
+    char* list_blk_default[] = { "tar",
+                                 "dup",
+                                 "tar + gzip",
+                                 "block image (default)",
                                  NULL };
 
     if (fmt == NANDROID_BACKUP_FORMAT_DUP) {
         list = list_dup_default;
     } else if (fmt == NANDROID_BACKUP_FORMAT_TGZ) {
         list = list_tgz_default;
+    } else if (fmt == NANDROID_BACKUP_FORMAT_BLK) {
+        list = list_blk_default;
     } else {
         list = list_tar_default;
     }
@@ -4274,6 +4316,11 @@ void choose_default_backup_format() {
             ui_print("Default backup format set to tar + gzip.\n");
             break;
         }
+        case 3: {
+            write_string_to_file(path, "blk");
+            ui_print("Default backup format set to block image.\n");
+            break;
+        }
     }
 }
 
@@ -29,7 +29,7 @@
 #include <linux/limits.h>   // PATH_MAX
 #include "ui_defines.h" // MENU_MAX_COLS, CHAR_HEIGHT, CHAR_WIDTH
 
-// print custom logtail (detailed logging report in raw-backup.sh...)
+// print custom logtail (detailed logging report in raw backups log.txt...)
 void ui_print_custom_logtail(const char* filename, int nb_lines);
 
 void show_nandroid_restore_menu(const char* path);
@@ -145,6 +145,7 @@ static int get_fb_from_adb(struct fb *fb)
     memcpy(fb, &fbinfo->bpp, sizeof(struct fbinfo) - 4);
     fb_dump(fb);
 
+    fb->line_length = 0;
     fb->data = malloc(fb->size);
     if (!fb->data) return -1;
 
@@ -99,53 +99,46 @@ static int fb_get_format(const struct fb *fb)
 
 int fb_save_png(const struct fb *fb, const char *path)
 {
-    char *rgb_matrix;
+    pixel_converter convert = NULL;
+    size_t line_length;
     int ret = -1;
 
-    /* Allocate RGB Matrix. */
-    rgb_matrix = malloc(fb->width * fb->height * 3);
-    if(!rgb_matrix) {
-        D("rgb_matrix: memory error");
-        return -1;
-    }
-
     int fmt = fb_get_format(fb);
     D("Framebuffer Pixel Format: %d", fmt);
 
     switch(fmt) {
         case FB_FORMAT_RGB565:
             /* emulator use rgb565 */
-            ret = rgb565_to_rgb888(fb->data,
-                    rgb_matrix, fb->width * fb->height);
+            convert = rgb565_to_rgb888;
             break;
         case FB_FORMAT_ARGB8888:
             /* most devices use argb8888 */
-            ret = argb8888_to_rgb888(fb->data,
-                    rgb_matrix, fb->width * fb->height);
+            convert = argb8888_to_rgb888;
             break;
         case FB_FORMAT_ABGR8888:
-            ret = abgr8888_to_rgb888(fb->data,
-                    rgb_matrix, fb->width * fb->height);
+            convert = abgr8888_to_rgb888;
             break;
         case FB_FORMAT_BGRA8888:
-            ret = bgra8888_to_rgb888(fb->data,
-                    rgb_matrix, fb->width * fb->height);
+            convert = bgra8888_to_rgb888;
             break;
         case FB_FORMAT_RGBA8888:
-            ret = rgba8888_to_rgb888(fb->data,
-                    rgb_matrix, fb->width * fb->height);
+            convert = rgba8888_to_rgb888;
             break;
         default:
             D("Unsupported framebuffer type.");
             break;
     }
 
-    if (ret != 0)
+    line_length = fb->line_length;
+    if (line_length == 0)
+        line_length = fb->width * (fb->bpp / 8);
+
+    if (convert == NULL)
         D("Error while processing input image.");
-    else if (0 != (ret = save_png(path, rgb_matrix, fb->width, fb->height)))
+    else if (0 != (ret = save_png_stream(path, fb->data, fb->width, fb->height,
+                line_length, convert)))
         D("Failed to save in PNG format.");
 
-    free(rgb_matrix);
     free(fb->data);
     return ret;
 }
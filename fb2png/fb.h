@@ -35,6 +35,8 @@ struct fb {
     unsigned int alpha_offset;
     unsigned int alpha_length;
     void* data;
+    /* bytes per row in data, 0 if rows are not padded */
+    unsigned int line_length;
 };
 
 int fb_save_png(const struct fb *fb, const char *path);
@@ -158,42 +158,11 @@ int get_device_fb(const char* path, struct fb *fb)
     raw_line_length = (width + padding_offset) * bytespp
 
     This gives: padding_offset = (raw_line_length / bytespp) - width
+    Padded rows are skipped by fb_save_png() using line_length, so we
+    don't need an aligned copy of the whole image.
 */
-    unsigned int padding_offset = (raw_line_length / bytespp) - fb->width;
-    if (padding_offset) {
-        unsigned char *data;
-        unsigned char *pdata;
-        unsigned char *praw;
-        const unsigned char *data_buffer_end;
-        const unsigned char *raw_buffer_end;
-
-        // container for final aligned image data
-        data = malloc(fb->size);
-        if (!data) {
-            D("data: memory error");
-            goto oops;
-        }
-
-        pdata = data;
-        praw = raw;
-        data_buffer_end = data + fb->size;
-        raw_buffer_end = raw + raw_size;
-
-        // Add a margin to prevent buffer overflow during copy
-        data_buffer_end -= bytespp * fb->width;
-        raw_buffer_end -= raw_line_length;
-        while (praw < raw_buffer_end && pdata < data_buffer_end) {
-            memcpy(pdata, praw, bytespp * fb->width);
-            pdata += bytespp * fb->width;
-            praw += raw_line_length;
-        }
-        D("Padding done.");
-
-        fb->data = data;
-        free(raw);
-    } else {
-        fb->data = raw;
-    }
+    fb->data = raw;
+    fb->line_length = raw_line_length;
 
     close(fd);
     return 0;
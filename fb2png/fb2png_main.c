@@ -23,6 +23,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include "fb2png.h"
+#include "img_process.h"
 
 #ifdef ANDROID
     #define DEFAULT_SAVE_PATH "/data/local/fbdump.png"
@@ -49,6 +50,7 @@ int print_usage() {
         "   The default output path is /data/local/fbdump.png\n"
         "Options: \n"
         "   -buffer=n  0:single 1:double... buffering (default=auto detect)\n"
+        "   -fast      fastest png compression (bigger files)\n"
         "\n"
     );
 
@@ -69,6 +71,9 @@ int parse_options(const char* option) {
             printf("invalid buffer option (%ld)\n", value);
             found_option = -1;
         }
+    } else if (strcmp(option, "-fast") == 0) {
+        png_fast_compression = 1;
+        found_option = 1;
     } else if (strcmp(option, "-help") == 0 || strcmp(option, "--help") == 0 || strcmp(option, "-h") == 0) {
         // print help and exit
         found_option = -1;
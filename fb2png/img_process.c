@@ -20,133 +20,125 @@
 
 #include <errno.h>
 #include <png.h>
+#include <zlib.h>
 
 #include "fb.h"
 #include "img_process.h"
 #include "log.h"
 
-int rgb565_to_rgb888(const char* src, char* dst, size_t pixel)
-{
-    struct rgb565  *from;
-    struct rgb888  *to;
+#if defined(__ARM_NEON__) || defined(__ARM_NEON)
+#include <arm_neon.h>
+#define HAVE_NEON_CONVERT 1
+#elif defined(__SSSE3__)
+#include <tmmintrin.h>
+#define HAVE_SSSE3_CONVERT 1
+#endif
 
-    from = (struct rgb565 *) src;
-    to = (struct rgb888 *) dst;
-
-    size_t i = 0;
-    /* traverse pixel of the row */
-    while(i++ < pixel) {
-
-        to->r = from->r;
-        to->g = from->g;
-        to->b = from->b;
-        /* scale */
-        to->r <<= 3;
-        to->g <<= 2;
-        to->b <<= 3;
-
-        to++;
-        from++;
-    }
+/* when set, png is written with the fastest zlib level and no filtering */
+int png_fast_compression = 0;
 
-    return 0;
-}
+/* number of rows converted at once before feeding them to libpng */
+#define PNG_STRIP_ROWS 16
 
-int argb8888_to_rgb888(const char* src, char* dst, size_t pixel)
+int rgb565_to_rgb888(const char* src, char* dst, size_t pixel)
 {
-    size_t i;
-    struct argb8888  *from;
-    struct rgb888  *to;
-
-    from = (struct argb8888 *) src;
-    to = (struct rgb888 *) dst;
-
-    i = 0;
-    /* traverse pixel of the row */
-    while(i++ < pixel) {
-
-        to->r = from->r;
-        to->g = from->g;
-        to->b = from->b;
+    const unsigned short *from = (const unsigned short *) src;
+    unsigned char *to = (unsigned char *) dst;
+    size_t i = 0;
 
-        to++;
-        from++;
+#ifdef HAVE_NEON_CONVERT
+    /* 8 pixels per iteration */
+    for (; i + 8 <= pixel; i += 8) {
+        uint16x8_t p = vld1q_u16(from + i);
+        uint8x8x3_t rgb;
+        rgb.val[0] = vand_u8(vshrn_n_u16(p, 8), vdup_n_u8(0xf8));
+        rgb.val[1] = vand_u8(vshrn_n_u16(p, 3), vdup_n_u8(0xfc));
+        rgb.val[2] = vmovn_u16(vshlq_n_u16(p, 3));
+        vst3_u8(to + i * 3, rgb);
     }
-
-    return 0;
-}
-
-int abgr8888_to_rgb888(const char* src, char* dst, size_t pixel)
-{
-    size_t i;
-    struct abgr8888  *from;
-    struct rgb888  *to;
-
-    from = (struct abgr8888 *) src;
-    to = (struct rgb888 *) dst;
-
-    i = 0;
-    /* traverse pixel of the row */
-    while(i++ < pixel) {
-
-        to->r = from->r;
-        to->g = from->g;
-        to->b = from->b;
-
-        to++;
-        from++;
+#endif
+
+    /* traverse remaining pixels of the row */
+    for (; i < pixel; i++) {
+        unsigned short p = from[i];
+        to[i * 3]     = (p >> 8) & 0xf8;
+        to[i * 3 + 1] = (p >> 3) & 0xfc;
+        to[i * 3 + 2] = (p << 3) & 0xf8;
     }
 
     return 0;
 }
 
-int bgra8888_to_rgb888(const char* src, char* dst, size_t pixel)
-{
-    size_t i;
-    struct bgra8888  *from;
-    struct rgb888  *to;
-
-    from = (struct bgra8888 *) src;
-    to = (struct rgb888 *) dst;
-
-    i = 0;
-    /* traverse pixel of the row */
-    while(i++ < pixel) {
-
-        to->r = from->r;
-        to->g = from->g;
-        to->b = from->b;
-
-        to++;
-        from++;
+/*
+ * 32 bits formats only differ by the byte position of each channel:
+ * generate one converter per format so that the SIMD shuffles use
+ * constant lanes.
+ */
+#ifdef HAVE_NEON_CONVERT
+/* 16 pixels per iteration, deinterleaved by vld4 */
+#define SIMD_CONVERT_32(R, G, B)                                    \
+    for (; i + 16 <= pixel; i += 16) {                              \
+        uint8x16x4_t p = vld4q_u8(from + i * 4);                    \
+        uint8x16x3_t rgb;                                           \
+        rgb.val[0] = p.val[R];                                      \
+        rgb.val[1] = p.val[G];                                      \
+        rgb.val[2] = p.val[B];                                      \
+        vst3q_u8(to + i * 3, rgb);                                  \
     }
-
-    return 0;
-}
-
-int rgba8888_to_rgb888(const char* src, char* dst, size_t pixel)
-{
-    size_t i;
-    struct rgba8888  *from;
-    struct rgb888  *to;
-
-    from = (struct rgba8888 *) src;
-    to = (struct rgb888 *) dst;
-
-    i = 0;
-    /* traverse pixel of the row */
-    while (i++ < pixel) {
-        to->r = from->r;
-        to->g = from->g;
-        to->b = from->b;
-
-        to++;
-        from++;
+#elif defined(HAVE_SSSE3_CONVERT)
+/*
+ * 4 pixels per iteration. The 16 bytes store only has 12 valid bytes,
+ * the 4 extra ones are overwritten by next iteration: stop 2 pixels early.
+ */
+#define SIMD_CONVERT_32(R, G, B)                                    \
+    {                                                               \
+        const __m128i mask = _mm_setr_epi8(                         \
+                R, G, B, 4 + R, 4 + G, 4 + B,                       \
+                8 + R, 8 + G, 8 + B, 12 + R, 12 + G, 12 + B,        \
+                -1, -1, -1, -1);                                    \
+        for (; i + 6 <= pixel; i += 4) {                            \
+            __m128i p = _mm_loadu_si128((const __m128i *) (from + i * 4)); \
+            _mm_storeu_si128((__m128i *) (to + i * 3),              \
+                    _mm_shuffle_epi8(p, mask));                     \
+        }                                                           \
     }
+#else
+#define SIMD_CONVERT_32(R, G, B)
+#endif
 
-    return 0;
+/*
+ * The remaining pixels are copied through the pixel structs. The channels
+ * are bytes, which may alias anything: the pointers are __restrict, as the
+ * source and output rows never overlap, so the compiler can copy adjacent
+ * channels with one load and one store instead of a byte at a time.
+ */
+#define DEFINE_CONVERT_32(name, type, R, G, B)                      \
+int name(const char* src, char* dst, size_t pixel)                  \
+{                                                                   \
+    const unsigned char *from = (const unsigned char *) src;        \
+    unsigned char *to = (unsigned char *) dst;                      \
+    size_t i = 0;                                                   \
+                                                                    \
+    SIMD_CONVERT_32(R, G, B)                                        \
+                                                                    \
+    /* traverse remaining pixels of the row */                      \
+    const type *__restrict px = (const type *) (from + i * 4);      \
+    struct rgb888 *__restrict out = (struct rgb888 *) (to + i * 3); \
+    for (; i < pixel; i++, px++, out++) {                           \
+        out->r = px->r;                                             \
+        out->g = px->g;                                             \
+        out->b = px->b;                                             \
+    }                                                               \
+                                                                    \
+    return 0;                                                       \
 }
 
+/* byte positions of r, g, b: see struct definitions in img_process.h */
+DEFINE_CONVERT_32(argb8888_to_rgb888, struct argb8888, 1, 2, 3)
+DEFINE_CONVERT_32(abgr8888_to_rgb888, struct abgr8888, 3, 2, 1)
+DEFINE_CONVERT_32(bgra8888_to_rgb888, struct bgra8888, 2, 1, 0)
+DEFINE_CONVERT_32(rgba8888_to_rgb888, struct rgba8888, 0, 1, 2)
+
 static void
 stdio_write_func (png_structp png, png_bytep data, png_size_t size)
 {
@@ -182,41 +174,26 @@ png_simple_warning_callback (png_structp png,
     fprintf(stderr, "png warning: %s\n", error_msg);
 }
 
-/* save rgb888 to png format in fp */
-int save_png(const char* path, const char* data, int width, int height)
+/* create png write struct for a rgb888 image and write its header */
+static png_struct *
+png_simple_write_header (FILE *fp, int width, int height, png_info **pinfo)
 {
-    FILE *fp;
-    png_byte **volatile rows;
     png_struct *png;
     png_info *info;
 
-    fp = fopen(path, "w");
-    if (!fp) {
-        int errsv = errno;
-        E("Cannot open file %s for writing.\n", path);
-        return errsv;
-    }
-
-    rows = malloc(height * sizeof rows[0]);
-    if (!rows) goto oops;
-
-    int i;
-    for (i = 0; i < height; i++)
-        rows[i] = (png_byte *) data + i * width * 3 /*fb.stride*/;
-
     png = png_create_write_struct (PNG_LIBPNG_VER_STRING, NULL,
                                png_simple_error_callback,
                                png_simple_warning_callback);
     if (!png) {
         E("png_create_write_struct failed\n");
-        goto oops;
+        return NULL;
     }
 
     info = png_create_info_struct (png);
     if (!info) {
         E("png_create_info_struct failed\n");
         png_destroy_write_struct (&png, NULL);
-        goto oops;
+        return NULL;
     }
 
     png_set_write_fn (png, fp, stdio_write_func, png_simple_output_flush_fn);
@@ -230,6 +207,12 @@ int save_png(const char* path, const char* data, int width, int height)
         PNG_COMPRESSION_TYPE_DEFAULT,
         PNG_FILTER_TYPE_DEFAULT);
 
+    if (png_fast_compression) {
+        /* screenshots are mostly flat UI: filters don't pay off at level 1 */
+        png_set_compression_level (png, Z_BEST_SPEED);
+        png_set_filter (png, PNG_FILTER_TYPE_BASE, PNG_FILTER_NONE);
+    }
+
     png_color_16 white;
 
     white.gray = (1 << DEPTH) - 1;
@@ -238,6 +221,36 @@ int save_png(const char* path, const char* data, int width, int height)
     png_set_bKGD (png, info, &white);
     png_write_info (png, info);
 
+    *pinfo = info;
+    return png;
+}
+
+/* save rgb888 to png format in fp */
+int save_png(const char* path, const char* data, int width, int height)
+{
+    FILE *fp;
+    png_byte **volatile rows;
+    png_struct *png;
+    png_info *info;
+
+    fp = fopen(path, "w");
+    if (!fp) {
+        int errsv = errno;
+        E("Cannot open file %s for writing.\n", path);
+        return errsv;
+    }
+
+    rows = malloc(height * sizeof rows[0]);
+    if (!rows) goto oops;
+
+    int i;
+    for (i = 0; i < height; i++)
+        rows[i] = (png_byte *) data + i * width * 3 /*fb.stride*/;
+
+    png = png_simple_write_header (fp, width, height, &info);
+    if (!png)
+        goto oops;
+
     png_write_image (png, rows);
     png_write_end (png, info);
 
@@ -252,3 +265,54 @@ oops:
     free (rows);
     return -1;
 }
+
+/*
+ * save raw framebuffer data to png format: rows are converted to rgb888
+ * PNG_STRIP_ROWS at a time and streamed to libpng, so that we never hold
+ * more than one strip of the rgb888 image in memory
+ */
+int save_png_stream(const char* path, const char* data, int width, int height,
+        size_t line_length, pixel_converter convert)
+{
+    FILE *fp;
+    png_byte *volatile strip;
+    png_byte *rows[PNG_STRIP_ROWS];
+    png_struct *png;
+    png_info *info;
+
+    fp = fopen(path, "w");
+    if (!fp) {
+        int errsv = errno;
+        E("Cannot open file %s for writing.\n", path);
+        return errsv;
+    }
+
+    strip = malloc(PNG_STRIP_ROWS * width * 3);
+    if (!strip) goto oops;
+
+    png = png_simple_write_header (fp, width, height, &info);
+    if (!png)
+        goto oops;
+
+    int i, y;
+    for (y = 0; y < height; y += PNG_STRIP_ROWS) {
+        int n = height - y < PNG_STRIP_ROWS ? height - y : PNG_STRIP_ROWS;
+        for (i = 0; i < n; i++) {
+            rows[i] = strip + i * width * 3;
+            convert(data + (size_t)(y + i) * line_length, (char *) rows[i], width);
+        }
+        png_write_rows (png, rows, n);
+    }
+    png_write_end (png, info);
+
+    png_destroy_write_struct (&png, &info);
+
+    fclose(fp);
+    free (strip);
+    return 0;
+
+oops:
+    fclose(fp);
+    free (strip);
+    return -1;
+}
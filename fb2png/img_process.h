@@ -69,6 +69,11 @@ typedef struct rgb565 {
         short r:5;
 } rgb565_t;
 
+/* convert a row of pixel framebuffer pixels to rgb888 */
+typedef int (*pixel_converter)(const char* src, char* dst, size_t pixel);
+
+extern int png_fast_compression;
+
 int rgb565_to_rgb888(const char* src, char* dst, size_t pixel);
 
 int argb8888_to_rgb888(const char* src, char* dst, size_t pixel);
@@ -81,4 +86,7 @@ int rgba8888_to_rgb888(const char* src, char* dst, size_t pixel);
 
 int save_png(const char* path, const char* data, int width, int height);
 
+int save_png_stream(const char* path, const char* data, int width, int height,
+        size_t line_length, pixel_converter convert);
+
 #endif
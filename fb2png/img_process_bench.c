@@ -0,0 +1,244 @@
+/*
+ * Host benchmark of the framebuffer to png path, built by img_process_bench.sh
+ *
+ * For every FB_FORMAT_*, on a padded 1080x1920 frame:
+ * - the row converters must give the same rgb888 bytes as the previous
+ *   struct based converters, and are timed against them
+ * - save_png_stream() must write the same png as the previous path (whole
+ *   frame converted to a rgb888 copy, then save_png()), and is timed
+ *   against it, with default and fast compression
+ *
+ *   img_process_bench <output directory>
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+#include "img_process.h"
+
+#define BENCH_W         1080
+#define BENCH_H         1920
+#define BENCH_PAD       64      /* line_length padding, in bytes */
+#define BENCH_CONVERTS  50      /* frames converted per timing */
+
+/* previous converters, one struct copy per pixel */
+static int ref_rgb565_to_rgb888(const char* src, char* dst, size_t pixel)
+{
+    const struct rgb565 *from = (const struct rgb565 *) src;
+    struct rgb888 *to = (struct rgb888 *) dst;
+    size_t i = 0;
+
+    while (i++ < pixel) {
+        to->r = from->r;
+        to->g = from->g;
+        to->b = from->b;
+        to->r <<= 3;
+        to->g <<= 2;
+        to->b <<= 3;
+        to++;
+        from++;
+    }
+    return 0;
+}
+
+#define DEFINE_REF_CONVERT_32(name, type)                           \
+static int name(const char* src, char* dst, size_t pixel)           \
+{                                                                   \
+    const type *from = (const type *) src;                          \
+    struct rgb888 *to = (struct rgb888 *) dst;                      \
+    size_t i = 0;                                                   \
+                                                                    \
+    while (i++ < pixel) {                                           \
+        to->r = from->r;                                            \
+        to->g = from->g;                                            \
+        to->b = from->b;                                            \
+        to++;                                                       \
+        from++;                                                     \
+    }                                                               \
+    return 0;                                                       \
+}
+
+DEFINE_REF_CONVERT_32(ref_argb8888_to_rgb888, struct argb8888)
+DEFINE_REF_CONVERT_32(ref_abgr8888_to_rgb888, struct abgr8888)
+DEFINE_REF_CONVERT_32(ref_bgra8888_to_rgb888, struct bgra8888)
+DEFINE_REF_CONVERT_32(ref_rgba8888_to_rgb888, struct rgba8888)
+
+static const struct {
+    const char *name;
+    int bpp;
+    pixel_converter convert;
+    pixel_converter ref;
+} formats[] = {
+    { "rgb565",   16, rgb565_to_rgb888,   ref_rgb565_to_rgb888 },
+    { "argb8888", 32, argb8888_to_rgb888, ref_argb8888_to_rgb888 },
+    { "rgba8888", 32, rgba8888_to_rgb888, ref_rgba8888_to_rgb888 },
+    { "abgr8888", 32, abgr8888_to_rgb888, ref_abgr8888_to_rgb888 },
+    { "bgra8888", 32, bgra8888_to_rgb888, ref_bgra8888_to_rgb888 },
+};
+
+static long long now_usec()
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return (long long) tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+/* recovery like frame: flat bars, a gradient and some noisy "text" rows */
+static void fill_frame(unsigned char *data, size_t line_length)
+{
+    int x, y;
+    unsigned int seed = 1;
+
+    for (y = 0; y < BENCH_H; y++) {
+        unsigned char *row = data + (size_t) y * line_length;
+        for (x = 0; x < (int) line_length; x++) {
+            if ((y / 96) % 3 == 0) {
+                row[x] = 0x20;
+            } else if ((y / 96) % 3 == 1) {
+                row[x] = (unsigned char) (x + y);
+            } else {
+                seed = seed * 1103515245 + 12345;
+                row[x] = (seed >> 16) & 0x8 ? 0xff : 0x10;
+            }
+        }
+    }
+}
+
+static void convert_frame(pixel_converter convert, const unsigned char *data,
+        size_t line_length, char *rgb)
+{
+    int y;
+
+    for (y = 0; y < BENCH_H; y++)
+        convert((const char *) data + (size_t) y * line_length,
+                rgb + (size_t) y * BENCH_W * 3, BENCH_W);
+}
+
+/* best of BENCH_CONVERTS frames: the host is not idle */
+static long long time_converts(pixel_converter convert, const unsigned char *data,
+        size_t line_length, char *rgb)
+{
+    long long best = -1;
+    int i;
+
+    for (i = 0; i < BENCH_CONVERTS; i++) {
+        long long start = now_usec();
+        convert_frame(convert, data, line_length, rgb);
+        long long us = now_usec() - start;
+        if (best < 0 || us < best)
+            best = us;
+    }
+    return best;
+}
+
+/* previous fb_save_png(): whole frame converted to rgb888, then saved */
+static int save_png_copy(const char *path, const unsigned char *data,
+        size_t line_length, pixel_converter convert)
+{
+    char *rgb = malloc((size_t) BENCH_W * BENCH_H * 3);
+    int ret;
+
+    if (rgb == NULL)
+        return -1;
+    convert_frame(convert, data, line_length, rgb);
+    ret = save_png(path, rgb, BENCH_W, BENCH_H);
+    free(rgb);
+    return ret;
+}
+
+static int same_file(const char *a, const char *b, long *size)
+{
+    FILE *fa = fopen(a, "r");
+    FILE *fb = fopen(b, "r");
+    int ca, cb, same = fa != NULL && fb != NULL;
+
+    *size = 0;
+    while (same) {
+        ca = getc(fa);
+        cb = getc(fb);
+        if (ca != cb)
+            same = 0;
+        else if (ca == EOF)
+            break;
+        else
+            (*size)++;
+    }
+    if (fa) fclose(fa);
+    if (fb) fclose(fb);
+    return same;
+}
+
+static int bench_format(int f, const char *dir)
+{
+    size_t line_length = BENCH_W * formats[f].bpp / 8 + BENCH_PAD;
+    unsigned char *data = malloc(line_length * BENCH_H);
+    char *rgb = malloc((size_t) BENCH_W * BENCH_H * 3);
+    char *ref = malloc((size_t) BENCH_W * BENCH_H * 3);
+    char path_copy[1024], path_stream[1024];
+    int failed = 0;
+    int fast;
+
+    if (data == NULL || rgb == NULL || ref == NULL) {
+        fprintf(stderr, "out of memory\n");
+        return 1;
+    }
+    fill_frame(data, line_length);
+
+    convert_frame(formats[f].convert, data, line_length, rgb);
+    convert_frame(formats[f].ref, data, line_length, ref);
+    if (memcmp(rgb, ref, (size_t) BENCH_W * BENCH_H * 3) != 0) {
+        printf("%s: converted pixels differ\n", formats[f].name);
+        failed++;
+    }
+    long long ref_us = time_converts(formats[f].ref, data, line_length, ref);
+    long long new_us = time_converts(formats[f].convert, data, line_length, rgb);
+    printf("%s: convert %lld us/frame, previous %lld us/frame\n",
+            formats[f].name, new_us, ref_us);
+
+    for (fast = 0; fast <= 1; fast++) {
+        long size;
+
+        png_fast_compression = fast;
+        snprintf(path_copy, sizeof(path_copy), "%s/%s_copy.png", dir, formats[f].name);
+        snprintf(path_stream, sizeof(path_stream), "%s/%s_stream.png", dir, formats[f].name);
+
+        long long start = now_usec();
+        int ret = save_png_copy(path_copy, data, line_length, formats[f].ref);
+        long long copy_ms = (now_usec() - start) / 1000;
+        start = now_usec();
+        ret |= save_png_stream(path_stream, (const char *) data, BENCH_W, BENCH_H,
+                line_length, formats[f].convert);
+        long long stream_ms = (now_usec() - start) / 1000;
+
+        if (ret != 0 || !same_file(path_copy, path_stream, &size)) {
+            printf("%s: png files differ\n", formats[f].name);
+            failed++;
+            continue;
+        }
+        printf("%s: %s png %lld ms, previous %lld ms (%ld bytes)\n", formats[f].name,
+                fast ? "fast" : "default", stream_ms, copy_ms, size);
+    }
+
+    free(data);
+    free(rgb);
+    free(ref);
+    return failed;
+}
+
+int main(int argc, char **argv)
+{
+    int failed = 0;
+    int f;
+
+    if (argc != 2) {
+        fprintf(stderr, "usage: %s <output directory>\n", argv[0]);
+        return 2;
+    }
+
+    for (f = 0; f < (int) (sizeof(formats) / sizeof(formats[0])); f++)
+        failed += bench_format(f, argv[1]);
+    printf("%s\n", failed ? "FAILED" : "PASSED");
+    return failed ? 1 : 0;
+}
@@ -0,0 +1,36 @@
+#!/bin/bash
+#
+# Host benchmark of fb2png row converters and png streaming: builds
+# img_process_bench with the host gcc and libpng, once with the scalar
+# converters and once with the SSSE3 ones (see img_process_bench.c).
+# On ARM hosts the NEON converters are built in both runs.
+
+# ------------------------
+
+cd $(dirname $0)
+tmpdir=$(mktemp -d)
+
+cleanup() {
+  rm -rf $tmpdir
+}
+trap cleanup EXIT
+
+fail() {
+  echo
+  echo FAIL: $@
+  echo
+  exit 1
+}
+
+run_bench() {
+  echo "== $1"
+  gcc -O2 -Wall -Wno-unused $2 -o $tmpdir/img_process_bench img_process_bench.c img_process.c \
+    -lpng -lz -lm || fail "build $1"
+  $tmpdir/img_process_bench $tmpdir || fail "img_process_bench $1"
+  rm -f $tmpdir/*.png
+}
+
+run_bench scalar ""
+case $(uname -m) in
+  x86_64|i?86) run_bench ssse3 -mssse3 ;;
+esac
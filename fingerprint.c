@@ -0,0 +1,188 @@
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/xattr.h>
+
+#include "mincrypt/sha256.h"
+
+#include "common.h"
+#include "fingerprint.h"
+
+#define FINGERPRINT_BUFFER_SIZE     (1024 * 1024)
+
+// fixed size part of each tree entry
+typedef struct {
+    uint32_t mode;
+    uint32_t uid;
+    uint32_t gid;
+    uint32_t rdev;
+    uint64_t ino;
+    uint64_t size;
+    int64_t mtime;
+    int64_t ctime;
+} tree_entry_t;
+
+static int hash_fd(SHA256_CTX* ctx, int fd, char* buf) {
+    for (;;) {
+        ssize_t r = read(fd, buf, FINGERPRINT_BUFFER_SIZE);
+        if (r < 0 && errno == EINTR)
+            continue;
+        if (r < 0)
+            return -1;
+        if (r == 0)
+            return 0;
+        SHA256_update(ctx, buf, r);
+    }
+}
+
+int fingerprint_device(const char* device, uint8_t* digest) {
+    SHA256_CTX ctx;
+    int ret = -1;
+
+    int fd = open(device, O_RDONLY | O_LARGEFILE);
+    if (fd < 0) {
+        LOGE("fingerprint: can't open %s (%s)\n", device, strerror(errno));
+        return -1;
+    }
+    char* buf = malloc(FINGERPRINT_BUFFER_SIZE);
+    if (buf == NULL) {
+        LOGE("fingerprint: out of memory\n");
+        goto out;
+    }
+
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    SHA256_init(&ctx);
+    if (hash_fd(&ctx, fd, buf) != 0) {
+        LOGE("fingerprint: read error on %s (%s)\n", device, strerror(errno));
+        goto out;
+    }
+    memcpy(digest, SHA256_final(&ctx), FINGERPRINT_SIZE);
+    ret = 0;
+
+out:
+    free(buf);
+    close(fd);
+    return ret;
+}
+
+static int compare_names(const void* a, const void* b) {
+    return strcmp(*(char* const*)a, *(char* const*)b);
+}
+
+static int hash_entry(SHA256_CTX* ctx, char* path, size_t root_len);
+
+// readdir order depends on the filesystem history: hash the entries sorted
+static int hash_directory(SHA256_CTX* ctx, char* path, size_t root_len) {
+    char** names = NULL;
+    size_t count = 0, cap = 0, i;
+    int ret = 0;
+
+    DIR* dir = opendir(path);
+    if (dir == NULL)
+        return -1;
+    struct dirent* de;
+    while ((de = readdir(dir)) != NULL) {
+        if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0)
+            continue;
+        if (count == cap) {
+            cap = cap ? cap * 2 : 64;
+            char** tmp = realloc(names, cap * sizeof(char*));
+            if (tmp == NULL) {
+                ret = -1;
+                break;
+            }
+            names = tmp;
+        }
+        if ((names[count] = strdup(de->d_name)) == NULL) {
+            ret = -1;
+            break;
+        }
+        count++;
+    }
+    closedir(dir);
+
+    if (ret == 0)
+        qsort(names, count, sizeof(char*), compare_names);
+    size_t len = strlen(path);
+    for (i = 0; ret == 0 && i < count; i++) {
+        if (len + 1 + strlen(names[i]) >= PATH_MAX) {
+            ret = -1;
+            break;
+        }
+        path[len] = '/';
+        strcpy(path + len + 1, names[i]);
+        ret = hash_entry(ctx, path, root_len);
+        path[len] = '\0';
+    }
+
+    for (i = 0; i < count; i++)
+        free(names[i]);
+    free(names);
+    return ret;
+}
+
+// only the inode is read: a rewritten file gets a new inode or ctime even
+// when its size and mtime are restored (ROM zips use a fixed timestamp)
+static int hash_entry(SHA256_CTX* ctx, char* path, size_t root_len) {
+    tree_entry_t entry;
+    struct stat st;
+    char target[PATH_MAX];
+
+    if (lstat(path, &st) != 0)
+        return -1;
+    memset(&entry, 0, sizeof(entry));
+    entry.mode = st.st_mode;
+    entry.uid = st.st_uid;
+    entry.gid = st.st_gid;
+    if (S_ISCHR(st.st_mode) || S_ISBLK(st.st_mode))
+        entry.rdev = st.st_rdev;
+    if (S_ISREG(st.st_mode) || S_ISLNK(st.st_mode))
+        entry.size = st.st_size;
+    if (!S_ISDIR(st.st_mode)) {
+        entry.ino = st.st_ino;
+        entry.mtime = st.st_mtime;
+        entry.ctime = st.st_ctime;
+    }
+
+    // names are hashed with their ending 0, labels with their length
+    SHA256_update(ctx, path + root_len, strlen(path + root_len) + 1);
+    SHA256_update(ctx, &entry, sizeof(entry));
+    char label[256];
+    ssize_t n = lgetxattr(path, "security.selinux", label, sizeof(label));
+    uint32_t label_len = n > 0 ? n : 0;
+    SHA256_update(ctx, &label_len, sizeof(label_len));
+    SHA256_update(ctx, label, label_len);
+
+    if (S_ISDIR(st.st_mode))
+        return hash_directory(ctx, path, root_len);
+    if (S_ISLNK(st.st_mode)) {
+        n = readlink(path, target, sizeof(target));
+        if (n < 0)
+            return -1;
+        SHA256_update(ctx, target, n);
+    }
+    return 0;
+}
+
+int fingerprint_tree(const char* root, uint8_t* digest) {
+    SHA256_CTX ctx;
+    char path[PATH_MAX];
+
+    if (strlen(root) >= sizeof(path))
+        return -1;
+
+    strcpy(path, root);
+    SHA256_init(&ctx);
+    int ret = hash_entry(&ctx, path, strlen(root));
+    if (ret == 0)
+        memcpy(digest, SHA256_final(&ctx), FINGERPRINT_SIZE);
+    else
+        LOGE("fingerprint: can't read %s (%s)\n", path, strerror(errno));
+    return ret;
+}
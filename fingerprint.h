@@ -0,0 +1,23 @@
+/*
+    Partition fingerprints, to skip restoring what did not change since a backup
+*/
+
+#ifndef _FINGERPRINT_H
+#define _FINGERPRINT_H
+
+#include <stdint.h>
+
+// sha256
+#define FINGERPRINT_SIZE 32
+
+// raw partitions: the whole device content
+// returns 0 on success
+int fingerprint_device(const char* device, uint8_t* digest);
+
+// mounted filesystems: names, owners, modes, selinux labels, sizes, inode
+// numbers and symlink targets of all entries below root, in name order.
+// File contents are not read. Files times are included, but not the
+// directories ones that tar doesn't always restore
+int fingerprint_tree(const char* root, uint8_t* digest);
+
+#endif // _FINGERPRINT_H
@@ -2,9 +2,21 @@
 #define LIBCRECOVERY_COMMON_H
 
 #include <stdio.h>
+#include <sys/types.h>
 
 int __system(const char *command);
 FILE * __popen(const char *program, const char *type);
 int __pclose(FILE *iop);
 
-#endif
\ No newline at end of file
+// argv based runners: no /sbin/sh -c, child started by vfork()
+pid_t __spawn(char * const argv[], int fd_in, int fd_out, int fd_err);
+int __spawn_wait(pid_t pid);
+int __run(char * const argv[]);
+int __run_to_file(char * const argv[], const char *out);
+FILE * __popen_argv(char * const argv[], const char *type);
+
+// number of processes started by the runners above and their total run time
+void __spawn_stats(int *count, long long *usec);
+void __spawn_stats_reset(void);
+
+#endif
@@ -1,2 +1,6 @@
 #undef _PATH_BSHELL
 #define _PATH_BSHELL "/sbin/sh"
+
+// spawn.c process accounting, shared by all runners of this library
+long long __spawn_now_usec(void);
+void __spawn_account(long long start_usec);
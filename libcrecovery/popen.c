@@ -41,6 +41,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <paths.h>
+#include <pthread.h>
 
 #include "defines.h"
 
@@ -48,18 +49,29 @@ static struct pid {
 	struct pid *next;
 	FILE *fp;
 	pid_t pid;
+	long long start;
 } *pidlist;
 
+/*
+ * Guards pidlist. It is held across vfork() until the new entry is linked:
+ * vfork() only suspends the calling thread, and the child walks the list.
+ */
+static pthread_mutex_t pidlist_lock = PTHREAD_MUTEX_INITIALIZER;
+
 extern char **environ;
 
-FILE *
-__popen(const char *program, const char *type)
+/*
+ * Runs path, or argv[0] looked up in PATH when path is NULL, with its stdin or
+ * stdout on a pipe. The child is vfork()ed: it only closes and dup2()s
+ * descriptors before exec, which is safe while sharing our memory.
+ */
+static FILE *
+popen_exec(const char *path, char * const argv[], const char *type)
 {
 	struct pid * volatile cur;
 	FILE *iop;
 	int pdes[2];
 	pid_t pid;
-	char *argp[] = {"sh", "-c", NULL, NULL};
 
 	if ((*type != 'r' && *type != 'w') || type[1] != '\0') {
 		errno = EINVAL;
@@ -74,8 +86,11 @@ __popen(const char *program, const char *type)
 		return (NULL);
 	}
 
-	switch (pid = fork()) {
+	cur->start = __spawn_now_usec();
+	pthread_mutex_lock(&pidlist_lock);
+	switch (pid = vfork()) {
 	case -1:			/* Error. */
+		pthread_mutex_unlock(&pidlist_lock);
 		(void)close(pdes[0]);
 		(void)close(pdes[1]);
 		free(cur);
@@ -85,8 +100,9 @@ __popen(const char *program, const char *type)
 	    {
 		struct pid *pcur;
 		/*
-		 * We fork()'d, we got our own copy of the list, no
-		 * contention.
+		 * Only the vfork()ing thread is suspended until we exec, but
+		 * it holds pidlist_lock, so no other thread can popen or
+		 * pclose while we walk the list.
 		 */
 		for (pcur = pidlist; pcur; pcur = pcur->next)
 			close(fileno(pcur->fp));
@@ -104,8 +120,10 @@ __popen(const char *program, const char *type)
 				(void)close(pdes[0]);
 			}
 		}
-		argp[2] = (char *)program;
-		execve(_PATH_BSHELL, argp, environ);
+		if (path != NULL)
+			execve(path, argv, environ);
+		else
+			execvp(argv[0], argv);
 		_exit(127);
 		/* NOTREACHED */
 	    }
@@ -125,10 +143,30 @@ __popen(const char *program, const char *type)
 	cur->pid =  pid;
 	cur->next = pidlist;
 	pidlist = cur;
+	pthread_mutex_unlock(&pidlist_lock);
 
 	return (iop);
 }
 
+FILE *
+__popen(const char *program, const char *type)
+{
+	char *argp[] = {"sh", "-c", NULL, NULL};
+
+	argp[2] = (char *)program;
+	return (popen_exec(_PATH_BSHELL, argp, type));
+}
+
+FILE *
+__popen_argv(char * const argv[], const char *type)
+{
+	if (argv == NULL || argv[0] == NULL) {
+		errno = EINVAL;
+		return (NULL);
+	}
+	return (popen_exec(strchr(argv[0], '/') != NULL ? argv[0] : NULL, argv, type));
+}
+
 /*
  * pclose --
  *	Pclose returns -1 if stream is not associated with a `popened' command,
@@ -142,24 +180,34 @@ __pclose(FILE *iop)
 	pid_t pid;
 
 	/* Find the appropriate file pointer. */
+	pthread_mutex_lock(&pidlist_lock);
 	for (last = NULL, cur = pidlist; cur; last = cur, cur = cur->next)
 		if (cur->fp == iop)
 			break;
 
-	if (cur == NULL)
+	if (cur == NULL) {
+		pthread_mutex_unlock(&pidlist_lock);
 		return (-1);
+	}
 
+	/*
+	 * Close before unlinking, under the lock: a child vfork()ed in
+	 * between would otherwise keep our end of the pipe open.
+	 */
 	(void)fclose(iop);
 
-	do {
-		pid = waitpid(cur->pid, &pstat, 0);
-	} while (pid == -1 && errno == EINTR);
-
 	/* Remove the entry from the linked list. */
 	if (last == NULL)
 		pidlist = cur->next;
 	else
 		last->next = cur->next;
+	pthread_mutex_unlock(&pidlist_lock);
+
+	do {
+		pid = waitpid(cur->pid, &pstat, 0);
+	} while (pid == -1 && errno == EINTR);
+
+	__spawn_account(cur->start);
 	free(cur);
 
 	return (pid == -1 ? -1 : pstat);
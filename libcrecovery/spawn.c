@@ -0,0 +1,186 @@
+/*
+ * argv based process runners for recovery.
+ *
+ * __system() and __popen() go through /sbin/sh -c, which costs an extra
+ * exec and a shell startup for every fixed command. The functions below
+ * take an argv array and exec the program directly, from a vfork()ed
+ * child so the large recovery image is never copied.
+ *
+ * Every runner of this library reports to a process counter, so a
+ * backup job can log how many processes it spawned and their total
+ * wall time (see __spawn_stats()).
+ */
+
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "defines.h"
+#include "common.h"
+
+extern char **environ;
+
+#define SPAWN_TRACK_MAX 16
+
+static pthread_mutex_t spawn_lock = PTHREAD_MUTEX_INITIALIZER;
+static int spawn_count = 0;
+static long long spawn_usec = 0;
+
+// start time of __spawn() children until __spawn_wait() reaps them
+static struct {
+    pid_t pid;
+    long long start;
+} spawn_tracked[SPAWN_TRACK_MAX];
+
+long long
+__spawn_now_usec(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+void
+__spawn_account(long long start_usec)
+{
+    long long elapsed = __spawn_now_usec() - start_usec;
+    pthread_mutex_lock(&spawn_lock);
+    spawn_count++;
+    spawn_usec += elapsed;
+    pthread_mutex_unlock(&spawn_lock);
+}
+
+void
+__spawn_stats(int *count, long long *usec)
+{
+    pthread_mutex_lock(&spawn_lock);
+    if (count != NULL)
+        *count = spawn_count;
+    if (usec != NULL)
+        *usec = spawn_usec;
+    pthread_mutex_unlock(&spawn_lock);
+}
+
+void
+__spawn_stats_reset(void)
+{
+    pthread_mutex_lock(&spawn_lock);
+    spawn_count = 0;
+    spawn_usec = 0;
+    pthread_mutex_unlock(&spawn_lock);
+}
+
+/*
+ * Start argv[0] (searched in PATH when it has no '/') with fd_in, fd_out
+ * and fd_err as its stdin, stdout and stderr. Pass -1 to inherit ours.
+ * Returns the child pid, to be reaped by __spawn_wait(), or -1.
+ */
+pid_t
+__spawn(char * const argv[], int fd_in, int fd_out, int fd_err)
+{
+    pid_t pid;
+    long long start;
+    int i;
+
+    if (argv == NULL || argv[0] == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    start = __spawn_now_usec();
+    pid = vfork();
+    if (pid == 0) {
+        // only async-signal-safe calls past this point: we share the parent memory
+        if (fd_in >= 0 && fd_in != STDIN_FILENO)
+            dup2(fd_in, STDIN_FILENO);
+        if (fd_out >= 0 && fd_out != STDOUT_FILENO)
+            dup2(fd_out, STDOUT_FILENO);
+        if (fd_err >= 0 && fd_err != STDERR_FILENO)
+            dup2(fd_err, STDERR_FILENO);
+        if (strchr(argv[0], '/') != NULL)
+            execve(argv[0], argv, environ);
+        else
+            execvp(argv[0], argv);
+        _exit(127);
+    }
+    if (pid < 0)
+        return -1;
+
+    pthread_mutex_lock(&spawn_lock);
+    for (i = 0; i < SPAWN_TRACK_MAX; i++) {
+        if (spawn_tracked[i].pid == 0) {
+            spawn_tracked[i].pid = pid;
+            spawn_tracked[i].start = start;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&spawn_lock);
+    return pid;
+}
+
+// waits for a __spawn() child, returns its waitpid() status or -1
+int
+__spawn_wait(pid_t pid)
+{
+    int pstat;
+    pid_t ret;
+    long long start = -1;
+    int i;
+
+    do {
+        ret = waitpid(pid, &pstat, 0);
+    } while (ret == -1 && errno == EINTR);
+
+    pthread_mutex_lock(&spawn_lock);
+    for (i = 0; i < SPAWN_TRACK_MAX; i++) {
+        if (spawn_tracked[i].pid == pid) {
+            spawn_tracked[i].pid = 0;
+            start = spawn_tracked[i].start;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&spawn_lock);
+
+    if (start >= 0)
+        __spawn_account(start);
+    else
+        __spawn_account(__spawn_now_usec());
+
+    return (ret == -1 ? -1 : pstat);
+}
+
+// __system() without the shell: returns the waitpid() status or -1
+int
+__run(char * const argv[])
+{
+    pid_t pid = __spawn(argv, -1, -1, -1);
+    if (pid < 0)
+        return -1;
+    return __spawn_wait(pid);
+}
+
+/*
+ * Runs argv with stdout and stderr redirected to a file, like
+ * "cmd > out 2>&1". Pass NULL to discard the output.
+ */
+int
+__run_to_file(char * const argv[], const char *out)
+{
+    int fd = open(out != NULL ? out : "/dev/null",
+                  O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0)
+        return -1;
+
+    pid_t pid = __spawn(argv, -1, fd, fd);
+    close(fd);
+    if (pid < 0)
+        return -1;
+    return __spawn_wait(pid);
+}
@@ -46,6 +46,7 @@ __system(const char *command)
 	sig_t intsave, quitsave;
 	sigset_t mask, omask;
 	int pstat;
+	long long start;
 	char *argp[] = {"sh", "-c", NULL, NULL};
 
 	if (!command)		/* just checking... */
@@ -56,6 +57,7 @@ __system(const char *command)
 	sigemptyset(&mask);
 	sigaddset(&mask, SIGCHLD);
 	sigprocmask(SIG_BLOCK, &mask, &omask);
+	start = __spawn_now_usec();
 	switch (pid = vfork()) {
 	case -1:			/* error */
 		sigprocmask(SIG_SETMASK, &omask, NULL);
@@ -72,5 +74,6 @@ __system(const char *command)
 	sigprocmask(SIG_SETMASK, &omask, NULL);
 	(void)bsd_signal(SIGINT, intsave);
 	(void)bsd_signal(SIGQUIT, quitsave);
+	__spawn_account(start);
 	return (pid == -1 ? -1 : pstat);
 }
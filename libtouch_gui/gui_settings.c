@@ -1470,7 +1470,7 @@ static int fb2png_capture(const char* file_path) {
         return -1;
 
     char cmd[PATH_MAX];
-    sprintf(cmd, "%s %s", FB2PNG_BIN, file_path);
+    sprintf(cmd, "%s -fast %s", FB2PNG_BIN, file_path);
     return __system(cmd);
 }
 
@@ -277,7 +277,9 @@ static int vk_pressed = -1;
 - show_virtual_keys toggle is implemented in draw_virtualkeys_locked() instead of the caller draw_screen_locked()
   to keep it in philz_gui_defines.c code and not ui.c, but it would ideally be in ui.c
 - update_screen_locked() will not do anything until ui_has_initialized == 1
-- ui_has_initialized is set to 1 at start of ui_init(), called early on recovery start process (recovery.c)
+- ui_has_initialized is set to 1 at end of ui_init(), once all bitmaps (gVirtualKeys included) are decoded
+  ui_init() is called early on recovery start process (recovery.c)
+  ui_print() calls made meanwhile (by the vold thread) only log and draw nothing
 - update_screen_locked() is called by many functions to update screen, but not by ui_init() on boot
 - Very early functions calling it are : ui_print() and ui_set_background()
 - To avoid virtual keys being drawn on screen on start for a short time when they are disabled, we have 2 choices:
@@ -352,6 +354,8 @@ void fast_ui_init_png() {
 
     int i;
     for(i = 0; BITMAPS[i].name != NULL; ++i) {
+        // release our reference so that a changed png is freed from the resource cache
+        res_free_surface(*BITMAPS[i].surface);
         int result = res_create_surface(BITMAPS[i].name, BITMAPS[i].surface);
         if (result < 0) {
             LOGE("Missing bitmap %s\n(Code %d)\n", BITMAPS[i].name, result);
@@ -16,8 +16,12 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
 #include <fcntl.h>
 #include <dirent.h>
+#include <sys/epoll.h>
 #include <sys/poll.h>
 
 #include <linux/input.h>
@@ -46,12 +50,38 @@ static unsigned ev_count = 0;
 static unsigned ev_dev_count = 0;
 static unsigned ev_misc_count = 0;
 
+// all fds are registered in one epoll set: ev_wait() no longer has to
+// scan every fd, and ev_dispatch() only visits the ready ones
+static int ev_epoll_fd = -1;
+static struct epoll_event ev_ready[MAX_DEVICES + MAX_MISC_FDS];
+static int ev_ready_count = 0;
+
+// kernel timestamp (CLOCK_MONOTONIC if the driver supports it) of the
+// last event returned by ev_get_input_batch(), in usec
+static long long ev_last_input_usec = 0;
+static int ev_clock_monotonic = 0;
+
+static int ev_epoll_add(unsigned n)
+{
+    struct epoll_event e;
+
+    memset(&e, 0, sizeof(e));
+    e.events = EPOLLIN;
+    e.data.u32 = n;
+    return epoll_ctl(ev_epoll_fd, EPOLL_CTL_ADD, ev_fds[n].fd, &e);
+}
+
 int ev_init(ev_callback input_cb, void *data)
 {
     DIR *dir;
     struct dirent *de;
     int fd;
 
+    // created even without any device: ev_wait() must block on it
+    ev_epoll_fd = epoll_create(MAX_DEVICES + MAX_MISC_FDS);
+    if (ev_epoll_fd < 0)
+        return -1;
+
     dir = opendir("/dev/input");
     if(dir != 0) {
         while((de = readdir(dir))) {
@@ -75,10 +105,25 @@ int ev_init(ev_callback input_cb, void *data)
                 continue;
             }
 
+            // events are drained in bulk: never block in read()
+            fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+
+#ifdef EVIOCSCLOCKID
+            // stamp events on the same clock as our redraw timing
+            int clk = CLOCK_MONOTONIC;
+            if (ioctl(fd, EVIOCSCLOCKID, &clk) == 0)
+                ev_clock_monotonic = 1;
+#endif
+
             ev_fds[ev_count].fd = fd;
             ev_fds[ev_count].events = POLLIN;
             ev_fdinfo[ev_count].cb = input_cb;
             ev_fdinfo[ev_count].data = data;
+            if (ev_epoll_add(ev_count) != 0) {
+                // never watched: don't count it
+                close(fd);
+                continue;
+            }
             ev_count++;
             ev_dev_count++;
             if (ev_dev_count == (MAX_DEVICES + MAX_MISC_FDS)) break;
@@ -90,13 +135,15 @@ int ev_init(ev_callback input_cb, void *data)
 
 int ev_add_fd(int fd, ev_callback cb, void *data)
 {
-    if (ev_misc_count == MAX_MISC_FDS || cb == NULL)
+    if (ev_misc_count == MAX_MISC_FDS || cb == NULL || ev_epoll_fd < 0)
         return -1;
 
     ev_fds[ev_count].fd = fd;
     ev_fds[ev_count].events = POLLIN;
     ev_fdinfo[ev_count].cb = cb;
     ev_fdinfo[ev_count].data = data;
+    if (ev_epoll_add(ev_count) != 0)
+        return -1;
     ev_count++;
     ev_misc_count++;
     return 0;
@@ -109,40 +156,150 @@ void ev_exit(void)
     }
     ev_misc_count = 0;
     ev_dev_count = 0;
+
+    if (ev_epoll_fd >= 0) {
+        close(ev_epoll_fd);
+        ev_epoll_fd = -1;
+    }
+    ev_ready_count = 0;
 }
 
 int ev_wait(int timeout)
 {
     int r;
 
-    r = poll(ev_fds, ev_count, timeout);
-    if (r <= 0)
+    // maxevents must be positive: with no fd in the set, this blocks
+    // until the timeout, as poll() on no fd did
+    r = epoll_wait(ev_epoll_fd, ev_ready, ev_count > 0 ? ev_count : 1, timeout);
+    if (r <= 0) {
+        ev_ready_count = 0;
         return -1;
+    }
+    ev_ready_count = r;
     return 0;
 }
 
 void ev_dispatch(void)
 {
-    unsigned n;
-    int ret;
+    int i;
+
+    for (i = 0; i < ev_ready_count; i++) {
+        unsigned n = ev_ready[i].data.u32;
+        short revents = 0;
+
+        if (ev_ready[i].events & EPOLLIN)
+            revents |= POLLIN;
+        if (ev_ready[i].events & EPOLLERR)
+            revents |= POLLERR;
+        if (ev_ready[i].events & EPOLLHUP)
+            revents |= POLLHUP;
 
-    for (n = 0; n < ev_count; n++) {
+        ev_fds[n].revents = revents;
         ev_callback cb = ev_fdinfo[n].cb;
-        if (cb && (ev_fds[n].revents & ev_fds[n].events))
-            cb(ev_fds[n].fd, ev_fds[n].revents, ev_fdinfo[n].data);
+        if (cb && (revents & ev_fds[n].events))
+            cb(ev_fds[n].fd, revents, ev_fdinfo[n].data);
     }
+    ev_ready_count = 0;
 }
 
 int ev_get_input(int fd, short revents, struct input_event *ev)
+{
+    return ev_get_input_batch(fd, revents, ev, 1) == 1 ? 0 : -1;
+}
+
+int ev_get_input_batch(int fd, short revents, struct input_event *ev, int max)
 {
     int r;
 
-    if (revents & POLLIN) {
-        r = read(fd, ev, sizeof(*ev));
-        if (r == sizeof(*ev))
-            return 0;
+    if (!(revents & POLLIN) || max <= 0)
+        return -1;
+
+    r = read(fd, ev, max * sizeof(*ev));
+    if (r < (int) sizeof(*ev))
+        return -1;
+
+    r /= sizeof(*ev);
+    ev_last_input_usec = ev[r - 1].time.tv_sec * 1000000LL + ev[r - 1].time.tv_usec;
+    return r;
+}
+
+// only these codes describe the position of the current slot: a newer
+// value of the same code before any slot/tracking change supersedes it
+static int ev_is_abs_motion(const struct input_event *ev)
+{
+    if (ev->type != EV_ABS)
+        return 0;
+
+    switch (ev->code) {
+        case ABS_X:
+        case ABS_Y:
+        case ABS_PRESSURE:
+        case ABS_MT_POSITION_X:
+        case ABS_MT_POSITION_Y:
+        case ABS_MT_TOUCH_MAJOR:
+        case ABS_MT_WIDTH_MAJOR:
+        case ABS_MT_PRESSURE:
+            return 1;
     }
-    return -1;
+    return 0;
+}
+
+int ev_coalesce_abs(struct input_event *ev, int count)
+{
+    int out = 0;
+    int i = 0;
+
+    while (i < count) {
+        // find a run of consecutive frames made of motion events only
+        int run_end = i;
+        int j = i;
+        while (j < count) {
+            if (ev[j].type == EV_SYN && ev[j].code == SYN_REPORT) {
+                if (j == i || j == run_end)
+                    break; // empty frame
+                run_end = ++j;
+            } else if (ev_is_abs_motion(&ev[j])) {
+                j++;
+            } else {
+                break;
+            }
+        }
+
+        if (run_end == i) {
+            // not a motion frame: keep the event as is
+            ev[out++] = ev[i++];
+            continue;
+        }
+
+        // keep the last value of each code in the run, followed by one SYN_REPORT
+        int k;
+        for (k = i; k < run_end - 1; k++) {
+            int m;
+            if (ev[k].type != EV_ABS)
+                continue;
+            for (m = k + 1; m < run_end; m++) {
+                if (ev[m].type == EV_ABS && ev[m].code == ev[k].code)
+                    break;
+            }
+            if (m == run_end)
+                ev[out++] = ev[k];
+        }
+        ev[out++] = ev[run_end - 1];
+        i = run_end;
+    }
+
+    return out;
+}
+
+long long ev_input_latency_usec(void)
+{
+    struct timespec ts;
+
+    if (ev_last_input_usec == 0)
+        return -1;
+
+    clock_gettime(ev_clock_monotonic ? CLOCK_MONOTONIC : CLOCK_REALTIME, &ts);
+    return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000 - ev_last_input_usec;
 }
 
 int ev_sync_key_state(ev_set_key_callback set_key_cb, void *data)
@@ -69,6 +69,19 @@ int ev_wait(int timeout);
 int ev_get_input(int fd, short revents, struct input_event *ev);
 void ev_dispatch(void);
 
+// Reads up to max pending events from fd in a single read().
+// Returns the number of events read, or -1 if none.
+int ev_get_input_batch(int fd, short revents, struct input_event *ev, int max);
+
+// Collapses consecutive SYN_REPORT frames that only move the current
+// touch slot into one frame holding the latest coordinates.
+// Returns the new number of events in ev.
+int ev_coalesce_abs(struct input_event *ev, int count);
+
+// usec elapsed since the kernel timestamp of the last input event read,
+// -1 if no event was read yet
+long long ev_input_latency_usec(void);
+
 // Resources
 
 // Returns 0 if no error, else negative.
@@ -17,11 +17,15 @@
 #include <stdlib.h>
 #include <unistd.h>
 
+#include <errno.h>
 #include <fcntl.h>
+#include <pthread.h>
 #include <stdio.h>
+#include <string.h>
 
 #include <sys/ioctl.h>
 #include <sys/mman.h>
+#include <sys/stat.h>
 #include <sys/types.h>
 
 #include <linux/fb.h>
@@ -33,6 +37,54 @@
 
 #include "minui.h"
 
+// Must match the framebuffer format picked in graphics.c: opaque images
+// are stored in this format so pixelflinger can blit them without a
+// per-pixel format conversion.
+#if defined(RECOVERY_BGRA)
+#define NATIVE_PIXEL_FORMAT GGL_PIXEL_FORMAT_BGRA_8888
+#define NATIVE_PIXEL_SIZE   4
+#elif defined(RECOVERY_RGBX)
+#define NATIVE_PIXEL_FORMAT GGL_PIXEL_FORMAT_RGBX_8888
+#define NATIVE_PIXEL_SIZE   4
+#else
+#define NATIVE_PIXEL_FORMAT GGL_PIXEL_FORMAT_RGB_565
+#define NATIVE_PIXEL_SIZE   2
+#endif
+
+// decoded surfaces are also dumped here so that a restarted recovery can
+// mmap them instead of decoding the png again
+#define RES_CACHE_DIR       "/tmp/.res_cache"
+#define RES_CACHE_MAGIC     0x53455243 // "CRES"
+#define RES_CACHE_VERSION   1
+
+typedef struct {
+    unsigned int magic;
+    unsigned int version;
+    long long src_mtime;
+    long long src_size;
+    unsigned int width;
+    unsigned int height;
+    unsigned int stride;
+    unsigned int format;
+    unsigned int data_len;
+    unsigned int pad;
+} res_cache_header;
+
+typedef struct res_entry {
+    char path[256];
+    time_t mtime;
+    off_t size;
+    GGLSurface* surface;
+    void* map;      // pixels mapped from RES_CACHE_DIR, else NULL
+    size_t map_len;
+    int refs;
+    int stale;      // source png changed, free when last user releases it
+    struct res_entry* next;
+} res_entry;
+
+static res_entry* res_cache = NULL;
+static pthread_mutex_t res_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
 // libpng gives "undefined reference to 'pow'" errors, and I have no
 // idea how to convince the build system to link with -lm.  We don't
 // need this functionality (it's used for gamma adjustment) so provide
@@ -41,8 +93,8 @@ double pow(double x, double y) {
     return x;
 }
 
-int res_create_surface(const char* name, gr_surface* pSurface) {
-    char resPath[256];
+// decode png file to a RGBX_8888 or RGBA_8888 surface
+static int res_decode_png(const char* resPath, GGLSurface** pSurface) {
     GGLSurface* surface = NULL;
     int result = 0;
     unsigned char header[8];
@@ -51,8 +103,6 @@ int res_create_surface(const char* name, gr_surface* pSurface) {
 
     *pSurface = NULL;
 
-    snprintf(resPath, sizeof(resPath)-1, "/res/images/%s.png", name);
-    resPath[sizeof(resPath)-1] = '\0';
     FILE* fp = fopen(resPath, "rb");
     if (fp == NULL) {
         result = -1;
@@ -103,7 +153,7 @@ int res_create_surface(const char* name, gr_surface* pSurface) {
           ((channels == 3 && color_type == PNG_COLOR_TYPE_RGB) ||
            (channels == 4 && color_type == PNG_COLOR_TYPE_RGBA) ||
            (channels == 1 && color_type == PNG_COLOR_TYPE_PALETTE)))) {
-        return -7;
+        result = -7;
         goto exit;
     }
 
@@ -132,6 +182,8 @@ int res_create_surface(const char* name, gr_surface* pSurface) {
 
     unsigned y;
     if (channels == 3 || (channels == 1 && !alpha)) {
+        // palette images without tRNS are opaque too
+        surface->format = GGL_PIXEL_FORMAT_RGBX_8888;
         for (y = 0; y < height; ++y) {
             unsigned char* pRow = pData + y * stride;
             png_read_row(png_ptr, pRow, NULL);
@@ -157,7 +209,7 @@ int res_create_surface(const char* name, gr_surface* pSurface) {
         }
     }
 
-    *pSurface = (gr_surface) surface;
+    *pSurface = surface;
 
 exit:
     png_destroy_read_struct(&png_ptr, &info_ptr, NULL);
@@ -173,9 +225,283 @@ exit:
     return result;
 }
 
+// Convert an opaque RGBX_8888 surface in place to the framebuffer format.
+// Surfaces with an alpha channel are kept in RGBA_8888 as pixelflinger
+// needs the alpha for GGL_SRC_ALPHA blending.
+// Returns the (possibly reallocated) surface.
+static GGLSurface* res_convert_native(GGLSurface* surface) {
+    if (surface->format != GGL_PIXEL_FORMAT_RGBX_8888 ||
+            NATIVE_PIXEL_FORMAT == GGL_PIXEL_FORMAT_RGBX_8888)
+        return surface;
+
+    unsigned char* src = (unsigned char*) surface->data;
+    size_t count = (size_t) surface->width * surface->height;
+    size_t i;
+
+    if (NATIVE_PIXEL_SIZE == 2) {
+        // converting forward is safe: destination never overtakes source
+        unsigned short* dst = (unsigned short*) surface->data;
+        for (i = 0; i < count; ++i, src += 4) {
+            dst[i] = ((src[0] & 0xf8) << 8) | ((src[1] & 0xfc) << 3) | (src[2] >> 3);
+        }
+        GGLSurface* shrunk = realloc(surface, sizeof(GGLSurface) + count * 2);
+        if (shrunk != NULL) {
+            surface = shrunk;
+            surface->data = (GGLubyte*) (surface + 1);
+        }
+    } else {
+        // BGRA_8888
+        for (i = 0; i < count; ++i, src += 4) {
+            unsigned char r = src[0];
+            src[0] = src[2];
+            src[2] = r;
+        }
+    }
+
+    surface->format = NATIVE_PIXEL_FORMAT;
+    return surface;
+}
+
+static size_t res_surface_data_len(const GGLSurface* surface) {
+    size_t bpp = (surface->format == GGL_PIXEL_FORMAT_RGB_565) ? 2 : 4;
+    return (size_t) surface->stride * surface->height * bpp;
+}
+
+static void res_cache_file_path(const char* name, char* buf, size_t len) {
+    char* p;
+    snprintf(buf, len, "%s/%s.raw", RES_CACHE_DIR, name);
+    // flatten any sub-directory in name
+    for (p = buf + strlen(RES_CACHE_DIR) + 1; *p != '\0'; ++p) {
+        if (*p == '/')
+            *p = '_';
+    }
+}
+
+// mmap a previously dumped surface if it is still valid for the source png
+static int res_cache_file_load(const char* name, const struct stat* st, res_entry* e) {
+    char cachePath[256];
+    res_cache_header hdr;
+    struct stat cache_st;
+    GGLSurface* surface;
+    unsigned long long row_len;
+    void* map;
+    size_t map_len;
+    int fd;
+
+    res_cache_file_path(name, cachePath, sizeof(cachePath));
+    fd = open(cachePath, O_RDONLY);
+    if (fd < 0)
+        return -1;
+
+    if (read(fd, &hdr, sizeof(hdr)) != sizeof(hdr) ||
+            hdr.magic != RES_CACHE_MAGIC ||
+            hdr.version != RES_CACHE_VERSION ||
+            hdr.src_mtime != (long long) st->st_mtime ||
+            hdr.src_size != (long long) st->st_size) {
+        close(fd);
+        return -1;
+    }
+
+    // the file may be truncated or corrupted: reading pages mapped past
+    // its end raises SIGBUS on first draw, so check that the pixels the
+    // header describes fit in data_len, and data_len in the file
+    row_len = (unsigned long long) hdr.stride *
+            (hdr.format == GGL_PIXEL_FORMAT_RGB_565 ? 2 : 4);
+    if (hdr.width > hdr.stride ||
+            (hdr.height != 0 && row_len > hdr.data_len / hdr.height) ||
+            fstat(fd, &cache_st) != 0 ||
+            (long long) cache_st.st_size < (long long) sizeof(hdr) + hdr.data_len) {
+        close(fd);
+        return -1;
+    }
+    map_len = sizeof(hdr) + hdr.data_len;
+
+    map = mmap(NULL, map_len, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+        return -1;
+
+    surface = malloc(sizeof(GGLSurface));
+    if (surface == NULL) {
+        munmap(map, map_len);
+        return -1;
+    }
+    surface->version = sizeof(GGLSurface);
+    surface->width = hdr.width;
+    surface->height = hdr.height;
+    surface->stride = hdr.stride;
+    surface->format = hdr.format;
+    surface->data = (GGLubyte*) map + sizeof(hdr);
+
+    e->surface = surface;
+    e->map = map;
+    e->map_len = map_len;
+    return 0;
+}
+
+// best effort: a failure only means next start will decode the png again
+static void res_cache_file_save(const char* name, const struct stat* st, const GGLSurface* surface) {
+    char cachePath[256];
+    char tmpPath[256 + 12];
+    res_cache_header hdr;
+    int fd;
+
+    if (mkdir(RES_CACHE_DIR, 0700) != 0 && errno != EEXIST)
+        return;
+
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.magic = RES_CACHE_MAGIC;
+    hdr.version = RES_CACHE_VERSION;
+    hdr.src_mtime = (long long) st->st_mtime;
+    hdr.src_size = (long long) st->st_size;
+    hdr.width = surface->width;
+    hdr.height = surface->height;
+    hdr.stride = surface->stride;
+    hdr.format = surface->format;
+    hdr.data_len = res_surface_data_len(surface);
+
+    res_cache_file_path(name, cachePath, sizeof(cachePath));
+    snprintf(tmpPath, sizeof(tmpPath), "%s.%d", cachePath, (int) gettid());
+    fd = open(tmpPath, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    if (fd < 0)
+        return;
+
+    if (write(fd, &hdr, sizeof(hdr)) != sizeof(hdr) ||
+            write(fd, surface->data, hdr.data_len) != (ssize_t) hdr.data_len) {
+        close(fd);
+        unlink(tmpPath);
+        return;
+    }
+    close(fd);
+    rename(tmpPath, cachePath);
+}
+
+static void res_entry_destroy(res_entry* e) {
+    if (e->map != NULL) {
+        munmap(e->map, e->map_len);
+        free(e->surface);
+    } else {
+        // decoded surfaces are allocated with their pixels in one block
+        free(e->surface);
+    }
+    free(e);
+}
+
+// res_cache_lock must be held: take a reference on an up to date cached entry
+static res_entry* res_cache_lookup(const char* resPath, const struct stat* st) {
+    res_entry* e;
+    for (e = res_cache; e != NULL; e = e->next) {
+        if (e->stale || strcmp(e->path, resPath) != 0)
+            continue;
+        if (e->mtime == st->st_mtime && e->size == st->st_size) {
+            e->refs++;
+            return e;
+        }
+        // png was replaced: drop it from lookups, free once released
+        e->stale = 1;
+    }
+    return NULL;
+}
+
+// res_cache_lock must be held: purge stale entries nobody references anymore
+static void res_cache_purge() {
+    res_entry** pp = &res_cache;
+    while (*pp != NULL) {
+        res_entry* cur = *pp;
+        if (cur->stale && cur->refs <= 0) {
+            *pp = cur->next;
+            res_entry_destroy(cur);
+        } else {
+            pp = &cur->next;
+        }
+    }
+}
+
+// Surfaces are decoded once and kept in res_cache until their png changes
+// on disk (themes and background images overwrite /res/images/stitch.png).
+// Callers must not modify the returned surface: it may be shared.
+// Decoding is done without res_cache_lock, so several images can load in parallel.
+int res_create_surface(const char* name, gr_surface* pSurface) {
+    char resPath[256];
+    struct stat st;
+    res_entry* e;
+    res_entry* cached;
+    int result = 0;
+
+    *pSurface = NULL;
+
+    snprintf(resPath, sizeof(resPath)-1, "/res/images/%s.png", name);
+    resPath[sizeof(resPath)-1] = '\0';
+    if (stat(resPath, &st) != 0)
+        return -1;
+
+    pthread_mutex_lock(&res_cache_lock);
+    cached = res_cache_lookup(resPath, &st);
+    res_cache_purge();
+    pthread_mutex_unlock(&res_cache_lock);
+    if (cached != NULL) {
+        *pSurface = (gr_surface) cached->surface;
+        return 0;
+    }
+
+    e = calloc(1, sizeof(res_entry));
+    if (e == NULL)
+        return -8;
+    strcpy(e->path, resPath);
+    e->mtime = st.st_mtime;
+    e->size = st.st_size;
+
+    if (res_cache_file_load(name, &st, e) != 0) {
+        GGLSurface* surface;
+        result = res_decode_png(resPath, &surface);
+        if (result < 0) {
+            free(e);
+            return result;
+        }
+        e->surface = res_convert_native(surface);
+        res_cache_file_save(name, &st, e->surface);
+    }
+
+    pthread_mutex_lock(&res_cache_lock);
+    // another thread may have loaded the same image meanwhile: keep the first one
+    cached = res_cache_lookup(resPath, &st);
+    if (cached != NULL) {
+        res_entry_destroy(e);
+        e = cached;
+    } else {
+        e->refs = 1;
+        e->next = res_cache;
+        res_cache = e;
+    }
+    *pSurface = (gr_surface) e->surface;
+    res_cache_purge();
+    pthread_mutex_unlock(&res_cache_lock);
+    return 0;
+}
+
 void res_free_surface(gr_surface surface) {
     GGLSurface* pSurface = (GGLSurface*) surface;
-    if (pSurface) {
-        free(pSurface);
+    res_entry** pp;
+
+    if (pSurface == NULL)
+        return;
+
+    pthread_mutex_lock(&res_cache_lock);
+    for (pp = &res_cache; *pp != NULL; pp = &(*pp)->next) {
+        res_entry* e = *pp;
+        if (e->surface != pSurface)
+            continue;
+
+        // unreferenced up to date entries stay cached for the next caller
+        if (--e->refs <= 0 && e->stale) {
+            *pp = e->next;
+            res_entry_destroy(e);
+        }
+        pthread_mutex_unlock(&res_cache_lock);
+        return;
     }
+    pthread_mutex_unlock(&res_cache_lock);
+
+    // not a cached surface
+    free(pSurface);
 }
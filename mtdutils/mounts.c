@@ -19,179 +19,397 @@
 #include <string.h>
 #include <fcntl.h>
 #include <errno.h>
+#include <unistd.h>
+#include <poll.h>
+#include <pthread.h>
 #include <sys/mount.h>
 
 #include "mounts.h"
 
+/* The mount table lives in one arena: the table header, the volumes,
+ * both hash indexes and the text of /proc/self/mounts which the volume
+ * strings point into.  It is only re-read when poll() on the mounts file
+ * reports a change (POLLPRI/POLLERR), so repeated ensure_path_mounted()
+ * calls cost a syscall instead of a parse.
+ *
+ * The find functions return a copy of the volume in storage of the
+ * calling thread, valid until that thread's next lookup, so a caller and
+ * a background job can both scan without pulling the strings from under
+ * each other, and a replaced table is freed at once.
+ */
 typedef struct {
     MountedVolume *volumes;
-    int volumes_allocd;
     int volume_count;
+    int hash_size;          // power of two
+    int *by_mount_point;    // volume index + 1, 0 is empty
+    int *by_device;
+} MountsTable;
+
+typedef struct {
+    pthread_mutex_t lock;
+    int fd;
+    int stale;
+    MountsTable *table;
+    char *buf;
+    size_t buf_size;
 } MountsState;
 
 static MountsState g_mounts_state = {
-    NULL,   // volumes
-    0,      // volumes_allocd
-    0       // volume_count
+    PTHREAD_MUTEX_INITIALIZER,  // lock
+    -1,     // fd
+    1,      // stale
+    NULL,   // table
+    NULL,   // buf
+    0       // buf_size
 };
 
-static inline void
-free_volume_internals(const MountedVolume *volume, int zero)
+// per thread copy of the last volume found, strings in buf
+typedef struct {
+    MountedVolume volume;
+    char *buf;
+    size_t buf_size;
+} MountsCopy;
+
+static pthread_key_t g_mounts_copy_key;
+static pthread_once_t g_mounts_copy_once = PTHREAD_ONCE_INIT;
+
+#define PROC_MOUNTS_FILENAME   "/proc/self/mounts"
+
+static unsigned int
+mounts_hash(const char *str)
 {
-    free((char *)volume->device);
-    free((char *)volume->mount_point);
-    free((char *)volume->filesystem);
-    free((char *)volume->flags);
-    if (zero) {
-        memset((void *)volume, 0, sizeof(*volume));
+    unsigned int h = 2166136261u;
+    while (*str) {
+        h = (h ^ (unsigned char)*str++) * 16777619u;
     }
+    return h;
 }
 
-#define PROC_MOUNTS_FILENAME   "/proc/mounts"
+static void
+mounts_index_add(const MountsTable *t, int *index, const char *key, int i)
+{
+    unsigned int mask = t->hash_size - 1;
+    unsigned int h = mounts_hash(key) & mask;
+    while (index[h] != 0) {
+        // keep the first (lowest) mount, like a linear scan would
+        if (index == t->by_mount_point &&
+                strcmp(t->volumes[index[h] - 1].mount_point, key) == 0)
+            return;
+        if (index == t->by_device &&
+                strcmp(t->volumes[index[h] - 1].device, key) == 0)
+            return;
+        h = (h + 1) & mask;
+    }
+    index[h] = i + 1;
+}
 
-// this function is not thread safe as it free/malloc/modify the static g_mounts_state members
-// called by ensure_path_mounted/ensure_path_unmounted and a few other non thread concerned functions
-int
-scan_mounted_volumes()
+static const MountedVolume *
+mounts_index_find(const MountsTable *t, const int *index, const char *key,
+        int by_device)
 {
-    char buf[2048];
-    const char *bufp;
-    int fd;
-    ssize_t nbytes;
+    if (t == NULL || key == NULL)
+        return NULL;
+    unsigned int mask = t->hash_size - 1;
+    unsigned int h = mounts_hash(key) & mask;
+    while (index[h] != 0) {
+        const MountedVolume *v = &t->volumes[index[h] - 1];
+        const char *k = by_device ? v->device : v->mount_point;
+        /* May be null if it was unmounted and we haven't rescanned.
+         */
+        if (k != NULL && strcmp(k, key) == 0)
+            return v;
+        h = (h + 1) & mask;
+    }
+    return NULL;
+}
+
+static void
+mounts_copy_free(void *arg)
+{
+    MountsCopy *c = (MountsCopy *)arg;
+    free(c->buf);
+    free(c);
+}
 
-    if (g_mounts_state.volumes == NULL) {
-        const int numv = 32;
-        MountedVolume *volumes = malloc(numv * sizeof(*volumes));
-        if (volumes == NULL) {
+static void
+mounts_copy_key_create()
+{
+    pthread_key_create(&g_mounts_copy_key, mounts_copy_free);
+}
+
+// g_mounts_state.lock must be held: v points into the current table
+static const MountedVolume *
+mounts_copy(const MountedVolume *v)
+{
+    if (v == NULL)
+        return NULL;
+
+    pthread_once(&g_mounts_copy_once, mounts_copy_key_create);
+    MountsCopy *c = (MountsCopy *)pthread_getspecific(g_mounts_copy_key);
+    if (c == NULL) {
+        c = calloc(1, sizeof(MountsCopy));
+        if (c == NULL || pthread_setspecific(g_mounts_copy_key, c) != 0) {
+            free(c);
             errno = ENOMEM;
-            return -1;
+            return NULL;
         }
-        g_mounts_state.volumes = volumes;
-        g_mounts_state.volumes_allocd = numv;
-        memset(volumes, 0, numv * sizeof(*volumes));
-    } else {
-        /* Free the old volume strings.
-         */
-        int i;
-        for (i = 0; i < g_mounts_state.volume_count; i++) {
-            free_volume_internals(&g_mounts_state.volumes[i], 1);
+    }
+
+    const char *src[4] = { v->device, v->mount_point, v->filesystem, v->flags };
+    const char **dst[4] = { &c->volume.device, &c->volume.mount_point,
+            &c->volume.filesystem, &c->volume.flags };
+    size_t len[4];
+    size_t size = 0;
+    int i;
+    for (i = 0; i < 4; i++) {
+        len[i] = strlen(src[i]) + 1;
+        size += len[i];
+    }
+    if (size > c->buf_size) {
+        char *buf = realloc(c->buf, size);
+        if (buf == NULL) {
+            errno = ENOMEM;
+            return NULL;
         }
+        c->buf = buf;
+        c->buf_size = size;
     }
-    g_mounts_state.volume_count = 0;
+    char *p = c->buf;
+    for (i = 0; i < 4; i++) {
+        memcpy(p, src[i], len[i]);
+        *dst[i] = p;
+        p += len[i];
+    }
+    return &c->volume;
+}
 
-    /* Open and read the file contents.
-     */
-    fd = open(PROC_MOUNTS_FILENAME, O_RDONLY);
-    if (fd < 0) {
-        goto bail;
-    }
-    nbytes = read(fd, buf, sizeof(buf) - 1);
-    close(fd);
-    if (nbytes < 0) {
-        goto bail;
-    }
-    buf[nbytes] = '\0';
-
-    /* Parse the contents of the file, which looks like:
-     *
-     *     # cat /proc/mounts
-     *     rootfs / rootfs rw 0 0
-     *     /dev/pts /dev/pts devpts rw 0 0
-     *     /proc /proc proc rw 0 0
-     *     /sys /sys sysfs rw 0 0
-     *     /dev/block/mtdblock4 /system yaffs2 rw,nodev,noatime,nodiratime 0 0
-     *     /dev/block/mtdblock5 /data yaffs2 rw,nodev,noatime,nodiratime 0 0
-     *     /dev/block/mmcblk0p1 /sdcard vfat rw,sync,dirsync,fmask=0000,dmask=0000,codepage=cp437,iocharset=iso8859-1,utf8 0 0
-     *
-     * The zeroes at the end are dummy placeholder fields to make the
-     * output match Linux's /etc/mtab, but don't represent anything here.
-     */
-    bufp = buf;
-    while (nbytes > 0) {
-        char device[PATH_MAX];
-        char mount_point[PATH_MAX];
-        char filesystem[64];
-        char flags[256];
-        int matches;
-
-        /* %as is a gnu extension that malloc()s a string for each field.
-         */
-        matches = sscanf(bufp, "%63s %63s %63s %127s",
-                device, mount_point, filesystem, flags);
-
-        if (matches == 4) {
-            device[sizeof(device)-1] = '\0';
-            mount_point[sizeof(mount_point)-1] = '\0';
-            filesystem[sizeof(filesystem)-1] = '\0';
-            flags[sizeof(flags)-1] = '\0';
-
-            MountedVolume *v =
-                    &g_mounts_state.volumes[g_mounts_state.volume_count++];
-            v->device = strdup(device);
-            v->mount_point = strdup(mount_point);
-            v->filesystem = strdup(filesystem);
-            v->flags = strdup(flags);
+// /proc/mounts escapes space, tab, newline and backslash as \ooo
+static void
+mounts_unescape(char *str)
+{
+    char *out = str;
+    while (*str) {
+        if (str[0] == '\\' && str[1] >= '0' && str[1] <= '3' &&
+                str[2] >= '0' && str[2] <= '7' && str[3] >= '0' && str[3] <= '7') {
+            *out++ = ((str[1] - '0') << 6) | ((str[2] - '0') << 3) | (str[3] - '0');
+            str += 4;
         } else {
-printf("matches was %d on <<%.40s>>\n", matches, bufp);
+            *out++ = *str++;
         }
+    }
+    *out = '\0';
+}
 
-        /* Eat the line.
-         */
-        while (nbytes > 0 && *bufp != '\n') {
-            bufp++;
-            nbytes--;
+static char *
+mounts_next_field(char **bufp)
+{
+    char *p = *bufp;
+    while (*p == ' ' || *p == '\t')
+        p++;
+    if (*p == '\0')
+        return NULL;
+    char *field = p;
+    while (*p != '\0' && *p != ' ' && *p != '\t')
+        p++;
+    if (*p != '\0')
+        *p++ = '\0';
+    *bufp = p;
+    mounts_unescape(field);
+    return field;
+}
+
+// read the whole mounts file, whatever its size; returns its length
+static ssize_t
+mounts_read(MountsState *st)
+{
+    size_t len = 0;
+    if (st->buf == NULL) {
+        st->buf_size = 16384;
+        st->buf = malloc(st->buf_size);
+        if (st->buf == NULL) {
+            st->buf_size = 0;
+            errno = ENOMEM;
+            return -1;
         }
-        if (nbytes > 0) {
-            bufp++;
-            nbytes--;
+    }
+
+    for (;;) {
+        ssize_t nbytes = pread(st->fd, st->buf + len, st->buf_size - len - 1, len);
+        if (nbytes < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        if (nbytes == 0)
+            break;
+        len += nbytes;
+        if (len + 1 == st->buf_size) {
+            char *buf = realloc(st->buf, st->buf_size * 2);
+            if (buf == NULL) {
+                errno = ENOMEM;
+                return -1;
+            }
+            st->buf = buf;
+            st->buf_size *= 2;
         }
     }
+    st->buf[len] = '\0';
+    return len;
+}
 
-    return 0;
+/* Parse the contents of the file, which looks like:
+ *
+ *     # cat /proc/mounts
+ *     rootfs / rootfs rw 0 0
+ *     /dev/pts /dev/pts devpts rw 0 0
+ *     /proc /proc proc rw 0 0
+ *     /sys /sys sysfs rw 0 0
+ *     /dev/block/mtdblock4 /system yaffs2 rw,nodev,noatime,nodiratime 0 0
+ *     /dev/block/mtdblock5 /data yaffs2 rw,nodev,noatime,nodiratime 0 0
+ *     /dev/block/mmcblk0p1 /sdcard vfat rw,sync,dirsync,fmask=0000,dmask=0000,codepage=cp437,iocharset=iso8859-1,utf8 0 0
+ *
+ * The zeroes at the end are dummy placeholder fields to make the
+ * output match Linux's /etc/mtab, but don't represent anything here.
+ */
+static MountsTable *
+mounts_parse(const char *text, size_t len)
+{
+    int lines = 1;
+    size_t i;
+    for (i = 0; i < len; i++) {
+        if (text[i] == '\n')
+            lines++;
+    }
+
+    int hash_size = 16;
+    while (hash_size < lines * 2)
+        hash_size <<= 1;
 
-bail:
-//TODO: free the strings we've allocated.
-    g_mounts_state.volume_count = 0;
-    return -1;
+    size_t size = sizeof(MountsTable) +
+            lines * sizeof(MountedVolume) +
+            2 * hash_size * sizeof(int) +
+            len + 1;
+    char *arena = calloc(1, size);
+    if (arena == NULL) {
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    MountsTable *t = (MountsTable *)arena;
+    t->volumes = (MountedVolume *)(arena + sizeof(MountsTable));
+    t->hash_size = hash_size;
+    t->by_mount_point = (int *)(t->volumes + lines);
+    t->by_device = t->by_mount_point + hash_size;
+    char *bufp = (char *)(t->by_device + hash_size);
+    memcpy(bufp, text, len);
+
+    while (*bufp != '\0') {
+        char *line = bufp;
+        char *eol = strchr(line, '\n');
+        if (eol != NULL) {
+            *eol = '\0';
+            bufp = eol + 1;
+        } else {
+            bufp = line + strlen(line);
+        }
+
+        char *device = mounts_next_field(&line);
+        char *mount_point = mounts_next_field(&line);
+        char *filesystem = mounts_next_field(&line);
+        char *flags = mounts_next_field(&line);
+        if (flags == NULL) {
+            if (device != NULL)
+                printf("mounts: can't parse <<%.40s>>\n", device);
+            continue;
+        }
+
+        MountedVolume *v = &t->volumes[t->volume_count];
+        v->device = device;
+        v->mount_point = mount_point;
+        v->filesystem = filesystem;
+        v->flags = flags;
+        mounts_index_add(t, t->by_mount_point, mount_point, t->volume_count);
+        mounts_index_add(t, t->by_device, device, t->volume_count);
+        t->volume_count++;
+    }
+
+    return t;
 }
 
-const MountedVolume *
-find_mounted_volume_by_device(const char *device)
+// 1 if the mount table changed since it was last read
+static int
+mounts_changed(MountsState *st)
 {
-    if (g_mounts_state.volumes != NULL) {
-        int i;
-        for (i = 0; i < g_mounts_state.volume_count; i++) {
-            MountedVolume *v = &g_mounts_state.volumes[i];
-            /* May be null if it was unmounted and we haven't rescanned.
-             */
-            if (v->device != NULL) {
-                if (strcmp(v->device, device) == 0) {
-                    return v;
-                }
-            }
+    if (st->fd < 0) {
+        st->fd = open(PROC_MOUNTS_FILENAME, O_RDONLY | O_CLOEXEC);
+        if (st->fd < 0)
+            return -1;
+        return 1;
+    }
+    if (st->stale || st->table == NULL)
+        return 1;
+
+    struct pollfd pfd;
+    pfd.fd = st->fd;
+    pfd.events = POLLPRI | POLLERR;
+    pfd.revents = 0;
+    if (poll(&pfd, 1, 0) < 0)
+        return 1;
+    return (pfd.revents & (POLLPRI | POLLERR)) != 0;
+}
+
+// re-reads /proc/self/mounts only when the kernel reported a change
+// thread safe: lookups copy what they return, so the old table can go
+int
+scan_mounted_volumes()
+{
+    MountsState *st = &g_mounts_state;
+    int ret = 0;
+
+    pthread_mutex_lock(&st->lock);
+    int changed = mounts_changed(st);
+    if (changed < 0) {
+        ret = -1;
+    } else if (changed) {
+        ssize_t len = mounts_read(st);
+        MountsTable *t = (len < 0) ? NULL : mounts_parse(st->buf, len);
+        if (t == NULL) {
+            ret = -1;
+        } else {
+            free(st->table);
+            st->table = t;
+            st->stale = 0;
         }
     }
-    return NULL;
+    pthread_mutex_unlock(&st->lock);
+    return ret;
+}
+
+const MountedVolume *
+find_mounted_volume_by_device(const char *device)
+{
+    MountsTable *t;
+    const MountedVolume *v;
+
+    pthread_mutex_lock(&g_mounts_state.lock);
+    t = g_mounts_state.table;
+    v = (t == NULL) ? NULL : mounts_copy(mounts_index_find(t, t->by_device, device, 1));
+    pthread_mutex_unlock(&g_mounts_state.lock);
+    return v;
 }
 
 // returned v->filesystem is the real fstype from /proc/mounts
 const MountedVolume *
 find_mounted_volume_by_mount_point(const char *mount_point)
 {
-    if (g_mounts_state.volumes != NULL) {
-        int i;
-        for (i = 0; i < g_mounts_state.volume_count; i++) {
-            MountedVolume *v = &g_mounts_state.volumes[i];
-            /* May be null if it was unmounted and we haven't rescanned.
-             */
-            if (v->mount_point != NULL) {
-                if (strcmp(v->mount_point, mount_point) == 0) {
-                    return v;
-                }
-            }
-        }
-    }
-    return NULL;
+    MountsTable *t;
+    const MountedVolume *v;
+
+    pthread_mutex_lock(&g_mounts_state.lock);
+    t = g_mounts_state.table;
+    v = (t == NULL) ? NULL : mounts_copy(mounts_index_find(t, t->by_mount_point, mount_point, 0));
+    pthread_mutex_unlock(&g_mounts_state.lock);
+    return v;
 }
 
 int
@@ -203,7 +421,18 @@ unmount_mounted_volume(const MountedVolume *volume)
      */
     int ret = umount(volume->mount_point);
     if (ret == 0) {
-        free_volume_internals(volume, 1);
+        // the strings belong to the table arena, just hide the entry
+        MountsTable *t;
+        const MountedVolume *v;
+        pthread_mutex_lock(&g_mounts_state.lock);
+        t = g_mounts_state.table;
+        v = (t == NULL) ? NULL :
+                mounts_index_find(t, t->by_mount_point, volume->mount_point, 0);
+        if (v != NULL)
+            memset((void *)v, 0, sizeof(*v));
+        memset((void *)volume, 0, sizeof(*volume));
+        g_mounts_state.stale = 1;
+        pthread_mutex_unlock(&g_mounts_state.lock);
         return 0;
     }
     return ret;
@@ -28,6 +28,9 @@ typedef struct MountedVolume MountedVolume;
 
 int scan_mounted_volumes(void);
 
+/* The returned volume is a copy owned by the calling thread: it stays
+ * valid until the same thread looks up a volume again.
+ */
 const MountedVolume *find_mounted_volume_by_device(const char *device);
 
 const MountedVolume *
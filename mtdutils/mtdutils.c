@@ -22,6 +22,8 @@
 #include <errno.h>
 #include <sys/mount.h>  // for _IOW, _IOR, mount()
 #include <sys/stat.h>
+#include <sys/time.h>
+#include <pthread.h>
 #include <mtd/mtd-user.h>
 #undef NDEBUG
 #include <assert.h>
@@ -35,13 +37,35 @@ struct MtdPartition {
     char *name;
 };
 
+// bad_map values: MEMGETBADBLOCK result of each erase block
+#define MTD_BLOCK_GOOD      0
+#define MTD_BLOCK_BAD       1   // marked bad
+#define MTD_BLOCK_UNKNOWN   2   // query failed: don't write, but still erase it
+
+// Read ahead budget: whole blocks are read together, one ECC check per batch
+#define MTD_READ_AHEAD_BYTES    (1024 * 1024)
+
 struct MtdReadContext {
     const MtdPartition *partition;
     char *buffer;
     size_t consumed;
+    size_t filled;
     int fd;
+
+    int batch;                  // blocks per read
+    int block_count;
+    unsigned char *bad_map;     // scanned once, on first read
+    struct mtd_ecc_stats ecc;   // counters after the last read
+
+    long long bytes_read;
+    long long start_usec;
 };
 
+// Blocks written but not yet verified, and blocks erased ahead of the write cursor.
+// Only blocks the caller already gave data for are erased ahead.
+#define MTD_WRITE_SLOTS     4
+#define MTD_ERASE_AHEAD     4
+
 struct MtdWriteContext {
     const MtdPartition *partition;
     char *buffer;
@@ -51,6 +75,31 @@ struct MtdWriteContext {
     off_t* bad_block_offsets;
     int bad_block_alloc;
     int bad_block_count;
+
+    // Write cursor, the fd offset is not used (pread / pwrite)
+    off_t pos;
+    int block_count;
+    unsigned char *bad_map;     // scanned once, on first write
+    char *verify;
+
+    // The worker erases blocks ahead of the cursor and verifies written slots behind it
+    pthread_t worker;
+    int worker_running;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int stop;
+    int busy;
+    int erase_next;             // next block index to erase
+    int erase_limit;            // erase up to this block index (excluded)
+    unsigned char *erase_err;   // erase ahead failed for this block
+    char *slot_data[MTD_WRITE_SLOTS];
+    off_t slot_pos[MTD_WRITE_SLOTS];
+    int write_seq;              // slots written
+    int verify_seq;             // slots verified
+    int failed_seq;             // first slot that failed verification, or -1
+
+    long long bytes_written;
+    long long start_usec;
 };
 
 typedef struct {
@@ -254,12 +303,27 @@ mtd_partition_info(const MtdPartition *partition,
     return 0;
 }
 
+static long long mtd_now_usec() {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return (long long) tv.tv_sec * 1000000LL + tv.tv_usec;
+}
+
 MtdReadContext *mtd_read_partition(const MtdPartition *partition)
 {
-    MtdReadContext *ctx = (MtdReadContext*) malloc(sizeof(MtdReadContext));
+    MtdReadContext *ctx = (MtdReadContext*) calloc(1, sizeof(MtdReadContext));
     if (ctx == NULL) return NULL;
 
-    ctx->buffer = malloc(partition->erase_size);
+    ctx->block_count = partition->size / partition->erase_size;
+    ctx->batch = MTD_READ_AHEAD_BYTES / partition->erase_size;
+    if (ctx->batch > ctx->block_count) ctx->batch = ctx->block_count;
+    if (ctx->batch < 1) ctx->batch = 1;
+
+    ctx->buffer = malloc(ctx->batch * partition->erase_size);
+    if (ctx->buffer == NULL && ctx->batch > 1) {
+        ctx->batch = 1;
+        ctx->buffer = malloc(partition->erase_size);
+    }
     if (ctx->buffer == NULL) {
         free(ctx);
         return NULL;
@@ -275,63 +339,146 @@ MtdReadContext *mtd_read_partition(const MtdPartition *partition)
     }
 
     ctx->partition = partition;
-    ctx->consumed = partition->erase_size;
+    ctx->consumed = 0;
+    ctx->filled = 0;
     return ctx;
 }
 
 // Seeks to a location in the partition.  Don't mix with reads of
 // anything other than whole blocks; unpredictable things will result.
-void mtd_read_skip_to(const MtdReadContext* ctx, size_t offset) {
+void mtd_read_skip_to(MtdReadContext* ctx, size_t offset) {
+    // drop the read ahead
+    ctx->consumed = ctx->filled = 0;
     lseek64(ctx->fd, offset, SEEK_SET);
 }
 
-static int read_block(const MtdPartition *partition, int fd, char *data)
+// Scan the bad block map and take the ECC counters baseline once per context
+static int mtd_read_prepare(MtdReadContext *ctx)
 {
-    struct mtd_ecc_stats before, after;
-    if (ioctl(fd, ECCGETSTATS, &before)) {
+    if (ctx->bad_map != NULL) return 0;
+
+    if (ioctl(ctx->fd, ECCGETSTATS, &ctx->ecc)) {
         printf("mtd: ECCGETSTATS error (%s)\n", strerror(errno));
         return -1;
     }
 
-    loff_t pos = lseek64(fd, 0, SEEK_CUR);
-
-    ssize_t size = partition->erase_size;
-    int mgbb;
+    ctx->bad_map = calloc(ctx->block_count + 1, 1);
+    if (ctx->bad_map == NULL) return -1;
 
-    while (pos + size <= (int) partition->size) {
-        if (lseek64(fd, pos, SEEK_SET) != pos || read(fd, data, size) != size) {
-            printf("mtd: read error at 0x%08llx (%s)\n",
-                    pos, strerror(errno));
-        } else if (ioctl(fd, ECCGETSTATS, &after)) {
-            printf("mtd: ECCGETSTATS error (%s)\n", strerror(errno));
-            return -1;
-        } else if (after.failed != before.failed) {
-            printf("mtd: ECC errors (%d soft, %d hard) at 0x%08llx\n",
-                    after.corrected - before.corrected,
-                    after.failed - before.failed, pos);
-            // copy the comparison baseline for the next read.
-            memcpy(&before, &after, sizeof(struct mtd_ecc_stats));
-        } else if ((mgbb = ioctl(fd, MEMGETBADBLOCK, &pos))) {
+    int i;
+    for (i = 0; i < ctx->block_count; ++i) {
+        loff_t bpos = (loff_t) i * ctx->partition->erase_size;
+        int mgbb = ioctl(ctx->fd, MEMGETBADBLOCK, &bpos);
+        if (mgbb) {
             fprintf(stderr,
                     "mtd: MEMGETBADBLOCK returned %d at 0x%08llx (errno=%d)\n",
-                    mgbb, pos, errno);
-        } else {
-            return 0;  // Success!
+                    mgbb, bpos, errno);
+            ctx->bad_map[i] = mgbb > 0 ? MTD_BLOCK_BAD : MTD_BLOCK_UNKNOWN;
         }
+    }
 
-        pos += partition->erase_size;
+    ctx->start_usec = mtd_now_usec();
+    return 0;
+}
+
+// Read one block at pos and check the ECC counters did not move
+static int read_block(MtdReadContext *ctx, char *data, loff_t pos)
+{
+    ssize_t size = ctx->partition->erase_size;
+    struct mtd_ecc_stats after;
+
+    if (pread64(ctx->fd, data, size, pos) != size) {
+        printf("mtd: read error at 0x%08llx (%s)\n",
+                pos, strerror(errno));
+        return 1;
+    }
+    if (ioctl(ctx->fd, ECCGETSTATS, &after)) {
+        printf("mtd: ECCGETSTATS error (%s)\n", strerror(errno));
+        return -1;
+    }
+    if (after.failed != ctx->ecc.failed) {
+        printf("mtd: ECC errors (%d soft, %d hard) at 0x%08llx\n",
+                after.corrected - ctx->ecc.corrected,
+                after.failed - ctx->ecc.failed, pos);
+        // copy the comparison baseline for the next read.
+        memcpy(&ctx->ecc, &after, sizeof(struct mtd_ecc_stats));
+        return 1;
+    }
+    memcpy(&ctx->ecc, &after, sizeof(struct mtd_ecc_stats));
+    return 0;
+}
+
+// Read up to want good blocks from the current position into data, skipping bad ones.
+// Consecutive good blocks are read with one call and one ECC check; when the counters
+// moved, each block of the run is read again alone to find and skip the failing ones.
+// Returns the number of blocks read, -1 on error or at the end of the partition.
+static int read_blocks(MtdReadContext *ctx, char *data, int want)
+{
+    const MtdPartition *partition = ctx->partition;
+    ssize_t size = partition->erase_size;
+
+    if (mtd_read_prepare(ctx)) return -1;
+    if (want > ctx->batch) want = ctx->batch;
+
+    loff_t pos = lseek64(ctx->fd, 0, SEEK_CUR);
+
+    while (pos + size <= (loff_t) partition->size) {
+        int index = pos / size;
+        if (ctx->bad_map[index] != MTD_BLOCK_GOOD) {
+            pos += size;
+            continue;
+        }
+
+        int count = 1;
+        while (count < want && index + count < ctx->block_count &&
+               ctx->bad_map[index + count] == MTD_BLOCK_GOOD) {
+            ++count;
+        }
+
+        ssize_t len = count * size;
+        struct mtd_ecc_stats after;
+        if (pread64(ctx->fd, data, len, pos) == len) {
+            if (ioctl(ctx->fd, ECCGETSTATS, &after)) {
+                printf("mtd: ECCGETSTATS error (%s)\n", strerror(errno));
+                return -1;
+            }
+            if (after.failed == ctx->ecc.failed) {
+                memcpy(&ctx->ecc, &after, sizeof(struct mtd_ecc_stats));
+                lseek64(ctx->fd, pos + len, SEEK_SET);
+                ctx->bytes_read += len;
+                return count;
+            }
+            memcpy(&ctx->ecc, &after, sizeof(struct mtd_ecc_stats));
+        }
+
+        // Counters moved or the run could not be read: one block at a time
+        int i;
+        int good = 0;
+        for (i = 0; i < count; ++i, pos += size) {
+            int ret = read_block(ctx, data + good * size, pos);
+            if (ret < 0) return -1;
+            if (ret == 0) ++good;
+        }
+        if (good > 0) {
+            lseek64(ctx->fd, pos, SEEK_SET);
+            ctx->bytes_read += good * size;
+            return good;
+        }
     }
 
+    lseek64(ctx->fd, pos, SEEK_SET);
     errno = ENOSPC;
     return -1;
 }
 
 ssize_t mtd_read_data(MtdReadContext *ctx, char *data, size_t len)
 {
+    size_t erase_size = ctx->partition->erase_size;
     size_t read = 0;
+    int blocks;
     while (read < len) {
-        if (ctx->consumed < ctx->partition->erase_size) {
-            size_t avail = ctx->partition->erase_size - ctx->consumed;
+        if (ctx->consumed < ctx->filled) {
+            size_t avail = ctx->filled - ctx->consumed;
             size_t copy = len - read < avail ? len - read : avail;
             memcpy(data + read, ctx->buffer + ctx->consumed, copy);
             ctx->consumed += copy;
@@ -339,19 +486,21 @@ ssize_t mtd_read_data(MtdReadContext *ctx, char *data, size_t len)
         }
 
         // Read complete blocks directly into the user's buffer
-        while (ctx->consumed == ctx->partition->erase_size &&
-               len - read >= ctx->partition->erase_size) {
-            if (read_block(ctx->partition, ctx->fd, data + read)) return -1;
-            read += ctx->partition->erase_size;
+        while (ctx->consumed == ctx->filled && len - read >= erase_size) {
+            blocks = read_blocks(ctx, data + read, (len - read) / erase_size);
+            if (blocks < 0) return -1;
+            read += blocks * erase_size;
         }
 
         if (read >= len) {
             return read;
         }
 
-        // Read the next block into the buffer
-        if (ctx->consumed == ctx->partition->erase_size && read < len) {
-            if (read_block(ctx->partition, ctx->fd, ctx->buffer)) return -1;
+        // Read the next blocks into the buffer
+        if (ctx->consumed == ctx->filled && read < len) {
+            blocks = read_blocks(ctx, ctx->buffer, ctx->batch);
+            if (blocks < 0) return -1;
+            ctx->filled = blocks * erase_size;
             ctx->consumed = 0;
         }
     }
@@ -361,20 +510,25 @@ ssize_t mtd_read_data(MtdReadContext *ctx, char *data, size_t len)
 
 void mtd_read_close(MtdReadContext *ctx)
 {
+    if (ctx->bytes_read > 0) {
+        long long msec = (mtd_now_usec() - ctx->start_usec) / 1000;
+        printf("mtd: read %lld KB in %lld ms (%lld.%02lld MB/s)\n",
+                ctx->bytes_read / 1024, msec,
+                msec > 0 ? ctx->bytes_read * 1000 / msec / (1024 * 1024) : 0,
+                msec > 0 ? ctx->bytes_read * 1000 / msec % (1024 * 1024) * 100 / (1024 * 1024) : 0);
+    }
+
     close(ctx->fd);
+    free(ctx->bad_map);
     free(ctx->buffer);
     free(ctx);
 }
 
 MtdWriteContext *mtd_write_partition(const MtdPartition *partition)
 {
-    MtdWriteContext *ctx = (MtdWriteContext*) malloc(sizeof(MtdWriteContext));
+    MtdWriteContext *ctx = (MtdWriteContext*) calloc(1, sizeof(MtdWriteContext));
     if (ctx == NULL) return NULL;
 
-    ctx->bad_block_offsets = NULL;
-    ctx->bad_block_alloc = 0;
-    ctx->bad_block_count = 0;
-
     ctx->buffer = malloc(partition->erase_size);
     if (ctx->buffer == NULL) {
         free(ctx);
@@ -392,69 +546,172 @@ MtdWriteContext *mtd_write_partition(const MtdPartition *partition)
 
     ctx->partition = partition;
     ctx->stored = 0;
+    ctx->pos = 0;
+    ctx->block_count = partition->size / partition->erase_size;
+    ctx->failed_seq = -1;
+    pthread_mutex_init(&ctx->lock, NULL);
+    pthread_cond_init(&ctx->cond, NULL);
     return ctx;
 }
 
+// Keep the list sorted for mtd_find_write_start(): a block that fails
+// verification is only known after later blocks were written
 static void add_bad_block_offset(MtdWriteContext *ctx, off_t pos) {
+    int i = ctx->bad_block_count;
+    while (i > 0 && ctx->bad_block_offsets[i - 1] >= pos) {
+        if (ctx->bad_block_offsets[i - 1] == pos) return;
+        --i;
+    }
     if (ctx->bad_block_count + 1 > ctx->bad_block_alloc) {
         ctx->bad_block_alloc = (ctx->bad_block_alloc*2) + 1;
         ctx->bad_block_offsets = realloc(ctx->bad_block_offsets,
                                          ctx->bad_block_alloc * sizeof(off_t));
     }
-    ctx->bad_block_offsets[ctx->bad_block_count++] = pos;
+    memmove(ctx->bad_block_offsets + i + 1, ctx->bad_block_offsets + i,
+            (ctx->bad_block_count - i) * sizeof(off_t));
+    ctx->bad_block_offsets[i] = pos;
+    ctx->bad_block_count++;
 }
 
-static int write_block(MtdWriteContext *ctx, const char *data)
+static void *mtd_write_worker(void *cookie)
 {
-    const MtdPartition *partition = ctx->partition;
-    int fd = ctx->fd;
+    MtdWriteContext *ctx = (MtdWriteContext*) cookie;
+    ssize_t size = ctx->partition->erase_size;
+
+    pthread_mutex_lock(&ctx->lock);
+    while (!ctx->stop) {
+        if (ctx->erase_next < ctx->erase_limit) {
+            int index = ctx->erase_next;
+            int err = 0;
+            ctx->busy = 1;
+            pthread_mutex_unlock(&ctx->lock);
+
+            if (ctx->bad_map[index] == MTD_BLOCK_GOOD) {
+                struct erase_info_user erase_info;
+                erase_info.start = (off_t) index * size;
+                erase_info.length = size;
+                if (ioctl(ctx->fd, MEMERASE, &erase_info) < 0) {
+                    printf("mtd: erase failure at 0x%08lx (%s)\n",
+                            (off_t) erase_info.start, strerror(errno));
+                    err = 1;
+                }
+            }
 
-    off_t pos = lseek(fd, 0, SEEK_CUR);
-    if (pos == (off_t) -1) return 1;
+            pthread_mutex_lock(&ctx->lock);
+            ctx->erase_err[index] = err;
+            ctx->erase_next++;
+            ctx->busy = 0;
+            pthread_cond_broadcast(&ctx->cond);
+        } else if (ctx->failed_seq < 0 && ctx->verify_seq < ctx->write_seq) {
+            int seq = ctx->verify_seq;
+            const char *data = ctx->slot_data[seq % MTD_WRITE_SLOTS];
+            off_t pos = ctx->slot_pos[seq % MTD_WRITE_SLOTS];
+            int ok = 0;
+            ctx->busy = 1;
+            pthread_mutex_unlock(&ctx->lock);
+
+            if (pread(ctx->fd, ctx->verify, size, pos) != size) {
+                printf("mtd: re-read error at 0x%08lx (%s)\n",
+                        pos, strerror(errno));
+            } else if (memcmp(data, ctx->verify, size) != 0) {
+                printf("mtd: verification error at 0x%08lx (%s)\n",
+                        pos, strerror(errno));
+            } else {
+                printf("mtd: successfully wrote block at %lx\n", pos);
+                ok = 1;
+            }
 
+            pthread_mutex_lock(&ctx->lock);
+            if (ok) ctx->verify_seq++;
+            else ctx->failed_seq = seq;
+            ctx->busy = 0;
+            pthread_cond_broadcast(&ctx->cond);
+        } else {
+            pthread_cond_wait(&ctx->cond, &ctx->lock);
+        }
+    }
+    pthread_mutex_unlock(&ctx->lock);
+    return NULL;
+}
+
+// Scan the bad block map once and start the erase / verify worker.
+// Without memory or thread, blocks are written one by one as before.
+static int mtd_write_prepare(MtdWriteContext *ctx)
+{
+    if (ctx->bad_map != NULL) return 0;
+
+    const MtdPartition *partition = ctx->partition;
     ssize_t size = partition->erase_size;
 
-    // fix crash on large erase block
-    // https://github.com/CyanogenMod/android_bootable_recovery/commit/35ced477713582fae54c1ac70198bf78a1a44783
-    char* verify = (char*)malloc(size * sizeof(char));
-    if (verify == NULL)
-        return 1;
+    ctx->bad_map = calloc(ctx->block_count + 1, 1);
+    ctx->erase_err = calloc(ctx->block_count + 1, 1);
+    ctx->verify = malloc(size);
+    if (ctx->bad_map == NULL || ctx->erase_err == NULL || ctx->verify == NULL)
+        return -1;
+
+    int i;
+    for (i = 0; i < ctx->block_count; ++i) {
+        loff_t bpos = (loff_t) i * size;
+        int ret = ioctl(ctx->fd, MEMGETBADBLOCK, &bpos);
+        if (ret > 0) {
+            ctx->bad_map[i] = MTD_BLOCK_BAD;
+        } else if (ret != 0 && !(ret == -1 && errno == EOPNOTSUPP)) {
+            ctx->bad_map[i] = MTD_BLOCK_UNKNOWN;
+        }
+    }
+
+    for (i = 0; i < MTD_WRITE_SLOTS; ++i) {
+        ctx->slot_data[i] = malloc(size);
+        if (ctx->slot_data[i] == NULL) return 0;
+    }
+
+    ctx->erase_next = ctx->erase_limit = ctx->pos / size;
+    if (pthread_create(&ctx->worker, NULL, mtd_write_worker, ctx) == 0)
+        ctx->worker_running = 1;
+    return 0;
+}
+
+// Erase, write and verify one block at or after the write cursor, skipping
+// bad blocks. A block is given up after two failed attempts.
+static int write_block_sync(MtdWriteContext *ctx, const char *data, int retry)
+{
+    const MtdPartition *partition = ctx->partition;
+    int fd = ctx->fd;
+    off_t pos = ctx->pos;
+    ssize_t size = partition->erase_size;
 
     while (pos + size <= (int) partition->size) {
-        loff_t bpos = pos;
-        int ret = ioctl(fd, MEMGETBADBLOCK, &bpos);
-        if (ret != 0 && !(ret == -1 && errno == EOPNOTSUPP)) {
+        int bad = ctx->bad_map[pos / size];
+        if (bad != MTD_BLOCK_GOOD) {
             add_bad_block_offset(ctx, pos);
             fprintf(stderr,
-                    "mtd: not writing bad block at 0x%08lx (ret %d errno %d)\n",
-                    pos, ret, errno);
+                    "mtd: not writing bad block at 0x%08lx (%s)\n",
+                    pos, bad == MTD_BLOCK_BAD ? "marked bad" : "MEMGETBADBLOCK failed");
             pos += partition->erase_size;
+            retry = 0;
             continue;  // Don't try to erase known factory-bad blocks.
         }
 
         struct erase_info_user erase_info;
         erase_info.start = pos;
         erase_info.length = size;
-        int retry;
-        for (retry = 0; retry < 2; ++retry) {
+        for (; retry < 2; ++retry) {
             if (ioctl(fd, MEMERASE, &erase_info) < 0) {
                 printf("mtd: erase failure at 0x%08lx (%s)\n",
                         pos, strerror(errno));
                 continue;
             }
-            if (lseek(fd, pos, SEEK_SET) != pos ||
-                write(fd, data, size) != size) {
+            if (pwrite(fd, data, size, pos) != size) {
                 printf("mtd: write error at 0x%08lx (%s)\n",
                         pos, strerror(errno));
             }
 
-            if (lseek(fd, pos, SEEK_SET) != pos ||
-                read(fd, verify, size) != size) {
+            if (pread(fd, ctx->verify, size, pos) != size) {
                 printf("mtd: re-read error at 0x%08lx (%s)\n",
                         pos, strerror(errno));
                 continue;
             }
-            if (memcmp(data, verify, size) != 0) {
+            if (memcmp(data, ctx->verify, size) != 0) {
                 printf("mtd: verification error at 0x%08lx (%s)\n",
                         pos, strerror(errno));
                 continue;
@@ -464,7 +721,7 @@ static int write_block(MtdWriteContext *ctx, const char *data)
                 printf("mtd: wrote block after %d retries\n", retry);
             }
             printf("mtd: successfully wrote block at %lx\n", pos);
-            free(verify);
+            ctx->pos = pos + size;
             return 0;  // Success!
         }
 
@@ -473,19 +730,160 @@ static int write_block(MtdWriteContext *ctx, const char *data)
         printf("mtd: skipping write block at 0x%08lx\n", pos);
         ioctl(fd, MEMERASE, &erase_info);
         pos += partition->erase_size;
+        retry = 0;
     }
 
-    free(verify);
-
     // Ran out of space on the device
+    ctx->pos = pos;
     errno = ENOSPC;
     return -1;
 }
 
+// Wait until all written blocks are verified and the worker is idle. When a block
+// failed verification, it and all blocks written after it are written again from
+// its position: its retry happens in place and, if it goes bad, the next ones shift.
+static int mtd_write_drain(MtdWriteContext *ctx)
+{
+    if (!ctx->worker_running) return 0;
+
+    int ret = 0;
+    ssize_t size = ctx->partition->erase_size;
+
+    pthread_mutex_lock(&ctx->lock);
+    ctx->erase_limit = ctx->erase_next;
+    while (ctx->busy || (ctx->failed_seq < 0 && ctx->verify_seq < ctx->write_seq))
+        pthread_cond_wait(&ctx->cond, &ctx->lock);
+
+    if (ctx->failed_seq >= 0) {
+        int seq;
+        ctx->pos = ctx->slot_pos[ctx->failed_seq % MTD_WRITE_SLOTS];
+        for (seq = ctx->failed_seq; seq < ctx->write_seq; ++seq) {
+            if (write_block_sync(ctx, ctx->slot_data[seq % MTD_WRITE_SLOTS],
+                                 seq == ctx->failed_seq ? 1 : 0)) {
+                ret = -1;
+                break;
+            }
+        }
+    }
+
+    ctx->write_seq = ctx->verify_seq = 0;
+    ctx->failed_seq = -1;
+    ctx->erase_next = ctx->erase_limit = ctx->pos / size;
+    pthread_mutex_unlock(&ctx->lock);
+    return ret;
+}
+
+static int write_block(MtdWriteContext *ctx, const char *data)
+{
+    const MtdPartition *partition = ctx->partition;
+    ssize_t size = partition->erase_size;
+
+    if (ctx->start_usec == 0) ctx->start_usec = mtd_now_usec();
+    if (mtd_write_prepare(ctx)) return 1;
+    if (!ctx->worker_running) {
+        if (write_block_sync(ctx, data, 0)) return -1;
+        ctx->bytes_written += size;
+        return 0;
+    }
+
+    for (;;) {
+        int index = ctx->pos / size;
+        while (index < ctx->block_count && ctx->bad_map[index] != MTD_BLOCK_GOOD) {
+            add_bad_block_offset(ctx, (off_t) index * size);
+            fprintf(stderr,
+                    "mtd: not writing bad block at 0x%08lx (%s)\n",
+                    (off_t) index * size,
+                    ctx->bad_map[index] == MTD_BLOCK_BAD ? "marked bad" : "MEMGETBADBLOCK failed");
+            ++index;
+        }
+        if (index >= ctx->block_count) {
+            if (mtd_write_drain(ctx) == 0) {
+                // Ran out of space on the device
+                errno = ENOSPC;
+            }
+            return -1;
+        }
+
+        // Wait for a free slot and for the block to be erased
+        pthread_mutex_lock(&ctx->lock);
+        if (ctx->erase_limit <= index) {
+            ctx->erase_limit = index + 1;
+            pthread_cond_broadcast(&ctx->cond);
+        }
+        while (ctx->failed_seq < 0 &&
+               (ctx->write_seq - ctx->verify_seq >= MTD_WRITE_SLOTS || ctx->erase_next <= index))
+            pthread_cond_wait(&ctx->cond, &ctx->lock);
+        int failed = ctx->failed_seq >= 0;
+        int erase_err = ctx->erase_err[index];
+        pthread_mutex_unlock(&ctx->lock);
+
+        if (failed) {
+            // An earlier block must be written again, then retry from the new cursor
+            if (mtd_write_drain(ctx)) return -1;
+            continue;
+        }
+
+        if (erase_err) {
+            // First attempt failed in the erase ahead: retry in place, in lockstep
+            if (mtd_write_drain(ctx)) return -1;
+            ctx->pos = (off_t) index * size;
+            if (write_block_sync(ctx, data, 1)) return -1;
+            ctx->bytes_written += size;
+            return 0;
+        }
+
+        int slot = ctx->write_seq % MTD_WRITE_SLOTS;
+        off_t pos = (off_t) index * size;
+        memcpy(ctx->slot_data[slot], data, size);
+        ctx->slot_pos[slot] = pos;
+        if (pwrite(ctx->fd, ctx->slot_data[slot], size, pos) != size) {
+            // the verify stage will fail and retry this block
+            printf("mtd: write error at 0x%08lx (%s)\n",
+                    pos, strerror(errno));
+        }
+
+        pthread_mutex_lock(&ctx->lock);
+        ctx->write_seq++;
+        pthread_cond_broadcast(&ctx->cond);
+        pthread_mutex_unlock(&ctx->lock);
+
+        ctx->pos = pos + size;
+        ctx->bytes_written += size;
+        return 0;
+    }
+}
+
+// Let the worker erase the good blocks that will receive the next pending bytes,
+// MTD_ERASE_AHEAD at most. A short write never erases the blocks after its end.
+static void mtd_erase_ahead(MtdWriteContext *ctx, size_t pending)
+{
+    if (pending == 0 || mtd_write_prepare(ctx) || !ctx->worker_running) return;
+
+    size_t size = ctx->partition->erase_size;
+    size_t blocks = (pending + size - 1) / size;
+    if (blocks > MTD_ERASE_AHEAD) blocks = MTD_ERASE_AHEAD;
+
+    int index = ctx->pos / size;
+    while (index < ctx->block_count && blocks > 0) {
+        if (ctx->bad_map[index] == MTD_BLOCK_GOOD) --blocks;
+        ++index;
+    }
+
+    pthread_mutex_lock(&ctx->lock);
+    if (ctx->erase_limit < index) {
+        ctx->erase_limit = index;
+        pthread_cond_broadcast(&ctx->cond);
+    }
+    pthread_mutex_unlock(&ctx->lock);
+}
+
 ssize_t mtd_write_data(MtdWriteContext *ctx, const char *data, size_t len)
 {
     size_t wrote = 0;
     while (wrote < len) {
+        // Bytes from the write cursor on: buffered ones, then the caller's
+        mtd_erase_ahead(ctx, ctx->stored + len - wrote);
+
         // Coalesce partial writes into complete blocks
         if (ctx->stored > 0 || len - wrote < ctx->partition->erase_size) {
             size_t avail = ctx->partition->erase_size - ctx->stored;
@@ -521,8 +919,11 @@ off_t mtd_erase_blocks(MtdWriteContext *ctx, int blocks)
         ctx->stored = 0;
     }
 
-    off_t pos = lseek(ctx->fd, 0, SEEK_CUR);
-    if ((off_t) pos == (off_t) -1) return pos;
+    // All written blocks must be verified before we go on
+    if (mtd_write_drain(ctx)) return -1;
+    if (mtd_write_prepare(ctx)) return -1;
+
+    off_t pos = ctx->pos;
 
     const int total = (ctx->partition->size - pos) / ctx->partition->erase_size;
     if (blocks < 0) blocks = total;
@@ -533,8 +934,7 @@ off_t mtd_erase_blocks(MtdWriteContext *ctx, int blocks)
 
     // Erase the specified number of blocks
     while (blocks-- > 0) {
-        loff_t bpos = pos;
-        if (ioctl(ctx->fd, MEMGETBADBLOCK, &bpos) > 0) {
+        if (ctx->bad_map[pos / ctx->partition->erase_size] == MTD_BLOCK_BAD) {
             printf("mtd: not erasing bad block at 0x%08lx\n", pos);
             pos += ctx->partition->erase_size;
             continue;  // Don't try to erase known factory-bad blocks.
@@ -549,15 +949,44 @@ off_t mtd_erase_blocks(MtdWriteContext *ctx, int blocks)
         pos += ctx->partition->erase_size;
     }
 
+    ctx->pos = pos;
+    if (ctx->worker_running) {
+        pthread_mutex_lock(&ctx->lock);
+        ctx->erase_next = ctx->erase_limit = pos / ctx->partition->erase_size;
+        pthread_mutex_unlock(&ctx->lock);
+    }
     return pos;
 }
 
 int mtd_write_close(MtdWriteContext *ctx)
 {
     int r = 0;
+    int i;
     // Make sure any pending data gets written
     if (mtd_erase_blocks(ctx, 0) == (off_t) -1) r = -1;
+
+    if (ctx->worker_running) {
+        pthread_mutex_lock(&ctx->lock);
+        ctx->stop = 1;
+        pthread_cond_broadcast(&ctx->cond);
+        pthread_mutex_unlock(&ctx->lock);
+        pthread_join(ctx->worker, NULL);
+    }
+
+    if (ctx->bytes_written > 0) {
+        long long msec = (mtd_now_usec() - ctx->start_usec) / 1000;
+        printf("mtd: wrote %lld KB in %lld ms (%lld KB/s)\n",
+                ctx->bytes_written / 1024, msec,
+                msec > 0 ? ctx->bytes_written * 1000 / 1024 / msec : 0);
+    }
+
     if (close(ctx->fd)) r = -1;
+    pthread_mutex_destroy(&ctx->lock);
+    pthread_cond_destroy(&ctx->cond);
+    for (i = 0; i < MTD_WRITE_SLOTS; ++i) free(ctx->slot_data[i]);
+    free(ctx->bad_map);
+    free(ctx->erase_err);
+    free(ctx->verify);
     free(ctx->bad_block_offsets);
     free(ctx->buffer);
     free(ctx);
@@ -0,0 +1,138 @@
+/*
+ * Write and read back test of the MTD block writer, meant to run on a
+ * nandsim partition (see nandsim_test.sh). The partition is overwritten.
+ *
+ *   mtdutils_test <partition name>
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+#include "mtdutils.h"
+
+static long long now_usec() {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return (long long) tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+static int write_image(const MtdPartition *partition, const char *data, size_t len, size_t chunk) {
+    MtdWriteContext *ctx = mtd_write_partition(partition);
+    if (ctx == NULL) {
+        fprintf(stderr, "can't open partition for writing\n");
+        return -1;
+    }
+    size_t done = 0;
+    while (done < len) {
+        size_t n = len - done < chunk ? len - done : chunk;
+        if (mtd_write_data(ctx, data + done, n) != (ssize_t) n) {
+            fprintf(stderr, "write error at %zu\n", done);
+            mtd_write_close(ctx);
+            return -1;
+        }
+        done += n;
+    }
+    return mtd_write_close(ctx);
+}
+
+static int read_image(const MtdPartition *partition, char *data, size_t len) {
+    MtdReadContext *ctx = mtd_read_partition(partition);
+    if (ctx == NULL) {
+        fprintf(stderr, "can't open partition for reading\n");
+        return -1;
+    }
+    ssize_t r = mtd_read_data(ctx, data, len);
+    mtd_read_close(ctx);
+    return r == (ssize_t) len ? 0 : -1;
+}
+
+// Odd sized writes of a whole image, as flash_image does from a pipe
+static int test_round_trip(const MtdPartition *partition, size_t size, size_t erase_size) {
+    // leave room for the bad blocks nandsim may simulate
+    size_t len = size - 8 * erase_size;
+    char *data = malloc(len);
+    char *back = malloc(len);
+    size_t i;
+    if (data == NULL || back == NULL) return -1;
+    srand(1);
+    for (i = 0; i < len; ++i) data[i] = rand();
+
+    long long start = now_usec();
+    int ret = write_image(partition, data, len, 4096 + 17);
+    long long msec = (now_usec() - start) / 1000;
+    if (ret == 0) {
+        printf("round trip: wrote %zu KB in %lld ms (%lld KB/s)\n", len / 1024, msec,
+               msec > 0 ? (long long) len * 1000 / 1024 / msec : 0);
+        ret = read_image(partition, back, len);
+    }
+    if (ret == 0 && memcmp(data, back, len) != 0) {
+        fprintf(stderr, "round trip: data mismatch\n");
+        ret = -1;
+    }
+    free(data);
+    free(back);
+    return ret;
+}
+
+// A write shorter than a block (the bootloader message in misc) must leave
+// the blocks after it untouched
+static int test_short_write(const MtdPartition *partition, size_t erase_size, size_t write_size) {
+    size_t len = 8 * erase_size;
+    size_t short_len = 3 * write_size;
+    char *data = malloc(len);
+    char *back = malloc(len);
+    size_t i;
+    int ret;
+    if (data == NULL || back == NULL) return -1;
+
+    memset(data, 0x5a, len);
+    ret = write_image(partition, data, len, len);
+    memset(data, 0xa5, short_len);
+    if (ret == 0) ret = write_image(partition, data, short_len, short_len);
+    if (ret == 0) ret = read_image(partition, back, len);
+    if (ret == 0) {
+        // the end of the first block is zero padded
+        memset(data + short_len, 0, erase_size - short_len);
+        for (i = 0; i < len && data[i] == back[i]; ++i);
+        if (i < len) {
+            fprintf(stderr, "short write: unexpected data at 0x%zx (block %zu)\n", i, i / erase_size);
+            ret = -1;
+        }
+    }
+    free(data);
+    free(back);
+    return ret;
+}
+
+int main(int argc, char **argv) {
+    if (argc != 2) {
+        fprintf(stderr, "usage: %s <partition name>\n", argv[0]);
+        return 2;
+    }
+
+    mtd_scan_partitions();
+    const MtdPartition *partition = mtd_find_partition_by_name(argv[1]);
+    size_t size, erase_size, write_size;
+    if (partition == NULL || mtd_partition_info(partition, &size, &erase_size, &write_size)) {
+        fprintf(stderr, "can't find partition %s\n", argv[1]);
+        return 1;
+    }
+    if (size < 16 * erase_size) {
+        fprintf(stderr, "partition %s is too small\n", argv[1]);
+        return 1;
+    }
+
+    int failed = 0;
+    if (test_round_trip(partition, size, erase_size)) {
+        printf("round trip: FAILED\n");
+        failed++;
+    }
+    if (test_short_write(partition, erase_size, write_size)) {
+        printf("short write: FAILED\n");
+        failed++;
+    }
+    printf("%s\n", failed ? "FAILED" : "PASSED");
+    return failed ? 1 : 0;
+}
@@ -0,0 +1,69 @@
+#!/bin/bash
+#
+# Test of the MTD block writer on a simulated NAND chip. Run as root on a
+# Linux host with the nandsim module: it builds mtdutils_test with the host
+# gcc, loads nandsim (128MB, 128KB erase blocks, 2KB pages, two bad blocks)
+# and writes the simulated partition.
+
+NANDSIM_ARGS="first_id_byte=0xec second_id_byte=0xa1 third_id_byte=0x00 fourth_id_byte=0x15 badblocks=3,40"
+PARTITION="NAND simulator partition 0"
+
+# ------------------------
+
+cd $(dirname $0)
+tmpdir=$(mktemp -d)
+
+# what this script created, only that is removed on exit
+loaded_nandsim=
+created_links=
+created_mtd_dir=
+
+cleanup() {
+  rm -rf $tmpdir
+  for link in $created_links; do
+    rm -f $link
+  done
+  if [ -n "$created_mtd_dir" ]; then
+    rmdir /dev/mtd
+  fi
+  if [ -n "$loaded_nandsim" ]; then
+    modprobe -r nandsim
+  fi
+}
+trap cleanup EXIT
+
+fail() {
+  echo
+  echo FAIL: $@
+  echo
+  exit 1
+}
+
+gcc -O2 -D_GNU_SOURCE -o $tmpdir/mtdutils_test mtdutils_test.c mtdutils.c -lpthread || fail "build"
+
+# an already loaded nandsim may not have our geometry, and isn't ours to unload
+if grep -q "^nandsim " /proc/modules; then
+  fail "nandsim is already loaded"
+fi
+modprobe nandsim $NANDSIM_ARGS || fail "modprobe nandsim"
+loaded_nandsim=1
+
+# mtdutils opens /dev/mtd/mtdN, as on android
+if [ ! -e /dev/mtd ]; then
+  mkdir /dev/mtd || fail "mkdir /dev/mtd"
+  created_mtd_dir=1
+fi
+for dev in /dev/mtd[0-9]*; do
+  link=/dev/mtd/$(basename $dev)
+  case $dev in
+    *ro) ;;
+    *)
+      if [ ! -e $link ] && [ ! -L $link ]; then
+        ln -s $dev $link || fail "ln $link"
+        created_links="$created_links $link"
+      fi
+      ;;
+  esac
+done
+
+$tmpdir/mtdutils_test "$PARTITION" || fail "mtdutils_test"
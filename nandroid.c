@@ -18,9 +18,11 @@
 #include <sys/stat.h>
 
 #include <signal.h>
+#include <stdarg.h>
 #include <sys/wait.h>
 #include <libgen.h>
 #include <sys/vfs.h>
+#include <pthread.h>
 
 #include "libcrecovery/common.h"
 #include "flashutils/flashutils.h" // backup_raw_partition() and restore_raw_partition()
@@ -39,6 +41,14 @@
 #include "recovery_settings.h"
 #include "nandroid.h"
 #include "mtdutils/mounts.h"
+#include "raw_image.h"
+#include "block_store.h"
+#include "fingerprint.h"
+#include "split_archive.h"
+
+#ifdef BOARD_RECOVERY_USE_LIBTAR
+#include "libtar.h"
+#endif
 
 #ifdef PHILZ_TOUCH_RECOVERY
 #include "libtouch_gui/nandroid_gui.h"
@@ -75,6 +85,7 @@ int print_and_error(const char* message, int ret) {
 
 static int nandroid_backup_bitfield = 0;
 #define NANDROID_FIELD_DEDUPE_CLEARED_SPACE 1
+#define NANDROID_FIELD_BLOCK_STORE_CLEARED_SPACE 2
 static int nandroid_files_total = 0;
 static int nandroid_files_count = 0;
 static int nandroid_stdout_progress = 0;
@@ -135,32 +146,171 @@ static void nandroid_callback(const char* filename) {
         ui_set_progress((float)nandroid_files_count / (float)nandroid_files_total);
 }
 
-static void compute_directory_stats(const char* directory) {
-    char tmp[PATH_MAX];
-    char count_text[100];
+// native "find path | grep -v exclude | wc -l": path itself and all entries below, symlinks not followed
+// when bytes is not NULL, also sums the size of the regular files, like Get_Folder_Size()
+// a count only walk (progress stats) stats nothing but the entries readdir() can't type
+static void scan_directory(const char* path, const char* exclude, int* entries, unsigned long long* bytes) {
+    if (exclude != NULL && strstr(path, exclude) != NULL)
+        return;
 
-    // reset file count if we ever return before setting it
-    nandroid_files_count = 0;
-    nandroid_files_total = 0;
+    (*entries)++;
+    DIR* dir = opendir(path);
+    if (dir == NULL)
+        return;
 
-    sprintf(tmp, "find %s | %s wc -l > /tmp/dircount", directory, strcmp(directory, "/data") == 0 && is_data_media() ? "grep -v /data/media |" : "");
-    __system(tmp);
+    struct dirent* de;
+    struct stat st;
+    char child[PATH_MAX];
+    while ((de = readdir(dir)) != NULL) {
+        if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0)
+            continue;
+        snprintf(child, sizeof(child), "%s/%s", path, de->d_name);
+        if (de->d_type == DT_DIR) {
+            scan_directory(child, exclude, entries, bytes);
+            continue;
+        }
+        int need_stat = de->d_type == DT_UNKNOWN || (bytes != NULL && de->d_type == DT_REG);
+        if (need_stat) {
+            if (lstat(child, &st) != 0)
+                st.st_mode = 0;
+            if (S_ISDIR(st.st_mode)) {
+                scan_directory(child, exclude, entries, bytes);
+                continue;
+            }
+        }
+        if (exclude != NULL && strstr(child, exclude) != NULL)
+            continue;
+        (*entries)++;
+        if (bytes != NULL && need_stat && S_ISREG(st.st_mode))
+            *bytes += st.st_size;
+    }
+    closedir(dir);
+}
 
-    FILE* f = fopen("/tmp/dircount", "r");
-    if (f == NULL)
-        return;
+// directory scans are shared by the backup size check and the progress stats of the backup itself
+// a result stays valid while the filesystem it is on is not remounted (same mountinfo id)
+// and its statfs blocks and inodes counters did not move
+#define DIRECTORY_SCAN_CACHE_SIZE   8
+typedef struct {
+    char path[PATH_MAX];
+    char exclude[PATH_MAX];
+    int mount_id;
+    unsigned long long blocks;
+    unsigned long long bfree;
+    unsigned long long files;
+    unsigned long long ffree;
+    int entries;
+    unsigned long long bytes;
+    int has_bytes;      // 0 for a count only scan
+} directory_scan_t;
+
+static directory_scan_t directory_scan_cache[DIRECTORY_SCAN_CACHE_SIZE];
+static int directory_scan_next = 0;
+static pthread_mutex_t directory_scan_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// id of the mount holding path: the longest mount point in /proc/self/mountinfo that prefixes it
+static int get_mount_id(const char* path) {
+    FILE* fp = fopen("/proc/self/mountinfo", "r");
+    if (fp == NULL)
+        return -1;
 
-    if (fgets(count_text, sizeof(count_text), f) == NULL) {
-        fclose(f);
+    char line[1024];
+    char mount_point[PATH_MAX];
+    size_t best_len = 0;
+    int id, best_id = -1;
+    while (fgets(line, sizeof(line), fp) != NULL) {
+        if (sscanf(line, "%d %*d %*s %*s %4095s", &id, mount_point) != 2)
+            continue;
+        size_t len = strlen(mount_point);
+        if (strcmp(mount_point, "/") == 0)
+            len = 0;
+        else if (strncmp(path, mount_point, len) != 0 || (path[len] != '\0' && path[len] != '/'))
+            continue;
+        if (best_id < 0 || len >= best_len) {
+            best_len = len;
+            best_id = id;
+        }
+    }
+    fclose(fp);
+    return best_id;
+}
+
+// returns 0 when the key of path could be read
+static int get_directory_scan_key(const char* path, const char* exclude, directory_scan_t* key) {
+    struct statfs st;
+    if (strlen(path) >= sizeof(key->path) || (exclude != NULL && strlen(exclude) >= sizeof(key->exclude)))
+        return -1;
+    if (statfs(path, &st) != 0 || (key->mount_id = get_mount_id(path)) < 0)
+        return -1;
+
+    strcpy(key->path, path);
+    strcpy(key->exclude, exclude != NULL ? exclude : "");
+    key->blocks = st.f_blocks;
+    key->bfree = st.f_bfree;
+    key->files = st.f_files;
+    key->ffree = st.f_ffree;
+    return 0;
+}
+
+static int same_directory_scan_key(const directory_scan_t* a, const directory_scan_t* b) {
+    return a->mount_id == b->mount_id && a->blocks == b->blocks && a->bfree == b->bfree &&
+           a->files == b->files && a->ffree == b->ffree &&
+           strcmp(a->path, b->path) == 0 && strcmp(a->exclude, b->exclude) == 0;
+}
+
+// thread safe: the size check runs several scans at once
+// bytes can be NULL when only the entries are needed
+static void directory_scan(const char* path, const char* exclude, int* entries, unsigned long long* bytes) {
+    directory_scan_t key;
+    int i, cached = 0;
+
+    // the key is read before the walk: a change during the walk will not be hidden by the cache
+    int have_key = (get_directory_scan_key(path, exclude, &key) == 0);
+    if (have_key) {
+        pthread_mutex_lock(&directory_scan_lock);
+        for (i = 0; i < DIRECTORY_SCAN_CACHE_SIZE; ++i) {
+            if (same_directory_scan_key(&directory_scan_cache[i], &key) &&
+                    (bytes == NULL || directory_scan_cache[i].has_bytes)) {
+                *entries = directory_scan_cache[i].entries;
+                if (bytes != NULL)
+                    *bytes = directory_scan_cache[i].bytes;
+                cached = 1;
+                break;
+            }
+        }
+        pthread_mutex_unlock(&directory_scan_lock);
+    }
+    if (cached) {
+        LOGI("%s: using cached scan (%d entries)\n", path, *entries);
         return;
     }
 
-    size_t len = strlen(count_text);
-    if (count_text[len - 1] == '\n')
-        count_text[len - 1] = '\0';
+    *entries = 0;
+    if (bytes != NULL)
+        *bytes = 0;
+    scan_directory(path, exclude, entries, bytes);
+    if (!have_key)
+        return;
+
+    key.entries = *entries;
+    key.bytes = bytes != NULL ? *bytes : 0;
+    key.has_bytes = (bytes != NULL);
+    pthread_mutex_lock(&directory_scan_lock);
+    directory_scan_cache[directory_scan_next] = key;
+    directory_scan_next = (directory_scan_next + 1) % DIRECTORY_SCAN_CACHE_SIZE;
+    pthread_mutex_unlock(&directory_scan_lock);
+}
+
+static const char* directory_stats_exclude(const char* directory) {
+    return strcmp(directory, "/data") == 0 && is_data_media() ? "/data/media" : NULL;
+}
+
+static void compute_directory_stats(const char* directory) {
+    // reset file count if we ever return before setting it
+    nandroid_files_count = 0;
+    // progress only needs the entries: no size, no stat of every file
+    directory_scan(directory, directory_stats_exclude(directory), &nandroid_files_total, NULL);
 
-    fclose(f);
-    nandroid_files_total = atoi(count_text);
     // in twrp backup mode, do not refresh this or it will be a flashy effect on compute_twrp_backup_stats() call
     if (!twrp_backup_mode.value) {
         ui_reset_progress();
@@ -168,6 +318,32 @@ static void compute_directory_stats(const char* directory) {
     }
 }
 
+// native "chmod [-R]": set_mode replaces the permission bits when not 0, add_mode is or'ed to them
+static void chmod_directory(const char* path, mode_t set_mode, mode_t add_mode, int recursive) {
+    struct stat st;
+    if (lstat(path, &st) != 0 || S_ISLNK(st.st_mode))
+        return;
+
+    mode_t mode = set_mode ? set_mode : (st.st_mode & 07777);
+    chmod(path, mode | add_mode);
+    if (!recursive || !S_ISDIR(st.st_mode))
+        return;
+
+    DIR* dir = opendir(path);
+    if (dir == NULL)
+        return;
+
+    struct dirent* de;
+    char child[PATH_MAX];
+    while ((de = readdir(dir)) != NULL) {
+        if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0)
+            continue;
+        snprintf(child, sizeof(child), "%s/%s", path, de->d_name);
+        chmod_directory(child, set_mode, add_mode, 1);
+    }
+    closedir(dir);
+}
+
 // size progress update during backup jobs
 static void update_size_progress(const char* Path) {
     if (!show_nandroid_size_progress.value || Backup_Size == 0)
@@ -299,7 +475,10 @@ static int dedupe_compress_wrapper(const char* backup_path, const char* backup_f
         nandroid_dedupe_gc(blob_dir);
     }
 
-    sprintf(tmp, "dedupe c %s %s %s.dup %s", backup_path, blob_dir, backup_file_image, strcmp(backup_path, "/data") == 0 && is_data_media() ? "./media" : "");
+    char options[16] = "";
+    if (dedupe_compression.value)
+        sprintf(options, "-z %d ", dedupe_compression.value);
+    sprintf(tmp, "dedupe c %s%s %s %s.dup %s", options, backup_path, blob_dir, backup_file_image, strcmp(backup_path, "/data") == 0 && is_data_media() ? "./media" : "");
 
     FILE *fp = __popen(tmp, "r");
     if (fp == NULL) {
@@ -327,6 +506,68 @@ static int dedupe_compress_wrapper(const char* backup_path, const char* backup_f
     return __pclose(fp);
 }
 
+// block images of all backups on a storage share <storage>/clockworkmod/blocks
+static void get_block_store_dir(const char* backup_file_image, char* store_dir) {
+    char tmp[PATH_MAX];
+    int i;
+    strcpy(store_dir, backup_file_image);
+    for (i = 0; i < 3; i++) {
+        strcpy(tmp, dirname(store_dir));
+        strcpy(store_dir, tmp);
+    }
+    strcat(store_dir, "/blocks");
+}
+
+void nandroid_block_store_gc(const char* store_dir) {
+    char backup_dir[PATH_MAX];
+    strcpy(backup_dir, store_dir);
+    strcpy(backup_dir, dirname(backup_dir));
+    strcat(backup_dir, "/backup");
+    ui_print("Freeing block images space...\n");
+    long long freed = block_store_gc(store_dir, backup_dir);
+    if (freed >= 0)
+        ui_print("Done freeing %lluMb.\n", (unsigned long long)freed / 1048576LLU);
+}
+
+static void block_store_callback(unsigned long long done, unsigned long long total) {
+    if (total != 0)
+        ui_set_progress((float)done / (float)total);
+}
+
+static int blk_backup_wrapper(const char* backup_path, const char* backup_file_image, int callback) {
+    char tmp[PATH_MAX];
+    char store_dir[PATH_MAX];
+    Volume *v = volume_for_path(backup_path);
+    if (v == NULL || v->blk_device == NULL) {
+        ui_print("Unable to find volume.\n");
+        return -1;
+    }
+
+    get_block_store_dir(backup_file_image, store_dir);
+    ensure_directory(store_dir, 0755);
+
+    if (!(nandroid_backup_bitfield & NANDROID_FIELD_BLOCK_STORE_CLEARED_SPACE)) {
+        nandroid_backup_bitfield |= NANDROID_FIELD_BLOCK_STORE_CLEARED_SPACE;
+        nandroid_block_store_gc(store_dir);
+    }
+
+    // the used blocks map must not change while the blocks are read
+    if (ensure_path_unmounted(backup_path) != 0) {
+        ui_print("Can't unmount %s!\n", backup_path);
+        return -1;
+    }
+
+    BlockStoreStats stats;
+    sprintf(tmp, "%s.blk", backup_file_image);
+    int ret = block_store_backup(v->blk_device, tmp, store_dir, callback ? block_store_callback : NULL, &stats);
+    if (ret == 0) {
+        ui_print("%lluMb in use, %lluMb new in block store\n",
+                 stats.used / 1048576LLU, stats.written / 1048576LLU);
+    }
+    ensure_path_mounted(backup_path);
+    return ret;
+}
+
 static nandroid_backup_handler default_backup_handler = tar_compress_wrapper;
 static char forced_backup_format[5] = "";
 // this function will force the backup handler to be tar, whatever filesystem be it ext4 or yaffs2
@@ -358,6 +599,8 @@ static void refresh_default_backup_handler() {
     fmt[3] = '\0';
     if (0 == strcmp(fmt, "dup"))
         default_backup_handler = dedupe_compress_wrapper;
+    else if (0 == strcmp(fmt, "blk"))
+        default_backup_handler = blk_backup_wrapper;
     else if (0 == strcmp(fmt, "tgz"))
         default_backup_handler = tar_gzip_compress_wrapper;
     else
@@ -370,6 +613,8 @@ unsigned nandroid_get_default_backup_format() {
         return NANDROID_BACKUP_FORMAT_DUP;
     } else if (default_backup_handler == tar_gzip_compress_wrapper) {
         return NANDROID_BACKUP_FORMAT_TGZ;
+    } else if (default_backup_handler == blk_backup_wrapper) {
+        return NANDROID_BACKUP_FORMAT_BLK;
     } else {
         return NANDROID_BACKUP_FORMAT_TAR;
     }
@@ -402,6 +647,9 @@ static nandroid_backup_handler get_backup_handler(const char *mount_point) {
     }
 
     if (strcmp(mount_point, "/data") == 0 && is_data_media()) {
+        // block images can't exclude /data/media
+        if (default_backup_handler == blk_backup_wrapper)
+            return tar_compress_wrapper;
         return default_backup_handler;
     }
 
@@ -416,6 +664,11 @@ static nandroid_backup_handler get_backup_handler(const char *mount_point) {
         return mkyaffs2image_wrapper;
     }
 
+    // block images are only made of ext4 and f2fs partitions
+    if (default_backup_handler == blk_backup_wrapper &&
+            strcmp(mv->filesystem, "ext4") != 0 && strcmp(mv->filesystem, "f2fs") != 0)
+        return tar_compress_wrapper;
+
     return default_backup_handler;
 }
 
@@ -481,6 +734,95 @@ int nandroid_backup_partition_extended(const char* backup_path, const char* moun
     return 0;
 }
 
+// partitions a "roll back data only" restore usually finds unchanged: with nand_skip_unchanged,
+// their fingerprint is saved at backup time, and they are not restored when they still match it
+#define NANDROID_FINGERPRINT_FILE "nandroid.fingerprint"
+static const char* fingerprint_partitions[] = { BOOT_PARTITION_MOUNT_POINT, "/recovery", "/system", "/preload", NULL };
+
+static void fingerprint_to_hex(const uint8_t* digest, char* hex) {
+    int i;
+    for (i = 0; i < FINGERPRINT_SIZE; i++)
+        sprintf(hex + i * 2, "%02x", digest[i]);
+}
+
+static int nandroid_fingerprint_partition(const char* root, char* hex) {
+    uint8_t digest[FINGERPRINT_SIZE];
+    Volume *vol = volume_for_path(root);
+    int ret;
+    if (vol == NULL || vol->fs_type == NULL)
+        return -1;
+
+    // mtd and bml images are not a plain copy of the partition
+    if (strcmp(vol->fs_type, "emmc") == 0) {
+        ret = fingerprint_device(vol->blk_device, digest);
+    } else if (strcmp(vol->fs_type, "mtd") == 0 || strcmp(vol->fs_type, "bml") == 0) {
+        return -1;
+    } else {
+        if (ensure_path_mounted(root) != 0)
+            return -1;
+        ret = fingerprint_tree(vol->mount_point, digest);
+        ensure_path_unmounted(root);
+    }
+    if (ret == 0)
+        fingerprint_to_hex(digest, hex);
+    return ret;
+}
+
+static void nandroid_save_fingerprint(const char* backup_path, const char* root) {
+    char hex[FINGERPRINT_SIZE * 2 + 1];
+    char path[PATH_MAX];
+    int i;
+
+    if (!nand_skip_unchanged.value || strcmp(backup_path, "-") == 0)
+        return;
+    for (i = 0; fingerprint_partitions[i] != NULL; i++) {
+        if (strcmp(fingerprint_partitions[i], root) == 0)
+            break;
+    }
+    if (fingerprint_partitions[i] == NULL)
+        return;
+
+    ui_print("Saving %s fingerprint...\n", root);
+    if (nandroid_fingerprint_partition(root, hex) != 0) {
+        LOGI("No fingerprint for %s, it will always be restored\n", root);
+        return;
+    }
+    sprintf(path, "%s/%s", backup_path, NANDROID_FINGERPRINT_FILE);
+    FILE* f = fopen(path, "a");
+    if (f == NULL) {
+        LOGI("Can't write %s (%s)\n", path, strerror(errno));
+        return;
+    }
+    fprintf(f, "%s  %s\n", hex, root);
+    fclose(f);
+}
+
+// returns 1 if the partition still matches the fingerprint saved with the backup
+static int nandroid_partition_unchanged(const char* backup_path, const char* root) {
+    char saved[FINGERPRINT_SIZE * 2 + 1] = "";
+    char hex[FINGERPRINT_SIZE * 2 + 1];
+    char path[PATH_MAX];
+    char line[PATH_MAX];
+
+    if (!nand_skip_unchanged.value || strcmp(backup_path, "-") == 0)
+        return 0;
+    sprintf(path, "%s/%s", backup_path, NANDROID_FINGERPRINT_FILE);
+    FILE* f = fopen(path, "r");
+    if (f == NULL)
+        return 0;
+    while (fgets(line, sizeof(line), f) != NULL) {
+        char mount_point[PATH_MAX];
+        if (sscanf(line, "%64s %s", hex, mount_point) == 2 && strcmp(mount_point, root) == 0)
+            strcpy(saved, hex);
+    }
+    fclose(f);
+    if (strlen(saved) != FINGERPRINT_SIZE * 2)
+        return 0;
+
+    ui_print("Comparing %s with the backup...\n", root);
+    return nandroid_fingerprint_partition(root, hex) == 0 && strcmp(hex, saved) == 0;
+}
+
 int nandroid_backup_partition(const char* backup_path, const char* root) {
     Volume *vol = volume_for_path(root);
     // make sure the volume exists before attempting anything...
@@ -513,10 +855,14 @@ int nandroid_backup_partition(const char* backup_path, const char* root) {
         }
 
         ui_print("Backup of %s image completed.\n", name);
+        nandroid_save_fingerprint(backup_path, root);
         return 0;
     }
 
-    return nandroid_backup_partition_extended(backup_path, root, 1);
+    if (0 != (ret = nandroid_backup_partition_extended(backup_path, root, 1)))
+        return ret;
+    nandroid_save_fingerprint(backup_path, root);
+    return 0;
 }
 
 int nandroid_backup(const char* backup_path) {
@@ -543,6 +889,7 @@ int nandroid_backup(const char* backup_path) {
     // also, it is expected to have the background installing icon when we actually start backup
     ui_set_background(BACKGROUND_ICON_INSTALLING);
     nandroid_start_msec = timenow_msec(); // starts backup monitoring timer for total backup time
+    __spawn_stats_reset();
 #ifdef PHILZ_TOUCH_RECOVERY
     last_key_ev = nandroid_start_msec; //support dim screen timeout during nandroid operation
 #endif
@@ -622,7 +969,7 @@ int nandroid_backup(const char* backup_path) {
         }
     }
 
-    // 2 copies of efs are made: tarball and dd/cat raw backup
+    // 2 copies of efs are made: tarball and raw sparse image
     vol = volume_for_path("/efs");
     if (backup_efs && vol != NULL) {
         //first backup in raw format, returns 0 on success (or if skipped), else 1
@@ -668,8 +1015,8 @@ int nandroid_backup(const char* backup_path) {
     if (enable_md5sum.value && 0 != (ret = gen_nandroid_md5sum(backup_path)))
         return print_and_error(NULL, ret);
 
-    sprintf(tmp, "cp /tmp/recovery.log %s/recovery.log", backup_path);
-    __system(tmp);
+    sprintf(tmp, "%s/recovery.log", backup_path);
+    copy_a_file("/tmp/recovery.log", tmp);
 
     char base_dir[PATH_MAX];
     strcpy(base_dir, backup_path);
@@ -678,11 +1025,13 @@ int nandroid_backup(const char* backup_path) {
     d = dirname(base_dir);
     strcpy(base_dir, d);
 
-    sprintf(tmp, "chmod -R 777 %s ; chmod -R u+r,u+w,g+r,g+w,o+r,o+w %s ; chmod u+x,g+x,o+x %s/backup", backup_path, base_dir, base_dir);
-    __system(tmp);
-
-    sprintf(tmp, "if [ -d %s/blobs ]; then chmod u+x,g+x,o+x %s/blobs; fi", base_dir, base_dir);
-    __system(tmp);
+    chmod_directory(backup_path, 0777, 0, 1);
+    chmod_directory(base_dir, 0, 0666, 1);
+    sprintf(tmp, "%s/backup", base_dir);
+    chmod_directory(tmp, 0, 0111, 0);
+    sprintf(tmp, "%s/blobs", base_dir);
+    if (directory_found(tmp))
+        chmod_directory(tmp, 0, 0111, 0);
 
     finish_nandroid_job();
     show_backup_stats(backup_path);
@@ -759,6 +1108,7 @@ static int unyaffs_wrapper(const char* backup_file_image, const char* backup_pat
     return __pclose(fp);
 }
 
+#ifndef BOARD_RECOVERY_USE_LIBTAR
 static int do_tar_extract(char* command, const char* backup_file_image, const char* backup_path, int callback) {
     char buf[PATH_MAX];
 
@@ -793,19 +1143,113 @@ static int do_tar_extract(char* command, const char* backup_file_image, const ch
     set_perf_mode(0);
     return __pclose(fp);
 }
+#endif
+
+#ifdef BOARD_RECOVERY_USE_LIBTAR
+// in process "cat name* | [pigz -d -c |] tar -xpv": libtar reads the split volumes as one archive
+static SplitArchive* tar_split_archive = NULL;
+
+static ssize_t split_archive_tar_read(int fd, void* buf, size_t len) {
+    return split_archive_read(tar_split_archive, buf, len);
+}
+
+static ssize_t split_archive_tar_write(int fd, const void* buf, size_t len) {
+    errno = EBADF;
+    return -1;
+}
+
+static int split_archive_tar_close(int fd) {
+    return 0;
+}
+
+static tartype_t split_archive_tar_type = { (openfunc_t) open, split_archive_tar_close,
+    split_archive_tar_read, split_archive_tar_write
+};
+
+static int libtar_extract(const char* backup_file_image, const char* backup_path, int gzip, int callback) {
+    char prefix[PATH_MAX];
+    char filename[PATH_MAX];
+    TAR* t;
+    int ret = -1;
+
+    tar_split_archive = split_archive_open(backup_file_image, gzip);
+    if (tar_split_archive == NULL) {
+        ui_print("Unable to open %s.\n", backup_file_image);
+        return -1;
+    }
+    if (tar_fdopen(&t, 0, backup_file_image, &split_archive_tar_type, O_RDONLY, 0, TAR_GNU | TAR_STORE_SELINUX) != 0) {
+        ui_print("Unable to read tar archive.\n");
+        split_archive_close(tar_split_archive);
+        tar_split_archive = NULL;
+        return -1;
+    }
+
+    // archives store paths relative to the parent of the partition, as "tar -xpv" ran there
+    strcpy(prefix, DirName(backup_path));
+    set_perf_mode(1);
+
+    // no child process for user_cancel_nandroid() to close
+    FILE* fp = NULL;
+    int nand_starts = 1;
+    last_size_update = 0;
+    check_restore_size(backup_file_image, backup_path);
+    while ((ret = th_read(t)) == 0) {
+#ifdef PHILZ_TOUCH_RECOVERY
+        if (user_cancel_nandroid(&fp, NULL, 0, &nand_starts)) {
+            ret = -1;
+            goto out;
+        }
+#endif
+        char* pathname = th_get_pathname(t);
+        snprintf(filename, sizeof(filename), "%s/%s", prefix, pathname);
+        if (callback) {
+            update_size_progress(backup_path);
+            nandroid_callback(pathname);
+        }
+        free(pathname);
+
+        if (tar_extract_file(t, filename) != 0) {
+            LOGE("failed to extract %s (%s)\n", filename, strerror(errno));
+            ret = -1;
+            break;
+        }
+    }
+    // th_read() returns 1 at the end of the archive
+    if (ret == 1)
+        ret = 0;
+
+#ifdef PHILZ_TOUCH_RECOVERY
+    ui_print_preset_colors(0, NULL);
+#endif
+out:
+    set_perf_mode(0);
+    tar_close(t);
+    split_archive_close(tar_split_archive);
+    tar_split_archive = NULL;
+    return ret;
+}
+#endif
 
 static int tar_gzip_extract_wrapper(const char* backup_file_image, const char* backup_path, int callback) {
+#ifdef BOARD_RECOVERY_USE_LIBTAR
+    return libtar_extract(backup_file_image, backup_path, 1, callback);
+#else
     char tmp[PATH_MAX];
     sprintf(tmp, "cd $(dirname %s) ; set -o pipefail ; cat %s* | pigz -d -c | tar -xpv ; exit $?", backup_path, backup_file_image);
 
     return do_tar_extract(tmp, backup_file_image, backup_path, callback);
+#endif
 }
 
 static int tar_extract_wrapper(const char* backup_file_image, const char* backup_path, int callback) {
+#ifdef BOARD_RECOVERY_USE_LIBTAR
+    return libtar_extract(backup_file_image, backup_path, 0, callback);
+#else
     char tmp[PATH_MAX];
     sprintf(tmp, "cd $(dirname %s) ; set -o pipefail ; cat %s* | tar -xpv ; exit $?", backup_path, backup_file_image);
 
     return do_tar_extract(tmp, backup_file_image, backup_path, callback);
+#endif
 }
 
 static int dedupe_extract_wrapper(const char* backup_file_image, const char* backup_path, int callback) {
@@ -842,6 +1286,27 @@ static int dedupe_extract_wrapper(const char* backup_file_image, const char* bac
     return __pclose(fp);
 }
 
+static int blk_extract_wrapper(const char* backup_file_image, const char* backup_path, int callback) {
+    char store_dir[PATH_MAX];
+    Volume *v = volume_for_path(backup_path);
+    if (v == NULL || v->blk_device == NULL) {
+        ui_print("Unable to find volume.\n");
+        return -1;
+    }
+
+    get_block_store_dir(backup_file_image, store_dir);
+    if (ensure_path_unmounted(backup_path) != 0) {
+        ui_print("Can't unmount %s!\n", backup_path);
+        return -1;
+    }
+
+    int ret = block_store_restore(backup_file_image, store_dir, v->blk_device,
+                                  callback ? block_store_callback : NULL, NULL);
+    if (ret == 0 && 0 != (ret = ensure_path_mounted(backup_path)))
+        ui_print("Can't mount %s!\n", backup_path);
+    return ret;
+}
+
 static int tar_undump_wrapper(const char* backup_file_image, const char* backup_path, int callback) {
     char tmp[PATH_MAX];
     sprintf(tmp, "cd $(dirname %s) ; tar -xpv ", backup_path);
@@ -956,6 +1421,12 @@ int nandroid_restore_partition_extended(const char* backup_path, const char* mou
                     restore_handler = dedupe_extract_wrapper;
                     break;
                 }
+                sprintf(tmp, "%s/%s.%s.blk", backup_path, name, filesystem);
+                if (0 == (ret = stat(tmp, &file_info))) {
+                    backup_filesystem = filesystem;
+                    restore_handler = blk_extract_wrapper;
+                    break;
+                }
             }
             i++;
         }
@@ -969,13 +1440,20 @@ int nandroid_restore_partition_extended(const char* backup_path, const char* mou
             ui_print("Found backup image: %s\n", BaseName(tmp));
         } else if (backup_filesystem == NULL || restore_handler == NULL) {
             //ui_print("%s.img not found. Skipping restore of %s.\n", name, mount_point);
-            ui_print("No %s backup found(img, tar, dup). Skipping restore of %s.\n", name, mount_point);
+            ui_print("No %s backup found(img, tar, dup, blk). Skipping restore of %s.\n", name, mount_point);
             return 0;
         } else {
             printf("Found new backup image: %s\n", tmp);
         }
     }
 
+    // block images are written over the partition without formatting it:
+    // the volume must use the filesystem of the image
+    if (restore_handler == blk_extract_wrapper && (vol == NULL || strcmp(vol->fs_type, backup_filesystem) != 0)) {
+        ui_print("%s is a %s image, can't restore it to %s!\n", BaseName(tmp), backup_filesystem, mount_point);
+        return -1;
+    }
+
     // If the fs_type of this volume is "auto" or mount_point is /data
     // and is_data_media, let's revert
     // to using a rm -rf, rather than trying to do a
@@ -1008,7 +1486,9 @@ int nandroid_restore_partition_extended(const char* backup_path, const char* mou
     int callback = stat(path, &file_info) != 0;
 
     ui_print("Restoring %s...\n", name);
-    if (backup_filesystem == NULL) {
+    if (restore_handler == blk_extract_wrapper) {
+        // nothing to format, the whole filesystem is in the image
+    } else if (backup_filesystem == NULL) {
         if (0 != (ret = format_volume(mount_point))) {
             ui_print("Error while formatting %s!\n", mount_point);
             return ret;
@@ -1018,7 +1498,7 @@ int nandroid_restore_partition_extended(const char* backup_path, const char* mou
         return ret;
     }
 
-    if (0 != (ret = ensure_path_mounted(mount_point))) {
+    if (restore_handler != blk_extract_wrapper && 0 != (ret = ensure_path_mounted(mount_point))) {
         ui_print("Can't mount %s!\n", mount_point);
         return ret;
     }
@@ -1063,6 +1543,11 @@ int nandroid_restore_partition(const char* backup_path, const char* root) {
         return 0;
     }
 
+    if (nandroid_partition_unchanged(backup_path, root)) {
+        ui_print("\n>> %s matches the backup, skipping restore.\n", root);
+        return 0;
+    }
+
     // see if we need a raw restore (mtd)
     char tmp[PATH_MAX];
     if (strcmp(vol->fs_type, "mtd") == 0 || strcmp(vol->fs_type, "bml") == 0 || strcmp(vol->fs_type, "emmc") == 0) {
@@ -1109,6 +1594,7 @@ int nandroid_restore(const char* backup_path, int restore_boot, int restore_syst
     ui_set_background(BACKGROUND_ICON_INSTALLING);
     nandroid_files_total = 0;
     nandroid_start_msec = timenow_msec();
+    __spawn_stats_reset();
 #ifdef PHILZ_TOUCH_RECOVERY
     // support dim screen timeout during nandroid operation
     last_key_ev = timenow_msec();
@@ -8,6 +8,7 @@ int nandroid_dump(const char* partition);
 int nandroid_restore(const char* backup_path, int restore_boot, int restore_system, int restore_data, int restore_cache, int restore_sdext, int restore_wimax);
 int nandroid_undump(const char* partition);
 void nandroid_dedupe_gc(const char* blob_dir);
+void nandroid_block_store_gc(const char* store_dir);
 void nandroid_force_backup_format(const char* fmt);
 unsigned nandroid_get_default_backup_format();
 int nandroid_restore_partition(const char* backup_path, const char* root);
@@ -17,6 +18,7 @@ int nandroid_restore_partition_extended(const char* backup_path, const char* mou
 #define NANDROID_BACKUP_FORMAT_TAR 0
 #define NANDROID_BACKUP_FORMAT_DUP 1
 #define NANDROID_BACKUP_FORMAT_TGZ 2
+#define NANDROID_BACKUP_FORMAT_BLK 3
 
 #define NANDROID_ERROR_GENERAL 1
 
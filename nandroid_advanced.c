@@ -24,6 +24,11 @@ int android_secure_ext = 0;
 
 // resetting progress bar and background icon once backup/restore done or cancelled by user
 void finish_nandroid_job() {
+    int spawn_count;
+    long long spawn_usec;
+    __spawn_stats(&spawn_count, &spawn_usec);
+    LOGI("nandroid job spawned %d processes (%lld msec)\n", spawn_count, spawn_usec / 1000);
+
     ui_print("Finalizing, please wait...\n");
     sync();
 #ifdef PHILZ_TOUCH_RECOVERY
@@ -116,6 +121,40 @@ static int Is_Image(const char* root) {
 - So, only not mountable partitions are using Find_Partition_Size()
 */
 #define BASE_PARTITIONS_NUM   13
+
+// folder walks of the size check run in their own thread while the partitions are sized by statfs
+typedef struct {
+    const char* path;
+    const char* exclude;
+    int entries;
+    unsigned long long bytes;
+    pthread_t thread;
+    int started;
+} size_job_t;
+
+static void* size_job_thread(void* cookie) {
+    size_job_t* job = (size_job_t*)cookie;
+    directory_scan(job->path, job->exclude, &job->entries, &job->bytes);
+    return NULL;
+}
+
+static void start_size_job(size_job_t* job, const char* path, const char* exclude) {
+    job->path = path;
+    job->exclude = exclude;
+    job->entries = 0;
+    job->bytes = 0;
+    job->started = (pthread_create(&job->thread, NULL, size_job_thread, job) == 0);
+    if (!job->started)
+        size_job_thread(job);
+}
+
+static unsigned long long finish_size_job(size_job_t* job) {
+    if (job->started)
+        pthread_join(job->thread, NULL);
+    job->started = 0;
+    return job->bytes;
+}
+
 unsigned long long Backup_Size = 0;
 unsigned long long Before_Used_Size = 0;
 int check_backup_size(const char* backup_path) {
@@ -185,6 +224,42 @@ int check_backup_size(const char* backup_path) {
     int ret = 0;
     Volume* vol;
 
+    // folders that need a walk are mounted and started first, the other partitions are sized meanwhile
+    // on /data/media devices, /data is walked without /data/media as the progress stats of its backup will,
+    // so that the backup can reuse the scan. The sdcard size is estimated from the /data statfs used size
+    size_job_t data_job;
+    int data_job_started = 0;
+    unsigned long long data_total = 0, data_used = 0, data_free = 0;
+    if (is_data_media() && (backup_data || backup_data_media)) {
+        if (0 == ensure_path_mounted("/data") && 0 == Get_Size_Via_statfs("/data")) {
+            data_total = Total_Size;
+            data_used = Used_Size;
+            data_free = Free_Size;
+            start_size_job(&data_job, "/data", directory_stats_exclude("/data"));
+            data_job_started = 1;
+        } else {
+            if (backup_data) {
+                strcat(skipped_parts, " - /data");
+                ret++;
+            }
+            if (backup_data_media) {
+                strcat(skipped_parts, " - /data/media");
+                ret++;
+            }
+        }
+    }
+
+    // .android_secure size calculation
+    // set_android_secure_path() will mount tmp so no need to remount before walking it
+    char tmp[PATH_MAX];
+    size_job_t andsec_job;
+    int andsec_job_started = 0;
+    set_android_secure_path(tmp);
+    if (backup_data && android_secure_ext) {
+        start_size_job(&andsec_job, tmp, NULL);
+        andsec_job_started = 1;
+    }
+
     for (i = 0; Partitions_List[i] != NULL; ++i) {
         if (i >= BASE_PARTITIONS_NUM) {
             if (!extra_partition[i - BASE_PARTITIONS_NUM].backup_state)
@@ -234,26 +309,15 @@ int check_backup_size(const char* backup_path) {
     // handle special partitions and folders:
     // handle /data and /data/media partitions size for /data/media devices
     unsigned long long data_backup_size = 0;
-    unsigned long long data_used_bytes = 0;
     unsigned long long data_media_size = 0;
-    if (is_data_media() && (backup_data || backup_data_media)) {
-        if (0 == ensure_path_mounted("/data") && 0 == Get_Size_Via_statfs("/data")) {
-            data_media_size = Get_Folder_Size("/data/media");
-            data_used_bytes = Get_Folder_Size("/data");
-            data_backup_size = data_used_bytes - data_media_size;
-            LOGI("/data: tot size=%lluMb, free=%lluMb, backup size=%lluMb, used=%lluMb, media=%lluMb\n",
-                    Total_Size/1048576LLU, Free_Size/1048576LLU, data_backup_size/1048576LLU,
-                    data_used_bytes/1048576LLU, data_media_size/1048576LLU);
-        } else {
-            if (backup_data) {
-                strcat(skipped_parts, " - /data");
-                ret++;
-            }
-            if (backup_data_media) {
-                strcat(skipped_parts, " - /data/media");
-                ret++;
-            }
-        }
+    if (data_job_started) {
+        data_backup_size = finish_size_job(&data_job);
+        // statfs used size also counts the filesystem metadata: a slight overestimate of the sdcard files
+        if (data_used > data_backup_size)
+            data_media_size = data_used - data_backup_size;
+        LOGI("/data: tot size=%lluMb, free=%lluMb, backup size=%lluMb, used=%lluMb, media=%lluMb\n",
+                data_total/1048576LLU, data_free/1048576LLU, data_backup_size/1048576LLU,
+                data_used/1048576LLU, data_media_size/1048576LLU);
     }
 
     if (backup_data)
@@ -266,13 +330,9 @@ int check_backup_size(const char* backup_path) {
         LOGI("included /data/media size\n"); // debug
     }
 
-    // .android_secure size calculation
-    // set_android_secure_path() will mount tmp so no need to remount before calling Get_Folder_Size(tmp)
-    char tmp[PATH_MAX];
-    set_android_secure_path(tmp);
-    if (backup_data && android_secure_ext) {
+    if (andsec_job_started) {
         unsigned long long andsec_size;
-        andsec_size = Get_Folder_Size(tmp);
+        andsec_size = finish_size_job(&andsec_job);
         Backup_Size += andsec_size;
         LOGI("%s backup size=%lluMb\n", tmp, andsec_size / 1048576LLU); // debug
     }
@@ -284,10 +344,11 @@ int check_backup_size(const char* backup_path) {
     if (ret)
         ui_print(">> Unknown partitions size (%d):%s\n", ret, skipped_parts);
 
-    // dedupe wrapper needs less space than actual backup size (incremental backups)
+    // dedupe and block image wrappers need less space than actual backup size (incremental backups)
     // only check free space in Mb if we use tar or tar.gz as a default format
     // also, add extra 50 Mb for security measures
-    if (free_percent < 3 || (default_backup_handler != dedupe_compress_wrapper && free_mb < backup_size_mb + 50)) {
+    if (free_percent < 3 || (default_backup_handler != dedupe_compress_wrapper &&
+            default_backup_handler != blk_backup_wrapper && free_mb < backup_size_mb + 50)) {
         LOGW("Low space for backup!\n");
         if (!ui_is_initialized()) {
             // do not prompt when it is an "adb shell nandroid backup" command
@@ -338,7 +399,7 @@ void check_restore_size(const char* backup_file_image, const char* backup_path)
         }
     }
 
-    free_string_array(files);
+    free(files);
 }
 
 // print backup stats summary at end of a backup
@@ -358,7 +419,7 @@ void show_backup_stats(const char* backup_path) {
     ui_print("Backup size: %.2LfMb\n", (long double) final_size / 1048576);
     // print compression % only if it is a tar / tar.gz backup
     // keep also for tar to show it is 0% compression
-    if (default_backup_handler != dedupe_compress_wrapper)
+    if (default_backup_handler != dedupe_compress_wrapper && default_backup_handler != blk_backup_wrapper)
         ui_print("Compression: %.2Lf%%\n", compression * 100);
 }
 
@@ -372,9 +433,36 @@ void show_restore_stats() {
     ui_print("Restore time: %02lld:%02lld mn\n", minutes, seconds);
 }
 
-// custom backup: raw backup through shell (ext4 raw backup not supported in backup_raw_partition())
+// append a line to the log.txt of the raw backups folder
+static void raw_backup_log(const char* log_dir, const char* fmt, ...) {
+    char logfile[PATH_MAX];
+    sprintf(logfile, "%s/log.txt", log_dir);
+    FILE* fp = fopen(logfile, "a");
+    if (fp == NULL)
+        return;
+
+    va_list ap;
+    va_start(ap, fmt);
+    vfprintf(fp, fmt, ap);
+    va_end(ap);
+    fclose(fp);
+}
+
+// find the raw block device of a volume, NULL if none: free() the result
+static char* raw_backup_device(const char* root, Volume* vol) {
+    if (strstr(vol->blk_device, "/dev/block/mmcblk") != NULL || strstr(vol->blk_device, "/dev/block/mtdblock") != NULL)
+        return strdup(vol->blk_device);
+    if (vol->blk_device2 != NULL &&
+            (strstr(vol->blk_device2, "/dev/block/mmcblk") != NULL || strstr(vol->blk_device2, "/dev/block/mtdblock") != NULL))
+        return strdup(vol->blk_device2);
+    return readlink_device_blk(root);
+}
+
+// custom backup: native raw backup (ext4 raw backup not supported in backup_raw_partition())
 // for efs partition
 // for now called only from nandroid_backup()
+// the image is an android sparse image: empty blocks take no space
+// it is named .simg so that it can't be taken for a plain dd image (.img)
 // ret = 0 if success, else ret = 1
 int dd_raw_backup_handler(const char* backup_path, const char* root) {
     Volume *vol = volume_for_path(root);
@@ -384,27 +472,31 @@ int dd_raw_backup_handler(const char* backup_path, const char* root) {
         return 0;
     }
 
-    int ret = 0;
-    char tmp[PATH_MAX];
-    char* device_mmcblk;
-    if (strstr(vol->blk_device, "/dev/block/mmcblk") != NULL || strstr(vol->blk_device, "/dev/block/mtdblock") != NULL) {
-        sprintf(tmp, "raw-backup.sh -b %s %s %s", backup_path, vol->blk_device, vol->mount_point);
-    }
-    else if (vol->blk_device2 != NULL &&
-            (strstr(vol->blk_device2, "/dev/block/mmcblk") != NULL || strstr(vol->blk_device2, "/dev/block/mtdblock") != NULL)) {
-        sprintf(tmp, "raw-backup.sh -b %s %s %s", backup_path, vol->blk_device2, vol->mount_point);
-    }
-    else if ((device_mmcblk = readlink_device_blk(root)) != NULL) {
-        sprintf(tmp, "raw-backup.sh -b %s %s %s", backup_path, device_mmcblk, vol->mount_point);
-        free(device_mmcblk);
-    }
-    else {
+    char* device = raw_backup_device(root, vol);
+    if (device == NULL) {
         LOGE("invalid device! Skipping raw backup of %s\n", root);
         return 0;
     }
 
-    if (0 != (ret = __system(tmp)))
+    int ret = 0;
+    char image[PATH_MAX];
+    char date[32];
+    time_t now = time(NULL);
+    strftime(date, sizeof(date), "%Y%m%d_%H%M%S", localtime(&now));
+    sprintf(image, "%s%s_%s.simg", backup_path, vol->mount_point, date);
+    ensure_directory(backup_path, 0755);
+
+    raw_backup_log(backup_path, "\nBackup %s (%s) to %s\n", vol->mount_point, device, image);
+    RawImageStats stats;
+    if (0 != raw_image_backup(device, image, &stats)) {
         LOGE("failed raw backup of %s...\n", root);
+        raw_backup_log(backup_path, "Error!\n");
+        ret = 1;
+    } else {
+        raw_backup_log(backup_path, "Stored %llu of %llu bytes (crc32 %08x)\nSuccess!\n",
+                       stats.stored, stats.size, stats.crc);
+    }
+    free(device);
 
     //log
     //finish_nandroid_job();
@@ -418,6 +510,8 @@ int dd_raw_backup_handler(const char* backup_path, const char* root) {
 // used to restore efs in raw mode or modem.bin files
 // for now, only called directly from outside functions (not from nandroid_restore())
 // user selects an image file to restore, so backup_file_image path is already mounted
+// sparse (.simg) and plain (.img, .bin) images are told apart by their header, not their name:
+// sparse backups made before they got their own suffix are named .img
 int dd_raw_restore_handler(const char* backup_file_image, const char* root) {
     ui_print("\n>> Restoring %s...\n", root);
     Volume *vol = volume_for_path(root);
@@ -434,7 +528,7 @@ int dd_raw_restore_handler(const char* backup_file_image, const char* root) {
     char errmsg[PATH_MAX];
     char tmp[PATH_MAX];
     char filename[PATH_MAX];
-    const char *raw_image_format[] = { ".img", ".bin", NULL };
+    const char *raw_image_format[] = { ".simg", ".img", ".bin", NULL };
 
     sprintf(filename, "%s", BaseName(backup_file_image));
     while (raw_image_format[i] != NULL) {
@@ -459,31 +553,31 @@ int dd_raw_restore_handler(const char* backup_file_image, const char* root) {
 
     //restore raw image
     int ret = 0;
-    char* device_mmcblk;
-
-    ui_print("Restoring %s to %s\n", filename, vol->mount_point);
-    if (strstr(vol->blk_device, "/dev/block/mmcblk") != NULL || strstr(vol->blk_device, "/dev/block/mtdblock") != NULL) {
-        sprintf(tmp, "raw-backup.sh -r '%s' %s %s", backup_file_image, vol->blk_device, vol->mount_point);
-    } else if (vol->blk_device2 != NULL &&
-            (strstr(vol->blk_device2, "/dev/block/mmcblk") != NULL || strstr(vol->blk_device2, "/dev/block/mtdblock") != NULL)) {
-        sprintf(tmp, "raw-backup.sh -r '%s' %s %s", backup_file_image, vol->blk_device2, vol->mount_point);
-    } else if ((device_mmcblk = readlink_device_blk(root)) != NULL) {
-        sprintf(tmp, "raw-backup.sh -r '%s' %s %s", backup_file_image, device_mmcblk, vol->mount_point);
-        free(device_mmcblk);
-    } else {
+    char* device = raw_backup_device(root, vol);
+    if (device == NULL) {
         sprintf(errmsg, "raw restore: no device found (%s)\n", root);
         return print_and_error(errmsg, NANDROID_ERROR_GENERAL);
     }
 
-    ret = __system(tmp);
-    if (0 != ret) {
+    // sparse images are verified before anything is written
+    char log_dir[PATH_MAX];
+    strcpy(log_dir, DirName(backup_file_image));
+    ui_print("Restoring %s to %s\n", filename, vol->mount_point);
+    raw_backup_log(log_dir, "\nRestore %s to %s (%s)\n", backup_file_image, device, vol->mount_point);
+    RawImageStats stats;
+    if (0 != raw_image_restore(backup_file_image, device, &stats)) {
+        raw_backup_log(log_dir, "Error!\n");
+        ret = 1;
         sprintf(errmsg, "failed raw restore of %s to %s\n", filename, root);
         print_and_error(errmsg, ret);
     } else {
+        raw_backup_log(log_dir, "Wrote %llu of %llu bytes (crc32 %08x)\nSuccess!\n",
+                       stats.stored, stats.size, stats.crc);
         finish_nandroid_job();
     }
+    free(device);
 
-    sprintf(tmp, "%s/log.txt", DirName(backup_file_image));
+    sprintf(tmp, "%s/log.txt", log_dir);
     ui_print_custom_logtail(tmp, 3);
     return ret;
 }
@@ -649,8 +743,8 @@ int Generate_File_Lists(const char* Path) {
 int Make_File_List(const char* backup_path) {
     Makelist_File_Count = 0;
     Makelist_Current_Size = 0;
-    __system("cd /tmp && rm -rf list");
-    __system("cd /tmp && mkdir list");
+    dirUnlinkHierarchy("/tmp/list");
+    mkdir("/tmp/list", 0755);
     if (Generate_File_Lists(backup_path) < 0) {
         LOGE("Error generating file list\n");
         return -1;
@@ -742,7 +836,7 @@ int twrp_backup_wrapper(const char* backup_path, const char* backup_file_image,
         total_bsize += file_size;
     }
 
-    __system("cd /tmp && rm -rf list");
+    dirUnlinkHierarchy("/tmp/list");
     set_perf_mode(0);
     ui_print("Total backup size:\n  %llu bytes.\n", total_bsize);
     return 0;
@@ -774,6 +868,7 @@ int twrp_backup(const char* backup_path) {
     // also, it is expected to have the background installing icon when we actually start backup
     ui_set_background(BACKGROUND_ICON_INSTALLING);
     nandroid_start_msec = timenow_msec(); // starts backup monitoring timer for total backup time
+    __spawn_stats_reset();
 #ifdef PHILZ_TOUCH_RECOVERY
     last_key_ev = nandroid_start_msec; // support dim screen timeout during nandroid operation
 #endif
@@ -960,6 +1055,7 @@ int twrp_restore(const char* backup_path) {
     ui_set_background(BACKGROUND_ICON_INSTALLING);
     nandroid_files_total = 0;
     nandroid_start_msec = timenow_msec();
+    __spawn_stats_reset();
 #ifdef PHILZ_TOUCH_RECOVERY
     // support dim screen timeout during nandroid operation
     last_key_ev = timenow_msec();
@@ -1142,13 +1238,11 @@ int nandroid_restore_datamedia(const char* backup_path) {
         sprintf(backup_file_image, "%s/datamedia.%s.tar", backup_path, filesystem);
         if (0 == stat(backup_file_image, &s)) {
             restore_handler = tar_extract_wrapper;
-            sprintf(tmp, "cd / ; set -o pipefail ; cat %s* | tar -xpv ; exit $?", backup_file_image);
             break;
         }
         sprintf(backup_file_image, "%s/datamedia.%s.tar.gz", backup_path, filesystem);
         if (0 == stat(backup_file_image, &s)) {
             restore_handler = tar_gzip_extract_wrapper;
-            sprintf(tmp, "cd / ; set -o pipefail ; cat %s* | pigz -d -c | tar -xpv ; exit $?", backup_file_image);
             break;
         }
         i++;
@@ -1166,7 +1260,8 @@ int nandroid_restore_datamedia(const char* backup_path) {
     if (0 != ensure_path_mounted("/data"))
         return -1;
 
-    if (0 != do_tar_extract(tmp, backup_file_image, "/data", callback))
+    // archive paths start with data/media: the wrappers extract them from /
+    if (0 != restore_handler(backup_file_image, "/data", callback))
         return print_and_error("Failed to restore /data/media!\n", NANDROID_ERROR_GENERAL);
 
     ui_print("Restore of /data/media completed.\n");
@@ -1211,7 +1306,7 @@ int gen_nandroid_md5sum(const char* backup_path) {
 
 out:
     ui_reset_progress();
-    free_string_array(files);
+    free(files);
     if (ret != 0)
         LOGE("Error while generating md5 sum!\n");
 
@@ -1277,7 +1372,7 @@ int verify_nandroid_md5sum(const char* backup_path) {
     files = gather_files(backup_path, "", &numFiles);
     set_gather_hidden_files(1);
     if (numFiles == 0) {
-        free_string_array(files);
+        free(files);
         return -1;
     }
 
@@ -1290,7 +1385,7 @@ int verify_nandroid_md5sum(const char* backup_path) {
         sprintf(md5file, "/tmp/%s.md5", BaseName(files[i]));
         ui_print("  > %s\n", BaseName(files[i]));
         if (verify_md5digest(files[i], md5file) != 0) {
-            free_string_array(files);
+            free(files);
             ui_reset_progress();
             return -1;
         }
@@ -1298,7 +1393,7 @@ int verify_nandroid_md5sum(const char* backup_path) {
     }
 
     ui_reset_progress();
-    free_string_array(files);
+    free(files);
     return 0;
 }
 
@@ -1312,7 +1407,7 @@ int check_twrp_md5sum(const char* backup_path) {
     files = gather_files(backup_path, "", &numFiles);
     if (numFiles == 0) {
         LOGE("No files found in %s\n", backup_path);
-        free_string_array(files);
+        free(files);
         return -1;
     }
 
@@ -1329,14 +1424,14 @@ int check_twrp_md5sum(const char* backup_path) {
         if (verify_md5digest(files[i], md5file) != 0) {
             LOGE("md5sum error!\n");
             ui_reset_progress();
-            free_string_array(files);
+            free(files);
             return -1;
         }
     }
 
     ui_print("MD5 sum ok.\n");
     ui_reset_progress();
-    free_string_array(files);
+    free(files);
     return 0;
 }
 
@@ -1351,7 +1446,7 @@ int gen_twrp_md5sum(const char* backup_path) {
     char** files = gather_files(backup_path, "", &numFiles);
     if (numFiles == 0) {
         LOGE("No files found in backup path %s\n", backup_path);
-        free_string_array(files);
+        free(files);
         return -1;
     }
 
@@ -1363,13 +1458,13 @@ int gen_twrp_md5sum(const char* backup_path) {
         if (write_md5digest(files[i], md5file, 0) < 0) {
             LOGE("Error while generating md5sum!\n");
             ui_reset_progress();
-            free_string_array(files);
+            free(files);
             return -1;
         }
     }
 
     ui_print("MD5 sum created.\n");
     ui_reset_progress();
-    free_string_array(files);
+    free(files);
     return 0;
 }
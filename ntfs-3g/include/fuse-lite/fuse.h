@@ -503,6 +503,18 @@ void fuse_destroy(struct fuse *f);
  */
 int fuse_loop(struct fuse *f);
 
+/**
+ * FUSE event loop with a separate processing thread.
+ *
+ * Same as fuse_loop(), but the next requests are read from the kernel
+ * while the current one is being processed. Operations are still
+ * called one at a time, so they need not be thread safe.
+ *
+ * @param f the FUSE handle
+ * @return 0 if no error occurred, -1 otherwise
+ */
+int fuse_loop_mt(struct fuse *f);
+
 /**
  * Exit from event loop
  *
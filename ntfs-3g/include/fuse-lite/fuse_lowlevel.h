@@ -1240,6 +1240,9 @@ int fuse_session_loop(struct fuse_session *se);
 /**
  * Enter a multi-threaded event loop
  *
+ * The calling thread reads the requests while another thread processes
+ * them. Requests are still processed one at a time and in order.
+ *
  * @param se the session
  * @return 0 on success, -1 on error
  */
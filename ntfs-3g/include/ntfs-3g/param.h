@@ -69,6 +69,17 @@ enum {
 
 #define SAFE_CAPACITY_FOR_BIG_WRITES 0x100000000LL
 
+/*
+ *		Cluster reservation for sequential writes
+ *
+ *	When a file keeps being appended to where its previous allocation
+ *	ended (typically a backup archive being written), the free clusters
+ *	following it are remembered, so that the next appends are served
+ *	without scanning the bitmap. Zero disables the reservation.
+ */
+
+#define STREAM_RESERVE_SIZE 0x800000 /* 8MB */
+
 /*
  *		Parameters for runlists
  */
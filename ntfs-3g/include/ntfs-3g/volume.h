@@ -203,6 +203,14 @@ struct _ntfs_volume {
 	LCN mft_zone_pos;	/* Current position in the mft zone. */
 	LCN data1_zone_pos;	/* Current position in the first data zone. */
 	LCN data2_zone_pos;	/* Current position in the second data zone. */
+	LCN stream_lcn;		/* First free cluster reserved ahead of
+				   the current sequential writer, only
+				   in memory. */
+	s64 stream_len;		/* Number of clusters reserved. */
+	LCN stream_next;	/* Cluster following the latest data
+				   allocation, to detect sequential ones. */
+	s64 stream_reserve;	/* Clusters to reserve ahead of a sequential
+				   writer, zero to disable. */
 
 	s64 nr_clusters;	/* Volume size in clusters, hence also the
 				   number of bits in lcn_bitmap. */
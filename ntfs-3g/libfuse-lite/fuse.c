@@ -2767,6 +2767,14 @@ int fuse_loop(struct fuse *f)
         return -1;
 }
 
+int fuse_loop_mt(struct fuse *f)
+{
+    if (f)
+        return fuse_session_loop_mt(f->se);
+    else
+        return -1;
+}
+
 void fuse_exit(struct fuse *f)
 {
     fuse_session_exit(f->se);
@@ -11,7 +11,10 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <errno.h>
+#include <signal.h>
+#include <pthread.h>
 
 int fuse_session_loop(struct fuse_session *se)
 {
@@ -38,3 +41,122 @@ int fuse_session_loop(struct fuse_session *se)
     fuse_session_reset(se);
     return res < 0 ? -1 : 0;
 }
+
+/*
+ * Requests are read from the kernel by the calling thread while a single
+ * worker processes the previous ones, so that the filesystem is never
+ * waiting for the next request to be copied in. Processing stays
+ * serialized, as the filesystem code is not required to be thread safe.
+ */
+#define FUSE_LOOP_MT_BUFS 4
+
+struct fuse_loop_mt {
+    struct fuse_session *se;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    char *buf[FUSE_LOOP_MT_BUFS];
+    size_t len[FUSE_LOOP_MT_BUFS];
+    struct fuse_chan *ch[FUSE_LOOP_MT_BUFS];
+    unsigned int head;      /* next request to process */
+    unsigned int tail;      /* next buffer to read into */
+    int done;
+};
+
+static void *fuse_loop_mt_worker(void *data)
+{
+    struct fuse_loop_mt *mt = (struct fuse_loop_mt *) data;
+    unsigned int slot;
+
+    pthread_mutex_lock(&mt->lock);
+    while (1) {
+        while (mt->head == mt->tail && !mt->done)
+            pthread_cond_wait(&mt->cond, &mt->lock);
+        if (mt->head == mt->tail)
+            break;
+        slot = mt->head % FUSE_LOOP_MT_BUFS;
+        pthread_mutex_unlock(&mt->lock);
+
+        fuse_session_process(mt->se, mt->buf[slot], mt->len[slot],
+                             mt->ch[slot]);
+
+        pthread_mutex_lock(&mt->lock);
+        mt->head++;
+        pthread_cond_broadcast(&mt->cond);
+    }
+    pthread_mutex_unlock(&mt->lock);
+    return NULL;
+}
+
+int fuse_session_loop_mt(struct fuse_session *se)
+{
+    int i, err, res = 0;
+    struct fuse_chan *ch = fuse_session_next_chan(se, NULL);
+    size_t bufsize = fuse_chan_bufsize(ch);
+    struct fuse_loop_mt mt;
+    pthread_t worker;
+    sigset_t newset, oldset;
+    unsigned int slot;
+
+    memset(&mt, 0, sizeof(mt));
+    mt.se = se;
+    for (i = 0; i < FUSE_LOOP_MT_BUFS; i++) {
+        mt.buf[i] = (char *) malloc(bufsize);
+        if (!mt.buf[i]) {
+            fprintf(stderr, "fuse: failed to allocate read buffer\n");
+            res = -1;
+            goto out_free;
+        }
+    }
+    pthread_mutex_init(&mt.lock, NULL);
+    pthread_cond_init(&mt.cond, NULL);
+
+    /* Signals are to interrupt the reads, not the processing */
+    sigfillset(&newset);
+    pthread_sigmask(SIG_BLOCK, &newset, &oldset);
+    err = pthread_create(&worker, NULL, fuse_loop_mt_worker, &mt);
+    pthread_sigmask(SIG_SETMASK, &oldset, NULL);
+    if (err) {
+        pthread_cond_destroy(&mt.cond);
+        pthread_mutex_destroy(&mt.lock);
+        for (i = 0; i < FUSE_LOOP_MT_BUFS; i++)
+            free(mt.buf[i]);
+        return fuse_session_loop(se);
+    }
+
+    while (!fuse_session_exited(se)) {
+        struct fuse_chan *tmpch = ch;
+
+        pthread_mutex_lock(&mt.lock);
+        while (mt.tail - mt.head == FUSE_LOOP_MT_BUFS)
+            pthread_cond_wait(&mt.cond, &mt.lock);
+        slot = mt.tail % FUSE_LOOP_MT_BUFS;
+        pthread_mutex_unlock(&mt.lock);
+
+        res = fuse_chan_recv(&tmpch, mt.buf[slot], bufsize);
+        if (res == -EINTR)
+            continue;
+        if (res <= 0)
+            break;
+
+        pthread_mutex_lock(&mt.lock);
+        mt.len[slot] = res;
+        mt.ch[slot] = tmpch;
+        mt.tail++;
+        pthread_cond_broadcast(&mt.cond);
+        pthread_mutex_unlock(&mt.lock);
+    }
+
+    pthread_mutex_lock(&mt.lock);
+    mt.done = 1;
+    pthread_cond_broadcast(&mt.cond);
+    pthread_mutex_unlock(&mt.lock);
+    pthread_join(worker, NULL);
+    pthread_cond_destroy(&mt.cond);
+    pthread_mutex_destroy(&mt.lock);
+
+    fuse_session_reset(se);
+out_free:
+    for (i = 0; i < FUSE_LOOP_MT_BUFS; i++)
+        free(mt.buf[i]);
+    return res < 0 ? -1 : 0;
+}
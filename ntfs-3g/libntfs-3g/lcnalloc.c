@@ -192,6 +192,61 @@ static int bitmap_writeback(ntfs_volume *vol, s64 pos, s64 size, void *b,
 	return 0;
 }
 
+/*
+ *		Reserve the free clusters following a sequential allocation
+ *
+ *	Up to vol->stream_reserve free clusters starting at @lcn are
+ *	set aside, without leaving the current data zone.
+ *	@buf is a work buffer of NTFS_LCNALLOC_BSIZE bytes.
+ *
+ *	The reservation is only kept in memory, $Bitmap is updated when
+ *	the clusters are actually allocated, so nothing leaks if the
+ *	volume is not unmounted cleanly. It is dropped before any bitmap
+ *	search, which could otherwise hand the clusters out.
+ *
+ *	Failing to reserve is not an error, the next allocations will
+ *	just go through the usual bitmap search.
+ */
+
+static void ntfs_cluster_reserve(ntfs_volume *vol, LCN lcn, u8 *buf)
+{
+	LCN end;
+	s64 br, count;
+	int bit, bits;
+
+	if (lcn < vol->mft_zone_start)
+		end = vol->mft_zone_start;
+	else if (lcn >= vol->mft_zone_end)
+		end = vol->nr_clusters;
+	else
+		return;
+	if (end > lcn + vol->stream_reserve)
+		end = lcn + vol->stream_reserve;
+	if (end > lcn + ((NTFS_LCNALLOC_BSIZE - 1) << 3))
+		end = lcn + ((NTFS_LCNALLOC_BSIZE - 1) << 3);
+	if (end <= lcn)
+		return;
+	br = ntfs_attr_pread(vol->lcnbmp_na, lcn >> 3,
+			((end - 1) >> 3) - (lcn >> 3) + 1, buf);
+	if (br <= 0)
+		return;
+	bit = lcn & 7;
+	bits = (int)br << 3;
+	if (bits > bit + end - lcn)
+		bits = bit + end - lcn;
+	count = 0;
+	while ((bit < bits) && !(buf[bit >> 3] & (1 << (bit & 7)))) {
+		count++;
+		bit++;
+	}
+	if (!count)
+		return;
+	vol->stream_lcn = lcn;
+	vol->stream_len = count;
+	ntfs_log_debug("Reserved %lld clusters at %lld\n",
+			(long long)count, (long long)lcn);
+}
+
 /**
  * ntfs_cluster_alloc - allocate clusters on an ntfs volume
  * @vol:	mounted ntfs volume on which to allocate the clusters
@@ -272,6 +327,37 @@ runlist *ntfs_cluster_alloc(ntfs_volume *vol, VCN start_vcn, s64 count,
 		goto out;
 	}
 
+	/*
+	 * Serve an append to the current sequential writer from the
+	 * clusters reserved for it, with no bitmap search. Otherwise
+	 * drop the reservation, the search may allocate its clusters.
+	 */
+	if (vol->stream_len) {
+		if ((zone == DATA_ZONE) && (start_lcn == vol->stream_lcn)
+		    && (count <= vol->stream_len)) {
+			rl = ntfs_malloc(0x1000);
+			if (rl && ntfs_bitmap_set_run(vol->lcnbmp_na,
+					start_lcn, count)) {
+				free(rl);
+				rl = NULL;
+			}
+			if (rl) {
+				rl[0].vcn = start_vcn;
+				rl[0].lcn = start_lcn;
+				rl[0].length = count;
+				rl[1].vcn = start_vcn + count;
+				rl[1].lcn = LCN_RL_NOT_MAPPED;
+				rl[1].length = 0;
+				vol->free_clusters -= count;
+				vol->stream_lcn += count;
+				vol->stream_len -= count;
+				vol->stream_next = vol->stream_lcn;
+				goto out;
+			}
+		}
+		vol->stream_len = 0;
+	}
+
 	buf = ntfs_malloc(NTFS_LCNALLOC_BSIZE);
 	if (!buf)
 		goto out;
@@ -536,6 +622,18 @@ done_ret:
 		err = errno;
 		goto err_ret;
 	}
+	/*
+	 * A single run appended where the previous data allocation
+	 * ended denotes a sequential writer : reserve ahead of it.
+	 */
+	if (zone == DATA_ZONE) {
+		if (vol->stream_reserve && (rlpos == 1) && (start_lcn > 0)
+		    && (start_lcn == vol->stream_next)
+		    && (rl[0].lcn == start_lcn)) {
+			ntfs_cluster_reserve(vol, rl[0].lcn + rl[0].length, buf);
+		}
+		vol->stream_next = rl[rlpos - 1].lcn + rl[rlpos - 1].length;
+	}
 done_err_ret:
 	free(buf);
 	if (err) {
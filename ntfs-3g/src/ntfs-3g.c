@@ -3382,7 +3382,9 @@ static int ntfs_fuse_init(void)
 #endif			
 		.atime   = ATIME_RELATIVE,
 		.silent  = TRUE,
-		.recover = TRUE
+		.recover = TRUE,
+			/* vold gives no options, default to large writes */
+		.big_writes = TRUE
 	};
 	return 0;
 }
@@ -3407,6 +3409,9 @@ static int ntfs_open(const char *device)
 	}
 	if (ctx->sync && ctx->vol->dev)
 		NDevSetSync(ctx->vol->dev);
+	if (!ctx->ro)
+		ctx->vol->stream_reserve = STREAM_RESERVE_SIZE
+				>> ctx->vol->cluster_size_bits;
 	if (ctx->compression)
 		NVolSetCompression(ctx->vol);
 	else
@@ -3910,7 +3915,7 @@ int ntfs_3g_main(int argc, char *argv[])
 	    && !ctx->uid && ctx->gid)
 		ntfs_log_error("Warning : using problematic uid==0 and gid!=0\n");
 	
-	fuse_loop(fh);
+	fuse_loop_mt(fh);
 	
 	err = 0;
 
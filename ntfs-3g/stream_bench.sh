@@ -0,0 +1,88 @@
+#!/bin/bash
+#
+# Sequential write and read benchmark of ntfs-3g, as a nandroid backup to an
+# external NTFS drive does it. Run as root on a Linux host with FUSE and loop
+# devices: it builds ntfs-3g, mkntfs and ntfsfix with the host gcc, formats a
+# sparse image, streams a 4GB tar archive to it and reads it back. The volume
+# must be clean afterwards and get all its free space back.
+#
+#   stream_bench.sh [image size in GB] [archive size in GB]
+
+IMAGE_GB=${1:-6}
+ARCHIVE_GB=${2:-4}
+
+# ------------------------
+
+cd $(dirname $0)
+tmpdir=$(mktemp -d)
+mnt=$tmpdir/mnt
+
+cleanup() {
+  umount $mnt 2>/dev/null
+  [ -n "$loop" ] && losetup -d $loop
+  rm -rf $tmpdir
+}
+trap cleanup EXIT
+
+fail() {
+  echo
+  echo FAIL: $@
+  echo
+  exit 1
+}
+
+now_ms() {
+  echo $(( $(date +%s%N) / 1000000 ))
+}
+
+# config.h is the android one, off_t is a typedef there
+sed 's/^typedef long long off_t;//' config.h > $tmpdir/config.h
+CFLAGS="-O2 -w -D_LARGEFILE_SOURCE -D_FILE_OFFSET_BITS=64 -DHAVE_CONFIG_H -include sys/sysmacros.h \
+  -I$tmpdir -I. -Iinclude/fuse-lite -Iinclude/ntfs-3g -Isrc -Intfsprogs"
+FUSE_SRC=$(ls libfuse-lite/*.c)
+NTFS_SRC=$(ls libntfs-3g/*.c | grep -v -e win32_io.c -e xattrs.c)
+
+gcc $CFLAGS -o $tmpdir/ntfs-3g src/ntfs-3g_main.c src/ntfs-3g.c src/ntfs-3g_common.c \
+  $FUSE_SRC $NTFS_SRC -lpthread -ldl || fail "build ntfs-3g"
+gcc $CFLAGS -o $tmpdir/mkntfs ntfsprogs/mkntfs_main.c ntfsprogs/attrdef.c ntfsprogs/boot.c \
+  ntfsprogs/sd.c ntfsprogs/mkntfs.c ntfsprogs/utils.c $NTFS_SRC -luuid || fail "build mkntfs"
+gcc $CFLAGS -o $tmpdir/ntfsfix ntfsprogs/ntfsfix_main.c ntfsprogs/ntfsfix.c ntfsprogs/utils.c \
+  $NTFS_SRC || fail "build ntfsfix"
+
+# a block device, as a drive is: the device size is not probed from a file
+truncate -s ${IMAGE_GB}G $tmpdir/ntfs.img || fail "create image"
+loop=$(losetup -f --show $tmpdir/ntfs.img) || fail "losetup"
+image=$loop
+$tmpdir/mkntfs -F -Q -q $image 2>/dev/null || fail "mkntfs"
+
+# the archive: one sparse file, tar reads it as zeros at memory speed
+mkdir -p $tmpdir/src $mnt
+truncate -s ${ARCHIVE_GB}G $tmpdir/src/data.img
+
+$tmpdir/ntfs-3g $image $mnt || fail "mount"
+# the MFT record is allocated first, only the data clusters are compared
+touch $mnt/backup.tar
+free_before=$(stat -f -c %f $mnt)
+
+start=$(now_ms)
+tar -cf - -C $tmpdir/src data.img > $mnt/backup.tar || fail "write archive"
+sync
+umount $mnt || fail "umount"
+ms=$(( $(now_ms) - start ))
+size=$(( $(stat -c %s $tmpdir/src/data.img) / 1048576 ))
+echo "write: ${size}MB in ${ms}ms ($(( size * 1000 / (ms > 0 ? ms : 1) ))MB/s)"
+
+echo 3 > /proc/sys/vm/drop_caches
+$tmpdir/ntfs-3g $image $mnt || fail "remount"
+start=$(now_ms)
+cat $mnt/backup.tar > /dev/null || fail "read archive"
+ms=$(( $(now_ms) - start ))
+echo "read: ${size}MB in ${ms}ms ($(( size * 1000 / (ms > 0 ? ms : 1) ))MB/s)"
+
+rm $mnt/backup.tar
+free_after=$(stat -f -c %f $mnt)
+umount $mnt || fail "umount"
+[ "$free_before" = "$free_after" ] || fail "free clusters $free_before before, $free_after after"
+
+$tmpdir/ntfsfix -n $image > $tmpdir/ntfsfix.log 2>&1 || { cat $tmpdir/ntfsfix.log; fail "ntfsfix"; }
+echo PASSED
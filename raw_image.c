@@ -0,0 +1,475 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <linux/fs.h>
+
+#include "zlib.h"
+
+#include "common.h"
+#include "raw_image.h"
+
+#ifndef BLKZEROOUT
+#define BLKZEROOUT _IO(0x12, 127)
+#endif
+
+// partitions are read and written 1MB at a time
+#define RAW_IMAGE_BUFFER_SIZE   (1024 * 1024)
+
+// android sparse image format, as in system/core/libsparse/sparse_format.h
+#define SPARSE_HEADER_MAGIC     0xed26ff3a
+#define CHUNK_TYPE_RAW          0xCAC1
+#define CHUNK_TYPE_FILL         0xCAC2
+#define CHUNK_TYPE_DONT_CARE    0xCAC3
+#define CHUNK_TYPE_CRC32        0xCAC4
+
+typedef struct {
+    uint32_t magic;
+    uint16_t major_version;
+    uint16_t minor_version;
+    uint16_t file_hdr_sz;
+    uint16_t chunk_hdr_sz;
+    uint32_t blk_sz;
+    uint32_t total_blks;
+    uint32_t total_chunks;
+    uint32_t image_checksum;
+} sparse_header_t;
+
+typedef struct {
+    uint16_t chunk_type;
+    uint16_t reserved1;
+    uint32_t chunk_sz;      // in blocks
+    uint32_t total_sz;      // in bytes, header included
+} chunk_header_t;
+
+static void* alloc_buffer() {
+    void* buf = NULL;
+    if (posix_memalign(&buf, 4096, RAW_IMAGE_BUFFER_SIZE) != 0) {
+        LOGE("raw image: out of memory\n");
+        return NULL;
+    }
+    return buf;
+}
+
+static int read_full(int fd, void* buf, size_t len) {
+    size_t done = 0;
+    while (done < len) {
+        ssize_t r = read(fd, (char*)buf + done, len - done);
+        if (r < 0 && errno == EINTR)
+            continue;
+        if (r <= 0)
+            return -1;
+        done += r;
+    }
+    return 0;
+}
+
+static int pwrite_full(int fd, const void* buf, size_t len, off64_t offset) {
+    size_t done = 0;
+    while (done < len) {
+        ssize_t w = pwrite64(fd, (const char*)buf + done, len - done, offset + done);
+        if (w < 0 && errno == EINTR)
+            continue;
+        if (w <= 0)
+            return -1;
+        done += w;
+    }
+    return 0;
+}
+
+static int get_size(int fd, unsigned long long* size) {
+    if (ioctl(fd, BLKGETSIZE64, size) == 0)
+        return 0;
+
+    // not a block device
+    off64_t end = lseek64(fd, 0, SEEK_END);
+    if (end < 0 || lseek64(fd, 0, SEEK_SET) < 0)
+        return -1;
+    *size = end;
+    return 0;
+}
+
+// returns 1 and the value if the block repeats a single 32 bits word
+static int is_fill_block(const uint32_t* block, size_t words, uint32_t* value) {
+    size_t i;
+    for (i = 1; i < words; i++) {
+        if (block[i] != block[0])
+            return 0;
+    }
+    *value = block[0];
+    return 1;
+}
+
+static int write_chunk(FILE* out, uint16_t type, uint32_t blocks, const void* data, uint32_t data_len) {
+    chunk_header_t chunk;
+    chunk.chunk_type = type;
+    chunk.reserved1 = 0;
+    chunk.chunk_sz = blocks;
+    chunk.total_sz = sizeof(chunk) + data_len;
+    if (fwrite(&chunk, sizeof(chunk), 1, out) != 1)
+        return -1;
+    if (data_len && fwrite(data, data_len, 1, out) != 1)
+        return -1;
+    return 0;
+}
+
+int raw_image_backup(const char* device, const char* image_file, RawImageStats* stats) {
+    unsigned long long size;
+    sparse_header_t header;
+    char* buf = NULL;
+    FILE* out = NULL;
+    int ret = -1;
+
+    int fd = open(device, O_RDONLY | O_LARGEFILE);
+    if (fd < 0) {
+        LOGE("raw image: can't open %s (%s)\n", device, strerror(errno));
+        return -1;
+    }
+    if (get_size(fd, &size) != 0) {
+        LOGE("raw image: can't get size of %s\n", device);
+        goto out;
+    }
+
+    memset(&header, 0, sizeof(header));
+    header.magic = SPARSE_HEADER_MAGIC;
+    header.major_version = 1;
+    header.minor_version = 0;
+    header.file_hdr_sz = sizeof(sparse_header_t);
+    header.chunk_hdr_sz = sizeof(chunk_header_t);
+    header.blk_sz = (size % 4096) == 0 ? 4096 : 512;
+    if (size % header.blk_sz != 0 || size / header.blk_sz > UINT32_MAX) {
+        LOGE("raw image: unsupported size %llu for %s\n", size, device);
+        goto out;
+    }
+    header.total_blks = size / header.blk_sz;
+
+    if ((buf = alloc_buffer()) == NULL)
+        goto out;
+    out = fopen(image_file, "wb");
+    if (out == NULL) {
+        LOGE("raw image: can't create %s (%s)\n", image_file, strerror(errno));
+        goto out;
+    }
+    // the header is written again once the chunks are known
+    if (fwrite(&header, sizeof(header), 1, out) != 1)
+        goto write_error;
+
+    // a fill run can span several buffers, data runs are written per buffer
+    uint32_t crc = crc32(0L, Z_NULL, 0);
+    uint32_t fill_value = 0;
+    uint32_t fill_blocks = 0;
+    unsigned long long stored = 0;
+    unsigned long long pos = 0;
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    while (pos < size) {
+        size_t len = size - pos < RAW_IMAGE_BUFFER_SIZE ? size - pos : RAW_IMAGE_BUFFER_SIZE;
+        if (read_full(fd, buf, len) != 0) {
+            LOGE("raw image: read error on %s at %llu (%s)\n", device, pos, strerror(errno));
+            goto out;
+        }
+        crc = crc32(crc, (const Bytef*)buf, len);
+
+        size_t blocks = len / header.blk_sz;
+        size_t b, raw_start = 0, raw_blocks = 0;
+        for (b = 0; b < blocks; b++) {
+            uint32_t value;
+            const uint32_t* block = (const uint32_t*)(buf + b * header.blk_sz);
+            if (!is_fill_block(block, header.blk_sz / sizeof(uint32_t), &value)) {
+                if (fill_blocks) {
+                    if (write_chunk(out, CHUNK_TYPE_FILL, fill_blocks, &fill_value, sizeof(fill_value)) != 0)
+                        goto write_error;
+                    header.total_chunks++;
+                    fill_blocks = 0;
+                }
+                if (raw_blocks == 0)
+                    raw_start = b;
+                raw_blocks++;
+                continue;
+            }
+
+            if (raw_blocks) {
+                if (write_chunk(out, CHUNK_TYPE_RAW, raw_blocks, buf + raw_start * header.blk_sz,
+                                raw_blocks * header.blk_sz) != 0)
+                    goto write_error;
+                header.total_chunks++;
+                stored += (unsigned long long)raw_blocks * header.blk_sz;
+                raw_blocks = 0;
+            }
+            if (fill_blocks && value != fill_value) {
+                if (write_chunk(out, CHUNK_TYPE_FILL, fill_blocks, &fill_value, sizeof(fill_value)) != 0)
+                    goto write_error;
+                header.total_chunks++;
+                fill_blocks = 0;
+            }
+            fill_value = value;
+            fill_blocks++;
+        }
+        if (raw_blocks) {
+            if (write_chunk(out, CHUNK_TYPE_RAW, raw_blocks, buf + raw_start * header.blk_sz,
+                            raw_blocks * header.blk_sz) != 0)
+                goto write_error;
+            header.total_chunks++;
+            stored += (unsigned long long)raw_blocks * header.blk_sz;
+        }
+        pos += len;
+    }
+    if (fill_blocks) {
+        if (write_chunk(out, CHUNK_TYPE_FILL, fill_blocks, &fill_value, sizeof(fill_value)) != 0)
+            goto write_error;
+        header.total_chunks++;
+    }
+    if (write_chunk(out, CHUNK_TYPE_CRC32, 0, &crc, sizeof(crc)) != 0)
+        goto write_error;
+    header.total_chunks++;
+    header.image_checksum = crc;
+
+    if (fseeko(out, 0, SEEK_SET) != 0 || fwrite(&header, sizeof(header), 1, out) != 1 ||
+            fflush(out) != 0 || fsync(fileno(out)) != 0)
+        goto write_error;
+
+    if (stats != NULL) {
+        stats->size = size;
+        stats->stored = stored;
+        stats->crc = crc;
+    }
+    ret = 0;
+    goto out;
+
+write_error:
+    LOGE("raw image: write error on %s (%s)\n", image_file, strerror(errno));
+
+out:
+    if (out != NULL && fclose(out) != 0 && ret == 0) {
+        LOGE("raw image: can't close %s (%s)\n", image_file, strerror(errno));
+        ret = -1;
+    }
+    if (ret != 0 && out != NULL)
+        unlink(image_file);
+    free(buf);
+    close(fd);
+    return ret;
+}
+
+// fill the buffer with the 32 bits value, up to len bytes
+static void fill_buffer(uint32_t* buf, size_t len, uint32_t value) {
+    size_t i;
+    for (i = 0; i < len / sizeof(uint32_t); i++)
+        buf[i] = value;
+}
+
+/*
+ * Walk the chunks of the sparse image.  With dev < 0, only the crc and
+ * the chunk layout are checked.  Otherwise, the data and fill chunks
+ * are written to the device, and the don't care chunks are skipped.
+ */
+static int sparse_image_pass(int fd, const sparse_header_t* header, int dev,
+                             char* buf, RawImageStats* stats) {
+    unsigned long long image_size = (unsigned long long)header->total_blks * header->blk_sz;
+    unsigned long long pos = 0;
+    unsigned long long stored = 0;
+    uint32_t crc = crc32(0L, Z_NULL, 0);
+    uint32_t i;
+
+    if (lseek64(fd, header->file_hdr_sz, SEEK_SET) < 0)
+        return -1;
+
+    for (i = 0; i < header->total_chunks; i++) {
+        chunk_header_t chunk;
+        if (read_full(fd, &chunk, sizeof(chunk)) != 0 ||
+                (header->chunk_hdr_sz > sizeof(chunk) &&
+                 lseek64(fd, header->chunk_hdr_sz - sizeof(chunk), SEEK_CUR) < 0)) {
+            LOGE("raw image: truncated chunk %u\n", i);
+            return -1;
+        }
+
+        unsigned long long len = (unsigned long long)chunk.chunk_sz * header->blk_sz;
+        uint32_t data_sz = chunk.total_sz - header->chunk_hdr_sz;
+        if (chunk.total_sz < header->chunk_hdr_sz || pos + len > image_size) {
+            LOGE("raw image: invalid chunk %u\n", i);
+            return -1;
+        }
+
+        switch (chunk.chunk_type) {
+            case CHUNK_TYPE_RAW: {
+                if (data_sz != len) {
+                    LOGE("raw image: invalid data chunk %u\n", i);
+                    return -1;
+                }
+                unsigned long long done = 0;
+                while (done < len) {
+                    size_t n = len - done < RAW_IMAGE_BUFFER_SIZE ? len - done : RAW_IMAGE_BUFFER_SIZE;
+                    if (read_full(fd, buf, n) != 0) {
+                        LOGE("raw image: truncated data chunk %u\n", i);
+                        return -1;
+                    }
+                    crc = crc32(crc, (const Bytef*)buf, n);
+                    if (dev >= 0 && pwrite_full(dev, buf, n, pos + done) != 0) {
+                        LOGE("raw image: write error at %llu (%s)\n", pos + done, strerror(errno));
+                        return -1;
+                    }
+                    done += n;
+                }
+                stored += len;
+                break;
+            }
+            case CHUNK_TYPE_FILL:
+            case CHUNK_TYPE_DONT_CARE: {
+                uint32_t value = 0;
+                if (chunk.chunk_type == CHUNK_TYPE_FILL &&
+                        (data_sz != sizeof(value) || read_full(fd, &value, sizeof(value)) != 0)) {
+                    LOGE("raw image: invalid fill chunk %u\n", i);
+                    return -1;
+                }
+                if (chunk.chunk_type == CHUNK_TYPE_DONT_CARE && data_sz != 0) {
+                    LOGE("raw image: invalid skip chunk %u\n", i);
+                    return -1;
+                }
+
+                size_t n = len < RAW_IMAGE_BUFFER_SIZE ? len : RAW_IMAGE_BUFFER_SIZE;
+                fill_buffer((uint32_t*)buf, n, value);
+                // the kernel can zero a range without us sending the data
+                int write_fill = dev >= 0 && chunk.chunk_type == CHUNK_TYPE_FILL;
+                if (write_fill && value == 0 && len != 0) {
+                    uint64_t range[2] = { pos, len };
+                    if (ioctl(dev, BLKZEROOUT, range) == 0)
+                        write_fill = 0;
+                }
+                unsigned long long done = 0;
+                while (done < len) {
+                    n = len - done < RAW_IMAGE_BUFFER_SIZE ? len - done : RAW_IMAGE_BUFFER_SIZE;
+                    crc = crc32(crc, (const Bytef*)buf, n);
+                    if (write_fill && pwrite_full(dev, buf, n, pos + done) != 0) {
+                        LOGE("raw image: write error at %llu (%s)\n", pos + done, strerror(errno));
+                        return -1;
+                    }
+                    done += n;
+                }
+                break;
+            }
+            case CHUNK_TYPE_CRC32: {
+                uint32_t expected;
+                if (data_sz != sizeof(expected) || read_full(fd, &expected, sizeof(expected)) != 0) {
+                    LOGE("raw image: invalid crc chunk %u\n", i);
+                    return -1;
+                }
+                if (expected != crc) {
+                    LOGE("raw image: crc mismatch at chunk %u\n", i);
+                    return -1;
+                }
+                break;
+            }
+            default:
+                LOGE("raw image: unknown chunk type 0x%x\n", chunk.chunk_type);
+                return -1;
+        }
+        pos += len;
+    }
+
+    if (pos != image_size) {
+        LOGE("raw image: chunks cover %llu of %llu bytes\n", pos, image_size);
+        return -1;
+    }
+    if (header->image_checksum != 0 && header->image_checksum != crc) {
+        LOGE("raw image: image crc mismatch\n");
+        return -1;
+    }
+    if (stats != NULL) {
+        stats->size = image_size;
+        stats->stored = stored;
+        stats->crc = crc;
+    }
+    return 0;
+}
+
+// old backups and flashable .bin files: plain copy
+static int raw_copy(int fd, unsigned long long size, int dev, char* buf, RawImageStats* stats) {
+    unsigned long long pos = 0;
+    uint32_t crc = crc32(0L, Z_NULL, 0);
+
+    if (lseek64(fd, 0, SEEK_SET) < 0)
+        return -1;
+    while (pos < size) {
+        size_t n = size - pos < RAW_IMAGE_BUFFER_SIZE ? size - pos : RAW_IMAGE_BUFFER_SIZE;
+        if (read_full(fd, buf, n) != 0) {
+            LOGE("raw image: read error at %llu (%s)\n", pos, strerror(errno));
+            return -1;
+        }
+        crc = crc32(crc, (const Bytef*)buf, n);
+        if (pwrite_full(dev, buf, n, pos) != 0) {
+            LOGE("raw image: write error at %llu (%s)\n", pos, strerror(errno));
+            return -1;
+        }
+        pos += n;
+    }
+    if (stats != NULL) {
+        stats->size = size;
+        stats->stored = size;
+        stats->crc = crc;
+    }
+    return 0;
+}
+
+int raw_image_restore(const char* image_file, const char* device, RawImageStats* stats) {
+    unsigned long long image_size, device_size;
+    sparse_header_t header;
+    char* buf = NULL;
+    int dev = -1;
+    int ret = -1;
+
+    int fd = open(image_file, O_RDONLY | O_LARGEFILE);
+    if (fd < 0) {
+        LOGE("raw image: can't open %s (%s)\n", image_file, strerror(errno));
+        return -1;
+    }
+    if ((buf = alloc_buffer()) == NULL)
+        goto out;
+
+    int sparse = get_size(fd, &image_size) == 0 && image_size >= sizeof(header) &&
+                 read_full(fd, &header, sizeof(header)) == 0 &&
+                 header.magic == SPARSE_HEADER_MAGIC;
+    if (sparse) {
+        if (header.major_version != 1 || header.file_hdr_sz < sizeof(sparse_header_t) ||
+                header.chunk_hdr_sz < sizeof(chunk_header_t) ||
+                header.blk_sz == 0 || header.blk_sz % 4 != 0) {
+            LOGE("raw image: unsupported sparse image %s\n", image_file);
+            goto out;
+        }
+        // nothing is written unless the whole image is sound
+        if (sparse_image_pass(fd, &header, -1, buf, NULL) != 0) {
+            LOGE("raw image: %s is corrupted\n", image_file);
+            goto out;
+        }
+        image_size = (unsigned long long)header.total_blks * header.blk_sz;
+    }
+
+    dev = open(device, O_WRONLY | O_LARGEFILE);
+    if (dev < 0) {
+        LOGE("raw image: can't open %s (%s)\n", device, strerror(errno));
+        goto out;
+    }
+    if (get_size(dev, &device_size) == 0 && image_size > device_size) {
+        LOGE("raw image: %s (%llu bytes) is larger than %s (%llu bytes)\n",
+             image_file, image_size, device, device_size);
+        goto out;
+    }
+
+    if (sparse)
+        ret = sparse_image_pass(fd, &header, dev, buf, stats);
+    else
+        ret = raw_copy(fd, image_size, dev, buf, stats);
+    if (ret == 0 && fsync(dev) != 0) {
+        LOGE("raw image: can't sync %s (%s)\n", device, strerror(errno));
+        ret = -1;
+    }
+
+out:
+    if (dev >= 0)
+        close(dev);
+    free(buf);
+    close(fd);
+    return ret;
+}
@@ -0,0 +1,26 @@
+/*
+    Native raw partition imaging for the efs/modem/radio style backups
+*/
+
+#ifndef _RAW_IMAGE_H
+#define _RAW_IMAGE_H
+
+#include <stdint.h>
+
+// backups are android sparse images (the simg2img/fastboot format):
+// blocks filled with a single 32 bits value are stored as fill chunks,
+// and a crc32 of the whole partition ends the image
+typedef struct {
+    unsigned long long size;    // bytes of the partition
+    unsigned long long stored;  // bytes of the data chunks
+    uint32_t crc;
+} RawImageStats;
+
+// returns 0 on success
+int raw_image_backup(const char* device, const char* image_file, RawImageStats* stats);
+
+// sparse images are checked against their crc before the device is
+// written; any other file (old raw backups, modem.bin...) is copied as is
+int raw_image_restore(const char* image_file, const char* device, RawImageStats* stats);
+
+#endif // _RAW_IMAGE_H
@@ -21,6 +21,7 @@
 #include <fcntl.h>
 #include <getopt.h>
 #include <limits.h>
+#include <pthread.h>
 #include <linux/input.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -49,6 +50,7 @@
 #include "extendedcommands.h"
 #include "recovery_settings.h"
 #include "advanced_functions.h"
+#include "boot_trace.h"
 
 struct selabel_handle *sehandle;
 
@@ -315,6 +317,9 @@ copy_logs() {
 // this function is idempotent: call it as many times as you like.
 static void
 finish_recovery(const char *send_intent) {
+    // save settings changed in the menus we are leaving
+    flush_config_files();
+
     // By this point, we're ready to return to the main system...
     if (send_intent != NULL) {
         FILE *fp = fopen_path(INTENT_FILE, "w");
@@ -1085,6 +1090,45 @@ static struct vold_callbacks v_callbacks = {
     .disk_removed = handle_volume_hotswap,
 };
 
+// vold automounts volumes: it is only started once the volume table and /data/media are set up
+static pthread_mutex_t volumes_ready_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t volumes_ready_cond = PTHREAD_COND_INITIALIZER;
+static int volumes_ready = 0;
+
+// recovery start: volumes, /data/media and last logs, then parse settings file while ui_init() runs
+static void *start_storage_thread(void *cookie) {
+    int trace = boot_trace_begin("volumes");
+    load_volume_table();
+    setup_data_media(1);
+
+    pthread_mutex_lock(&volumes_ready_mutex);
+    volumes_ready = 1;
+    pthread_cond_broadcast(&volumes_ready_cond);
+    pthread_mutex_unlock(&volumes_ready_mutex);
+
+    ensure_path_mounted(LAST_LOG_FILE);
+    rotate_last_logs(10);
+    boot_trace_end(trace);
+
+    trace = boot_trace_begin("settings");
+    load_config_file(PHILZ_SETTINGS_FILE);
+    boot_trace_end(trace);
+    return NULL;
+}
+
+static void *start_vold_thread(void *cookie) {
+    pthread_mutex_lock(&volumes_ready_mutex);
+    while (!volumes_ready)
+        pthread_cond_wait(&volumes_ready_cond, &volumes_ready_mutex);
+    pthread_mutex_unlock(&volumes_ready_mutex);
+
+    int trace = boot_trace_begin("vold");
+    vold_client_start(&v_callbacks, 0);
+    vold_set_automount(1);
+    boot_trace_end(trace);
+    return NULL;
+}
+
 // used by nandroid cmd commands to support voldmanaged devices
 void vold_init() {
     vold_client_start(&v_callbacks, 0);
@@ -1141,8 +1185,12 @@ main(int argc, char **argv) {
         return busybox_driver(argc, argv);
     }
 
+    boot_trace_init();
+
     // devices can run specific tasks on recovery start
+    int trace = boot_trace_begin("postrecoveryboot");
     __system("/sbin/postrecoveryboot.sh");
+    boot_trace_end(trace);
 
     // Clear umask for packages that copy files out to /tmp and then over
     // to /system without properly setting all permissions (eg. gapps).
@@ -1154,13 +1202,26 @@ main(int argc, char **argv) {
 
     printf("Starting recovery on %s", ctime(&start));
 
-    load_volume_table();
-    setup_data_media(1);
-    vold_client_start(&v_callbacks, 0);
-    vold_set_automount(1);
+    // volumes and vold run together with images decoding in ui_init(), vold waits for the volumes
+    pthread_t storage_thread, vold_thread;
+    int storage_started = (pthread_create(&storage_thread, NULL, start_storage_thread, NULL) == 0);
+    if (!storage_started)
+        start_storage_thread(NULL);
+    int vold_started = (pthread_create(&vold_thread, NULL, start_vold_thread, NULL) == 0);
+    if (!vold_started)
+        start_vold_thread(NULL);
+
+    trace = boot_trace_begin("ui_init");
+    device_ui_init(&ui_parameters);
+    ui_init();
+    boot_trace_end(trace);
+
+    if (storage_started)
+        pthread_join(storage_thread, NULL);
+    if (vold_started)
+        pthread_join(vold_thread, NULL);
+
     setup_legacy_storage_paths();
-    ensure_path_mounted(LAST_LOG_FILE);
-    rotate_last_logs(10);
     get_args(&argc, &argv);
 
     const char *send_intent = NULL;
@@ -1198,8 +1259,6 @@ main(int argc, char **argv) {
 
     printf("stage is [%s]\n", stage);
 
-    device_ui_init(&ui_parameters);
-    ui_init();
     ui_print(EXPAND(RECOVERY_MOD_VERSION_BUILD) "\n");
     ui_print("ClockworkMod " EXPAND(CWM_BASE_VERSION) "\n");
     LOGI("Device target: " EXPAND(TARGET_COMMON_NAME) "\n");
@@ -1226,7 +1285,9 @@ main(int argc, char **argv) {
     }
 
     LOGI("device_recovery_start()\n");
+    trace = boot_trace_begin("device_recovery_start");
     device_recovery_start();
+    boot_trace_end(trace);
 
     printf("Command:");
     for (arg = 0; arg < argc; arg++) {
@@ -1325,10 +1386,12 @@ main(int argc, char **argv) {
 #ifdef PHILZ_TOUCH_RECOVERY
         check_recovery_lock();
 #endif
+        boot_trace_dump("first_menu");
         prompt_and_wait(status);
     }
 
     // We reach here when in main menu we choose reboot main system or on success install of boot scripts and recovery commands
+    boot_trace_dump("finish_recovery");
     finish_recovery(send_intent);
     if (shutdown_after) {
         ui_print("Shutting down...\n");
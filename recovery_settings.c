@@ -5,7 +5,9 @@
 #include <string.h>
 #include <sys/types.h>
 #include <unistd.h>
+#include <pthread.h>
 #include <sys/limits.h>
+#include <sys/stat.h>
 
 #include "cutils/properties.h"
 
@@ -25,11 +27,13 @@ struct CWMSettingsIntValues check_root_and_recovery = { "check_root_and_recovery
 struct CWMSettingsIntValues apply_loki_patch = { "apply_loki_patch", 1 };
 struct CWMSettingsIntValues twrp_backup_mode = { "twrp_backup_mode", 0 };
 struct CWMSettingsIntValues compression_value = { "compression_value", TAR_GZ_DEFAULT };
+struct CWMSettingsIntValues dedupe_compression = { "dedupe_compression", 0 };
 struct CWMSettingsIntValues nandroid_add_preload = { "nandroid_add_preload", 0 };
 struct CWMSettingsIntValues enable_md5sum = { "enable_md5sum", 1 };
 struct CWMSettingsIntValues show_nandroid_size_progress = { "show_nandroid_size_progress", 0 };
 struct CWMSettingsIntValues use_nandroid_simple_logging = { "use_nandroid_simple_logging", 1 };
 struct CWMSettingsIntValues nand_prompt_on_low_space = { "nand_prompt_on_low_space", 1 };
+struct CWMSettingsIntValues nand_skip_unchanged = { "nand_skip_unchanged", 0 };
 struct CWMSettingsIntValues signature_check_enabled = { "signature_check_enabled", 0 };
 struct CWMSettingsIntValues install_zip_verify_md5 = { "install_zip_verify_md5", 0 };
 
@@ -110,6 +114,8 @@ struct CompilerFlagsUI libtouch_flags = {
  After success install of a new rom, before reboot, it will preserve settings if they were wiped by installed ROM
 */
 void verify_settings_file() {
+    flush_config_files();
+
     char settings_copy[PATH_MAX];
     sprintf(settings_copy, "%s/%s", get_primary_storage_path(), PHILZ_SETTINGS_FILE2);
 
@@ -146,20 +152,45 @@ static void check_root_and_recovery_settings() {
         check_root_and_recovery.value = 1;
 }
 
+// compression levels and their name in config file
+static const struct {
+    int level;
+    const char* name;
+} compression_levels[] = {
+    { TAR_GZ_FAST, "fast" },
+    { TAR_GZ_LOW, "low" },
+    { TAR_GZ_MEDIUM, "medium" },
+    { TAR_GZ_HIGH, "high" },
+};
+
+const char* compression_level_name(int level) {
+    int i;
+    for (i = 0; i < (int)(sizeof(compression_levels) / sizeof(compression_levels[0])); ++i) {
+        if (compression_levels[i].level == level)
+            return compression_levels[i].name;
+    }
+    return NULL;
+}
+
+// level saved as name, or level_def
+static int compression_level_value(const char* name, int level_def) {
+    int i;
+    for (i = 0; i < (int)(sizeof(compression_levels) / sizeof(compression_levels[0])); ++i) {
+        if (strcmp(compression_levels[i].name, name) == 0)
+            return compression_levels[i].level;
+    }
+    return level_def;
+}
+
 // refresh nandroid compression
 static void refresh_nandroid_compression() {
     char value[PROPERTY_VALUE_MAX];
     read_config_file(PHILZ_SETTINGS_FILE, compression_value.key, value, TAR_GZ_DEFAULT_STR);
-    if (strcmp(value, "fast") == 0)
-        compression_value.value = TAR_GZ_FAST;
-    else if (strcmp(value, "low") == 0)
-        compression_value.value = TAR_GZ_LOW;
-    else if (strcmp(value, "medium") == 0)
-        compression_value.value = TAR_GZ_MEDIUM;
-    else if (strcmp(value, "high") == 0)
-        compression_value.value = TAR_GZ_HIGH;
-    else
-        compression_value.value = TAR_GZ_DEFAULT;
+    compression_value.value = compression_level_value(value, TAR_GZ_DEFAULT);
+
+    // dedupe blobs are stored raw unless enabled
+    read_config_file(PHILZ_SETTINGS_FILE, dedupe_compression.key, value, "off");
+    dedupe_compression.value = compression_level_value(value, 0);
 }
 
 // check user setting for backup mode (TWRP vs CWM)
@@ -232,6 +263,16 @@ static void check_prompt_on_low_space() {
         nand_prompt_on_low_space.value = 1;
 }
 
+// check if nandroid saves partition fingerprints and skips restoring the unchanged ones
+static void check_skip_unchanged() {
+    char value[PROPERTY_VALUE_MAX];
+    read_config_file(PHILZ_SETTINGS_FILE, nand_skip_unchanged.key, value, "0");
+    if (strcmp(value, "true") == 0 || strcmp(value, "1") == 0)
+        nand_skip_unchanged.value = 1;
+    else
+        nand_skip_unchanged.value = 0;
+}
+
 // check if we should verify signature during install of zip packages
 // only called on recovery start
 void toggle_signature_check() {
@@ -310,6 +351,7 @@ void refresh_recovery_settings(int on_start) {
     check_show_nand_size_progress();
     check_nandroid_simple_logging();
     check_prompt_on_low_space();
+    check_skip_unchanged();
     check_signature_check();
     check_install_zip_verify_md5();
 #ifdef ENABLE_LOKI
@@ -331,64 +373,186 @@ void refresh_recovery_settings(int on_start) {
 /*       Start file parser        */
 /*    Original source by PhilZ    */
 /**********************************/
-// todo: parse settings file in one pass and make pairs of key:value
-// get value of key from a given config file
-// always call with value[PROPERTY_VALUE_MAX] to prevent any buffer overflow caused by strcpy(value, strstr(line, "=") + 1);
-int read_config_file(const char* config_file, const char *key, char *value, const char *value_def) {
-    int ret = 0;
-    char line[PROPERTY_VALUE_MAX];
-    ensure_path_mounted(config_file);
-    FILE *fp = fopen(config_file, "rb");
-    if (fp != NULL) {
-        while (fgets(line, sizeof(line), fp) != NULL) {
-            if (strstr(line, key) != NULL && strncmp(line, key, strlen(key)) == 0 && line[strlen(key)] == '=') {
-                // we found the key: try to get its value, remove trailing \n and ensure it is not an empty value
-                strcpy(value, strstr(line, "=") + 1);
-                if (value[strlen(value)-1] == '\n')
-                    value[strlen(value)-1] = '\0';
-                if (value[0] != '\0') {
-                    fclose(fp);
-                    LOGI("%s=%s\n", key, value);
-                    return ret;
-                }
-            }
+/*
+ Each config file is parsed once into a ConfigStore: its lines in file order plus a hash index of keys.
+ - reads are served from memory: a stat() tells if the file changed on disk since it was parsed
+ - writes only change the store: flush_config_files() writes all changed stores at once,
+   through a temporary file and a rename(), when we go back to main menu (finish_recovery()) and on reboot
+ - if a file was replaced on disk (theme import, settings restore, /data restore...) while we had pending writes,
+   the file wins, like it did when every write went straight to disk
+ The file format is unchanged: key=value lines, comments and unknown lines are kept as they are
+*/
+typedef struct {
+    char* line;     // line without trailing \n
+    int key_len;    // length of key in "key=value" lines, 0 for other lines
+} ConfigLine;
+
+typedef struct ConfigStore {
+    struct ConfigStore* next;
+    char* path;
+    int exists;         // file was found when parsed
+    struct stat st;     // file stat when parsed or last flushed
+    int dirty;
+    ConfigLine* lines;
+    int line_count;
+    int line_alloc;
+    int* index;         // line number + 1, 0 = empty slot
+    int index_size;     // power of 2
+} ConfigStore;
+
+static ConfigStore* config_stores = NULL;
+static pthread_mutex_t config_stores_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static unsigned int config_hash(const char* key, int len) {
+    unsigned int h = 2166136261u;
+    int i;
+    for (i = 0; i < len; i++)
+        h = (h ^ (unsigned char)key[i]) * 16777619u;
+    return h;
+}
+
+static const char* config_line_value(const ConfigLine* l) {
+    return l->line + l->key_len + 1;
+}
+
+// slot of key in store index: either the slot holding key or the empty slot where it would go
+static int config_index_slot(const ConfigStore* store, const char* key, int len) {
+    unsigned int mask = store->index_size - 1;
+    unsigned int h = config_hash(key, len) & mask;
+    while (store->index[h] != 0) {
+        const ConfigLine* l = &store->lines[store->index[h] - 1];
+        if (l->key_len == len && strncmp(l->line, key, len) == 0)
+            break;
+        h = (h + 1) & mask;
+    }
+    return h;
+}
+
+static void config_index_rebuild(ConfigStore* store) {
+    int size = 64;
+    while (size < store->line_count * 2)
+        size <<= 1;
+
+    free(store->index);
+    store->index = (int*)calloc(size, sizeof(int));
+    store->index_size = size;
+
+    // like the old parser: first occurrence of a key with a non empty value wins
+    int i;
+    for (i = 0; i < store->line_count; i++) {
+        ConfigLine* l = &store->lines[i];
+        if (l->key_len == 0)
+            continue;
+        int slot = config_index_slot(store, l->line, l->key_len);
+        int cur = store->index[slot];
+        if (cur == 0 || (config_line_value(&store->lines[cur - 1])[0] == '\0' && config_line_value(l)[0] != '\0'))
+            store->index[slot] = i + 1;
+    }
+}
+
+static void config_add_line(ConfigStore* store, char* line) {
+    if (store->line_count == store->line_alloc) {
+        store->line_alloc = store->line_alloc ? store->line_alloc * 2 : 64;
+        store->lines = (ConfigLine*)realloc(store->lines, store->line_alloc * sizeof(ConfigLine));
+    }
+
+    ConfigLine* l = &store->lines[store->line_count++];
+    char* eq = strchr(line, '=');
+    l->line = line;
+    l->key_len = (eq == NULL || eq == line) ? 0 : eq - line;
+}
+
+static void config_store_clear(ConfigStore* store) {
+    int i;
+    for (i = 0; i < store->line_count; i++)
+        free(store->lines[i].line);
+    store->line_count = 0;
+    store->dirty = 0;
+}
+
+// (re)load store from disk, st is the current file stat or NULL if it doesn't exist
+static void config_store_parse(ConfigStore* store, const struct stat* st) {
+    config_store_clear(store);
+    store->exists = (st != NULL);
+    if (st != NULL)
+        store->st = *st;
+
+    unsigned long len = 0;
+    char* buf = NULL;
+    if (st != NULL && (buf = read_file_to_buffer(store->path, &len)) != NULL) {
+        buf[len] = '\0';
+        char* p = buf;
+        while (*p != '\0') {
+            char* eol = strchr(p, '\n');
+            if (eol != NULL)
+                *eol = '\0';
+            config_add_line(store, strdup(p));
+            if (eol == NULL)
+                break;
+            p = eol + 1;
         }
-        // either we didn't find the key or it has an empty value
-        ret = 1;
-        fclose(fp);
-    } else {
-        LOGI("Cannot open %s\n", config_file);
-        ret = -1;
+        free(buf);
     }
 
-    // set value to default
-    strcpy(value, value_def);
-    LOGI("%s set to default (%s)\n", key, value_def);
-    return ret;
+    config_index_rebuild(store);
 }
 
-// set value of key in config file
-int write_config_file(const char* config_file, const char* key, const char* value) {
-    if (ensure_path_mounted(config_file) != 0) {
-        LOGE("Cannot mount path for settings file: %s\n", config_file);
-        return -1;
+static int config_stat_changed(const ConfigStore* store, const struct stat* st) {
+    if (st == NULL)
+        return store->exists;
+    if (!store->exists)
+        return 1;
+    return st->st_ino != store->st.st_ino || st->st_size != store->st.st_size ||
+            st->st_mtime != store->st.st_mtime || st->st_ctime != store->st.st_ctime;
+}
+
+// config_stores_lock must be held: returns an up to date store for config_file
+static ConfigStore* config_store_get(const char* config_file) {
+    ConfigStore* store;
+    for (store = config_stores; store != NULL; store = store->next) {
+        if (strcmp(store->path, config_file) == 0)
+            break;
+    }
+
+    // only try to mount the volume if the file is not reachable: once mounted, a read is a stat()
+    struct stat st;
+    int found = (stat(config_file, &st) == 0);
+    if (!found) {
+        ensure_path_mounted(config_file);
+        found = (stat(config_file, &st) == 0);
+    }
+
+    if (store == NULL) {
+        store = (ConfigStore*)calloc(1, sizeof(ConfigStore));
+        store->path = strdup(config_file);
+        store->next = config_stores;
+        config_stores = store;
+        config_store_parse(store, found ? &st : NULL);
+    } else if (config_stat_changed(store, found ? &st : NULL)) {
+        if (store->dirty)
+            LOGI("%s changed on disk: dropping unsaved settings\n", config_file);
+        config_store_parse(store, found ? &st : NULL);
     }
 
-    char config_file_tmp[PATH_MAX];
+    return store;
+}
+
+// write store lines to path through a temporary file and an atomic rename()
+static int config_store_dump(ConfigStore* store, const char* path) {
+    char path_tmp[PATH_MAX];
     char tmp[PATH_MAX];
-    sprintf(config_file_tmp, "%s.tmp", config_file);
-    sprintf(tmp, "%s", DirName(config_file_tmp));
+    snprintf(path_tmp, sizeof(path_tmp), "%s.tmp", path);
+    sprintf(tmp, "%s", DirName(path_tmp));
     ensure_directory(tmp, 0755);
-    delete_a_file(config_file_tmp);
+    unlink(path_tmp);
 
-    FILE *f_tmp = fopen(config_file_tmp, "wb");
+    FILE *f_tmp = fopen(path_tmp, "wb");
     if (f_tmp == NULL) {
         LOGE("failed to create temporary settings file!\n");
         return -1;
     }
 
-    FILE *fp = fopen(config_file, "rb");
-    if (fp == NULL) {
+    if (!store->exists) {
         // we need to create a new settings file: write an info header
         const char* header[] = {
             "#PhilZ Touch Settings File\n",
@@ -404,40 +568,170 @@ int write_config_file(const char* config_file, const char* key, const char* valu
         for(i = 0; header[i] != NULL; i++) {
             fwrite(header[i], 1, strlen(header[i]), f_tmp);
         }
-    } else {
-        // parse existing config file and write new temporary file.
-        char line[PROPERTY_VALUE_MAX];
-        while (fgets(line, sizeof(line), fp) != NULL) {
-            // ignore any existing line with key we want to set
-            if (strstr(line, key) != NULL && strncmp(line, key, strlen(key)) == 0 && line[strlen(key)] == '=')
-                continue;
-            // ensure trailing \n, in case some one got a bad editor...
-            if (line[strlen(line) - 1] != '\n')
-                strcat(line, "\n");
-            fwrite(line, 1, strlen(line), f_tmp);
-        }
-        fclose(fp);
     }
 
-    // write new key=value entry
-    char new_entry[PROPERTY_VALUE_MAX];
-    sprintf(new_entry, "%s=%s\n", key, value);
-    fwrite(new_entry, 1, strlen(new_entry), f_tmp);
+    int i;
+    for (i = 0; i < store->line_count; i++) {
+        ConfigLine* l = &store->lines[i];
+        // drop duplicated keys: only the entry we read from is kept
+        if (l->key_len != 0 && store->index[config_index_slot(store, l->line, l->key_len)] != i + 1)
+            continue;
+        fputs(l->line, f_tmp);
+        fputc('\n', f_tmp);
+    }
+
+    fflush(f_tmp);
+    fsync(fileno(f_tmp));
     fclose(f_tmp);
 
-    if (rename(config_file_tmp, config_file) != 0) {
+    if (rename(path_tmp, path) != 0) {
         LOGE("failed to rename temporary settings file!\n");
         return -1;
     }
+    return 0;
+}
+
+static int config_store_write(ConfigStore* store) {
+    const char* config_file = store->path;
+    if (ensure_path_mounted(config_file) != 0) {
+        LOGE("Cannot mount path for settings file: %s\n", config_file);
+        return -1;
+    }
+
+    if (config_store_dump(store, config_file) != 0)
+        return -1;
 
     // if we are editing recovery settings file, create a second copy on primary storage
     if (strcmp(PHILZ_SETTINGS_FILE, config_file) == 0) {
-        sprintf(tmp, "%s/%s", get_primary_storage_path(), PHILZ_SETTINGS_FILE2);
-        if (copy_a_file(config_file, tmp) != 0)
+        char settings_copy[PATH_MAX];
+        sprintf(settings_copy, "%s/%s", get_primary_storage_path(), PHILZ_SETTINGS_FILE2);
+        if (ensure_path_mounted(settings_copy) != 0 || config_store_dump(store, settings_copy) != 0)
             LOGE("failed duplicating settings file to primary storage!\n");
     }
 
+    struct stat st;
+    if (stat(config_file, &st) == 0) {
+        store->st = st;
+        store->exists = 1;
+    }
+    store->dirty = 0;
+
+    LOGI("%s saved\n", config_file);
+    return 0;
+}
+
+// parse config file ahead of the first read_config_file() call: used on start, in parallel to ui_init()
+void load_config_file(const char* config_file) {
+    pthread_mutex_lock(&config_stores_lock);
+    config_store_get(config_file);
+    pthread_mutex_unlock(&config_stores_lock);
+}
+
+// get value of key from a given config file
+// always call with value[PROPERTY_VALUE_MAX] to prevent any buffer overflow
+int read_config_file(const char* config_file, const char *key, char *value, const char *value_def) {
+    int ret = 0;
+    pthread_mutex_lock(&config_stores_lock);
+    ConfigStore* store = config_store_get(config_file);
+    if (store->exists || store->dirty) {
+        int idx = store->index[config_index_slot(store, key, strlen(key))];
+        if (idx != 0 && config_line_value(&store->lines[idx - 1])[0] != '\0') {
+            // we found the key and it is not an empty value
+            snprintf(value, PROPERTY_VALUE_MAX, "%s", config_line_value(&store->lines[idx - 1]));
+            pthread_mutex_unlock(&config_stores_lock);
+            LOGI("%s=%s\n", key, value);
+            return ret;
+        }
+        // either we didn't find the key or it has an empty value
+        ret = 1;
+    } else {
+        LOGI("Cannot open %s\n", config_file);
+        ret = -1;
+    }
+    pthread_mutex_unlock(&config_stores_lock);
+
+    // set value to default
+    strcpy(value, value_def);
+    LOGI("%s set to default (%s)\n", key, value_def);
+    return ret;
+}
+
+// set value of key in config file: saved on disk by flush_config_files()
+int write_config_file(const char* config_file, const char* key, const char* value) {
+    if (ensure_path_mounted(config_file) != 0) {
+        LOGE("Cannot mount path for settings file: %s\n", config_file);
+        return -1;
+    }
+
+    int key_len = strlen(key);
+    char* line = (char*)malloc(key_len + strlen(value) + 2);
+    sprintf(line, "%s=%s", key, value);
+
+    pthread_mutex_lock(&config_stores_lock);
+    ConfigStore* store = config_store_get(config_file);
+    int slot = config_index_slot(store, key, key_len);
+    if (store->index[slot] != 0) {
+        ConfigLine* l = &store->lines[store->index[slot] - 1];
+        free(l->line);
+        l->line = line;
+    } else {
+        config_add_line(store, line);
+        if (store->line_count * 2 > store->index_size)
+            config_index_rebuild(store);
+        else
+            store->index[slot] = store->line_count;
+    }
+    store->dirty = 1;
+    pthread_mutex_unlock(&config_stores_lock);
+
     LOGI("%s was set to %s\n", key, value);
     return 0;
 }
+
+// write pending changes of config_file to disk, no-op if it was not changed
+int flush_config_file(const char* config_file) {
+    int ret = 0;
+    ConfigStore* store;
+    pthread_mutex_lock(&config_stores_lock);
+    for (store = config_stores; store != NULL; store = store->next) {
+        if (store->dirty && strcmp(store->path, config_file) == 0)
+            ret = config_store_write(store);
+    }
+    pthread_mutex_unlock(&config_stores_lock);
+    return ret;
+}
+
+// write all pending settings changes to disk
+int flush_config_files() {
+    int ret = 0;
+    ConfigStore* store;
+    pthread_mutex_lock(&config_stores_lock);
+    for (store = config_stores; store != NULL; store = store->next) {
+        if (store->dirty && config_store_write(store) != 0)
+            ret = -1;
+    }
+    pthread_mutex_unlock(&config_stores_lock);
+    return ret;
+}
+
+// config_file was rewritten or deleted by someone else: parse it again on next read
+void forget_config_file(const char* config_file) {
+    ConfigStore** link;
+    pthread_mutex_lock(&config_stores_lock);
+    for (link = &config_stores; *link != NULL; link = &(*link)->next) {
+        ConfigStore* store = *link;
+        if (strcmp(store->path, config_file) == 0) {
+            if (store->dirty)
+                LOGI("%s replaced: dropping unsaved settings\n", config_file);
+            *link = store->next;
+            config_store_clear(store);
+            free(store->lines);
+            free(store->index);
+            free(store->path);
+            free(store);
+            break;
+        }
+    }
+    pthread_mutex_unlock(&config_stores_lock);
+}
 //----- end file settings parser
@@ -90,11 +90,13 @@ struct CWMSettingsIntValues check_root_and_recovery;
 struct CWMSettingsIntValues apply_loki_patch;
 struct CWMSettingsIntValues twrp_backup_mode;
 struct CWMSettingsIntValues compression_value;
+struct CWMSettingsIntValues dedupe_compression;
 struct CWMSettingsIntValues nandroid_add_preload;
 struct CWMSettingsIntValues enable_md5sum;
 struct CWMSettingsIntValues show_nandroid_size_progress;
 struct CWMSettingsIntValues use_nandroid_simple_logging;
 struct CWMSettingsIntValues nand_prompt_on_low_space;
+struct CWMSettingsIntValues nand_skip_unchanged;
 struct CWMSettingsIntValues signature_check_enabled;
 struct CWMSettingsIntValues install_zip_verify_md5;
 
@@ -175,6 +177,9 @@ void refresh_recovery_settings(int on_start);
 // check settings file on start and prompt to restore it if absent AND a backup is found: called by recovery.c
 void verify_settings_file();
 
+// pigz compression levels, also used for dedupe blobs: name saved in config file, or NULL if not a level
+const char* compression_level_name(int level);
+
 void toggle_signature_check();
 void toggle_install_zip_verify_md5();
 #ifdef ENABLE_LOKI
@@ -182,8 +187,12 @@ void toggle_loki_support();
 int loki_support_enabled();
 #endif
 
+void load_config_file(const char* config_file);
 int read_config_file(const char* config_file, const char *key, char *value, const char *value_def);
 int write_config_file(const char* config_file, const char* key, const char* value);
+int flush_config_file(const char* config_file);
+int flush_config_files();
+void forget_config_file(const char* config_file);
 
 /*
 properties reference:
@@ -40,7 +40,7 @@
 #include "advanced_functions.h"
 
 #include "voldclient/voldclient.h"
-#include "libcrecovery/common.h" // __popen / __pclose
+#include "libcrecovery/common.h" // __popen_argv / __pclose / __run
 
 static struct fstab *fstab = NULL;
 
@@ -520,17 +520,17 @@ int try_mount(const char* device, const char* mount_point, const char* fs_type,
         return -1;
     int ret = 0;
     if (strcmp(fs_type, "auto") == 0) {
-        char mount_cmd[PATH_MAX];
-        sprintf(mount_cmd, "mount %s %s", device, mount_point);
-        ret = __system(mount_cmd);
+        const char* argv[] = { "mount", device, mount_point, NULL };
+        ret = __run((char* const*)argv);
     } else if (fs_options == NULL) {
         ret = mount(device, mount_point, fs_type,
                        MS_NOATIME | MS_NODEV | MS_NODIRATIME, "");
         // LOGE("ret =%d - device=%s - mount_point=%s - fstype=%s\n", ret, device, mount_point, fs_type); // debug
     } else {
-        char mount_cmd[PATH_MAX];
-        sprintf(mount_cmd, "mount -t %s -o%s %s %s", fs_type, fs_options, device, mount_point);
-        ret = __system(mount_cmd);
+        char options[PATH_MAX];
+        snprintf(options, sizeof(options), "-o%s", fs_options);
+        const char* argv[] = { "mount", "-t", fs_type, options, device, mount_point, NULL };
+        ret = __run((char* const*)argv);
     }
 
     if (ret != 0)
@@ -656,7 +656,6 @@ int ensure_path_mounted(const char* path) {
     return ensure_path_mounted_at_mount_point(path, NULL);
 }
 
-// not thread safe because of scan_mounted_volumes()
 int ensure_path_mounted_at_mount_point(const char* path, const char* mount_point) {
     if (is_data_media_volume_path(path)) {
         int ret;
@@ -744,7 +743,6 @@ int ensure_path_mounted_at_mount_point(const char* path, const char* mount_point
     return -1;
 }
 
-// not thread safe because of scan_mounted_volumes()
 int ensure_path_unmounted(const char* path) {
     // if we are using /data/media, do not unmount /sdcard until !is_data_media_preserved()
     if (is_data_media_volume_path(path)) {
@@ -1184,7 +1182,6 @@ int format_unknown_device(const char *device, const char* path, const char *fs_t
  to do: use libblkid inline code
 */
 char* get_real_fstype(const char* path) {
-    char cmd[PATH_MAX];
     char line[1024];
     static char fstype[128];
     char* real_device_fstype = NULL;
@@ -1195,8 +1192,8 @@ char* get_real_fstype(const char* path) {
         return NULL;
     }
 
-    sprintf(cmd, "/sbin/blkid -c /dev/null %s", vol->blk_device);
-    FILE *fp = __popen(cmd, "r");
+    const char* argv[] = { "/sbin/blkid", "-c", "/dev/null", vol->blk_device, NULL };
+    FILE *fp = __popen_argv((char* const*)argv, "r");
     if (fp == NULL) {
         printf("  get_real_fstype: blkid error\n");
         return NULL;
@@ -0,0 +1,175 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "zlib.h"
+
+#include "common.h"
+#include "split_archive.h"
+
+// volumes are read 1MB at a time
+#define SPLIT_ARCHIVE_BUFFER_SIZE   (1024 * 1024)
+
+// name itself, then the "split -a 1" suffixes .a to .z
+#define SPLIT_ARCHIVE_MAX_VOLUMES   27
+
+// start of the next volume the kernel is asked to read ahead once the current one is opened
+#define SPLIT_ARCHIVE_READAHEAD     (8 * 1024 * 1024)
+
+struct SplitArchive {
+    int fds[SPLIT_ARCHIVE_MAX_VOLUMES];
+    int count;
+    int current;
+    unsigned char* buf;
+    size_t buf_pos;
+    size_t buf_len;
+    int gzip;
+    int member_end;     // the last gzip member is complete
+    z_stream zs;
+};
+
+static void start_volume(SplitArchive* a) {
+    if (a->current + 1 < a->count)
+        posix_fadvise(a->fds[a->current + 1], 0, SPLIT_ARCHIVE_READAHEAD, POSIX_FADV_WILLNEED);
+}
+
+SplitArchive* split_archive_open(const char* name, int gzip) {
+    char path[PATH_MAX];
+    int i;
+
+    SplitArchive* a = calloc(1, sizeof(SplitArchive));
+    if (a == NULL) {
+        LOGE("split archive: out of memory\n");
+        return NULL;
+    }
+    for (i = 0; i < SPLIT_ARCHIVE_MAX_VOLUMES; ++i) {
+        if (i == 0)
+            snprintf(path, sizeof(path), "%s", name);
+        else
+            snprintf(path, sizeof(path), "%s.%c", name, 'a' + i - 1);
+        int fd = open(path, O_RDONLY | O_LARGEFILE);
+        if (fd < 0)
+            continue;
+        posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+        a->fds[a->count++] = fd;
+    }
+    if (a->count == 0) {
+        LOGE("split archive: can't open %s (%s)\n", name, strerror(errno));
+        free(a);
+        return NULL;
+    }
+
+    a->buf = malloc(SPLIT_ARCHIVE_BUFFER_SIZE);
+    if (a->buf == NULL) {
+        LOGE("split archive: out of memory\n");
+        split_archive_close(a);
+        return NULL;
+    }
+    a->gzip = gzip;
+    if (gzip && inflateInit2(&a->zs, 16 + MAX_WBITS) != Z_OK) {
+        LOGE("split archive: inflateInit2 failed\n");
+        a->gzip = 0;
+        split_archive_close(a);
+        return NULL;
+    }
+    start_volume(a);
+    return a;
+}
+
+// returns the number of buffered bytes, 0 once all volumes are read, -1 on error
+static ssize_t fill_buffer(SplitArchive* a) {
+    if (a->buf_pos < a->buf_len)
+        return a->buf_len - a->buf_pos;
+
+    while (a->current < a->count) {
+        ssize_t r = read(a->fds[a->current], a->buf, SPLIT_ARCHIVE_BUFFER_SIZE);
+        if (r < 0 && errno == EINTR)
+            continue;
+        if (r < 0) {
+            LOGE("split archive: read error (%s)\n", strerror(errno));
+            return -1;
+        }
+        if (r > 0) {
+            a->buf_pos = 0;
+            a->buf_len = r;
+            return r;
+        }
+        // volumes are only read once: do not keep them in cache
+        posix_fadvise(a->fds[a->current], 0, 0, POSIX_FADV_DONTNEED);
+        a->current++;
+        start_volume(a);
+    }
+    return 0;
+}
+
+static ssize_t read_raw(SplitArchive* a, unsigned char* buf, size_t len) {
+    size_t done = 0;
+    while (done < len) {
+        ssize_t avail = fill_buffer(a);
+        if (avail < 0)
+            return -1;
+        if (avail == 0)
+            break;
+        size_t n = len - done < (size_t)avail ? len - done : (size_t)avail;
+        memcpy(buf + done, a->buf + a->buf_pos, n);
+        a->buf_pos += n;
+        done += n;
+    }
+    return done;
+}
+
+static ssize_t read_gzip(SplitArchive* a, unsigned char* buf, size_t len) {
+    a->zs.next_out = buf;
+    a->zs.avail_out = len;
+    while (a->zs.avail_out != 0) {
+        ssize_t avail = fill_buffer(a);
+        if (avail < 0)
+            return -1;
+        if (avail == 0) {
+            if (!a->member_end) {
+                LOGE("split archive: truncated gzip stream\n");
+                return -1;
+            }
+            break;
+        }
+
+        // pigz may write several gzip members, one after the other
+        if (a->member_end) {
+            inflateReset(&a->zs);
+            a->member_end = 0;
+        }
+        a->zs.next_in = a->buf + a->buf_pos;
+        a->zs.avail_in = avail;
+        int ret = inflate(&a->zs, Z_NO_FLUSH);
+        a->buf_pos = a->buf_len - a->zs.avail_in;
+        if (ret == Z_STREAM_END) {
+            a->member_end = 1;
+        } else if (ret != Z_OK) {
+            LOGE("split archive: gzip error %d\n", ret);
+            return -1;
+        }
+    }
+    return len - a->zs.avail_out;
+}
+
+ssize_t split_archive_read(SplitArchive* a, void* buf, size_t len) {
+    if (a->gzip)
+        return read_gzip(a, buf, len);
+    return read_raw(a, buf, len);
+}
+
+void split_archive_close(SplitArchive* a) {
+    int i;
+    if (a == NULL)
+        return;
+    if (a->gzip)
+        inflateEnd(&a->zs);
+    for (i = 0; i < a->count; ++i)
+        close(a->fds[i]);
+    free(a->buf);
+    free(a);
+}
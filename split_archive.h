@@ -0,0 +1,24 @@
+/*
+    Read split nandroid archives (name, name.a, name.b...) as one stream
+*/
+
+#ifndef _SPLIT_ARCHIVE_H
+#define _SPLIT_ARCHIVE_H
+
+#include <sys/types.h>
+
+typedef struct SplitArchive SplitArchive;
+
+// the volumes are the existing files among name and name.a to name.z, in
+// that order, like "cat name*" lists them. With gzip, the concatenated
+// volumes are decompressed (pigz output, one or more gzip members)
+// returns NULL when there is no volume
+SplitArchive* split_archive_open(const char* name, int gzip);
+
+// fills buf up to len bytes, less only at the end of the last volume
+// returns the number of bytes read, 0 at the end, -1 on error
+ssize_t split_archive_read(SplitArchive* archive, void* buf, size_t len);
+
+void split_archive_close(SplitArchive* archive);
+
+#endif // _SPLIT_ARCHIVE_H
@@ -36,6 +36,7 @@
 #include "recovery_ui.h"
 #include "advanced_functions.h"
 #include "recovery_settings.h"
+#include "boot_trace.h"
 #include "ui.h"
 
 extern int __system(const char *command);
@@ -357,6 +358,9 @@ void update_screen_locked(void)
     if (!ui_has_initialized) return;
     draw_screen_locked();
     gr_flip();
+#ifdef RECOVERY_TOUCH_DEBUG
+    LOGI("input to redraw latency: %lld usec\n", ev_input_latency_usec());
+#endif
 }
 
 // Updates only the progress bar, if possible, otherwise redraws the screen.
@@ -422,16 +426,10 @@ static void *progress_thread(void *cookie)
 
 static int rel_sum = 0;
 
-static int input_callback(int fd, short revents, void *data)
+static int input_event_handle(int fd, struct input_event ev)
 {
-    struct input_event ev;
-    int ret;
     int fake_key = 0;
 
-    ret = ev_get_input(fd, revents, &ev);
-    if (ret)
-        return -1;
-
 #ifdef PHILZ_TOUCH_RECOVERY
     if (touch_handle_input(fd, ev))
         return 0;
@@ -502,6 +500,28 @@ static int input_callback(int fd, short revents, void *data)
     return 0;
 }
 
+// Drains all pending events of the device in one read
+// touch motion is coalesced up to the last SYN_REPORT so that touch
+// scrolling only handles the latest finger position of each batch
+#define INPUT_BATCH_MAX 64
+static int input_callback(int fd, short revents, void *data)
+{
+    struct input_event ev[INPUT_BATCH_MAX];
+    int count;
+    int i;
+
+    count = ev_get_input_batch(fd, revents, ev, INPUT_BATCH_MAX);
+    if (count <= 0)
+        return -1;
+
+    count = ev_coalesce_abs(ev, count);
+    for (i = 0; i < count; i++) {
+        input_event_handle(fd, ev[i]);
+    }
+
+    return 0;
+}
+
 // Reads input events, handles special hot keys, and adds to the key queue.
 static void *input_thread(void *cookie)
 {
@@ -512,11 +532,70 @@ static void *input_thread(void *cookie)
     return NULL;
 }
 
+// images are decoded by a few threads on start
+#define UI_DECODE_THREADS   4
+
+struct ui_bitmap_job {
+    char name[40];
+    gr_surface* surface;
+};
+
+static struct ui_bitmap_job* bitmap_jobs;
+static int bitmap_job_count = 0;
+static int bitmap_job_next = 0;
+static pthread_mutex_t bitmap_job_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static void add_bitmap_job(const char* name, gr_surface* surface) {
+    snprintf(bitmap_jobs[bitmap_job_count].name, sizeof(bitmap_jobs[0].name), "%s", name);
+    bitmap_jobs[bitmap_job_count].surface = surface;
+    ++bitmap_job_count;
+}
+
+static void *bitmap_decode_thread(void *cookie) {
+    for (;;) {
+        pthread_mutex_lock(&bitmap_job_mutex);
+        int i = bitmap_job_next++;
+        pthread_mutex_unlock(&bitmap_job_mutex);
+        if (i >= bitmap_job_count)
+            break;
+
+        int result = res_create_surface(bitmap_jobs[i].name, bitmap_jobs[i].surface);
+        if (result < 0) {
+            LOGE("Missing bitmap %s\n(Code %d)\n", bitmap_jobs[i].name, result);
+        }
+    }
+    return NULL;
+}
+
+// show the recovery icon as soon as the framebuffer is ready, while other images are decoded
+static void draw_first_frame() {
+    gr_surface icon = NULL;
+    if (res_create_surface("icon_clockwork", &icon) < 0 || icon == NULL)
+        return;
+
+    int iconWidth = gr_get_width(icon);
+    int iconHeight = gr_get_height(icon);
+    gr_color(0, 0, 0, 255);
+    gr_fill(0, 0, gr_fb_width(), gr_fb_height());
+    gr_blit(icon, 0, 0, iconWidth, iconHeight,
+            (gr_fb_width() - iconWidth) / 2, (gr_fb_height() - iconHeight) / 2);
+    gr_flip();
+    res_free_surface(icon);
+}
+
 void ui_init(void)
 {
-    ui_has_initialized = 1;
+    int trace = boot_trace_begin("gr_init");
     gr_init();
-    ev_init(input_callback, NULL);
+    boot_trace_end(trace);
+
+    trace = boot_trace_begin("first_frame");
+    draw_first_frame();
+    boot_trace_end(trace);
+
+    int ev_ok = (ev_init(input_callback, NULL) == 0);
+    if (!ev_ok)
+        LOGE("Can't watch input devices (%s)\n", strerror(errno));
 #ifdef PHILZ_TOUCH_RECOVERY
     touch_init();
 #endif
@@ -533,12 +612,17 @@ void ui_init(void)
     text_cols = gr_fb_width() / CHAR_WIDTH;
     if (text_cols > MAX_COLS - 1) text_cols = MAX_COLS - 1;
 
+    // queue all images, then decode them in parallel
     int i;
-    for (i = 0; BITMAPS[i].name != NULL; ++i) {
-        int result = res_create_surface(BITMAPS[i].name, BITMAPS[i].surface);
-        if (result < 0) {
-            LOGE("Missing bitmap %s\n(Code %d)\n", BITMAPS[i].name, result);
-        }
+    int num_bitmaps = 0;
+    while (BITMAPS[num_bitmaps].name != NULL)
+        ++num_bitmaps;
+    bitmap_jobs = malloc((num_bitmaps + ui_parameters.indeterminate_frames +
+                          ui_parameters.installing_frames) * sizeof(struct ui_bitmap_job));
+    bitmap_job_count = bitmap_job_next = 0;
+
+    for (i = 0; i < num_bitmaps; ++i) {
+        add_bitmap_job(BITMAPS[i].name, BITMAPS[i].surface);
     }
 
     gProgressBarIndeterminate = malloc(ui_parameters.indeterminate_frames *
@@ -547,10 +631,7 @@ void ui_init(void)
         char filename[40];
         // "indeterminate01.png", "indeterminate02.png", ...
         sprintf(filename, "indeterminate%02d", i+1);
-        int result = res_create_surface(filename, gProgressBarIndeterminate+i);
-        if (result < 0) {
-            LOGE("Missing bitmap %s\n(Code %d)\n", filename, result);
-        }
+        add_bitmap_job(filename, gProgressBarIndeterminate+i);
     }
 
     if (ui_parameters.installing_frames > 0) {
@@ -561,12 +642,28 @@ void ui_init(void)
             // "icon_installing_overlay01.png",
             // "icon_installing_overlay02.png", ...
             sprintf(filename, "icon_installing_overlay%02d", i+1);
-            int result = res_create_surface(filename, gInstallationOverlay+i);
-            if (result < 0) {
-                LOGE("Missing bitmap %s\n(Code %d)\n", filename, result);
-            }
+            add_bitmap_job(filename, gInstallationOverlay+i);
         }
+    } else {
+        gInstallationOverlay = NULL;
+    }
 
+    trace = boot_trace_begin("decode_images");
+    pthread_t decoders[UI_DECODE_THREADS - 1];
+    int num_decoders = 0;
+    for (i = 0; i < UI_DECODE_THREADS - 1; ++i) {
+        if (pthread_create(&decoders[num_decoders], NULL, bitmap_decode_thread, NULL) == 0)
+            ++num_decoders;
+    }
+    bitmap_decode_thread(NULL);
+    for (i = 0; i < num_decoders; ++i) {
+        pthread_join(decoders[i], NULL);
+    }
+    free(bitmap_jobs);
+    bitmap_jobs = NULL;
+    boot_trace_end(trace);
+
+    if (ui_parameters.installing_frames > 0) {
         // Adjust the offset to account for the positioning of the
         // base image on the screen.
         if (gBackgroundIcon[BACKGROUND_ICON_INSTALLING] != NULL) {
@@ -576,8 +673,6 @@ void ui_init(void)
             ui_parameters.install_overlay_offset_y +=
                 (gr_fb_height() - gr_get_height(bg)) / 2;
         }
-    } else {
-        gInstallationOverlay = NULL;
     }
 #ifndef PHILZ_TOUCH_RECOVERY
     // we manage this in touch_init()
@@ -603,9 +698,14 @@ void ui_init(void)
     }
 #endif
 
+    // ui_print() can be called by the vold thread while we are still here: only draw once all is loaded
+    ui_has_initialized = 1;
+
     pthread_t t;
     pthread_create(&t, NULL, progress_thread, NULL);
-    pthread_create(&t, NULL, input_thread, NULL);
+    // ev_wait() would fail at once without the epoll set
+    if (ev_ok)
+        pthread_create(&t, NULL, input_thread, NULL);
     //prints custom text at bottom of recovery interface on start
     //useless here if we use fast_ui_init() in default_recovery_ui.c: will be wiped
     //Better ui_print foot notes in recovery.c in that case